@@ -0,0 +1,41 @@
+aesgcm.o: aesgcm.c crypto.h pktqueue.h lock.h pktslab.h
+aqm.o: aqm.c csum.h aqm.h pktqueue.h lock.h pktslab.h pktring.h
+chacha.o: chacha.c crypto.h pktqueue.h lock.h pktslab.h
+compress.o: compress.c pktqueue.h lock.h pktslab.h compress.h
+crypto.o: crypto.c pktqueue.h lock.h pktslab.h crypto.h
+events.o: events.c uring.h events.h lock.h
+hub.o: hub.c lpm.h crypto.h pktqueue.h lock.h pktslab.h metrics.h peer.h \
+ iface.h events.h pktring.h aqm.h compress.h workers.h hub.h
+iface.o: iface.c events.h lock.h pktqueue.h pktslab.h pktring.h offload.h \
+ iface.h aqm.h workers.h hub.h
+io.o: io.c pktqueue.h lock.h pktslab.h pktring.h events.h iface.h aqm.h \
+ peer.h crypto.h compress.h workers.h hub.h metrics.h io.h
+lpm.o: lpm.c lpm.h
+metrics.o: metrics.c metrics.h
+offload.o: offload.c csum.h pktqueue.h lock.h pktslab.h offload.h
+pair.o: pair.c pair.h iface.h events.h lock.h pktqueue.h pktslab.h \
+ pktring.h aqm.h io.h
+peer.o: peer.c pktqueue.h lock.h pktslab.h events.h iface.h pktring.h \
+ aqm.h crypto.h compress.h workers.h hub.h peer.h
+pktslab.o: pktslab.c lock.h pktslab.h
+tun.o: tun.c iface.h events.h lock.h pktqueue.h pktslab.h pktring.h aqm.h \
+ io.h metrics.h crypto.h compress.h workers.h hub.h peer.h
+uring.o: uring.c uring.h
+workers.o: workers.c pktqueue.h lock.h pktslab.h events.h metrics.h \
+ workers.h
+bench/pkt_bench.o: bench/pkt_bench.c pktqueue.h lock.h pktslab.h \
+ pktring.h pktqueue.h bench/bench.h
+bench/event_bench.o: bench/event_bench.c events.h lock.h bench/bench.h
+bench/peer_bench.o: bench/peer_bench.c peer.h iface.h events.h lock.h \
+ pktqueue.h pktslab.h pktring.h aqm.h crypto.h compress.h workers.h \
+ bench/bench.h
+bench/crypto_bench.o: bench/crypto_bench.c pktqueue.h lock.h pktslab.h \
+ crypto.h pktqueue.h bench/bench.h
+bench/compress_bench.o: bench/compress_bench.c pktqueue.h lock.h \
+ pktslab.h compress.h pktqueue.h bench/bench.h
+bench/lpm_bench.o: bench/lpm_bench.c lpm.h bench/bench.h
+bench/tun_bench.o: bench/tun_bench.c events.h lock.h iface.h events.h \
+ pktqueue.h pktslab.h pktring.h aqm.h io.h pair.h iface.h io.h crypto.h \
+ compress.h workers.h
+tests/credit_test.o: tests/credit_test.c peer.h iface.h events.h lock.h \
+ pktqueue.h pktslab.h pktring.h aqm.h crypto.h compress.h workers.h
@@ -0,0 +1,340 @@
+/*
+ *  Copyright (c) 2011, Julian Pidancet <julian.pidancet@gmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *  3. Neither the name of Julian Pidancet nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <immintrin.h>
+
+#include "crypto.h"
+
+/*
+ * AES-256-GCM on AES-NI and PCLMULQDQ, for 96-bit nonces only. Counter mode
+ * runs 8 blocks at a time to keep the AES units busy; GHASH multiplies 4
+ * blocks at a time by H^4 .. H^1 and reduces once for all of them.
+ *
+ * GHASH works on byte-reversed blocks, so that the bit-reflected field
+ * elements of GCM end up in the natural order for PCLMULQDQ.
+ */
+
+#define AESGCM_TARGET __attribute__((target("aes,pclmul,sse4.1,ssse3")))
+
+int aesgcm_supported(void)
+{
+    __builtin_cpu_init();
+
+    return __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul") &&
+           __builtin_cpu_supports("sse4.1");
+}
+
+static AESGCM_TARGET __m128i bswap128(__m128i x)
+{
+    const __m128i mask = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+                                      8, 9, 10, 11, 12, 13, 14, 15);
+
+    return _mm_shuffle_epi8(x, mask);
+}
+
+static AESGCM_TARGET __m128i aes256_expand_a(__m128i a, __m128i t)
+{
+    __m128i s;
+
+    t = _mm_shuffle_epi32(t, 0xff);
+    s = _mm_slli_si128(a, 4);
+    a = _mm_xor_si128(a, s);
+    s = _mm_slli_si128(s, 4);
+    a = _mm_xor_si128(a, s);
+    s = _mm_slli_si128(s, 4);
+    a = _mm_xor_si128(a, s);
+
+    return _mm_xor_si128(a, t);
+}
+
+static AESGCM_TARGET __m128i aes256_expand_b(__m128i a, __m128i b)
+{
+    __m128i s, t;
+
+    t = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(a, 0), 0xaa);
+    s = _mm_slli_si128(b, 4);
+    b = _mm_xor_si128(b, s);
+    s = _mm_slli_si128(s, 4);
+    b = _mm_xor_si128(b, s);
+    s = _mm_slli_si128(s, 4);
+    b = _mm_xor_si128(b, s);
+
+    return _mm_xor_si128(b, t);
+}
+
+/* The round constant has to be an immediate */
+#define AES256_ROUND(rk, i, rcon)                                   \
+    do {                                                            \
+        rk[i] = aes256_expand_a(rk[i - 2],                          \
+                    _mm_aeskeygenassist_si128(rk[i - 1], rcon));    \
+        if (i + 1 < 15)                                             \
+            rk[i + 1] = aes256_expand_b(rk[i], rk[i - 1]);          \
+    } while (0)
+
+static AESGCM_TARGET void aes256_expand(__m128i *rk, const uint8_t *key)
+{
+    rk[0] = _mm_loadu_si128((const void *)key);
+    rk[1] = _mm_loadu_si128((const void *)(key + 16));
+    AES256_ROUND(rk, 2, 0x01);
+    AES256_ROUND(rk, 4, 0x02);
+    AES256_ROUND(rk, 6, 0x04);
+    AES256_ROUND(rk, 8, 0x08);
+    AES256_ROUND(rk, 10, 0x10);
+    AES256_ROUND(rk, 12, 0x20);
+    AES256_ROUND(rk, 14, 0x40);
+}
+
+static AESGCM_TARGET __m128i aes256_encrypt(const __m128i *rk, __m128i b)
+{
+    int r;
+
+    b = _mm_xor_si128(b, rk[0]);
+    for (r = 1; r < 14; r++)
+        b = _mm_aesenc_si128(b, rk[r]);
+
+    return _mm_aesenclast_si128(b, rk[14]);
+}
+
+/* The 256-bit carry-less product of a and b, as lo and hi halves */
+static AESGCM_TARGET void clmul_wide(__m128i a, __m128i b,
+                                     __m128i *lo, __m128i *hi)
+{
+    __m128i t0, t1, t2, t3;
+
+    t0 = _mm_clmulepi64_si128(a, b, 0x00);
+    t1 = _mm_clmulepi64_si128(a, b, 0x10);
+    t2 = _mm_clmulepi64_si128(a, b, 0x01);
+    t3 = _mm_clmulepi64_si128(a, b, 0x11);
+    t1 = _mm_xor_si128(t1, t2);
+    *lo = _mm_xor_si128(t0, _mm_slli_si128(t1, 8));
+    *hi = _mm_xor_si128(t3, _mm_srli_si128(t1, 8));
+}
+
+/*
+ * Reduction modulo x^128 + x^7 + x^2 + x + 1 of a product of reflected
+ * elements, shifted left by one bit first to account for the reflection.
+ */
+static AESGCM_TARGET __m128i gf_reduce(__m128i lo, __m128i hi)
+{
+    __m128i t7, t8, t9, t2, t4, t5;
+
+    t7 = _mm_srli_epi32(lo, 31);
+    t8 = _mm_srli_epi32(hi, 31);
+    lo = _mm_slli_epi32(lo, 1);
+    hi = _mm_slli_epi32(hi, 1);
+    t9 = _mm_srli_si128(t7, 12);
+    t8 = _mm_slli_si128(t8, 4);
+    t7 = _mm_slli_si128(t7, 4);
+    lo = _mm_or_si128(lo, t7);
+    hi = _mm_or_si128(hi, t8);
+    hi = _mm_or_si128(hi, t9);
+
+    t7 = _mm_slli_epi32(lo, 31);
+    t8 = _mm_slli_epi32(lo, 30);
+    t9 = _mm_slli_epi32(lo, 25);
+    t7 = _mm_xor_si128(t7, t8);
+    t7 = _mm_xor_si128(t7, t9);
+    t8 = _mm_srli_si128(t7, 4);
+    t7 = _mm_slli_si128(t7, 12);
+    lo = _mm_xor_si128(lo, t7);
+
+    t2 = _mm_srli_epi32(lo, 1);
+    t4 = _mm_srli_epi32(lo, 2);
+    t5 = _mm_srli_epi32(lo, 7);
+    t2 = _mm_xor_si128(t2, t4);
+    t2 = _mm_xor_si128(t2, t5);
+    t2 = _mm_xor_si128(t2, t8);
+    lo = _mm_xor_si128(lo, t2);
+
+    return _mm_xor_si128(hi, lo);
+}
+
+static AESGCM_TARGET __m128i gf_mul(__m128i a, __m128i b)
+{
+    __m128i lo, hi;
+
+    clmul_wide(a, b, &lo, &hi);
+
+    return gf_reduce(lo, hi);
+}
+
+static AESGCM_TARGET __m128i ghash(const __m128i *h, __m128i x,
+                                   const uint8_t *p, size_t len)
+{
+    __m128i lo, hi, l, m, b[4];
+    uint8_t last[16];
+    int i;
+
+    for (; len >= 64; len -= 64, p += 64) {
+        for (i = 0; i < 4; i++)
+            b[i] = bswap128(_mm_loadu_si128((const void *)(p + 16 * i)));
+        b[0] = _mm_xor_si128(b[0], x);
+
+        clmul_wide(b[0], h[3], &lo, &hi);
+        for (i = 1; i < 4; i++) {
+            clmul_wide(b[i], h[3 - i], &l, &m);
+            lo = _mm_xor_si128(lo, l);
+            hi = _mm_xor_si128(hi, m);
+        }
+        x = gf_reduce(lo, hi);
+    }
+
+    for (; len >= 16; len -= 16, p += 16) {
+        b[0] = bswap128(_mm_loadu_si128((const void *)p));
+        x = gf_mul(_mm_xor_si128(x, b[0]), h[0]);
+    }
+
+    if (len) {
+        memset(last, 0, sizeof (last));
+        memcpy(last, p, len);
+        b[0] = bswap128(_mm_loadu_si128((const void *)last));
+        x = gf_mul(_mm_xor_si128(x, b[0]), h[0]);
+    }
+
+    return x;
+}
+
+void AESGCM_TARGET aesgcm_init(struct crypto_aead *a, const uint8_t *key)
+{
+    __m128i *rk = (__m128i *)a->aes_rk;
+    __m128i *h = (__m128i *)a->ghash_h;
+    int i;
+
+    aes256_expand(rk, key);
+
+    h[0] = bswap128(aes256_encrypt(rk, _mm_setzero_si128()));
+    for (i = 1; i < 4; i++)
+        h[i] = gf_mul(h[i - 1], h[0]);
+}
+
+static AESGCM_TARGET __m128i ctr_block(__m128i j, uint32_t ctr)
+{
+    return _mm_insert_epi32(j, (int)__builtin_bswap32(ctr), 3);
+}
+
+/* Counter mode from block 2 on, block 1 being kept for the tag */
+static AESGCM_TARGET void aesgcm_ctr(const __m128i *rk, __m128i j,
+                                     uint8_t *buf, size_t len)
+{
+    __m128i b[8], d;
+    uint8_t last[16];
+    uint32_t ctr = 2;
+    int i, r;
+
+    for (; len >= 128; len -= 128, buf += 128, ctr += 8) {
+        for (i = 0; i < 8; i++)
+            b[i] = _mm_xor_si128(ctr_block(j, ctr + i), rk[0]);
+        for (r = 1; r < 14; r++) {
+            for (i = 0; i < 8; i++)
+                b[i] = _mm_aesenc_si128(b[i], rk[r]);
+        }
+        for (i = 0; i < 8; i++) {
+            b[i] = _mm_aesenclast_si128(b[i], rk[14]);
+            d = _mm_loadu_si128((const void *)(buf + 16 * i));
+            _mm_storeu_si128((void *)(buf + 16 * i), _mm_xor_si128(d, b[i]));
+        }
+    }
+
+    for (; len >= 16; len -= 16, buf += 16, ctr++) {
+        b[0] = aes256_encrypt(rk, ctr_block(j, ctr));
+        d = _mm_loadu_si128((const void *)buf);
+        _mm_storeu_si128((void *)buf, _mm_xor_si128(d, b[0]));
+    }
+
+    if (len) {
+        b[0] = aes256_encrypt(rk, ctr_block(j, ctr));
+        _mm_storeu_si128((void *)last, b[0]);
+        for (i = 0; i < (int)len; i++)
+            buf[i] ^= last[i];
+    }
+}
+
+static AESGCM_TARGET void aesgcm_tag(struct crypto_aead *a, __m128i j,
+                                     const uint8_t *aad, size_t aad_len,
+                                     const uint8_t *ct, size_t len,
+                                     uint8_t *tag)
+{
+    const __m128i *rk = (const __m128i *)a->aes_rk;
+    const __m128i *h = (const __m128i *)a->ghash_h;
+    __m128i x = _mm_setzero_si128();
+    __m128i lens;
+
+    x = ghash(h, x, aad, aad_len);
+    x = ghash(h, x, ct, len);
+    lens = _mm_set_epi64x((long long)aad_len * 8, (long long)len * 8);
+    x = gf_mul(_mm_xor_si128(x, lens), h[0]);
+
+    x = _mm_xor_si128(bswap128(x), aes256_encrypt(rk, ctr_block(j, 1)));
+    _mm_storeu_si128((void *)tag, x);
+}
+
+static AESGCM_TARGET __m128i aesgcm_j0(const uint8_t *nonce)
+{
+    uint8_t j[16];
+
+    memcpy(j, nonce, 12);
+    memset(j + 12, 0, 4);
+
+    return _mm_loadu_si128((const void *)j);
+}
+
+void AESGCM_TARGET aesgcm_seal(struct crypto_aead *a, const uint8_t *nonce,
+                               const uint8_t *aad, size_t aad_len,
+                               uint8_t *buf, size_t len, uint8_t *tag)
+{
+    __m128i j = aesgcm_j0(nonce);
+
+    aesgcm_ctr((const __m128i *)a->aes_rk, j, buf, len);
+    aesgcm_tag(a, j, aad, aad_len, buf, len, tag);
+}
+
+int AESGCM_TARGET aesgcm_open(struct crypto_aead *a, const uint8_t *nonce,
+                              const uint8_t *aad, size_t aad_len,
+                              uint8_t *buf, size_t len, const uint8_t *tag)
+{
+    __m128i j = aesgcm_j0(nonce);
+    uint8_t mac[CRYPTO_TAG_SZ];
+    uint8_t diff = 0;
+    int i;
+
+    aesgcm_tag(a, j, aad, aad_len, buf, len, mac);
+    for (i = 0; i < CRYPTO_TAG_SZ; i++)
+        diff |= mac[i] ^ tag[i];
+    if (diff)
+        return -1;
+
+    aesgcm_ctr((const __m128i *)a->aes_rk, j, buf, len);
+
+    return 0;
+}
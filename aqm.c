@@ -0,0 +1,352 @@
+/*
+ *  Copyright (c) 2011, Julian Pidancet <julian.pidancet@gmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *  3. Neither the name of Julian Pidancet nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/ip.h>
+#include <linux/if_tun.h>
+
+#include "csum.h"
+#include "aqm.h"
+
+struct aqm_opts aqm_opts = {
+    .target_ns = AQM_TARGET_NS,
+    .interval_ns = AQM_INTERVAL_NS,
+};
+
+int aqm_parse(const char *s)
+{
+    if (!strcmp(s, "codel"))
+        aqm_opts.mode = AQM_CODEL;
+    else if (!strcmp(s, "fq_codel"))
+        aqm_opts.mode = AQM_FQ_CODEL;
+    else if (!strcmp(s, "none"))
+        aqm_opts.mode = AQM_NONE;
+    else
+        return -1;
+
+    return 0;
+}
+
+uint32_t aqm_flow_hash(const struct pkt *p)
+{
+    const struct iphdr *ip = (const void *)(p->buff + sizeof (struct tun_pi));
+    size_t len = p->pkt_size - sizeof (struct tun_pi);
+    uint32_t h, ports;
+    size_t ihl;
+
+    if (p->pkt_size < sizeof (struct tun_pi) + sizeof (*ip) ||
+        ip->version != 4)
+        return 0;
+    ihl = ip->ihl * 4;
+
+    h = ip->saddr ^ (ip->daddr * 0x9e3779b1U) ^ ip->protocol;
+    if ((ip->protocol == IPPROTO_TCP || ip->protocol == IPPROTO_UDP) &&
+        !(ip->frag_off & htons(IP_MF | IP_OFFMASK)) && len >= ihl + 4) {
+        memcpy(&ports, (const char *)ip + ihl, sizeof (ports));
+        h ^= ports * 0x85ebca6bU;
+    }
+
+    /* Sub-queues are picked by modulo, every bit has to count */
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    return h ^ (h >> 16);
+}
+
+/*
+ * Nothing is ever held in the sub-queues without queue management, which
+ * is then only a name for the ring underneath.
+ */
+int aqm_init(struct aqm *a, unsigned int nflows, unsigned long limit,
+             int ecn)
+{
+    unsigned int i;
+
+    memset(a, 0, sizeof (*a));
+    TAILQ_INIT(&a->new_flows);
+    TAILQ_INIT(&a->old_flows);
+    if (!aqm_opts.mode)
+        return 0;
+
+    if (aqm_opts.mode == AQM_CODEL)
+        nflows = 1;
+    a->flows = calloc(nflows, sizeof (*a->flows));
+    if (!a->flows)
+        return -1;
+    for (i = 0; i < nflows; i++)
+        SIMPLEQ_INIT(&a->flows[i].pkts);
+    a->nflows = nflows;
+    a->limit = limit;
+    a->ecn = ecn;
+
+    return 0;
+}
+
+/* Packets still held, one at a time, for the owner to dispose of */
+struct pkt *aqm_drain(struct aqm *a)
+{
+    struct aqm_flow *f;
+    struct pkt *p;
+    unsigned int i;
+
+    for (i = 0; i < a->nflows; i++) {
+        f = &a->flows[i];
+        p = SIMPLEQ_FIRST(&f->pkts);
+        if (!p)
+            continue;
+        SIMPLEQ_REMOVE_HEAD(&f->pkts, link);
+        f->npkts--;
+        __atomic_store_n(&a->backlog, a->backlog - 1, __ATOMIC_RELAXED);
+        return p;
+    }
+
+    return NULL;
+}
+
+void aqm_cleanup(struct aqm *a)
+{
+    free(a->flows);
+    a->flows = NULL;
+    a->nflows = 0;
+}
+
+/* Set CE on an ECT IPv4 packet. Returns 0 if it was not ECN-capable. */
+static int aqm_mark(struct pkt *p)
+{
+    struct iphdr *ip = (void *)(p->buff + sizeof (struct tun_pi));
+    uint16_t old, new;
+    uint32_t sum;
+
+    if (p->pkt_size < sizeof (struct tun_pi) + sizeof (*ip) ||
+        ip->version != 4 || !(ip->tos & IPTOS_ECN_MASK))
+        return 0;
+    if ((ip->tos & IPTOS_ECN_MASK) == IPTOS_ECN_CE)
+        return 1;
+
+    /* RFC 1624: HC' = ~(~HC + ~m + m') over the word holding the TOS */
+    memcpy(&old, ip, sizeof (old));
+    ip->tos |= IPTOS_ECN_CE;
+    memcpy(&new, ip, sizeof (new));
+    sum = csum_add(csum_add((uint16_t)~ip->check, (uint16_t)~old), new);
+    ip->check = csum_fold(sum);
+
+    return 1;
+}
+
+/* Same as interval / sqrt(count), without floating point */
+static uint64_t codel_control_law(uint64_t t, uint32_t count)
+{
+    uint64_t x = (uint64_t)count << 32;
+    uint64_t root = 0, bit = 1ULL << 62;
+
+    while (bit > x)
+        bit >>= 2;
+    while (bit) {
+        if (x >= root + bit) {
+            x -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+
+    return t + (aqm_opts.interval_ns << 16) / root;
+}
+
+static struct pkt *codel_pop(struct aqm *a, struct aqm_flow *f, uint64_t now,
+                             int *ok_to_drop)
+{
+    struct codel *cd = &f->cd;
+    struct pkt *p;
+
+    *ok_to_drop = 0;
+    p = SIMPLEQ_FIRST(&f->pkts);
+    if (!p) {
+        cd->first_above = 0;
+        return NULL;
+    }
+    SIMPLEQ_REMOVE_HEAD(&f->pkts, link);
+    f->npkts--;
+    __atomic_store_n(&a->backlog, a->backlog - 1, __ATOMIC_RELAXED);
+
+    a->stats.sojourn_ns = now > p->stamp ? now - p->stamp : 0;
+    if (a->stats.sojourn_ns < aqm_opts.target_ns || !f->npkts)
+        cd->first_above = 0;
+    else if (!cd->first_above)
+        cd->first_above = now + aqm_opts.interval_ns;
+    else if (now >= cd->first_above)
+        *ok_to_drop = 1;
+
+    return p;
+}
+
+/* Drop p, or mark it and return 1 if the queue may ECN-mark it instead */
+static int codel_drop(struct aqm *a, struct pkt *p)
+{
+    if (a->ecn && aqm_mark(p)) {
+        a->stats.marks++;
+        return 1;
+    }
+
+    a->stats.drops++;
+    pkt_complete(p);
+    return 0;
+}
+
+static struct pkt *codel_dequeue(struct aqm *a, struct aqm_flow *f,
+                                 uint64_t now)
+{
+    struct codel *cd = &f->cd;
+    struct pkt *p;
+    uint32_t delta;
+    int ok;
+
+    p = codel_pop(a, f, now, &ok);
+
+    if (cd->dropping) {
+        if (!ok)
+            cd->dropping = 0;
+        while (cd->dropping && now >= cd->drop_next) {
+            cd->count++;
+            if (codel_drop(a, p)) {
+                cd->drop_next = codel_control_law(cd->drop_next, cd->count);
+                return p;
+            }
+            p = codel_pop(a, f, now, &ok);
+            if (!ok)
+                cd->dropping = 0;
+            else
+                cd->drop_next = codel_control_law(cd->drop_next, cd->count);
+        }
+    } else if (ok) {
+        /* Dropping again soon after the last time, pick up from there */
+        delta = cd->count - cd->lastcount;
+        cd->count = delta > 1 &&
+                    now - cd->drop_next < 16 * aqm_opts.interval_ns ?
+                    delta : 1;
+        cd->drop_next = codel_control_law(now, cd->count);
+        cd->lastcount = cd->count;
+        cd->dropping = 1;
+        if (!codel_drop(a, p))
+            p = codel_pop(a, f, now, &ok);
+    }
+
+    return p;
+}
+
+/*
+ * Over the limit, drop from the head of the longest sub-queue: the flow
+ * hogging the queue pays for it, with its oldest packets. Up to half of it
+ * goes at once, so that a flood does not have every sub-queue scanned for
+ * each of its packets.
+ */
+static void aqm_overlimit(struct aqm *a)
+{
+    struct aqm_flow *fat = &a->flows[0];
+    struct pkt *p;
+    unsigned long n;
+    unsigned int i;
+
+    for (i = 1; i < a->nflows; i++) {
+        if (a->flows[i].npkts > fat->npkts)
+            fat = &a->flows[i];
+    }
+
+    n = fat->npkts / 2;
+    if (n < 1)
+        n = 1;
+    if (n > AQM_OVERLIMIT_BATCH)
+        n = AQM_OVERLIMIT_BATCH;
+    while (n--) {
+        p = SIMPLEQ_FIRST(&fat->pkts);
+        SIMPLEQ_REMOVE_HEAD(&fat->pkts, link);
+        fat->npkts--;
+        __atomic_store_n(&a->backlog, a->backlog - 1, __ATOMIC_RELAXED);
+        a->stats.drops++;
+        pkt_complete(p);
+    }
+}
+
+struct pkt *aqm_dequeue_managed(struct aqm *a, struct pktring *r,
+                                uint64_t now)
+{
+    struct aqm_flow_list *list;
+    struct aqm_flow *f;
+    struct pkt *p;
+
+    /* Take in whatever arrived, the ring only hands packets over */
+    while ((p = pktring_dequeue(r))) {
+        if (a->backlog >= a->limit)
+            aqm_overlimit(a);
+        f = &a->flows[a->nflows > 1 ? p->hash % a->nflows : 0];
+        SIMPLEQ_INSERT_TAIL(&f->pkts, p, link);
+        f->npkts++;
+        __atomic_store_n(&a->backlog, a->backlog + 1, __ATOMIC_RELAXED);
+        if (!f->listed) {
+            f->listed = 1;
+            f->deficit = AQM_QUANTUM;
+            TAILQ_INSERT_TAIL(&a->new_flows, f, link);
+        }
+    }
+
+    for (;;) {
+        list = TAILQ_EMPTY(&a->new_flows) ? &a->old_flows : &a->new_flows;
+        f = TAILQ_FIRST(list);
+        if (!f)
+            return NULL;
+
+        if (f->deficit <= 0) {
+            f->deficit += AQM_QUANTUM;
+            TAILQ_REMOVE(list, f, link);
+            TAILQ_INSERT_TAIL(&a->old_flows, f, link);
+            continue;
+        }
+
+        p = codel_dequeue(a, f, now);
+        if (!p) {
+            /* New flows that ran dry get a turn among the old first */
+            TAILQ_REMOVE(list, f, link);
+            if (list == &a->new_flows && !TAILQ_EMPTY(&a->old_flows))
+                TAILQ_INSERT_TAIL(&a->old_flows, f, link);
+            else
+                f->listed = 0;
+            continue;
+        }
+
+        f->deficit -= p->pkt_size;
+        return p;
+    }
+}
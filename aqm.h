@@ -0,0 +1,168 @@
+/*
+ *  Copyright (c) 2011, Julian Pidancet <julian.pidancet@gmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *  3. Neither the name of Julian Pidancet nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#ifndef AQM_H_
+#define AQM_H_
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/queue.h>
+
+#include "pktqueue.h"
+#include "pktring.h"
+
+/*
+ * Active queue management for the queues packets wait in on their way out:
+ * to the tunnel device, and to the transport socket for each peer.
+ *
+ * CoDel (RFC 8289) watches how long packets sat in the queue. Once even the
+ * shortest wait has stayed above the target for a whole interval, the
+ * queue is a standing one and packets are dropped from its head, or
+ * ECN-marked if they are ECT, ever more often until it drains. Bursts come
+ * and go without a drop.
+ *
+ * FQ-CoDel (RFC 8290) first hashes packets on their inner addresses,
+ * protocol and ports into sub-queues, each with CoDel of its own, and
+ * serves them deficit round robin, new flows first: a bulk transfer
+ * keeps its own queue short without sparse flows waiting behind it.
+ *
+ * Rings stay the lock-free handoff between threads. The consumer moves
+ * every packet on the ring into its sub-queues, and decides there which go
+ * out. Past the limit, the longest sub-queue loses packets from its head.
+ */
+#define AQM_NONE 0
+#define AQM_CODEL 1
+#define AQM_FQ_CODEL 2
+
+#define AQM_TARGET_NS 5000000UL
+#define AQM_INTERVAL_NS 100000000UL
+#define AQM_QUANTUM 1514
+#define AQM_OVERLIMIT_BATCH 64
+
+struct aqm_opts
+{
+    int mode;
+    int ecn;            /* Mark ECT packets rather than drop them */
+    unsigned long target_ns;
+    unsigned long interval_ns;
+};
+
+extern struct aqm_opts aqm_opts;
+
+/* Plain stores by the consumer */
+struct aqm_stats
+{
+    unsigned long drops;
+    unsigned long marks;
+    unsigned long sojourn_ns;   /* Of the last packet let through */
+};
+
+struct codel
+{
+    uint64_t first_above;       /* When the wait may count as standing */
+    uint64_t drop_next;
+    uint32_t count;             /* Drops since dropping began */
+    uint32_t lastcount;
+    int dropping;
+};
+
+struct aqm_flow
+{
+    SIMPLEQ_HEAD(, pkt) pkts;
+    unsigned long npkts;
+    TAILQ_ENTRY(aqm_flow) link;
+    int listed;
+    long deficit;
+    struct codel cd;
+};
+
+/* Consumer side of a ring */
+struct aqm
+{
+    struct aqm_flow *flows;
+    unsigned int nflows;
+    unsigned long limit;        /* Packets held in the sub-queues */
+    unsigned long backlog;
+    int ecn;
+    TAILQ_HEAD(aqm_flow_list, aqm_flow) new_flows;
+    struct aqm_flow_list old_flows;
+    struct aqm_stats stats;
+};
+
+int aqm_parse(const char *s);
+int aqm_init(struct aqm *a, unsigned int nflows, unsigned long limit,
+             int ecn);
+struct pkt *aqm_drain(struct aqm *a);
+void aqm_cleanup(struct aqm *a);
+struct pkt *aqm_dequeue_managed(struct aqm *a, struct pktring *r,
+                                uint64_t now);
+
+static inline uint64_t aqm_now(void)
+{
+    struct timespec ts;
+
+    if (!aqm_opts.mode)
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Producer side, right before the packet goes on the ring */
+static inline void aqm_stamp(struct pkt *p)
+{
+    p->stamp = aqm_now();
+}
+
+/*
+ * Next packet to send, or NULL. Packets put back on the ring go first and
+ * as they are, having been through already.
+ */
+static inline struct pkt *aqm_dequeue(struct aqm *a, struct pktring *r,
+                                      uint64_t now)
+{
+    if (!a->nflows || r->nback)
+        return pktring_dequeue(r);
+
+    return aqm_dequeue_managed(a, r, now);
+}
+
+/* Packets on the ring and in the sub-queues */
+static inline unsigned long aqm_count(struct aqm *a, struct pktring *r)
+{
+    return pktring_count(r) + __atomic_load_n(&a->backlog, __ATOMIC_RELAXED);
+}
+
+/* Hash of the inner flow of a tun_pi framed IPv4 packet, 0 for others */
+uint32_t aqm_flow_hash(const struct pkt *p);
+
+#endif /* AQM_H_ */
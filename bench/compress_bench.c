@@ -0,0 +1,214 @@
+/*
+ *  Copyright (c) 2011, Julian Pidancet <julian.pidancet@gmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *  3. Neither the name of Julian Pidancet nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <linux/if_tun.h>
+#include <linux/if_ether.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+
+#include "pktqueue.h"
+#include "compress.h"
+#include "bench.h"
+
+/*
+ * The LZ4 codec on its own, on text made up of protocol-looking words and
+ * on random bytes, and the per-packet path the tunnel runs: batches of
+ * packets through compress_pack(), where random flows should cost next to
+ * nothing once learned. Packets are copied back from templates before each
+ * batch, which is counted in.
+ */
+
+#define BYTES (64 << 20)
+#define BATCH 32
+#define PKT_PAYLOAD 1400
+
+#define NBUFS 16           /* Distinct inputs, not to flatter the branch
+                              predictor */
+
+static const int sizes[] = { 64, 256, 576, 1400 };
+
+enum payload { PAYLOAD_TEXT, PAYLOAD_RANDOM };
+
+static const char *payload_str[] = { "text", "random" };
+
+static uint8_t src[NBUFS][PKT_PAYLOAD], dst[NBUFS][COMPRESS_MAX_PKT];
+static size_t clen[NBUFS];
+
+static void payload_fill(uint8_t *buf, size_t len, enum payload kind,
+                         unsigned int seed)
+{
+    static const char *words[] = {
+        "GET /index.html HTTP/1.1\r\n", "Host: example.com\r\n",
+        "Accept: */*\r\n", "Content-Type: application/json\r\n",
+        "{\"id\": ", "\"name\": \"", "\"value\": ", "}, ", "null, ",
+        "true", "false", "1234", "0x1f", "the ", "and ", "of ", "\n",
+    };
+    const char *w;
+    size_t i = 0;
+
+    while (i < len) {
+        if (kind == PAYLOAD_RANDOM) {
+            buf[i++] = rand_r(&seed);
+            continue;
+        }
+        w = words[rand_r(&seed) % (sizeof (words) / sizeof (words[0]))];
+        while (*w && i < len)
+            buf[i++] = *w++;
+    }
+}
+
+static void report(const char *name, enum payload kind, int size,
+                   unsigned long ops, uint64_t ns, size_t out)
+{
+    char params[160];
+
+    snprintf(params, sizeof (params),
+             "\"payload\":\"%s\",\"size\":%d,\"ratio\":%.3f,"
+             "\"mb_per_s\":%.1f",
+             payload_str[kind], size, (double)out / ((double)ops * size),
+             ns ? (double)ops * size * 1e3 / ns : 0.0);
+    bench_report(name, params, ops, ns);
+}
+
+static void bench_codec(enum payload kind, int size)
+{
+    unsigned long ops = BYTES / size;
+    size_t out = 0;
+    uint64_t start;
+    unsigned long i;
+    int b;
+
+    for (b = 0; b < NBUFS; b++)
+        payload_fill(src[b], size, kind, b + 1);
+
+    start = bench_now_ns();
+    for (i = 0; i < ops; i++) {
+        b = i % NBUFS;
+        clen[b] = lz4_compress(src[b], size, dst[b], sizeof (dst[b]));
+        out += clen[b];
+    }
+    report("lz4_compress", kind, size, ops, bench_now_ns() - start, out);
+
+    start = bench_now_ns();
+    for (i = 0; i < ops; i++) {
+        b = i % NBUFS;
+        if (lz4_decompress(dst[b], clen[b], src[b], sizeof (src[b])) != size)
+            abort();
+    }
+    report("lz4_decompress", kind, size, ops, bench_now_ns() - start,
+           (size_t)ops * size);
+}
+
+/* Inner IPv4/TCP packets of BATCH flows */
+static void pkt_fill(struct pkt *p, enum payload kind, int flow)
+{
+    struct tun_pi *pi = (struct tun_pi *)p->buff;
+    struct iphdr *iph = (struct iphdr *)(pi + 1);
+    struct tcphdr *th = (struct tcphdr *)(iph + 1);
+    size_t hlen = sizeof (*iph) + sizeof (*th);
+
+    memset(pi, 0, sizeof (*pi) + hlen);
+    pi->proto = htons(ETH_P_IP);
+    iph->version = 4;
+    iph->ihl = 5;
+    iph->ttl = 64;
+    iph->protocol = IPPROTO_TCP;
+    iph->tot_len = htons(PKT_PAYLOAD);
+    iph->saddr = htonl(0x0a000001);
+    iph->daddr = htonl(0x0a010001);
+    th->source = htons(10000 + flow);
+    th->dest = htons(443);
+    th->doff = sizeof (*th) / 4;
+    payload_fill((uint8_t *)(th + 1), PKT_PAYLOAD - hlen, kind, flow);
+    p->pkt_size = sizeof (*pi) + PKT_PAYLOAD;
+}
+
+static void bench_pack(enum payload kind)
+{
+    struct compress_ctx *c;
+    struct pkt *pkts[BATCH], *tmpl[BATCH];
+    size_t len = sizeof (struct tun_pi) + PKT_PAYLOAD;
+    unsigned long ops = BYTES / PKT_PAYLOAD;
+    size_t out = 0;
+    uint64_t start;
+    unsigned long i;
+    int j;
+
+    c = compress_ctx_create();
+    if (!c)
+        abort();
+    for (j = 0; j < BATCH; j++) {
+        pkts[j] = pkt_alloc(len);
+        tmpl[j] = pkt_alloc(len);
+        if (!pkts[j] || !tmpl[j])
+            abort();
+        pkt_fill(tmpl[j], kind, j);
+    }
+
+    start = bench_now_ns();
+    for (i = 0; i < ops; i += BATCH) {
+        for (j = 0; j < BATCH; j++) {
+            memcpy(pkts[j]->buff, tmpl[j]->buff, len);
+            pkts[j]->pkt_size = len;
+        }
+        compress_pack(c, pkts, BATCH);
+        for (j = 0; j < BATCH; j++)
+            out += pkts[j]->pkt_size - sizeof (struct tun_pi);
+    }
+    report("compress_pack", kind, PKT_PAYLOAD, i, bench_now_ns() - start,
+           out);
+
+    for (j = 0; j < BATCH; j++) {
+        pkt_free(pkts[j]);
+        pkt_free(tmpl[j]);
+    }
+    compress_ctx_destroy(c);
+}
+
+int main(void)
+{
+    enum payload kind;
+    unsigned int i;
+
+    for (kind = PAYLOAD_TEXT; kind <= PAYLOAD_RANDOM; kind++) {
+        for (i = 0; i < sizeof (sizes) / sizeof (sizes[0]); i++)
+            bench_codec(kind, sizes[i]);
+        bench_pack(kind);
+    }
+
+    return 0;
+}
@@ -0,0 +1,167 @@
+/*
+ *  Copyright (c) 2011, Julian Pidancet <julian.pidancet@gmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *  3. Neither the name of Julian Pidancet nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <x86intrin.h>
+#include <linux/if_tun.h>
+
+#include "pktqueue.h"
+#include "crypto.h"
+#include "bench.h"
+
+/*
+ * The AEAD kernels sealing in place, and the per-packet path the tunnel
+ * runs: batches of packets through crypto_seal() then crypto_open(), which
+ * costs the same as sealing plus the replay window.
+ * ChaCha20-Poly1305 runs on every SIMD level the CPU has, the scalar one
+ * being the reference; AES-GCM only runs with AES-NI.
+ *
+ * Cycles are TSC ticks, which match core cycles as long as the clock does
+ * not scale.
+ */
+
+#define BYTES (64 << 20)
+#define MAX_SZ 8192
+#define BATCH 32
+#define PKT_PAYLOAD 1400
+
+static const int sizes[] = { 64, 256, 576, 1420, 8192 };
+
+static uint8_t buf[MAX_SZ];
+
+static void report(const char *name, int cipher, const char *impl,
+                   int size, unsigned long ops, uint64_t ns, uint64_t cycles)
+{
+    char params[160];
+
+    snprintf(params, sizeof (params),
+             "\"cipher\":\"%s\",\"impl\":\"%s\",\"size\":%d,"
+             "\"cycles_per_byte\":%.3f",
+             crypto_cipher_str(cipher), impl, size,
+             (double)cycles / ((double)ops * size));
+    bench_report(name, params, ops, ns);
+}
+
+static void bench_aead(int cipher, const char *impl, int size)
+{
+    static struct crypto_aead a;
+    uint8_t key[CRYPTO_KEY_SZ], nonce[12], aad[12], tag[CRYPTO_TAG_SZ];
+    unsigned long ops = BYTES / size;
+    uint64_t start, tsc;
+    unsigned long i;
+
+    memset(key, 0x5a, sizeof (key));
+    memset(nonce, 0, sizeof (nonce));
+    memset(aad, 0, sizeof (aad));
+    memset(buf, 0xa5, size);
+    crypto_aead_init(&a, cipher, key);
+
+    start = bench_now_ns();
+    tsc = __rdtsc();
+    for (i = 0; i < ops; i++) {
+        memcpy(nonce + 4, &i, sizeof (i));
+        crypto_aead_seal(&a, nonce, aad, sizeof (aad), buf, size, tag);
+    }
+    tsc = __rdtsc() - tsc;
+    report("aead_seal", cipher, impl, size, ops, bench_now_ns() - start, tsc);
+}
+
+/* Seal a batch, open it on the other side, repeat */
+static void bench_session(int cipher, const char *impl)
+{
+    static const uint8_t cnonce[CRYPTO_HS_NONCE_SZ], snonce[CRYPTO_HS_NONCE_SZ];
+    struct crypto_session *tx, *rx;
+    struct pkt *pkts[BATCH];
+    uint64_t ctrs[BATCH];
+    unsigned long ops = BYTES / PKT_PAYLOAD;
+    size_t len = sizeof (struct tun_pi) + PKT_PAYLOAD;
+    uint64_t start, tsc;
+    unsigned long i;
+    int j;
+
+    tx = crypto_session_create(cipher, cnonce, snonce, 1);
+    rx = crypto_session_create(cipher, cnonce, snonce, 0);
+    if (!tx || !rx)
+        abort();
+    for (j = 0; j < BATCH; j++) {
+        pkts[j] = pkt_alloc(len + CRYPTO_OVERHEAD);
+        if (!pkts[j])
+            abort();
+        memset(pkts[j]->buff, 0, len);
+    }
+
+    start = bench_now_ns();
+    tsc = __rdtsc();
+    for (i = 0; i < ops; i += BATCH) {
+        for (j = 0; j < BATCH; j++)
+            pkts[j]->pkt_size = len;
+        if (crypto_seal(tx, pkts, BATCH) != BATCH ||
+            crypto_open(rx, pkts, BATCH, ctrs) != BATCH ||
+            crypto_replay_filter(rx, pkts, ctrs, BATCH) != BATCH)
+            abort();
+    }
+    tsc = __rdtsc() - tsc;
+    report("session_seal_open", cipher, impl, PKT_PAYLOAD, i,
+           bench_now_ns() - start, tsc);
+
+    for (j = 0; j < BATCH; j++)
+        pkt_free(pkts[j]);
+    crypto_session_destroy(tx);
+    crypto_session_destroy(rx);
+}
+
+int main(void)
+{
+    enum crypto_simd level;
+    unsigned int i;
+
+    crypto_init();
+
+    for (level = CRYPTO_SIMD_NONE; level <= CRYPTO_SIMD_AVX512; level++) {
+        if (crypto_simd_set(level) != (int)level)
+            continue;
+        for (i = 0; i < sizeof (sizes) / sizeof (sizes[0]); i++)
+            bench_aead(CRYPTO_CHACHA20_POLY1305, crypto_simd_str(), sizes[i]);
+        bench_session(CRYPTO_CHACHA20_POLY1305, crypto_simd_str());
+    }
+
+    if (crypto_aesni()) {
+        for (i = 0; i < sizeof (sizes) / sizeof (sizes[0]); i++)
+            bench_aead(CRYPTO_AES256_GCM, "aes-ni", sizes[i]);
+        bench_session(CRYPTO_AES256_GCM, "aes-ni");
+    }
+
+    return 0;
+}
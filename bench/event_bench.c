@@ -0,0 +1,344 @@
+/*
+ *  Copyright (c) 2011, Julian Pidancet <julian.pidancet@gmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *  3. Neither the name of Julian Pidancet nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+
+#include "events.h"
+#include "bench.h"
+
+/*
+ * Dispatcher costs, with each backend the kernel lets us have:
+ *
+ * - event_control() stalling and restarting a ready event, as the datapath
+ *   does whenever a pool runs dry or a queue empties;
+ * - a wakeup of event_dispatch() for one ready event among N registered.
+ *   The event signals itself again from its handler, so that every round
+ *   finds exactly one event ready.
+ * - writes of a handler to a file always ready for them, a batch per round:
+ *   a system call each under epoll, requests submitted along with the next
+ *   wait under io_uring, as the tun and socket writes of the datapath are.
+ */
+
+#define CHURN_OPS (1 << 20)
+#define CHURN_CHUNK 1024
+#define WAKEUPS (1 << 18)
+#define WRITES (1 << 20)
+#define WRITE_BATCH 32
+
+struct churn
+{
+    struct dispatch *d;
+    struct event *ev;
+    unsigned long ops;
+};
+
+static int churn_handler(int fd, unsigned short flags, void *priv)
+{
+    struct churn *c = priv;
+    int i;
+
+    (void)fd;
+    (void)flags;
+
+    for (i = 0; i < CHURN_CHUNK; i++) {
+        if (event_control(c->d, c->ev, EVCTL_READ_STALL) ||
+            event_control(c->d, c->ev, EVCTL_READ_RESTART))
+            return DISPATCH_ABORT;
+    }
+    c->ops += 2 * CHURN_CHUNK;
+
+    return c->ops < CHURN_OPS ? DISPATCH_CONTINUE : DISPATCH_ABORT;
+}
+
+struct wakeup
+{
+    unsigned long count;
+};
+
+static int wakeup_handler(int fd, unsigned short flags, void *priv)
+{
+    struct wakeup *w = priv;
+    uint64_t v = 1;
+
+    (void)flags;
+
+    if (read(fd, &v, sizeof (v)) != sizeof (v))
+        return DISPATCH_ABORT;
+    if (++w->count == WAKEUPS)
+        return DISPATCH_ABORT;
+    if (write(fd, &v, sizeof (v)) != sizeof (v))
+        return DISPATCH_ABORT;
+
+    return DISPATCH_CONTINUE;
+}
+
+struct writer
+{
+    struct uring_req req;       /* Shared by all its writes */
+    struct dispatch *d;
+    struct event *ev;
+    int fd;             /* Written to, /dev/null */
+    uint64_t one;
+    int inflight;
+    unsigned long queued;
+    unsigned long count;
+};
+
+static int writer_done(struct uring_req *req, int res, unsigned int flags)
+{
+    struct writer *w = (struct writer *)req;
+
+    (void)flags;
+
+    if (res != sizeof (w->one))
+        return DISPATCH_ABORT;
+    w->inflight--;
+    w->count++;
+    event_uring_ready(w->d, w->ev, EVENT_WRITE);
+
+    return DISPATCH_CONTINUE;
+}
+
+static int writer_handler(int fd, unsigned short flags, void *priv)
+{
+    struct writer *w = priv;
+    struct io_uring_sqe *sqe;
+    int i;
+
+    (void)fd;
+    (void)flags;
+
+    if (w->count == WRITES)
+        return DISPATCH_ABORT;
+
+    if (!w->d->ring) {
+        for (i = 0; i < WRITE_BATCH; i++) {
+            if (write(w->fd, &w->one, sizeof (w->one)) != sizeof (w->one))
+                return DISPATCH_ABORT;
+        }
+        w->count += WRITE_BATCH;
+        return DISPATCH_CONTINUE;
+    }
+
+    for (; w->inflight < WRITE_BATCH && w->queued < WRITES; w->queued++) {
+        sqe = event_uring_sqe(w->d, w->ev, &w->req);
+        if (!sqe)
+            return DISPATCH_ABORT;
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = w->fd;
+        sqe->addr = (uintptr_t)&w->one;
+        sqe->len = sizeof (w->one);
+        w->inflight++;
+    }
+    event_drained(w->d, w->ev, EVENT_WRITE);
+
+    return DISPATCH_CONTINUE;
+}
+
+static int idle_handler(int fd, unsigned short flags, void *priv)
+{
+    (void)fd;
+    (void)flags;
+    (void)priv;
+
+    return DISPATCH_ABORT;
+}
+
+static const char *backend_name(struct dispatch *d)
+{
+    return d->ring ? "io_uring" : "epoll";
+}
+
+static int bench_churn(void)
+{
+    struct dispatch d;
+    struct churn c = { .d = &d };
+    char params[64];
+    uint64_t start;
+    int fd;
+
+    if (dispatch_init(&d))
+        return -1;
+    fd = eventfd(1, EFD_NONBLOCK);
+    c.ev = fd < 0 ? NULL :
+           event_create(&d, fd, EVENT_READ, churn_handler, &c);
+    if (!c.ev) {
+        dispatch_cleanup(&d);
+        return -1;
+    }
+
+    start = bench_now_ns();
+    event_dispatch(&d);
+    snprintf(params, sizeof (params), "\"backend\":\"%s\"",
+             backend_name(&d));
+    bench_report("event_control", params, c.ops, bench_now_ns() - start);
+
+    event_delete(&d, c.ev);
+    dispatch_cleanup(&d);
+    close(fd);
+
+    return 0;
+}
+
+static int bench_wakeup(int nevents)
+{
+    struct dispatch d;
+    struct wakeup w = { 0 };
+    char params[64];
+    uint64_t start;
+    uint64_t one = 1;
+    int *fds;
+    struct event **evs;
+    int n = 0;
+    int rc = -1;
+    int i;
+
+    fds = calloc(nevents, sizeof (*fds));
+    evs = calloc(nevents, sizeof (*evs));
+    if (!fds || !evs || dispatch_init(&d))
+        goto free;
+
+    for (n = 0; n < nevents; n++) {
+        fds[n] = eventfd(0, EFD_NONBLOCK);
+        if (fds[n] < 0)
+            goto cleanup;
+        evs[n] = event_create(&d, fds[n], EVENT_READ,
+                              n ? idle_handler : wakeup_handler, &w);
+        if (!evs[n]) {
+            close(fds[n]);
+            goto cleanup;
+        }
+    }
+
+    if (write(fds[0], &one, sizeof (one)) != sizeof (one))
+        goto cleanup;
+
+    start = bench_now_ns();
+    event_dispatch(&d);
+    snprintf(params, sizeof (params), "\"backend\":\"%s\",\"events\":%d",
+             backend_name(&d), nevents);
+    bench_report("event_dispatch", params, w.count, bench_now_ns() - start);
+    rc = 0;
+
+cleanup:
+    for (i = 0; i < n; i++) {
+        event_delete(&d, evs[i]);
+        close(fds[i]);
+    }
+    dispatch_cleanup(&d);
+free:
+    free(evs);
+    free(fds);
+    return rc;
+}
+
+static int bench_write(void)
+{
+    struct dispatch d;
+    struct writer w = { .req.handler = writer_done, .d = &d, .one = 1 };
+    char params[64];
+    uint64_t start;
+    int fd;
+    int rc = -1;
+
+    if (dispatch_init(&d))
+        return -1;
+
+    /* The eventfd is only there to be polled, which /dev/null cannot be */
+    w.fd = open("/dev/null", O_WRONLY);
+    fd = eventfd(0, EFD_NONBLOCK);
+    if (w.fd < 0 || fd < 0)
+        goto close;
+    w.ev = event_create(&d, fd, EVENT_WRITE | EVENT_URING_WRITE,
+                        writer_handler, &w);
+    if (!w.ev)
+        goto close;
+
+    start = bench_now_ns();
+    event_dispatch(&d);
+    snprintf(params, sizeof (params), "\"backend\":\"%s\",\"batch\":%d",
+             backend_name(&d), WRITE_BATCH);
+    bench_report("event_write", params, w.count, bench_now_ns() - start);
+    rc = 0;
+
+    event_delete(&d, w.ev);
+close:
+    dispatch_cleanup(&d);
+    if (fd >= 0)
+        close(fd);
+    if (w.fd >= 0)
+        close(w.fd);
+
+    return rc;
+}
+
+/* Initialising a dispatch falls back to epoll if the kernel says no */
+static int use_backend(int backend)
+{
+    struct dispatch d;
+
+    dispatch_opts.backend = backend;
+    if (dispatch_init(&d))
+        return -1;
+    dispatch_cleanup(&d);
+
+    return dispatch_opts.backend == backend ? 0 : -1;
+}
+
+int main(void)
+{
+    static const int backends[] = { DISPATCH_EPOLL, DISPATCH_URING };
+    static const int sizes[] = { 1, 100, 1000, 10000 };
+    unsigned int b, s;
+
+    for (b = 0; b < sizeof (backends) / sizeof (backends[0]); b++) {
+        if (use_backend(backends[b]))
+            continue;
+
+        if (bench_churn())
+            return 1;
+        for (s = 0; s < sizeof (sizes) / sizeof (sizes[0]); s++) {
+            if (bench_wakeup(sizes[s]))
+                return 1;
+        }
+        if (bench_write())
+            return 1;
+    }
+
+    return 0;
+}
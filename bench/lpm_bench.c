@@ -0,0 +1,132 @@
+/*
+ *  Copyright (c) 2011, Julian Pidancet <julian.pidancet@gmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *  3. Neither the name of Julian Pidancet nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "lpm.h"
+#include "bench.h"
+
+/*
+ * Route lookups in the hub's table as it grows: mostly /32 routes to the
+ * clients of a /14 pool, plus shorter prefixes of static routes, looked up
+ * for addresses with a route (hit) and for addresses anywhere (miss, mostly).
+ * Addresses come from an array much larger than the caches, in random order.
+ */
+
+#define GROUPS (1 << 14)
+#define LOOKUPS (1 << 22)
+#define ADDRS (1 << 20)
+
+static const int nroutes[] = { 1000, 10000, 100000 };
+
+static uint32_t addrs[ADDRS];
+
+static void report(const char *name, int routes, int hit, unsigned long ops,
+                   uint64_t ns, struct lpm *l)
+{
+    char params[128];
+
+    snprintf(params, sizeof (params),
+             "\"routes\":%d,\"hit\":%s,\"groups\":%u", routes,
+             hit ? "true" : "false", l->used_groups - l->nfree);
+    bench_report(name, params, ops, ns);
+}
+
+static void bench_routes(int n)
+{
+    unsigned int seed = n;
+    volatile uint32_t sink;
+    struct lpm *l;
+    uint32_t nh, *hosts;
+    uint8_t *depths;
+    uint64_t start;
+    int hit, i;
+
+    l = lpm_create(GROUPS);
+    hosts = malloc(n * sizeof (*hosts));
+    depths = malloc(n);
+    if (!l || !hosts || !depths)
+        abort();
+
+    /* Some of the random /32s are drawn twice, which then only update */
+    for (i = 0; i < n; i++) {
+        if (i % 10) {
+            hosts[i] = 0x0a000000 | (rand_r(&seed) & 0x3ffff);
+            depths[i] = 32;
+        } else {
+            hosts[i] = 0x0a000000 | (rand_r(&seed) & 0xffffff);
+            depths[i] = 16 + rand_r(&seed) % 9;
+        }
+    }
+
+    start = bench_now_ns();
+    for (i = 0; i < n; i++) {
+        if (lpm_add(l, hosts[i], depths[i], i + 1))
+            abort();
+    }
+    report("lpm_add", n, 1, n, bench_now_ns() - start, l);
+
+    for (hit = 1; hit >= 0; hit--) {
+        for (i = 0; i < ADDRS; i++)
+            addrs[i] = hit ? hosts[rand_r(&seed) % n] :
+                       (uint32_t)rand_r(&seed) << 1 ^ rand_r(&seed);
+
+        start = bench_now_ns();
+        for (i = 0; i < LOOKUPS; i++) {
+            if (!lpm_lookup(l, addrs[i & (ADDRS - 1)], &nh))
+                sink = nh;
+        }
+        report("lpm_lookup", n, hit, LOOKUPS, bench_now_ns() - start, l);
+    }
+    (void)sink;
+
+    start = bench_now_ns();
+    for (i = 0; i < n; i++)
+        lpm_del(l, hosts[i], depths[i]);
+    report("lpm_del", n, 1, n, bench_now_ns() - start, l);
+
+    free(hosts);
+    free(depths);
+    lpm_destroy(l);
+}
+
+int main(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof (nroutes) / sizeof (nroutes[0]); i++)
+        bench_routes(nroutes[i]);
+
+    return 0;
+}
@@ -0,0 +1,127 @@
+/*
+ *  Copyright (c) 2011, Julian Pidancet <julian.pidancet@gmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *  3. Neither the name of Julian Pidancet nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "peer.h"
+#include "bench.h"
+
+/*
+ * peer_lookup() cost against table size. With a hashed table the cost per
+ * lookup should stay flat from a handful of peers to 100k.
+ */
+
+#define LOOKUPS (1 << 22)
+
+static void bench_lookups(struct peer_table *t, struct sockaddr_in *keys,
+                          uint32_t *order, uint32_t n, int hit)
+{
+    struct sockaddr_in miss;
+    unsigned long found = 0;
+    uint64_t start;
+    char params[64];
+    uint32_t i;
+
+    start = bench_now_ns();
+    for (i = 0; i < LOOKUPS; i++) {
+        struct sockaddr_in *addr = &keys[order[i] % n];
+
+        if (!hit) {
+            miss = *addr;
+            miss.sin_port ^= 0x8000;
+            addr = &miss;
+        }
+        found += !!peer_lookup(t, addr);
+    }
+
+    if (found != (hit ? LOOKUPS : 0))
+        fprintf(stderr, "peer_lookup: unexpected result count %lu\n", found);
+
+    snprintf(params, sizeof (params), "\"peers\":%u,\"hit\":%s", n,
+             hit ? "true" : "false");
+    bench_report("peer_lookup", params, LOOKUPS, bench_now_ns() - start);
+}
+
+int main(void)
+{
+    static const uint32_t sizes[] = { 10, 100, 1000, 10000, 100000 };
+    struct sockaddr_in *keys;
+    struct peer *peers;
+    uint32_t *order;
+    uint32_t max = sizes[sizeof (sizes) / sizeof (sizes[0]) - 1];
+    uint32_t i;
+    size_t s;
+
+    keys = calloc(max, sizeof (*keys));
+    peers = calloc(max, sizeof (*peers));
+    order = calloc(LOOKUPS, sizeof (*order));
+    if (!keys || !peers || !order)
+        return 1;
+
+    srandom(42);
+    for (i = 0; i < max; i++) {
+        keys[i].sin_family = AF_INET;
+        keys[i].sin_addr.s_addr = random();
+        keys[i].sin_port = htons(1024 + i % 0x7000);
+    }
+    for (i = 0; i < LOOKUPS; i++)
+        order[i] = random();
+
+    for (s = 0; s < sizeof (sizes) / sizeof (sizes[0]); s++) {
+        struct peer_table t;
+        uint32_t n = sizes[s];
+
+        if (peer_table_init(&t))
+            return 1;
+
+        for (i = 0; i < n; i++) {
+            memset(&peers[i], 0, sizeof (peers[i]));
+            peers[i].addr = keys[i];
+            if (peer_table_insert(&t, &peers[i]))
+                return 1;
+        }
+
+        bench_lookups(&t, keys, order, n, 1);
+        bench_lookups(&t, keys, order, n, 0);
+
+        peer_table_cleanup(&t);
+    }
+
+    free(order);
+    free(peers);
+    free(keys);
+
+    return 0;
+}
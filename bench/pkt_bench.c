@@ -0,0 +1,253 @@
+/*
+ *  Copyright (c) 2011, Julian Pidancet <julian.pidancet@gmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *  3. Neither the name of Julian Pidancet nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "pktqueue.h"
+#include "pktring.h"
+#include "bench.h"
+
+/*
+ * Packet allocation and the queues packets travel through: the locked
+ * pktqueue and both flavours of pktring, on one thread and handed over to
+ * another. Cross-thread runs pass a fixed set of packets around a loop of
+ * two queues, so every packet counted went there and back.
+ */
+
+#define OPS (1 << 22)
+#define XOPS (1 << 21)
+#define PKT_SZ 1600
+#define BATCH 32
+#define POOL 256
+#define RING_SZ 1024
+
+static struct pkt *pkts[POOL];
+
+static void bench_alloc(int batch)
+{
+    char params[64];
+    uint64_t start;
+    int i, j;
+
+    start = bench_now_ns();
+    for (i = 0; i < OPS; i += batch) {
+        for (j = 0; j < batch; j++) {
+            pkts[j] = pkt_alloc(PKT_SZ);
+            if (!pkts[j])
+                abort();
+        }
+        for (j = 0; j < batch; j++)
+            pkt_free(pkts[j]);
+    }
+
+    snprintf(params, sizeof (params), "\"size\":%d,\"batch\":%d", PKT_SZ,
+             batch);
+    bench_report("pkt_alloc_free", params, OPS, bench_now_ns() - start);
+}
+
+static void bench_pktqueue(int batch)
+{
+    struct pktqueue q;
+    char params[64];
+    uint64_t start;
+    int i, j;
+
+    pktqueue_init(&q);
+    start = bench_now_ns();
+    for (i = 0; i < OPS; i += batch) {
+        for (j = 0; j < batch; j++)
+            pktqueue_enqueue(&q, pkts[j]);
+        for (j = 0; j < batch; j++)
+            pkts[j] = pktqueue_dequeue(&q);
+    }
+
+    snprintf(params, sizeof (params), "\"batch\":%d", batch);
+    bench_report("pktqueue", params, OPS, bench_now_ns() - start);
+}
+
+static void bench_pktring(int mode, int batch)
+{
+    struct pktring *r;
+    char params[64];
+    uint64_t start;
+    int i, j;
+
+    r = pktring_create(RING_SZ, mode);
+    if (!r)
+        abort();
+
+    start = bench_now_ns();
+    for (i = 0; i < OPS; i += batch) {
+        if (batch == 1) {
+            pktring_enqueue(r, pkts[0]);
+            pkts[0] = pktring_dequeue(r);
+            continue;
+        }
+        j = pktring_enqueue_bulk(r, pkts, batch);
+        j = pktring_dequeue_bulk(r, pkts, j);
+        if (j != batch)
+            abort();
+    }
+
+    snprintf(params, sizeof (params), "\"mode\":\"%s\",\"batch\":%d",
+             mode == PKTRING_SPSC ? "spsc" : "mpmc", batch);
+    bench_report("pktring", params, OPS, bench_now_ns() - start);
+    pktring_destroy(r);
+}
+
+/*
+ * Cross-thread: the main thread feeds "to" from "back", the other thread
+ * moves everything from "to" to "back". Either waits by yielding, so that
+ * running on a single CPU stays meaningful.
+ */
+struct xbench
+{
+    int ring;
+    void *to;
+    void *back;
+};
+
+static struct pkt *xdequeue(struct xbench *x, void *q)
+{
+    return x->ring ? pktring_dequeue(q) : pktqueue_dequeue(q);
+}
+
+static void xenqueue(struct xbench *x, void *q, struct pkt *p)
+{
+    if (x->ring) {
+        while (pktring_enqueue(q, p))
+            sched_yield();
+    } else {
+        pktqueue_enqueue(q, p);
+    }
+}
+
+static void *xbench_thread(void *priv)
+{
+    struct xbench *x = priv;
+    struct pkt *p;
+    int n;
+
+    for (n = 0; n < XOPS; n++) {
+        while (!(p = xdequeue(x, x->to)))
+            sched_yield();
+        xenqueue(x, x->back, p);
+    }
+
+    return NULL;
+}
+
+static void bench_cross(struct xbench *x, const char *name,
+                        const char *params)
+{
+    pthread_t thread;
+    struct pkt *p;
+    uint64_t start;
+    int n;
+
+    for (n = 0; n < POOL; n++)
+        xenqueue(x, x->back, pkts[n]);
+
+    start = bench_now_ns();
+    if (pthread_create(&thread, NULL, xbench_thread, x))
+        abort();
+    for (n = 0; n < XOPS; n++) {
+        while (!(p = xdequeue(x, x->back)))
+            sched_yield();
+        xenqueue(x, x->to, p);
+    }
+    pthread_join(thread, NULL);
+    bench_report(name, params, XOPS, bench_now_ns() - start);
+
+    for (n = 0; n < POOL; n++)
+        pkts[n] = xdequeue(x, x->back);
+}
+
+static void bench_pktqueue_cross(void)
+{
+    struct pktqueue to, back;
+    struct xbench x = { .ring = 0, .to = &to, .back = &back };
+
+    pktqueue_init(&to);
+    pktqueue_init(&back);
+    bench_cross(&x, "pktqueue_xthread", "");
+}
+
+static void bench_pktring_cross(int mode)
+{
+    struct xbench x = { .ring = 1 };
+
+    x.to = pktring_create(RING_SZ, mode);
+    x.back = pktring_create(RING_SZ, mode);
+    if (!x.to || !x.back)
+        abort();
+    bench_cross(&x, "pktring_xthread",
+                mode == PKTRING_SPSC ? "\"mode\":\"spsc\"" :
+                                       "\"mode\":\"mpmc\"");
+    pktring_destroy(x.to);
+    pktring_destroy(x.back);
+}
+
+int main(void)
+{
+    int i;
+
+    bench_alloc(1);
+    bench_alloc(POOL);
+
+    for (i = 0; i < POOL; i++) {
+        pkts[i] = pkt_alloc(PKT_SZ);
+        if (!pkts[i])
+            return 1;
+    }
+
+    bench_pktqueue(1);
+    bench_pktqueue(BATCH);
+    bench_pktring(PKTRING_SPSC, 1);
+    bench_pktring(PKTRING_SPSC, BATCH);
+    bench_pktring(PKTRING_MPMC, 1);
+    bench_pktring(PKTRING_MPMC, BATCH);
+
+    bench_pktqueue_cross();
+    bench_pktring_cross(PKTRING_SPSC);
+    bench_pktring_cross(PKTRING_MPMC);
+
+    for (i = 0; i < POOL; i++)
+        pkt_free(pkts[i]);
+
+    return 0;
+}
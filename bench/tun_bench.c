@@ -0,0 +1,429 @@
+/*
+ *  Copyright (c) 2011, Julian Pidancet <julian.pidancet@gmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *  3. Neither the name of Julian Pidancet nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <linux/if_ether.h>
+#include <linux/if_tun.h>
+
+#include "events.h"
+#include "iface.h"
+#include "io.h"
+#include "pair.h"
+#include "crypto.h"
+#include "compress.h"
+#include "workers.h"
+
+/*
+ * Throughput and latency of the whole pipeline: a client and a listener in
+ * one process, joined by the in-memory pair backends. Packets written on the
+ * device side of the client's interface go through it, the transport and the
+ * listener's peer and interface, get echoed on the listener's device side and
+ * come back the same way, so that every one of them crosses it all twice.
+ */
+
+#define BENCH_SAMPLES (1 << 20)
+#define BENCH_FLOWS 64
+#define BENCH_ATTACH_MS 5000
+#define BENCH_LOST_MS 100
+
+struct bench_pkt
+{
+    struct tun_pi pi;
+    struct iphdr ip;
+    uint64_t stamp;
+    char pad[];
+};
+
+/* Device sides of the interfaces: 0 is the client's, 1 the listener's */
+struct bench_side
+{
+    int fds[IFACE_MAX_QUEUES];
+    int nfds;
+};
+
+struct endpoint
+{
+    int side;
+    struct io *io;
+    pthread_t thread;
+};
+
+static struct bench_side sides[2];
+static pthread_mutex_t sides_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Interfaces are created by the endpoint threads, which know their side */
+static __thread int current_side = -1;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void attach(struct iface *iface, int fd, void *priv)
+{
+    struct bench_side *side;
+
+    (void)iface;
+    (void)priv;
+
+    pthread_mutex_lock(&sides_lock);
+    side = current_side >= 0 ? &sides[current_side] : NULL;
+    if (side && side->nfds < IFACE_MAX_QUEUES)
+        side->fds[side->nfds++] = fd;
+    else
+        close(fd);
+    pthread_mutex_unlock(&sides_lock);
+}
+
+static void *endpoint_thread(void *priv)
+{
+    struct endpoint *e = priv;
+
+    current_side = e->side;
+    io_run(e->io);
+
+    return NULL;
+}
+
+static int wait_attached(void)
+{
+    int i;
+    int done;
+
+    for (i = 0; i < BENCH_ATTACH_MS; i++) {
+        pthread_mutex_lock(&sides_lock);
+        done = sides[0].nfds == iface_opts.queues &&
+               sides[1].nfds == iface_opts.queues;
+        pthread_mutex_unlock(&sides_lock);
+        if (done)
+            return 0;
+        usleep(1000);
+    }
+
+    fprintf(stderr, "tun_bench: the endpoints never connected.\n");
+    return -1;
+}
+
+static void bench_pkt_init(struct bench_pkt *p, size_t size)
+{
+    memset(p, 0, sizeof (p->pi) + size);
+    p->pi.proto = htons(ETH_P_IP);
+    p->ip.version = 4;
+    p->ip.ihl = 5;
+    p->ip.ttl = 64;
+    p->ip.protocol = 253;       /* Reserved for experimentation */
+    p->ip.tot_len = htons(size);
+    p->ip.daddr = htonl(0x0a010001);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(uint64_t *samples, size_t n, double pct)
+{
+    size_t i = n * pct / 100;
+
+    if (i >= n)
+        i = n - 1;
+    return samples[i] / 1e3;
+}
+
+/* Echo whatever the listener's interface wrote straight back into it */
+static void reflect(struct bench_side *side, char *buff, size_t size,
+                    unsigned long *drops)
+{
+    ssize_t rc;
+    int i;
+
+    for (i = 0; i < side->nfds; i++) {
+        while ((rc = read(side->fds[i], buff, size)) > 0) {
+            if (write(side->fds[i], buff, rc) != rc)
+                (*drops)++;
+        }
+    }
+}
+
+static void usage(const char *progname)
+{
+    fprintf(stderr, "Usage: %s [-d <seconds>] [-s <size>] [-w <window>] "
+                    "[-Q <queues>] [-b <batch>] [-B <budget>] [-u]\n"
+                    "       [-e] [-P <usecs>] [-k <key file>] [-c <cipher list>]\n"
+                    "       [-z] [-W <workers>]\n",
+            progname);
+}
+
+int main(int argc, char **argv)
+{
+    struct endpoint ends[2];
+    struct sockaddr_in addr;
+    struct pollfd pfds[2 * IFACE_MAX_QUEUES];
+    struct bench_pkt *pkt;
+    char *buff;
+    uint64_t *samples;
+    size_t nsamples = 0;
+    unsigned long seen = 0;
+    unsigned long sent = 0, echoed = 0, lost = 0, drops = 0;
+    unsigned long inflight = 0;
+    uint64_t start, end, t, last_rx;
+    double secs;
+    int duration = 5;
+    int size = 1400;
+    int window = 256;
+    int fds[2];
+    int npfds;
+    int flow = 0;
+    int rc = 1;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "d:s:w:Q:b:B:ueP:k:c:zW:")) != -1) {
+        switch (opt) {
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 's':
+            size = atoi(optarg);
+            break;
+        case 'w':
+            window = atoi(optarg);
+            break;
+        case 'Q':
+            iface_opts.queues = atoi(optarg);
+            break;
+        case 'b':
+            io_opts.batch = atoi(optarg);
+            break;
+        case 'B':
+            iface_opts.budget = atoi(optarg);
+            break;
+        case 'u':
+            dispatch_opts.backend = DISPATCH_URING;
+            break;
+        case 'e':
+            dispatch_opts.edge_triggered = 1;
+            break;
+        case 'P':
+            dispatch_opts.busy_poll_us = atoi(optarg);
+            break;
+        case 'k':
+            if (crypto_load_key(optarg))
+                return 1;
+            break;
+        case 'c':
+            crypto_opts.ciphers = crypto_parse_ciphers(optarg);
+            if (crypto_opts.ciphers <= 0)
+                return 1;
+            break;
+        case 'z':
+            compress_opts.enabled = 1;
+            break;
+        case 'W':
+            worker_opts.count = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (duration < 1 || window < 1 ||
+        size < (int)(sizeof (*pkt) - sizeof (pkt->pi)) ||
+        size > PAIR_MTU - 32 -
+               (crypto_opts.enabled ? CRYPTO_OVERHEAD : 0) ||
+        iface_opts.queues < 1 || iface_opts.queues > IFACE_MAX_QUEUES ||
+        io_opts.batch < 1 || io_opts.batch > IO_BATCH_MAX ||
+        iface_opts.budget < 1 ||
+        worker_opts.count < 0 || worker_opts.count > WORKERS_MAX) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (crypto_init() || workers_start())
+        return 1;
+
+    iface_opts.backend = &iface_pair_backend;
+    io_opts.backend = &io_pair_backend;
+    pair_opts.attach = attach;
+
+    buff = malloc(PAIR_MTU);
+    pkt = malloc(sizeof (pkt->pi) + size);
+    samples = malloc(BENCH_SAMPLES * sizeof (*samples));
+    if (!buff || !pkt || !samples)
+        goto free;
+
+    if (pair_transport(fds))
+        goto free;
+
+    pair_addr(&addr);
+    ends[0].side = 0;
+    ends[0].io = io_create(&fds[0], 1, &addr);
+    ends[1].side = 1;
+    ends[1].io = io_create(&fds[1], 1, NULL);
+    if (!ends[0].io || !ends[1].io)
+        goto destroy;
+
+    for (i = 0; i < 2; i++) {
+        if (pthread_create(&ends[i].thread, NULL, endpoint_thread, &ends[i])) {
+            fprintf(stderr, "pthread_create() failed.\n");
+            if (i)
+                goto stop0;
+            goto destroy;
+        }
+    }
+
+    if (wait_attached())
+        goto stop;
+
+    npfds = 0;
+    for (i = 0; i < sides[0].nfds; i++)
+        pfds[npfds++].fd = sides[0].fds[i];
+    for (i = 0; i < sides[1].nfds; i++)
+        pfds[npfds++].fd = sides[1].fds[i];
+    for (i = 0; i < npfds; i++)
+        pfds[i].events = POLLIN;
+
+    bench_pkt_init(pkt, size);
+    start = last_rx = now_ns();
+    end = start + duration * 1000000000ULL;
+
+    for (t = start; t < end; t = now_ns()) {
+        /* Keep the window full, one flow after the other */
+        while (inflight < (unsigned long)window) {
+            pkt->ip.saddr = htonl(0x0a000001 + flow);
+            pkt->stamp = now_ns();
+            if (write(sides[0].fds[flow % sides[0].nfds], pkt,
+                      sizeof (pkt->pi) + size) < 0)
+                break;
+            flow = (flow + 1) % BENCH_FLOWS;
+            sent++;
+            inflight++;
+        }
+
+        if (poll(pfds, npfds, 1) < 0 && errno != EINTR)
+            break;
+
+        reflect(&sides[1], buff, PAIR_MTU, &drops);
+
+        for (i = 0; i < sides[0].nfds; i++) {
+            while (read(sides[0].fds[i], buff, PAIR_MTU) > 0) {
+                struct bench_pkt *p = (void *)buff;
+
+                t = now_ns();
+                if (nsamples < BENCH_SAMPLES)
+                    samples[nsamples++] = t - p->stamp;
+                else if (random() % ++seen < BENCH_SAMPLES)
+                    samples[random() % BENCH_SAMPLES] = t - p->stamp;
+                echoed++;
+                if (inflight)
+                    inflight--;
+                last_rx = t;
+            }
+        }
+
+        /* Whatever did not come back by now is not going to */
+        if (inflight && t - last_rx > BENCH_LOST_MS * 1000000ULL) {
+            lost += inflight;
+            inflight = 0;
+            last_rx = t;
+        }
+    }
+    secs = (now_ns() - start) / 1e9;
+
+    qsort(samples, nsamples, sizeof (*samples), cmp_u64);
+
+    printf("tun_bench: %d byte packets, window %d, %d queue%s, %s%s%s, %s%s, "
+           "%d worker%s\n",
+           size, window, iface_opts.queues, iface_opts.queues > 1 ? "s" : "",
+           dispatch_opts.backend == DISPATCH_URING ? "io_uring" : "epoll",
+           dispatch_opts.edge_triggered ? " edge-triggered" : "",
+           dispatch_opts.busy_poll_us ? " busy polling" : "",
+           crypto_opts.enabled ? crypto_cipher_str(crypto_choose(
+               crypto_ciphers())) : "plaintext",
+           compress_opts.enabled ? ", lz4" : "",
+           worker_opts.count, worker_opts.count != 1 ? "s" : "");
+    printf("round trips: %lu in %.2f s, %.0f pps, %.3f Gbit/s each way\n",
+           echoed, secs, echoed / secs, echoed * size * 8 / secs / 1e9);
+    printf("sent %lu, lost %lu (%lu on echo)\n", sent, lost, drops);
+    if (nsamples)
+        printf("latency (us): p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f "
+               "max %.1f\n",
+               percentile(samples, nsamples, 50),
+               percentile(samples, nsamples, 90),
+               percentile(samples, nsamples, 99),
+               percentile(samples, nsamples, 99.9),
+               samples[nsamples - 1] / 1e3);
+    rc = echoed ? 0 : 1;
+
+stop:
+    io_stop(ends[1].io);
+    pthread_join(ends[1].thread, NULL);
+stop0:
+    io_stop(ends[0].io);
+    pthread_join(ends[0].thread, NULL);
+destroy:
+    for (i = 0; i < 2; i++) {
+        if (ends[i].io)
+            io_destroy(ends[i].io);
+    }
+    for (i = 0; i < sides[0].nfds; i++)
+        close(sides[0].fds[i]);
+    for (i = 0; i < sides[1].nfds; i++)
+        close(sides[1].fds[i]);
+    close(fds[0]);
+    close(fds[1]);
+free:
+    workers_stop();
+    free(samples);
+    free(pkt);
+    free(buff);
+
+    return rc;
+}
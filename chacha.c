@@ -0,0 +1,604 @@
+/*
+ *  Copyright (c) 2011, Julian Pidancet <julian.pidancet@gmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *  3. Neither the name of Julian Pidancet nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <immintrin.h>
+
+#include "crypto.h"
+
+/*
+ * ChaCha20 and Poly1305 as combined by RFC 8439. The keystream comes from
+ * one of three kernels picked at startup: the portable one below, or one
+ * computing 8 (AVX2) or 16 (AVX-512) blocks at a time, one block per 32-bit
+ * lane. Poly1305 stays scalar, on 44-bit limbs.
+ */
+
+static inline uint32_t le32_load(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+           (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void le32_store(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static inline uint64_t le64_load(const uint8_t *p)
+{
+    return (uint64_t)le32_load(p) | (uint64_t)le32_load(p + 4) << 32;
+}
+
+static inline void le64_store(uint8_t *p, uint64_t v)
+{
+    le32_store(p, v);
+    le32_store(p + 4, v >> 32);
+}
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QR(a, b, c, d)                                              \
+    do {                                                            \
+        a += b; d ^= a; d = ROTL32(d, 16);                          \
+        c += d; b ^= c; b = ROTL32(b, 12);                          \
+        a += b; d ^= a; d = ROTL32(d, 8);                           \
+        c += d; b ^= c; b = ROTL32(b, 7);                           \
+    } while (0)
+
+static void chacha20_rounds(uint32_t *x)
+{
+    int i;
+
+    for (i = 0; i < 10; i++) {
+        QR(x[0], x[4], x[8], x[12]);
+        QR(x[1], x[5], x[9], x[13]);
+        QR(x[2], x[6], x[10], x[14]);
+        QR(x[3], x[7], x[11], x[15]);
+        QR(x[0], x[5], x[10], x[15]);
+        QR(x[1], x[6], x[11], x[12]);
+        QR(x[2], x[7], x[8], x[13]);
+        QR(x[3], x[4], x[9], x[14]);
+    }
+}
+
+static void chacha20_init(uint32_t *st, const uint32_t *key,
+                          const uint8_t *nonce, uint32_t counter)
+{
+    st[0] = 0x61707865;
+    st[1] = 0x3320646e;
+    st[2] = 0x79622d32;
+    st[3] = 0x6b206574;
+    memcpy(st + 4, key, 8 * sizeof (*key));
+    st[12] = counter;
+    st[13] = le32_load(nonce);
+    st[14] = le32_load(nonce + 4);
+    st[15] = le32_load(nonce + 8);
+}
+
+static void chacha20_block(const uint32_t *st, uint8_t *out)
+{
+    uint32_t x[16];
+    int i;
+
+    memcpy(x, st, sizeof (x));
+    chacha20_rounds(x);
+    for (i = 0; i < 16; i++)
+        le32_store(out + 4 * i, x[i] + st[i]);
+}
+
+static void chacha20_xor_scalar(uint32_t *st, uint8_t *dst,
+                                const uint8_t *src, size_t len)
+{
+    uint8_t ks[64];
+    size_t i, n;
+
+    while (len) {
+        chacha20_block(st, ks);
+        st[12]++;
+
+        n = len < 64 ? len : 64;
+        for (i = 0; i < n; i++)
+            dst[i] = src[i] ^ ks[i];
+        dst += n;
+        src += n;
+        len -= n;
+    }
+}
+
+/*
+ * The vector kernels run the rounds on 16 registers, one per state word,
+ * each lane working on a block of its own. The result is transposed back
+ * into consecutive blocks before being XORed into the data.
+ */
+#define VQR(a, b, c, d, add, xor, rol16, rol12, rol8, rol7)        \
+    do {                                                            \
+        a = add(a, b); d = xor(d, a); d = rol16(d);                 \
+        c = add(c, d); b = xor(b, c); b = rol12(b);                 \
+        a = add(a, b); d = xor(d, a); d = rol8(d);                  \
+        c = add(c, d); b = xor(b, c); b = rol7(b);                  \
+    } while (0)
+
+#define VROUNDS(v, ...)                                             \
+    do {                                                            \
+        int r_;                                                     \
+        for (r_ = 0; r_ < 10; r_++) {                               \
+            VQR(v[0], v[4], v[8], v[12], __VA_ARGS__);              \
+            VQR(v[1], v[5], v[9], v[13], __VA_ARGS__);              \
+            VQR(v[2], v[6], v[10], v[14], __VA_ARGS__);             \
+            VQR(v[3], v[7], v[11], v[15], __VA_ARGS__);             \
+            VQR(v[0], v[5], v[10], v[15], __VA_ARGS__);             \
+            VQR(v[1], v[6], v[11], v[12], __VA_ARGS__);             \
+            VQR(v[2], v[7], v[8], v[13], __VA_ARGS__);              \
+            VQR(v[3], v[4], v[9], v[14], __VA_ARGS__);              \
+        }                                                           \
+    } while (0)
+
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+#define avx2_add _mm256_add_epi32
+#define avx2_xor _mm256_xor_si256
+#define avx2_rol(x, n) \
+    _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+#define avx2_rol16(x) _mm256_shuffle_epi8(x, rot16)
+#define avx2_rol12(x) avx2_rol(x, 12)
+#define avx2_rol8(x) _mm256_shuffle_epi8(x, rot8)
+#define avx2_rol7(x) avx2_rol(x, 7)
+
+/* 8x8 transpose of 32-bit words, in place */
+static AVX2_TARGET void avx2_transpose(__m256i *v)
+{
+    __m256i a[8], b[8];
+    int i;
+
+    for (i = 0; i < 8; i += 2) {
+        a[i] = _mm256_unpacklo_epi32(v[i], v[i + 1]);
+        a[i + 1] = _mm256_unpackhi_epi32(v[i], v[i + 1]);
+    }
+    for (i = 0; i < 8; i += 4) {
+        b[i] = _mm256_unpacklo_epi64(a[i], a[i + 2]);
+        b[i + 1] = _mm256_unpackhi_epi64(a[i], a[i + 2]);
+        b[i + 2] = _mm256_unpacklo_epi64(a[i + 1], a[i + 3]);
+        b[i + 3] = _mm256_unpackhi_epi64(a[i + 1], a[i + 3]);
+    }
+    for (i = 0; i < 4; i++) {
+        v[i] = _mm256_permute2x128_si256(b[i], b[i + 4], 0x20);
+        v[i + 4] = _mm256_permute2x128_si256(b[i], b[i + 4], 0x31);
+    }
+}
+
+/* 8 blocks, 512 bytes */
+static AVX2_TARGET void chacha20_8x(uint32_t *st, uint8_t *dst,
+                                    const uint8_t *src)
+{
+    const __m256i rot16 = _mm256_set_epi8(
+        13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+        13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2);
+    const __m256i rot8 = _mm256_set_epi8(
+        14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3,
+        14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3);
+    __m256i v[16], o[16], x;
+    int i;
+
+    for (i = 0; i < 16; i++)
+        o[i] = _mm256_set1_epi32(st[i]);
+    o[12] = _mm256_add_epi32(o[12], _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+    memcpy(v, o, sizeof (v));
+
+    VROUNDS(v, avx2_add, avx2_xor, avx2_rol16, avx2_rol12, avx2_rol8,
+            avx2_rol7);
+
+    for (i = 0; i < 16; i++)
+        v[i] = _mm256_add_epi32(v[i], o[i]);
+    avx2_transpose(v);
+    avx2_transpose(v + 8);
+
+    /* v[i] holds words 0-7 of block i, v[i + 8] words 8-15 */
+    for (i = 0; i < 8; i++) {
+        x = _mm256_loadu_si256((const void *)(src + 64 * i));
+        _mm256_storeu_si256((void *)(dst + 64 * i), _mm256_xor_si256(x, v[i]));
+        x = _mm256_loadu_si256((const void *)(src + 64 * i + 32));
+        _mm256_storeu_si256((void *)(dst + 64 * i + 32),
+                            _mm256_xor_si256(x, v[i + 8]));
+    }
+
+    st[12] += 8;
+}
+
+/* What does not fill the vectors: a last short run of 8 blocks, or scalar */
+static AVX2_TARGET void chacha20_xor_avx2(uint32_t *st, uint8_t *dst,
+                                          const uint8_t *src, size_t len)
+{
+    uint8_t tmp[512];
+
+    for (; len >= 512; len -= 512, src += 512, dst += 512)
+        chacha20_8x(st, dst, src);
+
+    if (len > 192) {
+        memcpy(tmp, src, len);
+        chacha20_8x(st, tmp, tmp);
+        memcpy(dst, tmp, len);
+    } else if (len) {
+        chacha20_xor_scalar(st, dst, src, len);
+    }
+}
+
+#define AVX512_TARGET __attribute__((target("avx512f,avx2")))
+
+#define avx512_add _mm512_add_epi32
+#define avx512_xor _mm512_xor_si512
+#define avx512_rol16(x) _mm512_rol_epi32(x, 16)
+#define avx512_rol12(x) _mm512_rol_epi32(x, 12)
+#define avx512_rol8(x) _mm512_rol_epi32(x, 8)
+#define avx512_rol7(x) _mm512_rol_epi32(x, 7)
+
+/*
+ * 16x16 transpose of 32-bit words, in place. Four 4x4 transposes within
+ * 128-bit lanes, then the 128-bit lanes of four registers are transposed
+ * the same way.
+ */
+static AVX512_TARGET void avx512_transpose(__m512i *v)
+{
+    __m512i a[16], b[16];
+    int i, j;
+
+    for (i = 0; i < 16; i += 2) {
+        a[i] = _mm512_unpacklo_epi32(v[i], v[i + 1]);
+        a[i + 1] = _mm512_unpackhi_epi32(v[i], v[i + 1]);
+    }
+    for (i = 0; i < 16; i += 4) {
+        b[i] = _mm512_unpacklo_epi64(a[i], a[i + 2]);
+        b[i + 1] = _mm512_unpackhi_epi64(a[i], a[i + 2]);
+        b[i + 2] = _mm512_unpacklo_epi64(a[i + 1], a[i + 3]);
+        b[i + 3] = _mm512_unpackhi_epi64(a[i + 1], a[i + 3]);
+    }
+
+    /*
+     * Lane l of b[4k + j] now holds words 4k..4k+3 of block 4l + j.
+     * Gather lane l of b[j], b[4 + j], b[8 + j], b[12 + j] into block 4l + j.
+     */
+    for (j = 0; j < 4; j++) {
+        __m512i t0, t1, t2, t3;
+
+        t0 = _mm512_shuffle_i32x4(b[j], b[4 + j], 0x44);
+        t1 = _mm512_shuffle_i32x4(b[j], b[4 + j], 0xee);
+        t2 = _mm512_shuffle_i32x4(b[8 + j], b[12 + j], 0x44);
+        t3 = _mm512_shuffle_i32x4(b[8 + j], b[12 + j], 0xee);
+
+        v[j] = _mm512_shuffle_i32x4(t0, t2, 0x88);
+        v[4 + j] = _mm512_shuffle_i32x4(t0, t2, 0xdd);
+        v[8 + j] = _mm512_shuffle_i32x4(t1, t3, 0x88);
+        v[12 + j] = _mm512_shuffle_i32x4(t1, t3, 0xdd);
+    }
+}
+
+/* 16 blocks, 1024 bytes */
+static AVX512_TARGET void chacha20_16x(uint32_t *st, uint8_t *dst,
+                                       const uint8_t *src)
+{
+    __m512i v[16], o[16], x;
+    int i;
+
+    for (i = 0; i < 16; i++)
+        o[i] = _mm512_set1_epi32(st[i]);
+    o[12] = _mm512_add_epi32(o[12],
+                             _mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8,
+                                              7, 6, 5, 4, 3, 2, 1, 0));
+    memcpy(v, o, sizeof (v));
+
+    VROUNDS(v, avx512_add, avx512_xor, avx512_rol16, avx512_rol12,
+            avx512_rol8, avx512_rol7);
+
+    for (i = 0; i < 16; i++)
+        v[i] = _mm512_add_epi32(v[i], o[i]);
+    avx512_transpose(v);
+
+    for (i = 0; i < 16; i++) {
+        x = _mm512_loadu_si512((const void *)(src + 64 * i));
+        _mm512_storeu_si512((void *)(dst + 64 * i), _mm512_xor_si512(x, v[i]));
+    }
+
+    st[12] += 16;
+}
+
+static AVX512_TARGET void chacha20_xor_avx512(uint32_t *st, uint8_t *dst,
+                                              const uint8_t *src, size_t len)
+{
+    for (; len >= 1024; len -= 1024, src += 1024, dst += 1024)
+        chacha20_16x(st, dst, src);
+
+    chacha20_xor_avx2(st, dst, src, len);
+}
+
+static void (*chacha20_xor)(uint32_t *, uint8_t *, const uint8_t *,
+                            size_t) = chacha20_xor_scalar;
+static enum crypto_simd chacha20_simd = CRYPTO_SIMD_NONE;
+
+/* Use at most the given level, as far as the CPU goes. Returns the level */
+int chacha20_simd_set(enum crypto_simd level)
+{
+    __builtin_cpu_init();
+
+    if (level >= CRYPTO_SIMD_AVX512 && __builtin_cpu_supports("avx512f") &&
+        __builtin_cpu_supports("avx2")) {
+        chacha20_xor = chacha20_xor_avx512;
+        chacha20_simd = CRYPTO_SIMD_AVX512;
+    } else if (level >= CRYPTO_SIMD_AVX2 && __builtin_cpu_supports("avx2")) {
+        chacha20_xor = chacha20_xor_avx2;
+        chacha20_simd = CRYPTO_SIMD_AVX2;
+    } else {
+        chacha20_xor = chacha20_xor_scalar;
+        chacha20_simd = CRYPTO_SIMD_NONE;
+    }
+
+    return chacha20_simd;
+}
+
+enum crypto_simd chacha20_simd_get(void)
+{
+    return chacha20_simd;
+}
+
+void hchacha20(uint8_t *out, const uint8_t *key, const uint8_t *nonce)
+{
+    uint32_t x[16];
+    int i;
+
+    x[0] = 0x61707865;
+    x[1] = 0x3320646e;
+    x[2] = 0x79622d32;
+    x[3] = 0x6b206574;
+    for (i = 0; i < 8; i++)
+        x[4 + i] = le32_load(key + 4 * i);
+    for (i = 0; i < 4; i++)
+        x[12 + i] = le32_load(nonce + 4 * i);
+
+    chacha20_rounds(x);
+
+    for (i = 0; i < 4; i++) {
+        le32_store(out + 4 * i, x[i]);
+        le32_store(out + 16 + 4 * i, x[12 + i]);
+    }
+}
+
+/* Poly1305, 130-bit arithmetic on three limbs of 44, 44 and 42 bits */
+struct poly1305
+{
+    uint64_t r[3];
+    uint64_t h[3];
+    uint64_t pad[2];
+    uint8_t buf[16];
+    size_t left;
+};
+
+#define M44 0xfffffffffffULL
+#define M42 0x3ffffffffffULL
+
+typedef unsigned __int128 u128;
+
+static void poly1305_init(struct poly1305 *st, const uint8_t *key)
+{
+    uint64_t t0 = le64_load(key);
+    uint64_t t1 = le64_load(key + 8);
+
+    /* r &= 0x0ffffffc0ffffffc0ffffffc0fffffff */
+    st->r[0] = t0 & 0xffc0fffffffULL;
+    st->r[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffffULL;
+    st->r[2] = (t1 >> 24) & 0x00ffffffc0fULL;
+
+    st->h[0] = st->h[1] = st->h[2] = 0;
+    st->pad[0] = le64_load(key + 16);
+    st->pad[1] = le64_load(key + 24);
+    st->left = 0;
+}
+
+static void poly1305_blocks(struct poly1305 *st, const uint8_t *m,
+                            size_t len, uint64_t hibit)
+{
+    uint64_t r0 = st->r[0], r1 = st->r[1], r2 = st->r[2];
+    uint64_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2];
+    uint64_t s1 = r1 * (5 << 2), s2 = r2 * (5 << 2);
+    uint64_t t0, t1, c;
+    u128 d0, d1, d2;
+
+    for (; len >= 16; len -= 16, m += 16) {
+        t0 = le64_load(m);
+        t1 = le64_load(m + 8);
+
+        h0 += t0 & M44;
+        h1 += ((t0 >> 44) | (t1 << 20)) & M44;
+        h2 += ((t1 >> 24) & M42) | hibit;
+
+        d0 = (u128)h0 * r0 + (u128)h1 * s2 + (u128)h2 * s1;
+        d1 = (u128)h0 * r1 + (u128)h1 * r0 + (u128)h2 * s2;
+        d2 = (u128)h0 * r2 + (u128)h1 * r1 + (u128)h2 * r0;
+
+        c = (uint64_t)(d0 >> 44); h0 = (uint64_t)d0 & M44;
+        d1 += c; c = (uint64_t)(d1 >> 44); h1 = (uint64_t)d1 & M44;
+        d2 += c; c = (uint64_t)(d2 >> 42); h2 = (uint64_t)d2 & M42;
+        h0 += c * 5; c = h0 >> 44; h0 &= M44;
+        h1 += c;
+    }
+
+    st->h[0] = h0;
+    st->h[1] = h1;
+    st->h[2] = h2;
+}
+
+static void poly1305_update(struct poly1305 *st, const uint8_t *m, size_t len)
+{
+    size_t n;
+
+    if (st->left) {
+        n = 16 - st->left;
+        if (n > len)
+            n = len;
+        memcpy(st->buf + st->left, m, n);
+        st->left += n;
+        m += n;
+        len -= n;
+        if (st->left < 16)
+            return;
+        poly1305_blocks(st, st->buf, 16, 1ULL << 40);
+        st->left = 0;
+    }
+
+    n = len & ~(size_t)15;
+    if (n) {
+        poly1305_blocks(st, m, n, 1ULL << 40);
+        m += n;
+        len -= n;
+    }
+
+    memcpy(st->buf, m, len);
+    st->left = len;
+}
+
+/* Zeroes up to the next 16-byte boundary, as the AEAD construction wants */
+static void poly1305_pad16(struct poly1305 *st)
+{
+    static const uint8_t zero[16];
+
+    if (st->left)
+        poly1305_update(st, zero, 16 - st->left);
+}
+
+static void poly1305_final(struct poly1305 *st, uint8_t *tag)
+{
+    uint64_t h0, h1, h2, g0, g1, g2, c, mask;
+    uint64_t t0, t1;
+
+    if (st->left) {
+        st->buf[st->left] = 1;
+        memset(st->buf + st->left + 1, 0, 16 - st->left - 1);
+        poly1305_blocks(st, st->buf, 16, 0);
+    }
+
+    h0 = st->h[0];
+    h1 = st->h[1];
+    h2 = st->h[2];
+
+    c = h1 >> 44; h1 &= M44;
+    h2 += c; c = h2 >> 42; h2 &= M42;
+    h0 += c * 5; c = h0 >> 44; h0 &= M44;
+    h1 += c; c = h1 >> 44; h1 &= M44;
+    h2 += c; c = h2 >> 42; h2 &= M42;
+    h0 += c * 5; c = h0 >> 44; h0 &= M44;
+    h1 += c;
+
+    /* h - p, kept if it did not go negative */
+    g0 = h0 + 5; c = g0 >> 44; g0 &= M44;
+    g1 = h1 + c; c = g1 >> 44; g1 &= M44;
+    g2 = h2 + c - (1ULL << 42);
+
+    mask = (g2 >> 63) - 1;
+    h0 = (h0 & ~mask) | (g0 & mask);
+    h1 = (h1 & ~mask) | (g1 & mask);
+    h2 = (h2 & ~mask) | (g2 & mask);
+
+    /* h + pad, mod 2^128 */
+    t0 = st->pad[0];
+    t1 = st->pad[1];
+    h0 += t0 & M44; c = h0 >> 44; h0 &= M44;
+    h1 += (((t0 >> 44) | (t1 << 20)) & M44) + c; c = h1 >> 44; h1 &= M44;
+    h2 += ((t1 >> 24) & M42) + c; h2 &= M42;
+
+    le64_store(tag, h0 | (h1 << 44));
+    le64_store(tag + 8, (h1 >> 20) | (h2 << 24));
+}
+
+static void chacha20_poly1305_tag(const uint8_t *otk, const uint8_t *aad,
+                                  size_t aad_len, const uint8_t *ct,
+                                  size_t len, uint8_t *tag)
+{
+    struct poly1305 st;
+    uint8_t lens[16];
+
+    poly1305_init(&st, otk);
+    poly1305_update(&st, aad, aad_len);
+    poly1305_pad16(&st);
+    poly1305_update(&st, ct, len);
+    poly1305_pad16(&st);
+    le64_store(lens, aad_len);
+    le64_store(lens + 8, len);
+    poly1305_update(&st, lens, sizeof (lens));
+    poly1305_final(&st, tag);
+}
+
+/* Block 0 gives the Poly1305 key, the data is encrypted from block 1 on */
+static void chacha20_poly1305_otk(uint32_t *st, const uint32_t *key,
+                                  const uint8_t *nonce, uint8_t *otk)
+{
+    uint8_t block[64];
+
+    chacha20_init(st, key, nonce, 0);
+    chacha20_block(st, block);
+    memcpy(otk, block, 32);
+    st[12] = 1;
+}
+
+void chacha20_poly1305_seal(const uint32_t *key, const uint8_t *nonce,
+                            const uint8_t *aad, size_t aad_len,
+                            uint8_t *buf, size_t len, uint8_t *tag)
+{
+    uint32_t st[16];
+    uint8_t otk[32];
+
+    chacha20_poly1305_otk(st, key, nonce, otk);
+    chacha20_xor(st, buf, buf, len);
+    chacha20_poly1305_tag(otk, aad, aad_len, buf, len, tag);
+}
+
+int chacha20_poly1305_open(const uint32_t *key, const uint8_t *nonce,
+                           const uint8_t *aad, size_t aad_len,
+                           uint8_t *buf, size_t len, const uint8_t *tag)
+{
+    uint32_t st[16];
+    uint8_t otk[32];
+    uint8_t mac[CRYPTO_TAG_SZ];
+    uint8_t diff = 0;
+    int i;
+
+    chacha20_poly1305_otk(st, key, nonce, otk);
+    chacha20_poly1305_tag(otk, aad, aad_len, buf, len, mac);
+    for (i = 0; i < CRYPTO_TAG_SZ; i++)
+        diff |= mac[i] ^ tag[i];
+    if (diff)
+        return -1;
+
+    chacha20_xor(st, buf, buf, len);
+
+    return 0;
+}
@@ -0,0 +1,566 @@
+/*
+ *  Copyright (c) 2011, Julian Pidancet <julian.pidancet@gmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *  3. Neither the name of Julian Pidancet nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <linux/if_tun.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+
+#include "pktqueue.h"
+#include "compress.h"
+
+struct compress_opts compress_opts;
+
+/*
+ * LZ4 block format. A block is a run of sequences, each a token, literals
+ * and a match:
+ *
+ *     | Token | Literal length+ | Literals | Offset | Match length+ |
+ *
+ * The token holds both lengths in a nibble each, the match length minus
+ * LZ4_MINMATCH; a nibble of 15 goes on in bytes of 255 and one less. The
+ * offset is 16 bits, little-endian. The last sequence stops after its
+ * literals, and the format wants the last LZ4_LASTLITERALS bytes to be
+ * literals and no match starting in the last LZ4_MFLIMIT.
+ */
+#define LZ4_MINMATCH 4
+#define LZ4_LASTLITERALS 5
+#define LZ4_MFLIMIT 12
+#define LZ4_HASH_LOG 12
+#define LZ4_SKIP_TRIGGER 6  /* Misses before the search strides further */
+
+/*
+ * Positions of 4-byte sequences seen lately, by hash. Entries hold the
+ * position plus the base of the packet they were taken from; those below
+ * the current base are from earlier packets, so the table never needs
+ * clearing between packets.
+ */
+static __thread uint32_t lz4_table[1 << LZ4_HASH_LOG];
+static __thread uint32_t lz4_base;
+
+static inline uint32_t lz4_read32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof (v));
+    return v;
+}
+
+static inline uint64_t lz4_read64(const uint8_t *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof (v));
+    return v;
+}
+
+/* Length of the common prefix of ip and ref, ip stopping at limit */
+static inline size_t lz4_count(const uint8_t *ip, const uint8_t *ref,
+                               const uint8_t *limit)
+{
+    const uint8_t *start = ip;
+    uint64_t diff;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (ip + 8 <= limit) {
+        diff = lz4_read64(ip) ^ lz4_read64(ref);
+        if (diff)
+            return ip - start + (__builtin_ctzll(diff) >> 3);
+        ip += 8;
+        ref += 8;
+    }
+#else
+    (void)diff;
+#endif
+    while (ip < limit && *ip == *ref) {
+        ip++;
+        ref++;
+    }
+
+    return ip - start;
+}
+
+static inline uint32_t lz4_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+/* Room for a sequence: token, both lengths, literals and offset */
+static inline size_t lz4_seq_max(size_t lit, size_t mlen)
+{
+    return 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1;
+}
+
+static uint8_t *lz4_put_len(uint8_t *op, size_t len)
+{
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = len;
+
+    return op;
+}
+
+static uint8_t *lz4_put_literals(uint8_t *op, const uint8_t *lit, size_t len)
+{
+    uint8_t *token = op++;
+
+    if (len >= 15) {
+        *token = 15 << 4;
+        op = lz4_put_len(op, len - 15);
+    } else {
+        *token = len << 4;
+    }
+    memcpy(op, lit, len);
+
+    return op + len;
+}
+
+/*
+ * Compress len bytes of src into at most cap bytes at dst. Returns the
+ * compressed length, or 0 as soon as it is clear it will not fit.
+ */
+size_t lz4_compress(const uint8_t *src, size_t len, uint8_t *dst,
+                    size_t cap)
+{
+    const uint8_t *ip = src, *anchor = src, *end = src + len;
+    const uint8_t *mflimit = end - LZ4_MFLIMIT;
+    const uint8_t *matchlimit = end - LZ4_LASTLITERALS;
+    const uint8_t *ref;
+    uint8_t *op = dst, *oend = dst + cap;
+    uint8_t *token;
+    uint32_t base, h, cand;
+    unsigned attempts;
+    size_t lit, mlen, off;
+
+    if (len > COMPRESS_MAX_PKT)
+        return 0;
+    if (lz4_base > UINT32_MAX - 2 * COMPRESS_MAX_PKT) {
+        memset(lz4_table, 0, sizeof (lz4_table));
+        lz4_base = 0;
+    }
+    base = lz4_base;
+    lz4_base += len;
+
+    if (len <= LZ4_MFLIMIT)
+        goto last;
+
+    lz4_table[lz4_hash(lz4_read32(ip))] = base;
+    ip++;
+
+    for (;;) {
+        /* Look for a match, striding further the longer none turns up */
+        attempts = 1 << LZ4_SKIP_TRIGGER;
+        for (;;) {
+            if (ip > mflimit)
+                goto last;
+            h = lz4_hash(lz4_read32(ip));
+            cand = lz4_table[h];
+            lz4_table[h] = base + (ip - src);
+            if (cand >= base) {
+                ref = src + (cand - base);
+                if (lz4_read32(ref) == lz4_read32(ip))
+                    break;
+            }
+            ip += attempts++ >> LZ4_SKIP_TRIGGER;
+        }
+
+        while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+            ip--;
+            ref--;
+        }
+        mlen = LZ4_MINMATCH + lz4_count(ip + LZ4_MINMATCH,
+                                        ref + LZ4_MINMATCH, matchlimit);
+
+        lit = ip - anchor;
+        if (lz4_seq_max(lit, mlen) > (size_t)(oend - op))
+            return 0;
+        token = op;
+        op = lz4_put_literals(op, anchor, lit);
+        off = ip - ref;
+        *op++ = off;
+        *op++ = off >> 8;
+        if (mlen - LZ4_MINMATCH >= 15) {
+            *token |= 15;
+            op = lz4_put_len(op, mlen - LZ4_MINMATCH - 15);
+        } else {
+            *token |= mlen - LZ4_MINMATCH;
+        }
+
+        ip += mlen;
+        anchor = ip;
+        if (ip > mflimit)
+            break;
+        /* Catch matches starting inside this one */
+        lz4_table[lz4_hash(lz4_read32(ip - 2))] = base + (ip - 2 - src);
+    }
+
+last:
+    lit = end - anchor;
+    if (1 + lit / 255 + 1 + lit > (size_t)(oend - op))
+        return 0;
+    op = lz4_put_literals(op, anchor, lit);
+
+    return op - dst;
+}
+
+static inline int lz4_get_len(const uint8_t **ip, const uint8_t *iend,
+                              size_t *len)
+{
+    uint8_t b;
+
+    do {
+        if (*ip >= iend)
+            return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+
+    return 0;
+}
+
+/*
+ * Decompress a block of len bytes at src into at most cap bytes at dst.
+ * Returns the decompressed length, or -1 if the block is malformed or does
+ * not fit.
+ */
+ssize_t lz4_decompress(const uint8_t *src, size_t len, uint8_t *dst,
+                       size_t cap)
+{
+    const uint8_t *ip = src, *iend = src + len;
+    const uint8_t *ref;
+    uint8_t *op = dst, *oend = dst + cap;
+    size_t lit, mlen, off, step, i;
+    uint8_t token;
+
+    for (;;) {
+        if (ip >= iend)
+            return -1;
+        token = *ip++;
+
+        lit = token >> 4;
+        if (lit == 15 && lz4_get_len(&ip, iend, &lit))
+            return -1;
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op))
+            return -1;
+        /* Short runs in one fixed-size copy, where there is room for it */
+        if (lit <= 16 && iend - ip >= 16 && oend - op >= 16)
+            memcpy(op, ip, 16);
+        else
+            memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        off = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (!off || off > (size_t)(op - dst))
+            return -1;
+
+        mlen = token & 15;
+        if (mlen == 15 && lz4_get_len(&ip, iend, &mlen))
+            return -1;
+        mlen += LZ4_MINMATCH;
+        if (mlen > (size_t)(oend - op))
+            return -1;
+
+        /*
+         * Offsets shorter than the match repeat what the match itself is
+         * writing, which copying by words still gets right from 8 on.
+         */
+        ref = op - off;
+        if (off < 8 && mlen > 16) {
+            /* The output repeats every off bytes: widen it past a word */
+            step = (8 + off - 1) / off * off;
+            for (i = 0; i < step; i++)
+                op[i] = ref[i];
+            op += step;
+            mlen -= step;
+            ref = op - step;
+            off = step;
+        }
+        if (off >= 8 && mlen <= 16 && oend - op >= 16) {
+            memcpy(op, ref, 8);
+            memcpy(op + 8, ref + 8, 8);
+            op += mlen;
+            continue;
+        }
+        if (off >= 8) {
+            for (; mlen >= 8; mlen -= 8, op += 8, ref += 8)
+                memcpy(op, ref, 8);
+        }
+        while (mlen--)
+            *op++ = *ref++;
+    }
+
+    return op - dst;
+}
+
+/*
+ * Packets shorter than this hardly ever shrink, and those that do save
+ * less than what trying costs.
+ */
+#define COMPRESS_MIN_LEN 64
+
+/* At least 1/COMPRESS_MIN_GAIN of the packet must go to be worth it */
+#define COMPRESS_MIN_GAIN 16
+
+/*
+ * Bytes sampled for the randomness guess, and the range of distinct values
+ * among them that has the payload taken for random. Random data shows 162
+ * in 256 give or take 5, text rarely more than 80; counting sequences and
+ * other ramps show nearly every value once, and compress well.
+ */
+#define COMPRESS_SAMPLE 256
+#define COMPRESS_DISTINCT_MIN 128
+#define COMPRESS_DISTINCT_MAX 200
+
+struct compress_ctx *compress_ctx_create(void)
+{
+    return calloc(1, sizeof (struct compress_ctx));
+}
+
+void compress_ctx_destroy(struct compress_ctx *c)
+{
+    free(c);
+}
+
+static unsigned long compress_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/*
+ * Slot of the packet's flow in the table, from its addresses, protocol and
+ * ports. Also finds where the transport payload starts, for the guess.
+ */
+static unsigned compress_flow(const uint8_t *data, size_t len, size_t *hlen)
+{
+    const struct iphdr *iph = (const void *)data;
+    const struct tcphdr *th;
+    uint32_t h, ports;
+    size_t ihl;
+
+    *hlen = 0;
+    if (len < sizeof (*iph) || iph->version != 4)
+        return 0;
+    ihl = iph->ihl * 4;
+    if (ihl < sizeof (*iph) || ihl > len)
+        return 0;
+
+    *hlen = ihl;
+    h = iph->saddr ^ (iph->daddr * 0x9e3779b1U) ^ iph->protocol;
+    if ((iph->protocol == IPPROTO_TCP || iph->protocol == IPPROTO_UDP) &&
+        !(iph->frag_off & htons(IP_OFFMASK)) && len >= ihl + 8) {
+        memcpy(&ports, data + ihl, sizeof (ports));
+        h ^= ports * 0x85ebca6bU;
+        if (iph->protocol == IPPROTO_UDP) {
+            *hlen = ihl + 8;
+        } else {
+            th = (const void *)(data + ihl);
+            if (len >= ihl + sizeof (*th))
+                *hlen = ihl + th->doff * 4;
+        }
+    }
+
+    return (h * 2654435761U) >> (32 - COMPRESS_FLOWS_LOG);
+}
+
+/* Whether a sample of data has as many distinct byte values as noise */
+static int compress_looks_random(const uint8_t *data, size_t len)
+{
+    uint64_t seen[4] = { 0 };
+    int i, distinct = 0;
+
+    if (len < COMPRESS_SAMPLE)
+        return 0;
+
+    for (i = 0; i < COMPRESS_SAMPLE; i++)
+        seen[data[i] >> 6] |= 1ULL << (data[i] & 63);
+    for (i = 0; i < 4; i++)
+        distinct += __builtin_popcountll(seen[i]);
+
+    return distinct > COMPRESS_DISTINCT_MIN &&
+           distinct < COMPRESS_DISTINCT_MAX;
+}
+
+static void compress_backoff(struct compress_ctx *c, unsigned flow)
+{
+    uint8_t b = __atomic_load_n(&c->backoff[flow], __ATOMIC_RELAXED);
+
+    __atomic_store_n(&c->skip[flow], 1 << b, __ATOMIC_RELAXED);
+    if (b < COMPRESS_BACKOFF_MAX)
+        __atomic_store_n(&c->backoff[flow], b + 1, __ATOMIC_RELAXED);
+}
+
+#define COMPRESS_STAT_ADD(c, st, f) \
+    __atomic_fetch_add(&(c)->stats.f, (st).f, __ATOMIC_RELAXED)
+
+/*
+ * Compress a batch of packets in place, those that shrink enough anyway.
+ * Flows found not to compress, and packets that look random, are sent as
+ * they are for next to nothing.
+ */
+void compress_pack(struct compress_ctx *c, struct pkt **pkts, int n)
+{
+    static __thread uint8_t out[COMPRESS_MAX_PKT];
+    struct compress_stats st = { 0 };
+    unsigned long start = compress_now_ns();
+    struct tun_pi *pi;
+    uint8_t *data;
+    size_t len, hlen, clen;
+    unsigned flow;
+    uint16_t skip;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        pi = (struct tun_pi *)pkts[i]->buff;
+        data = (uint8_t *)(pi + 1);
+        len = pkts[i]->pkt_size - sizeof (*pi);
+        st.tx_bytes_in += len;
+        st.tx_bytes_out += len;
+        if (len < COMPRESS_MIN_LEN || len > COMPRESS_MAX_PKT)
+            continue;
+
+        flow = compress_flow(data, len, &hlen);
+        skip = __atomic_load_n(&c->skip[flow], __ATOMIC_RELAXED);
+        if (skip) {
+            __atomic_store_n(&c->skip[flow], skip - 1, __ATOMIC_RELAXED);
+            st.tx_skipped++;
+            continue;
+        }
+
+        if (compress_looks_random(data + hlen, len - hlen)) {
+            compress_backoff(c, flow);
+            st.tx_random++;
+            continue;
+        }
+
+        clen = lz4_compress(data, len, out, len - len / COMPRESS_MIN_GAIN);
+        if (!clen) {
+            compress_backoff(c, flow);
+            st.tx_incompressible++;
+            continue;
+        }
+        __atomic_store_n(&c->backoff[flow], 0, __ATOMIC_RELAXED);
+
+        memcpy(data, out, clen);
+        pkt_trim(pkts[i], sizeof (*pi) + clen);
+        pi->flags |= htons(TUN_PI_COMPRESSED);
+        st.tx_bytes_out -= len - clen;
+        st.tx_pkts++;
+    }
+
+    st.tx_ns = compress_now_ns() - start;
+    COMPRESS_STAT_ADD(c, st, tx_pkts);
+    COMPRESS_STAT_ADD(c, st, tx_bytes_in);
+    COMPRESS_STAT_ADD(c, st, tx_bytes_out);
+    COMPRESS_STAT_ADD(c, st, tx_skipped);
+    COMPRESS_STAT_ADD(c, st, tx_random);
+    COMPRESS_STAT_ADD(c, st, tx_incompressible);
+    COMPRESS_STAT_ADD(c, st, tx_ns);
+}
+
+/*
+ * Decompress the compressed packets of a batch in place. Those that do not
+ * decompress, or are compressed while c is NULL because compression is
+ * off, go after the others, along with their meta entry if meta is not
+ * NULL. Returns the number of packets left.
+ */
+int compress_unpack(struct compress_ctx *c, struct pkt **pkts, int n,
+                    uint64_t *meta)
+{
+    static __thread uint8_t out[COMPRESS_MAX_PKT];
+    struct compress_stats st = { 0 };
+    unsigned long start = 0;
+    struct tun_pi *pi;
+    struct pkt *p;
+    ssize_t len;
+    size_t cap;
+    uint64_t m;
+    int i, good = 0;
+
+    if (c)
+        start = compress_now_ns();
+
+    for (i = 0; i < n; i++) {
+        p = pkts[i];
+        pi = (struct tun_pi *)p->buff;
+        if (pi->flags & htons(TUN_PI_COMPRESSED)) {
+            /* The packet may grow into all of its tailroom */
+            cap = p->pkt_size - sizeof (*pi) + pkt_tailroom(p);
+            if (cap > sizeof (out))
+                cap = sizeof (out);
+            len = -1;
+            if (c)
+                len = lz4_decompress((uint8_t *)(pi + 1),
+                                     p->pkt_size - sizeof (*pi), out, cap);
+            if (len < 0) {
+                st.rx_errors++;
+                continue;
+            }
+            memcpy(pi + 1, out, len);
+            pkt_trim(p, sizeof (*pi));
+            pkt_put(p, len);
+            pi->flags &= ~htons(TUN_PI_COMPRESSED);
+            st.rx_pkts++;
+        }
+
+        /* Keep the good ones in order, swapping the bad ones behind */
+        pkts[i] = pkts[good];
+        pkts[good] = p;
+        if (meta) {
+            m = meta[i];
+            meta[i] = meta[good];
+            meta[good] = m;
+        }
+        good++;
+    }
+
+    if (c) {
+        st.rx_ns = compress_now_ns() - start;
+        COMPRESS_STAT_ADD(c, st, rx_pkts);
+        COMPRESS_STAT_ADD(c, st, rx_errors);
+        COMPRESS_STAT_ADD(c, st, rx_ns);
+    }
+
+    return good;
+}
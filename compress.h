@@ -0,0 +1,113 @@
+/*
+ *  Copyright (c) 2011, Julian Pidancet <julian.pidancet@gmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *  3. Neither the name of Julian Pidancet nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#ifndef COMPRESS_H_
+#define COMPRESS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "pktqueue.h"
+
+/*
+ * Packets are compressed whole, inner IP header included, with the LZ4
+ * block format and nothing around it:
+ *
+ *     | Tun PI |    LZ4 block    |
+ *
+ * and flagged in the tun_pi, which sealing covers. Only packets that come
+ * out smaller are sent compressed; the others go as they are.
+ *
+ * Compressing before sealing lets packet sizes tell something about their
+ * content, which an attacker who can inject traffic into a flow may use to
+ * guess at secrets elsewhere in it (VORACLE).
+ */
+#define TUN_PI_COMPRESSED 0x4000
+
+#define COMPRESS_MAX_PKT 65535  /* Longer packets are sent as they are */
+
+/*
+ * Flows whose packets did not compress are left alone for a while, twice
+ * as long each time, up to COMPRESS_BACKOFF_MAX doublings. Flows hash into
+ * a table of 1 << COMPRESS_FLOWS_LOG slots, which they may share.
+ */
+#define COMPRESS_FLOWS_LOG 8
+#define COMPRESS_FLOWS (1 << COMPRESS_FLOWS_LOG)
+#define COMPRESS_BACKOFF_MAX 10
+
+struct compress_opts
+{
+    int enabled;
+};
+
+extern struct compress_opts compress_opts;
+
+/* Updated with atomic adds by whoever compresses or decompresses */
+struct compress_stats
+{
+    unsigned long tx_pkts;          /* Sent compressed */
+    unsigned long tx_bytes_in;      /* Offered, and what they went out as */
+    unsigned long tx_bytes_out;
+    unsigned long tx_skipped;       /* Left alone, as their flow is */
+    unsigned long tx_random;        /* Left alone, as they looked random */
+    unsigned long tx_incompressible;        /* Tried, and did not shrink */
+    unsigned long tx_ns;            /* Spent in compress_pack() */
+    unsigned long rx_pkts;          /* Decompressed */
+    unsigned long rx_errors;        /* Malformed or unexpected */
+    unsigned long rx_ns;            /* Spent in compress_unpack() */
+};
+
+/*
+ * Per peer. The flow table is a hint: threads compressing for the same
+ * peer share it without locking.
+ */
+struct compress_ctx
+{
+    struct compress_stats stats;
+    uint8_t backoff[COMPRESS_FLOWS];    /* Doublings so far */
+    uint16_t skip[COMPRESS_FLOWS];      /* Packets left to leave alone */
+};
+
+struct compress_ctx *compress_ctx_create(void);
+void compress_ctx_destroy(struct compress_ctx *c);
+void compress_pack(struct compress_ctx *c, struct pkt **pkts, int n);
+int compress_unpack(struct compress_ctx *c, struct pkt **pkts, int n,
+                    uint64_t *meta);
+
+/* The codec underneath, for the benchmark */
+size_t lz4_compress(const uint8_t *src, size_t len, uint8_t *dst,
+                    size_t cap);
+ssize_t lz4_decompress(const uint8_t *src, size_t len, uint8_t *dst,
+                       size_t cap);
+
+#endif /* COMPRESS_H_ */
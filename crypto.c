@@ -0,0 +1,526 @@
+/*
+ *  Copyright (c) 2011, Julian Pidancet <julian.pidancet@gmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *  3. Neither the name of Julian Pidancet nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <linux/if_tun.h>
+#include <arpa/inet.h>
+
+#include "pktqueue.h"
+#include "crypto.h"
+
+struct crypto_opts crypto_opts = {
+    .ciphers = CRYPTO_CHACHA20_POLY1305 | CRYPTO_AES256_GCM,
+};
+
+static int crypto_have_aesni;
+
+int crypto_simd_set(enum crypto_simd level)
+{
+    return chacha20_simd_set(level);
+}
+
+const char *crypto_simd_str(void)
+{
+    switch (chacha20_simd_get()) {
+    case CRYPTO_SIMD_AVX512:
+        return "avx512";
+    case CRYPTO_SIMD_AVX2:
+        return "avx2";
+    default:
+        return "scalar";
+    }
+}
+
+int crypto_aesni(void)
+{
+    return crypto_have_aesni;
+}
+
+/* Pick the fastest kernels the CPU has */
+int crypto_init(void)
+{
+    crypto_have_aesni = aesgcm_supported();
+    crypto_simd_set(CRYPTO_SIMD_AVX512);
+
+    if (crypto_opts.enabled && !crypto_ciphers()) {
+        fprintf(stderr, "No usable cipher.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+const char *crypto_cipher_str(int cipher)
+{
+    switch (cipher) {
+    case CRYPTO_CHACHA20_POLY1305:
+        return "chacha20-poly1305";
+    case CRYPTO_AES256_GCM:
+        return "aes-256-gcm";
+    default:
+        return "none";
+    }
+}
+
+/* A comma separated list of cipher names, as a mask */
+int crypto_parse_ciphers(const char *s)
+{
+    static const int all[] = { CRYPTO_CHACHA20_POLY1305, CRYPTO_AES256_GCM };
+    const char *end;
+    size_t len;
+    int mask = 0;
+    unsigned int i;
+
+    for (; *s; s = *end ? end + 1 : end) {
+        end = strchr(s, ',');
+        if (!end)
+            end = s + strlen(s);
+        len = end - s;
+
+        for (i = 0; i < sizeof (all) / sizeof (all[0]); i++) {
+            if (strlen(crypto_cipher_str(all[i])) == len &&
+                !strncmp(crypto_cipher_str(all[i]), s, len))
+                break;
+        }
+        if (i == sizeof (all) / sizeof (all[0])) {
+            fprintf(stderr, "Unknown cipher: %.*s\n", (int)len, s);
+            return -1;
+        }
+        mask |= all[i];
+    }
+
+    return mask;
+}
+
+/* What this side offers: allowed, and fast enough here */
+int crypto_ciphers(void)
+{
+    int mask = crypto_opts.ciphers;
+
+    if (!crypto_have_aesni)
+        mask &= ~CRYPTO_AES256_GCM;
+
+    return mask;
+}
+
+/*
+ * The listener's pick among what the client offered. AES-GCM wins when both
+ * ends run it in hardware, which is only offered in that case.
+ */
+int crypto_choose(int offered)
+{
+    int mask = offered & crypto_ciphers();
+
+    if (mask & CRYPTO_AES256_GCM)
+        return CRYPTO_AES256_GCM;
+    if (mask & CRYPTO_CHACHA20_POLY1305)
+        return CRYPTO_CHACHA20_POLY1305;
+
+    return 0;
+}
+
+static int hexval(int c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/*
+ * The pre-shared key file holds 64 hex digits, whitespace aside, as
+ * written by e.g. `openssl rand -hex 32`.
+ */
+int crypto_load_key(const char *path)
+{
+    FILE *f;
+    int c, v;
+    int n = 0;
+    int rc = -1;
+
+    f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    while ((c = fgetc(f)) != EOF) {
+        if (isspace(c))
+            continue;
+        v = hexval(c);
+        if (v < 0 || n == 2 * CRYPTO_KEY_SZ)
+            goto out;
+        if (n % 2)
+            crypto_opts.psk[n / 2] |= v;
+        else
+            crypto_opts.psk[n / 2] = v << 4;
+        n++;
+    }
+    if (n != 2 * CRYPTO_KEY_SZ)
+        goto out;
+
+    crypto_opts.enabled = 1;
+    rc = 0;
+
+out:
+    if (rc)
+        fprintf(stderr, "%s: expected %d hex digits.\n", path,
+                2 * CRYPTO_KEY_SZ);
+    fclose(f);
+    return rc;
+}
+
+void crypto_aead_init(struct crypto_aead *a, int cipher, const uint8_t *key)
+{
+    int i;
+
+    memset(a, 0, sizeof (*a));
+    a->cipher = cipher;
+
+    if (cipher == CRYPTO_AES256_GCM) {
+        aesgcm_init(a, key);
+        return;
+    }
+
+    for (i = 0; i < 8; i++)
+        a->chacha_key[i] = (uint32_t)key[4 * i] |
+                           (uint32_t)key[4 * i + 1] << 8 |
+                           (uint32_t)key[4 * i + 2] << 16 |
+                           (uint32_t)key[4 * i + 3] << 24;
+}
+
+void crypto_aead_seal(struct crypto_aead *a, const uint8_t *nonce,
+                      const uint8_t *aad, size_t aad_len,
+                      uint8_t *buf, size_t len, uint8_t *tag)
+{
+    if (a->cipher == CRYPTO_AES256_GCM)
+        aesgcm_seal(a, nonce, aad, aad_len, buf, len, tag);
+    else
+        chacha20_poly1305_seal(a->chacha_key, nonce, aad, aad_len,
+                               buf, len, tag);
+}
+
+int crypto_aead_open(struct crypto_aead *a, const uint8_t *nonce,
+                     const uint8_t *aad, size_t aad_len,
+                     uint8_t *buf, size_t len, const uint8_t *tag)
+{
+    if (a->cipher == CRYPTO_AES256_GCM)
+        return aesgcm_open(a, nonce, aad, aad_len, buf, len, tag);
+
+    return chacha20_poly1305_open(a->chacha_key, nonce, aad, aad_len,
+                                  buf, len, tag);
+}
+
+/*
+ * Keys are derived from the pre-shared key and both handshake nonces with
+ * HChaCha20 as the PRF:
+ *
+ *     K  = HChaCha20(HChaCha20(PSK, client nonce), server nonce)
+ *     Kc = HChaCha20(K, "client -> server"), the client's sending key
+ *     Ks = HChaCha20(K, "server -> client"), the server's
+ *
+ * Fresh nonces on both sides give every session keys of its own, so nonce
+ * counters can start over at zero.
+ */
+struct crypto_session *crypto_session_create(int cipher,
+                                             const uint8_t *cnonce,
+                                             const uint8_t *snonce,
+                                             int initiator)
+{
+    static const uint8_t c2s[16] = "client -> server";
+    static const uint8_t s2c[16] = "server -> client";
+    struct crypto_session *s;
+    uint8_t k[CRYPTO_KEY_SZ], kc[CRYPTO_KEY_SZ], ks[CRYPTO_KEY_SZ];
+
+    s = aligned_alloc(16, sizeof (*s));
+    if (!s)
+        return NULL;
+    memset(s, 0, sizeof (*s));
+    s->cipher = cipher;
+    s->ctl_counter = CRYPTO_CTL_COUNTER;
+
+    hchacha20(k, crypto_opts.psk, cnonce);
+    hchacha20(k, k, snonce);
+    hchacha20(kc, k, c2s);
+    hchacha20(ks, k, s2c);
+
+    crypto_aead_init(&s->tx, cipher, initiator ? kc : ks);
+    crypto_aead_init(&s->rx, cipher, initiator ? ks : kc);
+
+    memset(k, 0, sizeof (k));
+    memset(kc, 0, sizeof (kc));
+    memset(ks, 0, sizeof (ks));
+
+    return s;
+}
+
+void crypto_session_destroy(struct crypto_session *s)
+{
+    memset(s, 0, sizeof (*s));
+    free(s);
+}
+
+/* Whether ctr has not been seen and is recent enough */
+static int crypto_replay_check(struct crypto_replay *r, uint64_t ctr)
+{
+    if (ctr > r->top)
+        return 0;
+    if (r->top - ctr >= CRYPTO_REPLAY_WINDOW)
+        return -1;
+    if (r->bits[(ctr / 64) % CRYPTO_REPLAY_WORDS] & (1ULL << (ctr % 64)))
+        return -1;
+
+    return 0;
+}
+
+/* Record ctr, which passed the check */
+static void crypto_replay_update(struct crypto_replay *r, uint64_t ctr)
+{
+    uint64_t word, top;
+
+    if (ctr > r->top) {
+        word = r->top / 64;
+        top = ctr / 64;
+        if (top - word >= CRYPTO_REPLAY_WORDS)
+            word = top - CRYPTO_REPLAY_WORDS;
+        while (word++ < top)
+            r->bits[word % CRYPTO_REPLAY_WORDS] = 0;
+        r->top = ctr;
+    }
+
+    r->bits[(ctr / 64) % CRYPTO_REPLAY_WORDS] |= 1ULL << (ctr % 64);
+}
+
+static inline void crypto_nonce(uint8_t *nonce, uint64_t ctr)
+{
+    int i;
+
+    memset(nonce, 0, 4);
+    for (i = 0; i < 8; i++)
+        nonce[4 + i] = ctr >> (8 * i);
+}
+
+static inline uint64_t crypto_counter(const uint8_t *b)
+{
+    uint64_t ctr = 0;
+    int i;
+
+    for (i = 8; i--; )
+        ctr = ctr << 8 | b[i];
+
+    return ctr;
+}
+
+static inline void crypto_aad(uint8_t *aad, const struct pkt *p,
+                              const uint8_t *ctr)
+{
+    memcpy(aad, p->buff, sizeof (struct tun_pi));
+    memcpy(aad + sizeof (struct tun_pi), ctr, 8);
+}
+
+/* Failed packets go after the good ones, keeping the order of both */
+static void crypto_partition(struct pkt **pkts, int n, const char *ok)
+{
+    struct pkt *bad[CRYPTO_BATCH_MAX];
+    int i, good = 0, nbad = 0;
+
+    for (i = 0; i < n; i++) {
+        if (ok[i])
+            pkts[good++] = pkts[i];
+        else
+            bad[nbad++] = pkts[i];
+    }
+    memcpy(pkts + good, bad, nbad * sizeof (*bad));
+}
+
+/* Seal with consecutive counters from ctr */
+static int crypto_seal_from(struct crypto_session *s, struct pkt **pkts,
+                            int n, uint64_t ctr)
+{
+    uint8_t aad[sizeof (struct tun_pi) + 8];
+    uint8_t nonce[12];
+    char ok[CRYPTO_BATCH_MAX];
+    struct tun_pi *pi;
+    struct pkt *p;
+    uint8_t *trailer;
+    size_t len;
+    int i, good = 0;
+
+    for (i = 0; i < n; i++, ctr++) {
+        p = pkts[i];
+        ok[i] = 0;
+        if (p->pkt_size < sizeof (*pi) || pkt_tailroom(p) < CRYPTO_OVERHEAD)
+            continue;
+
+        pi = (struct tun_pi *)p->buff;
+        pi->flags |= htons(TUN_PI_SEALED);
+
+        len = p->pkt_size - sizeof (*pi);
+        trailer = (uint8_t *)pkt_put(p, CRYPTO_OVERHEAD);
+        crypto_nonce(nonce, ctr);
+        memcpy(trailer, nonce + 4, 8);
+        crypto_aad(aad, p, trailer);
+
+        crypto_aead_seal(&s->tx, nonce, aad, sizeof (aad),
+                         (uint8_t *)p->buff + sizeof (*pi), len,
+                         trailer + 8);
+        ok[i] = 1;
+        good++;
+    }
+
+    if (good < n)
+        crypto_partition(pkts, n, ok);
+
+    return good;
+}
+
+/*
+ * Seal up to CRYPTO_BATCH_MAX packets in place, with consecutive counters
+ * reserved in one go. Packets without room for the trailer are left as
+ * they are, after the sealed ones. Returns the number sealed.
+ */
+int crypto_seal(struct crypto_session *s, struct pkt **pkts, int n)
+{
+    uint64_t ctr = __atomic_fetch_add(&s->tx_counter, n, __ATOMIC_RELAXED);
+
+    return crypto_seal_from(s, pkts, n, ctr);
+}
+
+/*
+ * Open up to CRYPTO_BATCH_MAX packets in place, and store the counter of
+ * every packet opened in ctrs. Packets that are not sealed or fail the tag
+ * go after the good ones. Returns the number opened.
+ *
+ * Batches may be opened concurrently; the replay window is left to
+ * crypto_replay_filter(), which has to see them in order.
+ */
+int crypto_open(struct crypto_session *s, struct pkt **pkts, int n,
+                uint64_t *ctrs)
+{
+    uint8_t aad[sizeof (struct tun_pi) + 8];
+    uint8_t nonce[12];
+    char ok[CRYPTO_BATCH_MAX];
+    struct tun_pi *pi;
+    struct pkt *p;
+    uint8_t *trailer;
+    uint64_t ctr;
+    size_t len;
+    int i, good = 0;
+
+    for (i = 0; i < n; i++) {
+        p = pkts[i];
+        pi = (struct tun_pi *)p->buff;
+        ok[i] = 0;
+        if (p->pkt_size < sizeof (*pi) + CRYPTO_OVERHEAD ||
+            !(pi->flags & htons(TUN_PI_SEALED)))
+            continue;
+
+        len = p->pkt_size - sizeof (*pi) - CRYPTO_OVERHEAD;
+        trailer = (uint8_t *)p->buff + sizeof (*pi) + len;
+        ctr = crypto_counter(trailer);
+        crypto_nonce(nonce, ctr);
+        crypto_aad(aad, p, trailer);
+        if (crypto_aead_open(&s->rx, nonce, aad, sizeof (aad),
+                             (uint8_t *)p->buff + sizeof (*pi), len,
+                             trailer + 8))
+            continue;
+
+        pi->flags &= ~htons(TUN_PI_SEALED);
+        pkt_trim(p, sizeof (*pi) + len);
+        ctrs[good++] = ctr;
+        ok[i] = 1;
+    }
+
+    if (good < n)
+        crypto_partition(pkts, n, ok);
+
+    return good;
+}
+
+/*
+ * Run opened packets and their counters through the replay window, in the
+ * order they arrived. Replayed packets go after the others. Returns the
+ * number of packets left.
+ */
+int crypto_replay_filter(struct crypto_session *s, struct pkt **pkts,
+                         uint64_t *ctrs, int n)
+{
+    char ok[CRYPTO_BATCH_MAX];
+    int i, good = 0;
+
+    for (i = 0; i < n; i++) {
+        ok[i] = !crypto_replay_check(&s->replay, ctrs[i]);
+        if (ok[i]) {
+            crypto_replay_update(&s->replay, ctrs[i]);
+            good++;
+        }
+    }
+
+    if (good < n)
+        crypto_partition(pkts, n, ok);
+
+    return good;
+}
+
+/*
+ * Control packets are sealed and opened one at a time, by the thread
+ * running their peer. Their counters are kept apart from data, so that a
+ * window of their own keeps them from being replayed however much data
+ * goes by in between.
+ */
+int crypto_seal_ctl(struct crypto_session *s, struct pkt *p)
+{
+    if (crypto_seal_from(s, &p, 1, s->ctl_counter) != 1)
+        return -1;
+    s->ctl_counter++;
+
+    return 0;
+}
+
+int crypto_open_ctl(struct crypto_session *s, struct pkt *p)
+{
+    uint64_t ctr;
+
+    if (crypto_open(s, &p, 1, &ctr) != 1 || ctr < CRYPTO_CTL_COUNTER ||
+        crypto_replay_check(&s->ctl_replay, ctr))
+        return -1;
+    crypto_replay_update(&s->ctl_replay, ctr);
+
+    return 0;
+}
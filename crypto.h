@@ -0,0 +1,181 @@
+/*
+ *  Copyright (c) 2011, Julian Pidancet <julian.pidancet@gmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *  3. Neither the name of Julian Pidancet nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#ifndef CRYPTO_H_
+#define CRYPTO_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pktqueue.h"
+
+#define CRYPTO_KEY_SZ 32
+#define CRYPTO_TAG_SZ 16
+#define CRYPTO_HS_NONCE_SZ 16   /* Handshake randomness, each side */
+
+/*
+ * A sealed packet keeps its tun_pi in the clear and carries the nonce
+ * counter and the tag behind the payload:
+ *
+ *     | Tun PI |    Ciphertext    | Counter | Tag |
+ *                                  <-  8  -> <-16->
+ *
+ * The tun_pi and the counter are authenticated as associated data.
+ */
+#define CRYPTO_OVERHEAD (8 + CRYPTO_TAG_SZ)
+
+/* In tun_pi.flags, network order: the packet is sealed */
+#define TUN_PI_SEALED 0x8000
+
+#define CRYPTO_CHACHA20_POLY1305 0x01
+#define CRYPTO_AES256_GCM 0x02
+
+/* Most packets sealed or opened in one call */
+#define CRYPTO_BATCH_MAX 64
+
+struct crypto_opts
+{
+    int enabled;        /* A pre-shared key has been loaded */
+    int ciphers;        /* Offered or accepted, CRYPTO_* mask */
+    uint8_t psk[CRYPTO_KEY_SZ];
+};
+
+extern struct crypto_opts crypto_opts;
+
+/*
+ * Key state for one direction of one session. The AES round keys and the
+ * powers of the GHASH key are only set up for AES-GCM.
+ */
+struct crypto_aead
+{
+    int cipher;
+    uint32_t chacha_key[8];
+    uint8_t aes_rk[15][16] __attribute__((aligned(16)));
+    uint8_t ghash_h[4][16] __attribute__((aligned(16)));  /* H^1 .. H^4 */
+};
+
+/*
+ * The 64-bit counters of packets received lately. Anything at or below the
+ * highest counter seen minus the window size is refused, as is anything in
+ * the window whose bit is already set (RFC 6479).
+ */
+#define CRYPTO_REPLAY_WORDS 32
+#define CRYPTO_REPLAY_WINDOW ((CRYPTO_REPLAY_WORDS - 1) * 64)
+
+struct crypto_replay
+{
+    uint64_t top;
+    uint64_t bits[CRYPTO_REPLAY_WORDS];
+};
+
+/* Control packets count from there, apart from data */
+#define CRYPTO_CTL_COUNTER (1ULL << 63)
+
+struct crypto_session
+{
+    int cipher;
+    struct crypto_aead tx;
+    struct crypto_aead rx;
+    uint64_t tx_counter;    /* Next nonce, taken by senders atomically */
+    struct crypto_replay replay;    /* Receiving side, in packet order */
+
+    /* Control packets, only ever sealed and opened by the peer's thread */
+    uint64_t ctl_counter;
+    struct crypto_replay ctl_replay;
+};
+
+int crypto_init(void);
+int crypto_load_key(const char *path);
+int crypto_parse_ciphers(const char *s);
+const char *crypto_cipher_str(int cipher);
+int crypto_ciphers(void);
+int crypto_choose(int offered);
+
+struct crypto_session *crypto_session_create(int cipher,
+                                             const uint8_t *cnonce,
+                                             const uint8_t *snonce,
+                                             int initiator);
+void crypto_session_destroy(struct crypto_session *s);
+int crypto_seal(struct crypto_session *s, struct pkt **pkts, int n);
+int crypto_open(struct crypto_session *s, struct pkt **pkts, int n,
+                uint64_t *ctrs);
+int crypto_replay_filter(struct crypto_session *s, struct pkt **pkts,
+                         uint64_t *ctrs, int n);
+int crypto_seal_ctl(struct crypto_session *s, struct pkt *p);
+int crypto_open_ctl(struct crypto_session *s, struct pkt *p);
+
+/*
+ * The primitives underneath, for the benchmark. Sealing and opening work in
+ * place, the nonce is 12 bytes. ChaCha20 has a portable scalar kernel and
+ * AVX2 and AVX-512 ones; AES-GCM needs AES-NI and PCLMULQDQ.
+ */
+enum crypto_simd
+{
+    CRYPTO_SIMD_NONE,
+    CRYPTO_SIMD_AVX2,
+    CRYPTO_SIMD_AVX512,
+};
+
+int crypto_simd_set(enum crypto_simd level);
+const char *crypto_simd_str(void);
+int crypto_aesni(void);
+
+void crypto_aead_init(struct crypto_aead *a, int cipher, const uint8_t *key);
+void crypto_aead_seal(struct crypto_aead *a, const uint8_t *nonce,
+                      const uint8_t *aad, size_t aad_len,
+                      uint8_t *buf, size_t len, uint8_t *tag);
+int crypto_aead_open(struct crypto_aead *a, const uint8_t *nonce,
+                     const uint8_t *aad, size_t aad_len,
+                     uint8_t *buf, size_t len, const uint8_t *tag);
+
+/* chacha.c */
+void hchacha20(uint8_t *out, const uint8_t *key, const uint8_t *nonce);
+void chacha20_poly1305_seal(const uint32_t *key, const uint8_t *nonce,
+                            const uint8_t *aad, size_t aad_len,
+                            uint8_t *buf, size_t len, uint8_t *tag);
+int chacha20_poly1305_open(const uint32_t *key, const uint8_t *nonce,
+                           const uint8_t *aad, size_t aad_len,
+                           uint8_t *buf, size_t len, const uint8_t *tag);
+int chacha20_simd_set(enum crypto_simd level);
+enum crypto_simd chacha20_simd_get(void);
+
+/* aesgcm.c */
+int aesgcm_supported(void);
+void aesgcm_init(struct crypto_aead *a, const uint8_t *key);
+void aesgcm_seal(struct crypto_aead *a, const uint8_t *nonce,
+                 const uint8_t *aad, size_t aad_len,
+                 uint8_t *buf, size_t len, uint8_t *tag);
+int aesgcm_open(struct crypto_aead *a, const uint8_t *nonce,
+                const uint8_t *aad, size_t aad_len,
+                uint8_t *buf, size_t len, const uint8_t *tag);
+
+#endif /* CRYPTO_H_ */
@@ -0,0 +1,98 @@
+/*
+ *  Copyright (c) 2011, Julian Pidancet <julian.pidancet@gmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *  3. Neither the name of Julian Pidancet nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#ifndef CSUM_H_
+#define CSUM_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <netinet/in.h>
+
+/*
+ * Internet checksum helpers. Partial sums are kept as 32-bit values in
+ * memory byte order, so they can be added together and folded at the end.
+ */
+
+static inline uint32_t csum_add(uint32_t a, uint32_t b)
+{
+    a += b;
+    return a + (a < b);
+}
+
+static inline uint32_t csum_partial(const void *buf, size_t len, uint32_t sum)
+{
+    const uint8_t *p = buf;
+    uint64_t acc = sum;
+    uint32_t w;
+    uint16_t h = 0;
+
+    for (; len >= 4; p += 4, len -= 4) {
+        memcpy(&w, p, sizeof (w));
+        acc += w;
+    }
+    if (len >= 2) {
+        memcpy(&h, p, sizeof (h));
+        acc += h;
+        p += 2;
+        len -= 2;
+    }
+    if (len) {
+        h = 0;
+        memcpy(&h, p, 1);
+        acc += h;
+    }
+
+    acc = (acc & 0xffffffff) + (acc >> 32);
+    acc = (acc & 0xffffffff) + (acc >> 32);
+    return acc;
+}
+
+/* Fold a partial sum into the final, complemented, 16-bit checksum */
+static inline uint16_t csum_fold(uint32_t sum)
+{
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum;
+}
+
+/* Partial sum of the TCP/UDP pseudo-header over IPv4 */
+static inline uint32_t csum_pseudo(uint32_t saddr, uint32_t daddr,
+                                   uint8_t proto, uint16_t len)
+{
+    uint32_t sum;
+
+    sum = csum_partial(&saddr, sizeof (saddr), 0);
+    sum = csum_partial(&daddr, sizeof (daddr), sum);
+    return csum_add(sum, htons(proto) + htons(len));
+}
+
+#endif /* CSUM_H_ */
@@ -35,11 +35,297 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/queue.h>
+#include <time.h>
 
+#include "uring.h"
 #include "events.h"
 
+#define DISPATCH_URING_ENTRIES 256
+
+struct dispatch_opts dispatch_opts = {
+    .backend = DISPATCH_EPOLL,
+};
+
+/* The dispatch the calling thread is currently running, if any */
+static __thread struct dispatch *current_dispatch;
+static __thread int foreign_thread;
+
+/*
+ * io_uring backend. Events may do their I/O on the ring itself, for the
+ * directions they were created with EVENT_URING_READ or EVENT_URING_WRITE:
+ * their owner submits the requests with event_uring_sqe(), all of them
+ * going to the kernel along with the next wait, and gets the completions
+ * back through the requests' handlers. Such directions are never polled.
+ * Whether they can make progress, e.g. with buffers to fill or requests to
+ * spare, is kept in user space as for edge-triggered epoll events: the
+ * owner says so with event_uring_ready() and event_drained(), and the
+ * handler is called from the dispatch's ready list for what is both ready
+ * and wanted.
+ *
+ * Other directions are polled for, the handler then doing the I/O with
+ * system calls as under epoll. Readiness is watched with oneshot poll
+ * requests, which look at the current state of the file when armed and
+ * therefore behave level-triggered, edge-triggered events included. One
+ * request stays in flight per event with the mask it wants, and every
+ * change goes through an SQE submitted along with the next wait, never
+ * through a system call of its own.
+ *
+ * Requests are told apart from polls by the low bit of their user_data.
+ */
+#define URING_REQ_TAG 1UL
+
+/* Directions e does on the ring rather than polls for */
+static inline unsigned short event_uring_dirs(struct event *e)
+{
+    unsigned short dirs = 0;
+
+    if (e->flags & EVENT_URING_READ)
+        dirs |= EVENT_READ;
+    if (e->flags & EVENT_URING_WRITE)
+        dirs |= EVENT_WRITE;
+
+    return dirs;
+}
+
+static int event_uring_sync(struct dispatch *d, struct event *e)
+{
+    struct io_uring_sqe *sqe;
+    unsigned short polled = e->flags & ~event_uring_dirs(e);
+    unsigned int mask = 0;
+
+    if (polled & EVENT_READ)
+        mask |= POLLIN;
+    if (polled & EVENT_WRITE)
+        mask |= POLLOUT;
+
+    /* A request wanting too much is filtered when it completes */
+    if (!mask || (e->armed && e->armed_mask == mask))
+        return 0;
+
+    sqe = uring_get_sqe(d->ring);
+    if (!sqe) {
+        fprintf(stderr, "io_uring: submission failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (e->armed) {
+        /* Raced by a completion, the update fails and the re-arm fixes it */
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = (uintptr_t)e;
+        sqe->len = IORING_POLL_UPDATE_EVENTS;
+    } else {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = e->fd;
+        sqe->user_data = (uintptr_t)e;
+        e->armed = 1;
+    }
+    sqe->poll32_events = mask;
+    e->armed_mask = mask;
+
+    return 0;
+}
+
+/*
+ * The kernel may still complete a request for an event being deleted, or
+ * the event's handler may still be running: keep it around until then.
+ */
+static int event_uring_release(struct dispatch *d, struct event *e)
+{
+    struct io_uring_sqe *sqe;
+
+    if (!e->armed && !e->running)
+        return 0;
+
+    if (e->armed) {
+        sqe = uring_get_sqe(d->ring);
+        if (sqe) {
+            sqe->opcode = IORING_OP_POLL_REMOVE;
+            sqe->fd = -1;
+            sqe->addr = (uintptr_t)e;
+        }
+    }
+    e->dead = 1;
+    LIST_INSERT_HEAD(&d->zombies, e, link);
+
+    return 1;
+}
+
+/*
+ * Edge-triggered epoll events. Which of reading and writing would not block
+ * is kept in user space: set by the edges epoll reports, cleared by the
+ * handler when it runs into EAGAIN. Stalling and restarting an event then
+ * only changes what its handler is called for, and an event both ready and
+ * wanted goes on the dispatch's ready list, without asking the kernel.
+ *
+ * Epoll always watches for reading. Writing is assumed possible until it
+ * fails, and only then watched for, until an edge comes with nothing left
+ * to write: a socket signals every send completing, which would be an edge
+ * per packet otherwise.
+ *
+ * A handler is called once per round with its own budget. One leaving its
+ * event ready stays on the list and gets its next turn after the others,
+ * the kernel's new edges and the timers have had theirs.
+ */
+static inline int event_edge(struct dispatch *d, struct event *e)
+{
+    return !d->ring && (e->flags & EVENT_EDGE_TRIGGERED);
+}
+
+static int event_watch(struct dispatch *d, struct event *e, unsigned int mask)
+{
+    struct epoll_event ee;
+
+    memset(&ee, 0, sizeof (ee));
+    ee.data.ptr = e;
+    ee.events = mask;
+
+    d->stats.ctls++;
+    if (epoll_ctl(d->epfd, EPOLL_CTL_MOD, e->fd, &ee) == -1) {
+        fprintf(stderr, "epoll_ctl(MOD) failed: %s\n", strerror(errno));
+        return -1;
+    }
+    e->kmask = mask;
+
+    return 0;
+}
+
+static void event_ready(struct dispatch *d, struct event *e)
+{
+    if (!e->queued && (e->ready & e->flags)) {
+        TAILQ_INSERT_TAIL(&d->ready, e, ready_link);
+        e->queued = 1;
+    }
+}
+
+/*
+ * Called by handlers of edge-triggered events on EAGAIN, or having seen the
+ * file empty: there is nothing more to do until the next edge.
+ */
+void event_drained(struct dispatch *d, struct event *e, unsigned short flags)
+{
+    if (d->ring) {
+        e->ready &= ~(flags & event_uring_dirs(e));
+        return;
+    }
+    if (!event_edge(d, e))
+        return;
+
+    e->ready &= ~flags;
+    if ((flags & EVENT_WRITE) && !(e->kmask & EPOLLOUT))
+        event_watch(d, e, e->kmask | EPOLLOUT);
+}
+
+/*
+ * An SQE for a request of the owner of e, cleared, which the dispatch
+ * submits along with its next wait. Requests are counted as e's until their
+ * last completion unless e is NULL, as for multishot requests nobody waits
+ * for. NULL if the ring is full and could not be submitted.
+ */
+struct io_uring_sqe *event_uring_sqe(struct dispatch *d, struct event *e,
+                                     struct uring_req *req)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_get_sqe(d->ring);
+    if (!sqe) {
+        fprintf(stderr, "io_uring: submission failed: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    sqe->user_data = (uintptr_t)req | URING_REQ_TAG;
+    req->e = e;
+    if (e)
+        e->inflight++;
+
+    return sqe;
+}
+
+/* Directions of e done on the ring can make progress again */
+void event_uring_ready(struct dispatch *d, struct event *e,
+                       unsigned short flags)
+{
+    e->ready |= flags & event_uring_dirs(e);
+    event_ready(d, e);
+}
+
+static int uring_req_complete(struct dispatch *d, struct uring_req *req,
+                              int res, unsigned int flags)
+{
+    if (req->e && !(flags & IORING_CQE_F_MORE))
+        req->e->inflight--;
+
+    d->stats.events++;
+    return req->handler(req, res, flags);
+}
+
+static void dispatch_uring_defer(struct dispatch *d, uint64_t user_data,
+                                 int res, unsigned int flags)
+{
+    struct dispatch_cqe *c;
+    unsigned int max;
+
+    if (d->ndeferred == d->deferred_max) {
+        max = d->deferred_max ? 2 * d->deferred_max : DISPATCH_URING_ENTRIES;
+        c = realloc(d->deferred, max * sizeof (*c));
+        if (!c) {
+            fprintf(stderr, "io_uring: completion lost: %s\n",
+                    strerror(errno));
+            return;
+        }
+        d->deferred = c;
+        d->deferred_max = max;
+    }
+
+    c = &d->deferred[d->ndeferred++];
+    c->user_data = user_data;
+    c->res = res;
+    c->flags = flags;
+}
+
+/*
+ * Reap completions until none of e's requests is in flight anymore, for an
+ * owner about to free what they point at. Those of e's requests are handled
+ * as they come, the others saved for the next round.
+ */
+void event_uring_flush(struct dispatch *d, struct event *e)
+{
+    struct io_uring_cqe *cqe;
+    struct uring_req *req;
+    uint64_t user_data;
+    unsigned int flags;
+    int res;
+
+    while (d->ring && e->inflight) {
+        if (uring_enter(d->ring, 1, -1)) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "io_uring_enter() failed: %s\n", strerror(errno));
+            return;
+        }
+
+        while ((cqe = uring_peek_cqe(d->ring))) {
+            user_data = cqe->user_data;
+            res = cqe->res;
+            flags = cqe->flags;
+            uring_cqe_seen(d->ring);
+
+            req = (void *)(uintptr_t)(user_data & ~URING_REQ_TAG);
+            if ((user_data & URING_REQ_TAG) && req->e == e)
+                uring_req_complete(d, req, res, flags);
+            else
+                dispatch_uring_defer(d, user_data, res, flags);
+        }
+    }
+}
+
 struct event *event_create(struct dispatch *d, int fd, unsigned short flags,
                            event_handler_t handler, void *priv)
 {
@@ -57,15 +343,31 @@ struct event *event_create(struct dispatch *d, int fd, unsigned short flags,
     e->fd = fd;
     LIST_INSERT_HEAD(&d->handlers, e, link);
 
+    if (d->ring) {
+        if (event_uring_sync(d, e)) {
+            LIST_REMOVE(e, link);
+            free(e);
+            return NULL;
+        }
+        /* Nothing in flight yet, the owner has everything to start */
+        e->ready = event_uring_dirs(e);
+        event_ready(d, e);
+        return e;
+    }
+
     memset(&ee, 0, sizeof (ee));
     ee.data.ptr = e;
 
-    if (flags & EVENT_READ)
-        ee.events |= EPOLLIN;
-    if (flags & EVENT_WRITE)
-        ee.events |= EPOLLOUT;
-    if (flags & EVENT_EDGE_TRIGGERED)
-        ee.events |= EPOLLET;
+    if (flags & EVENT_EDGE_TRIGGERED) {
+        ee.events = EPOLLIN | EPOLLET;
+        e->ready = EVENT_WRITE;
+        e->kmask = ee.events;
+    } else {
+        if (flags & EVENT_READ)
+            ee.events |= EPOLLIN;
+        if (flags & EVENT_WRITE)
+            ee.events |= EPOLLOUT;
+    }
 
     rc = epoll_ctl(d->epfd, EPOLL_CTL_ADD, fd, &ee);
     if (rc == -1) {
@@ -80,17 +382,75 @@ struct event *event_create(struct dispatch *d, int fd, unsigned short flags,
 
 void event_delete(struct dispatch *d, struct event *e)
 {
-    epoll_ctl(d->epfd, EPOLL_CTL_DEL, e->fd, (void *) -1);
+    event_uring_flush(d, e);
+
+    if (!d->ring)
+        epoll_ctl(d->epfd, EPOLL_CTL_DEL, e->fd, (void *) -1);
     LIST_REMOVE(e, link);
+    if (e->queued)
+        TAILQ_REMOVE(&d->ready, e, ready_link);
+
+    lock(&d->remote_lock);
+    if (e->remote_ctl)
+        SIMPLEQ_REMOVE(&d->remote, e, event, remote_link);
+    unlock(&d->remote_lock);
+
+    if (d->ring && event_uring_release(d, e))
+        return;
+
+    /* Deleted by its own handler, freed once that returns */
+    if (e->running) {
+        e->dead = 1;
+        LIST_INSERT_HEAD(&d->zombies, e, link);
+        return;
+    }
+
     free(e);
 }
 
+static int dispatch_kick(struct dispatch *d)
+{
+    uint64_t one = 1;
+    int rc;
+
+    rc = write(d->wake->fd, &one, sizeof (one));
+    if (rc != sizeof (one)) {
+        fprintf(stderr, "dispatch: wakeup failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Queue a control request for the thread owning the dispatch. Requests for
+ * the same event are merged, and the owner is only woken up when the queue
+ * goes from empty to non-empty.
+ */
+static int event_post(struct dispatch *d, struct event *e, int ctl)
+{
+    int kick;
+
+    lock(&d->remote_lock);
+    kick = SIMPLEQ_EMPTY(&d->remote);
+    if (!e->remote_ctl)
+        SIMPLEQ_INSERT_TAIL(&d->remote, e, remote_link);
+    e->remote_ctl |= 1 << ctl;
+    unlock(&d->remote_lock);
+
+    return kick ? dispatch_kick(d) : 0;
+}
+
 int event_control(struct dispatch *d, struct event *e, int ctl)
 {
     struct epoll_event ee;
     int rc;
     unsigned short flags = e->flags;
 
+    if (current_dispatch != d &&
+        (current_dispatch || foreign_thread || d->threaded))
+        return event_post(d, e, ctl);
+
     if (ctl == EVCTL_READ_STALL)
         flags &= ~EVENT_READ;
     if (ctl == EVCTL_READ_RESTART)
@@ -100,10 +460,20 @@ int event_control(struct dispatch *d, struct event *e, int ctl)
     if (ctl == EVCTL_WRITE_RESTART)
         flags |= EVENT_WRITE;
 
-    if (flags == e->flags)
+    if (flags == e->flags && ctl != EVCTL_REARM)
         return 0;
     e->flags = flags;
 
+    if (d->ring) {
+        event_ready(d, e);
+        return event_uring_sync(d, e);
+    }
+
+    if (event_edge(d, e)) {
+        event_ready(d, e);
+        return 0;
+    }
+
     memset(&ee, 0, sizeof (ee));
     ee.data.ptr = e;
 
@@ -111,9 +481,8 @@ int event_control(struct dispatch *d, struct event *e, int ctl)
         ee.events |= EPOLLIN;
     if (e->flags & EVENT_WRITE)
         ee.events |= EPOLLOUT;
-    if (e->flags & EVENT_EDGE_TRIGGERED)
-        ee.events |= EPOLLET;
 
+    d->stats.ctls++;
     rc = epoll_ctl(d->epfd, EPOLL_CTL_MOD, e->fd, &ee);
     if (rc == -1) {
         fprintf(stderr, "epoll_ctl(MOD) failed: %s\n", strerror(errno));
@@ -123,68 +492,618 @@ int event_control(struct dispatch *d, struct event *e, int ctl)
     return 0;
 }
 
-int dispatch_init(struct dispatch *d)
+static int wake_handler(int fd, unsigned short flags, void *priv)
+{
+    struct dispatch *d = priv;
+    struct event *e;
+    uint64_t count;
+    int ctl;
+    int c;
+
+    (void)flags;
+
+    /* Drain the counter before the queue so that no kick gets lost */
+    if (read(fd, &count, sizeof (count)) != sizeof (count) && errno != EAGAIN)
+        fprintf(stderr, "dispatch: wakeup read failed: %s\n",
+                strerror(errno));
+
+    lock(&d->remote_lock);
+    while ((e = SIMPLEQ_FIRST(&d->remote))) {
+        SIMPLEQ_REMOVE_HEAD(&d->remote, remote_link);
+        ctl = e->remote_ctl;
+        e->remote_ctl = 0;
+        unlock(&d->remote_lock);
+
+        for (c = EVCTL_READ_STALL; c <= EVCTL_REARM; c++) {
+            if ((ctl & (1 << c)) && event_control(d, e, c))
+                return DISPATCH_ABORT;
+        }
+
+        lock(&d->remote_lock);
+    }
+    unlock(&d->remote_lock);
+
+    return d->stop ? DISPATCH_ABORT : DISPATCH_CONTINUE;
+}
+
+static uint64_t clock_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t clock_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t wheel_tick(struct timer_wheel *w)
+{
+    return (clock_ms() - w->base) / TIMER_TICK_MS;
+}
+
+static void wheel_init(struct timer_wheel *w)
+{
+    int l, i;
+
+    w->base = clock_ms();
+    w->now = 0;
+    w->count = 0;
+    for (l = 0; l < TIMER_WHEEL_LEVELS; l++)
+        for (i = 0; i < TIMER_WHEEL_SLOTS; i++)
+            LIST_INIT(&w->slots[l][i]);
+}
+
+static void wheel_insert(struct timer_wheel *w, struct timer *t)
+{
+    uint64_t expires = t->expires;
+    int64_t delta = expires - w->now;
+    int l;
+
+    if (delta < 0) {
+        /* Already due, runs on the next tick processed */
+        expires = w->now;
+        l = 0;
+    } else {
+        for (l = 0; l < TIMER_WHEEL_LEVELS - 1; l++) {
+            if (delta < (int64_t)1 << (TIMER_WHEEL_BITS * (l + 1)))
+                break;
+        }
+        if (delta >= (int64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+            expires = w->now +
+                      ((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+                      - 1;
+    }
+
+    LIST_INSERT_HEAD(
+        &w->slots[l][(expires >> (TIMER_WHEEL_BITS * l)) & TIMER_WHEEL_MASK],
+        t, link);
+}
+
+/* Move the timers of an upper level slot to where they belong now */
+static int wheel_cascade(struct timer_wheel *w, int l)
+{
+    int i = (w->now >> (TIMER_WHEEL_BITS * l)) & TIMER_WHEEL_MASK;
+    struct timer *t;
+
+    while ((t = LIST_FIRST(&w->slots[l][i]))) {
+        LIST_REMOVE(t, link);
+        wheel_insert(w, t);
+    }
+
+    return i;
+}
+
+void timer_init(struct timer *t, timer_handler_t handler, void *priv)
+{
+    memset(t, 0, sizeof (*t));
+    t->handler = handler;
+    t->priv = priv;
+}
+
+void timer_arm(struct dispatch *d, struct timer *t, unsigned int ms)
 {
+    struct timer_wheel *w = &d->wheel;
+    uint64_t ticks = (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+
+    timer_cancel(d, t);
+
+    t->expires = wheel_tick(w) + (ticks ? ticks : 1);
+    t->pending = 1;
+    w->count++;
+    wheel_insert(w, t);
+}
+
+void timer_cancel(struct dispatch *d, struct timer *t)
+{
+    if (!t->pending)
+        return;
+
+    LIST_REMOVE(t, link);
+    t->pending = 0;
+    d->wheel.count--;
+}
+
+/*
+ * Run every timer due by now. Returns DISPATCH_ABORT if one of the handlers
+ * asked for it.
+ */
+static int timers_run(struct dispatch *d)
+{
+    struct timer_wheel *w = &d->wheel;
+    uint64_t tick = wheel_tick(w);
+    struct timer *t;
+    int l, i;
+    int rc;
+
+    if (!w->count) {
+        if (w->now <= tick)
+            w->now = tick + 1;
+        return DISPATCH_CONTINUE;
+    }
+
+    for (; w->now <= tick; w->now++) {
+        i = w->now & TIMER_WHEEL_MASK;
+
+        for (l = 1; !i && l < TIMER_WHEEL_LEVELS; l++)
+            i = wheel_cascade(w, l);
+        i = w->now & TIMER_WHEEL_MASK;
+
+        while ((t = LIST_FIRST(&w->slots[0][i]))) {
+            LIST_REMOVE(t, link);
+            t->pending = 0;
+            w->count--;
+            d->stats.timers++;
+
+            rc = t->handler(t, t->priv);
+            if (rc != DISPATCH_CONTINUE) {
+                w->now++;
+                return rc;
+            }
+        }
+    }
+
+    return DISPATCH_CONTINUE;
+}
+
+/* How long epoll_wait() may sleep before the wheel needs to be looked at */
+static int timers_timeout(struct dispatch *d)
+{
+    struct timer_wheel *w = &d->wheel;
+    uint64_t tick = w->now;
+    int64_t ms;
+    int i;
+
+    if (!w->count)
+        return -1;
+
+    /* Next busy slot, or the next cascade, whichever comes first */
+    for (i = 0; i < TIMER_WHEEL_SLOTS; i++, tick++) {
+        if (!(tick & TIMER_WHEEL_MASK))
+            break;
+        if (!LIST_EMPTY(&w->slots[0][tick & TIMER_WHEEL_MASK]))
+            break;
+    }
+
+    ms = w->base + tick * TIMER_TICK_MS - clock_ms();
+
+    return ms < 0 ? 0 : ms;
+}
+
+static int dispatch_backend_init(struct dispatch *d)
+{
+    d->ring = NULL;
+    d->epfd = -1;
+    d->deferred = NULL;
+    d->ndeferred = 0;
+    d->deferred_max = 0;
+
+    if (dispatch_opts.backend == DISPATCH_URING) {
+        d->ring = malloc(sizeof (*d->ring));
+        if (d->ring && !uring_init(d->ring, DISPATCH_URING_ENTRIES))
+            return 0;
+
+        fprintf(stderr, "io_uring unavailable (%s), falling back to epoll.\n",
+                strerror(errno));
+        free(d->ring);
+        d->ring = NULL;
+        dispatch_opts.backend = DISPATCH_EPOLL;
+    }
+
     d->epfd = epoll_create(1024);
     if (d->epfd == -1) {
         fprintf(stderr, "epoll_create() failed: %s\n", strerror(errno));
         return -1;
     }
 
+    return 0;
+}
+
+static void dispatch_backend_cleanup(struct dispatch *d)
+{
+    if (d->ring) {
+        uring_cleanup(d->ring);
+        free(d->ring);
+        d->ring = NULL;
+        free(d->deferred);
+    } else {
+        close(d->epfd);
+    }
+}
+
+int dispatch_init(struct dispatch *d)
+{
+    int fd;
+
+    if (dispatch_backend_init(d))
+        return -1;
+
     LIST_INIT(&d->handlers);
+    LIST_INIT(&d->zombies);
+    TAILQ_INIT(&d->ready);
+    SIMPLEQ_INIT(&d->remote);
+    lock_init(&d->remote_lock);
+    d->threaded = 0;
+    d->stop = 0;
+    wheel_init(&d->wheel);
+    d->busy_ns = 0;
+    d->woke_ns = 0;
+    memset(&d->stats, 0, sizeof (d->stats));
+
+    fd = eventfd(0, EFD_NONBLOCK);
+    if (fd == -1) {
+        fprintf(stderr, "eventfd() failed: %s\n", strerror(errno));
+        dispatch_backend_cleanup(d);
+        return -1;
+    }
+
+    d->wake = event_create(d, fd, EVENT_READ, wake_handler, d);
+    if (!d->wake) {
+        close(fd);
+        dispatch_backend_cleanup(d);
+        return -1;
+    }
 
     return 0;
 }
 
+/*
+ * Requests whose owners wait for them are completed first. Closing the ring
+ * then drops every other one still in flight, after which the events can
+ * all go.
+ */
 void dispatch_cleanup(struct dispatch *d)
 {
     struct event *e, *te;
+    int wakefd = d->wake->fd;
 
-    close(d->epfd);
+    LIST_FOREACH(e, &d->handlers, link) {
+        event_uring_flush(d, e);
+    }
+    dispatch_backend_cleanup(d);
     LIST_FOREACH_SAFE(e, &d->handlers, link, te) {
         event_delete(d, e);
     }
+    LIST_FOREACH_SAFE(e, &d->zombies, link, te) {
+        LIST_REMOVE(e, link);
+        free(e);
+    }
+    close(wakefd);
+}
+
+static void *dispatch_thread(void *priv)
+{
+    event_dispatch(priv);
+
+    return NULL;
+}
+
+/*
+ * Run the dispatch loop on a thread of its own. From then on, other threads
+ * may only touch it through event_control() and dispatch_stop().
+ */
+int dispatch_spawn(struct dispatch *d, pthread_t *thread)
+{
+    int rc;
+
+    d->threaded = 1;
+    rc = pthread_create(thread, NULL, dispatch_thread, d);
+    if (rc) {
+        fprintf(stderr, "pthread_create() failed: %s\n", strerror(rc));
+        d->threaded = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * For threads running no dispatch at all, but working on packets whose
+ * events belong to dispatches running elsewhere, or not running yet.
+ */
+void dispatch_foreign_thread(void)
+{
+    foreign_thread = 1;
+}
+
+void dispatch_stop(struct dispatch *d)
+{
+    lock(&d->remote_lock);
+    d->stop = 1;
+    unlock(&d->remote_lock);
+
+    dispatch_kick(d);
 }
 
 #define DISPATCH_MAX_EVT 32
 
-int event_dispatch(struct dispatch *d)
+/*
+ * Give every edge-triggered event on the ready list a turn, those its
+ * handler leaves ready going back at the end for the next round.
+ */
+static int dispatch_ready_run(struct dispatch *d)
+{
+    struct event *e;
+    unsigned short flags;
+    int cont = DISPATCH_CONTINUE;
+    int n = 0;
+
+    TAILQ_FOREACH(e, &d->ready, ready_link)
+        n++;
+
+    while (cont == DISPATCH_CONTINUE && n-- && (e = TAILQ_FIRST(&d->ready))) {
+        TAILQ_REMOVE(&d->ready, e, ready_link);
+        e->queued = 0;
+
+        flags = e->ready & e->flags;
+        if (!flags)
+            continue;
+
+        e->running = 1;
+        d->stats.events++;
+        cont = e->handler(e->fd, flags, e->priv);
+        e->running = 0;
+
+        /* A poll still in flight frees it when it completes */
+        if (e->dead) {
+            if (!e->armed) {
+                LIST_REMOVE(e, link);
+                free(e);
+            }
+            continue;
+        }
+        event_ready(d, e);
+    }
+
+    return cont;
+}
+
+static int dispatch_epoll_round(struct dispatch *d, int timeout)
 {
     struct epoll_event evts[DISPATCH_MAX_EVT];
     int rc;
     int i;
     int cont = DISPATCH_CONTINUE;
 
-    do {
-        rc = epoll_wait(d->epfd, evts, DISPATCH_MAX_EVT, -1);
-        if (rc == -1) {
-            if (errno == EINTR)
-                continue;
-            fprintf(stderr, "epoll_wait() failed: %s\n", strerror(errno));
+    if (!TAILQ_EMPTY(&d->ready))
+        timeout = 0;
+
+    rc = epoll_wait(d->epfd, evts, DISPATCH_MAX_EVT, timeout);
+    if (rc == -1) {
+        if (errno == EINTR)
+            return DISPATCH_CONTINUE;
+        fprintf(stderr, "epoll_wait() failed: %s\n", strerror(errno));
+        return DISPATCH_ABORT;
+    }
+    if (dispatch_opts.busy_poll_us)
+        d->woke_ns = clock_ns();
+
+    for (i = 0; i < rc; i++) {
+        struct event *e = evts[i].data.ptr;
+        short flags = 0;
+
+        if (evts[i].events & EPOLLIN)
+            flags |= EVENT_READ;
+        if (evts[i].events & EPOLLOUT)
+            flags |= EVENT_WRITE;
+
+        if (evts[i].events & EPOLLERR) {
+            fprintf(stderr, "socket error.\n");
             return DISPATCH_ABORT;
         }
 
-        for (i = 0; i < rc; i++) {
-            struct event *e = evts[i].data.ptr;
-            short flags = 0;
+        if (e->flags & EVENT_EDGE_TRIGGERED) {
+            e->ready |= flags;
+            if ((flags & EVENT_WRITE) && !(e->flags & EVENT_WRITE) &&
+                event_watch(d, e, e->kmask & ~EPOLLOUT))
+                return DISPATCH_ABORT;
+            event_ready(d, e);
+            continue;
+        }
+
+        d->stats.events++;
+        cont = e->handler(e->fd, flags, e->priv);
+        if (cont != DISPATCH_CONTINUE)
+            return cont;
+    }
 
-            if (evts[i].events & EPOLLIN)
-                flags |= EVENT_READ;
-            if (evts[i].events & EPOLLOUT)
-                flags |= EVENT_WRITE;
+    return dispatch_ready_run(d);
+}
 
-            if (evts[i].events & EPOLLERR) {
-                fprintf(stderr, "socket error.\n");
-                return DISPATCH_ABORT;
-            }
+/* Hand a completion over to the request or the event it is for */
+static int dispatch_uring_cqe(struct dispatch *d, uint64_t user_data, int res,
+                              unsigned int flags)
+{
+    struct event *e;
+    short evflags;
+    int cont = DISPATCH_CONTINUE;
 
-            cont = e->handler(e->fd, flags, e->priv);
-            if (cont != DISPATCH_CONTINUE)
-                break;
+    if (user_data & URING_REQ_TAG)
+        return uring_req_complete(
+            d, (void *)(uintptr_t)(user_data & ~URING_REQ_TAG), res, flags);
+
+    /* Poll updates and removals */
+    e = (void *)(uintptr_t)user_data;
+    if (!e)
+        return DISPATCH_CONTINUE;
+
+    e->armed = 0;
+    if (e->dead) {
+        LIST_REMOVE(e, link);
+        free(e);
+        return DISPATCH_CONTINUE;
+    }
+
+    if (res < 0 && res != -ECANCELED) {
+        fprintf(stderr, "io_uring poll failed: %s\n", strerror(-res));
+        return DISPATCH_ABORT;
+    }
+    if (res > 0 && (res & POLLERR)) {
+        fprintf(stderr, "socket error.\n");
+        return DISPATCH_ABORT;
+    }
+
+    evflags = 0;
+    if (res > 0 && (res & POLLIN))
+        evflags |= EVENT_READ;
+    if (res > 0 && (res & POLLOUT))
+        evflags |= EVENT_WRITE;
+    evflags &= e->flags & ~event_uring_dirs(e);
+
+    if (evflags) {
+        e->running = 1;
+        d->stats.events++;
+        cont = e->handler(e->fd, evflags, e->priv);
+        e->running = 0;
+
+        if (e->dead) {
+            if (!e->armed) {
+                LIST_REMOVE(e, link);
+                free(e);
+            }
+            return cont;
         }
+    }
 
-    } while (cont == DISPATCH_CONTINUE);
+    if (event_uring_sync(d, e))
+        return DISPATCH_ABORT;
+
+    return cont;
+}
+
+/*
+ * Completions saved by flushes go first, then those of the ring, then the
+ * events done on the ring that are ready. The wait only blocks if none of
+ * them has anything left to do.
+ */
+static int dispatch_uring_round(struct dispatch *d, int timeout)
+{
+    struct io_uring_cqe *cqe;
+    struct dispatch_cqe c;
+    unsigned int i;
+    int wait = TAILQ_EMPTY(&d->ready) && !d->ndeferred;
+    int cont = DISPATCH_CONTINUE;
+
+    if (uring_enter(d->ring, wait, timeout)) {
+        if (errno == EINTR)
+            return DISPATCH_CONTINUE;
+        fprintf(stderr, "io_uring_enter() failed: %s\n", strerror(errno));
+        return DISPATCH_ABORT;
+    }
+    if (dispatch_opts.busy_poll_us)
+        d->woke_ns = clock_ns();
+
+    for (i = 0; cont == DISPATCH_CONTINUE && i < d->ndeferred; i++) {
+        c = d->deferred[i];
+        cont = dispatch_uring_cqe(d, c.user_data, c.res, c.flags);
+    }
+    /* Keep whatever was not handled, or deferred meanwhile */
+    if (i) {
+        memmove(d->deferred, d->deferred + i,
+                (d->ndeferred - i) * sizeof (*d->deferred));
+        d->ndeferred -= i;
+    }
+
+    while (cont == DISPATCH_CONTINUE && (cqe = uring_peek_cqe(d->ring))) {
+        c.user_data = cqe->user_data;
+        c.res = cqe->res;
+        c.flags = cqe->flags;
+        uring_cqe_seen(d->ring);
+
+        cont = dispatch_uring_cqe(d, c.user_data, c.res, c.flags);
+    }
+
+    if (cont == DISPATCH_CONTINUE)
+        cont = dispatch_ready_run(d);
+
+    return cont;
+}
+
+static int dispatch_round(struct dispatch *d, int timeout)
+{
+    if (d->ring)
+        return dispatch_uring_round(d, timeout);
+
+    return dispatch_epoll_round(d, timeout);
+}
+
+/*
+ * Poll without sleeping for as long as events kept coming within the spin
+ * budget, then sleep until the next one. Time spent in polls finding
+ * nothing is told apart from time spent handling what they found.
+ */
+static int dispatch_busy_round(struct dispatch *d)
+{
+    unsigned long events = d->stats.events;
+    uint64_t start = clock_ns();
+    uint64_t end;
+    int idle;
+    int cont;
+
+    idle = start - d->busy_ns >= dispatch_opts.busy_poll_us * 1000ULL;
+    if (idle)
+        d->stats.sleeps++;
+
+    cont = dispatch_round(d, idle ? timers_timeout(d) : 0);
+    end = clock_ns();
+
+    if (d->stats.events != events) {
+        d->busy_ns = end;
+        d->stats.work_ns += end - d->woke_ns;
+    } else if (!idle) {
+        d->stats.spins++;
+        d->stats.spin_ns += end - start;
+        sched_yield();
+    }
 
     return cont;
 }
 
+int event_dispatch(struct dispatch *d)
+{
+    int cont;
+    struct dispatch *prev = current_dispatch;
+
+    current_dispatch = d;
+
+    do {
+        d->stats.loops++;
+        if (dispatch_opts.busy_poll_us)
+            cont = dispatch_busy_round(d);
+        else
+            cont = dispatch_round(d, timers_timeout(d));
+
+        if (cont == DISPATCH_CONTINUE)
+            cont = timers_run(d);
+
+    } while (cont == DISPATCH_CONTINUE);
+
+    current_dispatch = prev;
+
+    return cont;
+}
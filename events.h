@@ -2,15 +2,68 @@
 #define EVENTS_H_
 
 #include <sys/queue.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "lock.h"
 
 #define EVENT_READ 0x1
 #define EVENT_WRITE 0x2
+/* io_uring backend: directions done with requests on the ring, not polled */
+#define EVENT_URING_READ 0x4
+#define EVENT_URING_WRITE 0x8
 #define EVENT_EDGE_TRIGGERED 0x80
 
 #define DISPATCH_CONTINUE 0
 #define DISPATCH_ABORT -1
 typedef int (*event_handler_t)(int, unsigned short, void *);
 
+#define DISPATCH_EPOLL 0
+#define DISPATCH_URING 1
+
+/*
+ * Busy polling: once a wait has found something to do, the dispatch keeps
+ * polling for events without sleeping until busy_poll_us go by with none,
+ * sparing the packets that follow the wakeup latency. Idle, it goes back to
+ * blocking waits.
+ */
+#define DISPATCH_BUSY_POLL_MAX_US 1000000
+
+struct dispatch_opts
+{
+    int backend;        /* DISPATCH_EPOLL, or DISPATCH_URING if available */
+    unsigned int busy_poll_us;  /* Spin budget, 0 to always sleep */
+    int edge_triggered;         /* Datapath events are EVENT_EDGE_TRIGGERED */
+};
+
+extern struct dispatch_opts dispatch_opts;
+
+struct uring;
+struct io_uring_sqe;
+struct event;
+
+/*
+ * A request submitted on the io_uring of a dispatch, by the owner of an
+ * event doing its I/O there. Its completions are handed to the handler on
+ * the dispatch's thread, with the CQE's result and flags.
+ */
+struct uring_req;
+typedef int (*uring_handler_t)(struct uring_req *, int, unsigned int);
+
+struct uring_req
+{
+    uring_handler_t handler;
+    struct event *e;    /* Counted among the requests it has in flight */
+};
+
+/* A completion reaped ahead of its round */
+struct dispatch_cqe
+{
+    uint64_t user_data;
+    int res;
+    unsigned int flags;
+};
+
 struct event
 {
     event_handler_t handler;
@@ -18,13 +71,109 @@ struct event
     void *priv;
     int flags;
     LIST_ENTRY(event) link;
+
+    /* Controls posted by other threads, applied by the owner */
+    int remote_ctl;
+    SIMPLEQ_ENTRY(event) remote_link;
+
+    /*
+     * Edge-triggered epoll events, and io_uring ones for the directions done
+     * on the ring: readiness as last known, in user space
+     */
+    unsigned short ready;
+    unsigned int kmask;         /* What epoll watches for */
+    int queued;
+    TAILQ_ENTRY(event) ready_link;
+
+    /* io_uring backend: state of the poll request standing for the event */
+    int armed;
+    unsigned int armed_mask;
+    int running;
+    int dead;           /* Deleted, freed once nothing refers to it anymore */
+    int inflight;       /* Requests submitted by its owner, not completed */
+};
+
+/*
+ * Hierarchical timer wheel: TIMER_WHEEL_LEVELS levels of TIMER_WHEEL_SLOTS
+ * slots, each level covering TIMER_WHEEL_SLOTS times the range of the one
+ * below. Timers sitting in upper levels are cascaded down as time gets
+ * closer to their expiry, so arming, cancelling and expiring are all O(1).
+ * Timers belong to a dispatch and may only be used by its thread.
+ */
+#define TIMER_TICK_MS 10
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 4
+
+struct timer;
+typedef int (*timer_handler_t)(struct timer *, void *);
+
+struct timer
+{
+    timer_handler_t handler;
+    void *priv;
+    uint64_t expires;           /* In ticks */
+    int pending;
+    LIST_ENTRY(timer) link;
+};
+
+struct timer_wheel
+{
+    uint64_t base;              /* Monotonic clock at tick 0, in ms */
+    uint64_t now;               /* Next tick to process */
+    unsigned long count;
+    LIST_HEAD(, timer) slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+struct dispatch_stats
+{
+    unsigned long loops;        /* Waits for events */
+    unsigned long events;       /* Handlers run */
+    unsigned long timers;       /* Timers expired */
+    unsigned long ctls;         /* epoll_ctl() calls changing what is watched */
+
+    /* Busy polling */
+    unsigned long sleeps;       /* Blocking waits, the spin budget spent */
+    unsigned long spins;        /* Polls that found nothing */
+    unsigned long spin_ns;      /* Time spent in those */
+    unsigned long work_ns;      /* Time spent handling what polls found */
 };
 
 struct dispatch
 {
     int epfd;
+    struct uring *ring;         /* Set when running on io_uring instead */
+
+    /* io_uring completions reaped early, handled first thing next round */
+    struct dispatch_cqe *deferred;
+    unsigned int ndeferred;
+    unsigned int deferred_max;
 
     LIST_HEAD(,event) handlers;
+    LIST_HEAD(,event) zombies;
+
+    /* Edge-triggered events both ready and wanted, served round robin */
+    TAILQ_HEAD(,event) ready;
+
+    /*
+     * A dispatch is driven by exactly one thread. Other threads may only
+     * call event_control() on it, which posts the request to the owner
+     * through the wake eventfd.
+     */
+    int threaded;
+    int stop;
+    struct event *wake;
+    lock_t remote_lock;
+    SIMPLEQ_HEAD(,event) remote;
+
+    struct timer_wheel wheel;
+
+    uint64_t busy_ns;           /* Last time a wait found events */
+    uint64_t woke_ns;           /* Last time a wait returned */
+
+    /* Only written by the thread driving the dispatch */
+    struct dispatch_stats stats;
 };
 
 #ifndef LIST_FOREACH_SAFE
@@ -39,15 +188,29 @@ enum event_control
     EVCTL_READ_STALL = 0,
     EVCTL_READ_RESTART,
     EVCTL_WRITE_STALL,
-    EVCTL_WRITE_RESTART
+    EVCTL_WRITE_RESTART,
+    EVCTL_REARM,        /* Re-evaluate readiness, e.g. after a partial drain */
 };
 
 struct event *event_create(struct dispatch *d, int fd, unsigned short flags,
                            event_handler_t handler, void *priv);
 int event_control(struct dispatch *d, struct event *e, int ctl);
+void event_drained(struct dispatch *d, struct event *e, unsigned short flags);
 void event_delete(struct dispatch *d, struct event *e);
+struct io_uring_sqe *event_uring_sqe(struct dispatch *d, struct event *e,
+                                     struct uring_req *req);
+void event_uring_ready(struct dispatch *d, struct event *e,
+                       unsigned short flags);
+void event_uring_flush(struct dispatch *d, struct event *e);
 int dispatch_init(struct dispatch *d);
 void dispatch_cleanup(struct dispatch *d);
 int event_dispatch(struct dispatch *d);
+int dispatch_spawn(struct dispatch *d, pthread_t *thread);
+void dispatch_stop(struct dispatch *d);
+void dispatch_foreign_thread(void);
+
+void timer_init(struct timer *t, timer_handler_t handler, void *priv);
+void timer_arm(struct dispatch *d, struct timer *t, unsigned int ms);
+void timer_cancel(struct dispatch *d, struct timer *t);
 
 #endif /* EVENTS_H_ */
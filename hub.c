@@ -0,0 +1,428 @@
+/*
+ *  Copyright (c) 2011, Julian Pidancet <julian.pidancet@gmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *  3. Neither the name of Julian Pidancet nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <linux/if_tun.h>
+
+#include "lpm.h"
+#include "crypto.h"
+#include "metrics.h"
+#include "peer.h"
+#include "hub.h"
+
+#define HUB_POOL_SZ 4096
+
+/* /24s holding longer prefixes, /32 routes to a /16 of clients take 256 */
+#define HUB_GROUPS (1 << 14)
+
+/* Sources looked up per received batch, the rest wait for the next one */
+#define HUB_LEARN_MAX 64
+
+struct hub_opts hub_opts;
+
+/*
+ * The table and the peers it routes to are read by the threads reading the
+ * interface, and by those receiving packets to learn routes from, once per
+ * batch. Peers coming and going, and new sources, take the write lock: no
+ * peer is freed while a batch might still be handing packets to it.
+ */
+static struct
+{
+    pthread_rwlock_t lock;
+    struct lpm *lpm;
+    struct peer **peers;        /* By next hop, 0 is none */
+    uint32_t npeers;
+    struct iface *iface;
+    struct hub_stats stats;
+} hub = {
+    .lock = PTHREAD_RWLOCK_INITIALIZER,
+};
+
+/* <prefix>/<length>@<peer address> */
+int hub_parse_route(const char *s)
+{
+    char prefix[INET_ADDRSTRLEN], peer[INET_ADDRSTRLEN];
+    struct hub_route *r;
+    struct in_addr a;
+    char c;
+
+    if (hub_opts.nroutes == HUB_ROUTES_MAX)
+        return -1;
+    r = &hub_opts.routes[hub_opts.nroutes];
+
+    if (sscanf(s, "%15[0-9.]/%d@%15[0-9.]%c", prefix, &r->depth, peer,
+               &c) != 3 ||
+        r->depth < 0 || r->depth > 32 ||
+        !inet_aton(prefix, &a) || !inet_aton(peer, &r->peer))
+        return -1;
+    r->prefix = ntohl(a.s_addr);
+    hub_opts.nroutes++;
+
+    return 0;
+}
+
+static const char *hub_prefix_str(uint32_t prefix, char *buf)
+{
+    struct in_addr a = { .s_addr = htonl(prefix) };
+
+    return inet_ntop(AF_INET, &a, buf, INET_ADDRSTRLEN);
+}
+
+static inline struct iphdr *hub_iphdr(struct pkt *pkt)
+{
+    struct iphdr *ip = (void *)(pkt->buff + sizeof (struct tun_pi));
+
+    if (pkt->pkt_size < sizeof (struct tun_pi) + sizeof (*ip) ||
+        ip->version != 4)
+        return NULL;
+
+    return ip;
+}
+
+static inline struct peer *hub_lookup(struct pkt *pkt)
+{
+    struct iphdr *ip = hub_iphdr(pkt);
+    uint32_t nh;
+
+    if (!ip || lpm_lookup(hub.lpm, ntohl(ip->daddr), &nh))
+        return NULL;
+
+    return hub.peers[nh];
+}
+
+/*
+ * Packets read from the shared interface. Those going to the same peer are
+ * handed over together, in the order they were read.
+ */
+static void hub_tx(struct pkt **pkts, int n, void *priv)
+{
+    struct peer *dst[IFACE_TX_BATCH];
+    struct pkt *run[IFACE_TX_BATCH];
+    unsigned long dropped = 0;
+    struct peer *p;
+    int i, j, k;
+
+    (void)priv;
+
+    pthread_rwlock_rdlock(&hub.lock);
+    for (i = 0; i < n; i++) {
+        dst[i] = hub_lookup(pkts[i]);
+        if (!dst[i]) {
+            pkt_complete(pkts[i]);
+            dropped++;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        p = dst[i];
+        if (!p)
+            continue;
+        for (j = i, k = 0; j < n; j++) {
+            if (dst[j] != p)
+                continue;
+            run[k++] = pkts[j];
+            dst[j] = NULL;
+        }
+        __atomic_fetch_add(&p->stats.tx_routed, k, __ATOMIC_RELAXED);
+        peer_tx(run, k, p);
+    }
+    pthread_rwlock_unlock(&hub.lock);
+
+    __atomic_fetch_add(&hub.stats.routed, n - dropped, __ATOMIC_RELAXED);
+    if (dropped)
+        __atomic_fetch_add(&hub.stats.no_route, dropped, __ATOMIC_RELAXED);
+}
+
+static inline uint32_t hub_mask(int depth)
+{
+    return depth ? ~0u << (32 - depth) : 0;
+}
+
+/* Whether one of the peer's static routes is, or covers, the prefix */
+static int hub_owns(struct peer *p, uint32_t prefix, int depth)
+{
+    struct hub_route *r;
+    int i;
+
+    for (i = 0; i < hub_opts.nroutes; i++) {
+        r = &hub_opts.routes[i];
+        if (r->peer.s_addr == p->addr.sin_addr.s_addr &&
+            r->depth <= depth &&
+            !((prefix ^ r->prefix) & hub_mask(r->depth)))
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * A source may be learned if it is within the peer's static routes, and
+ * the route it takes now, if any, is not another peer's: neither a /32,
+ * learned or static, nor a static route configured for another address.
+ */
+static int hub_may_learn(struct peer *p, uint32_t saddr)
+{
+    uint32_t nh;
+    int depth;
+
+    if (!hub_owns(p, saddr, 32))
+        return 0;
+    if (lpm_match(hub.lpm, saddr, &nh, &depth))
+        return 1;
+
+    return depth < 32 && hub_owns(p, saddr & hub_mask(depth), depth);
+}
+
+/*
+ * Routes the sources of packets received from a peer back to it, unless
+ * they already are, or are not the peer's to claim: spoofing sources takes
+ * no other peer's address, nor fills the table. A learned route goes away
+ * with its peer.
+ */
+void hub_learn(struct peer *p, struct pkt **pkts, int n)
+{
+    uint32_t learn[HUB_LEARN_MAX];
+    char buf[INET_ADDRSTRLEN];
+    struct iphdr *ip;
+    uint32_t saddr, nh;
+    unsigned long rejected = 0;
+    int i, k = 0;
+
+    pthread_rwlock_rdlock(&hub.lock);
+    for (i = 0; i < n && k < HUB_LEARN_MAX; i++) {
+        ip = hub_iphdr(pkts[i]);
+        if (!ip)
+            continue;
+        saddr = ntohl(ip->saddr);
+        if (!lpm_lookup(hub.lpm, saddr, &nh) && nh == p->hub_nh)
+            continue;
+        if (!hub_may_learn(p, saddr)) {
+            rejected++;
+            continue;
+        }
+        if (!k || learn[k - 1] != saddr)
+            learn[k++] = saddr;
+    }
+    pthread_rwlock_unlock(&hub.lock);
+
+    if (!k)
+        goto out;
+
+    pthread_rwlock_wrlock(&hub.lock);
+    /* Batches still with the workers are delivered after the peer left */
+    if (hub.peers[p->hub_nh] != p)
+        goto unlock;
+    for (i = 0; i < k; i++) {
+        if (!lpm_lookup(hub.lpm, learn[i], &nh) && nh == p->hub_nh)
+            continue;
+        if (!hub_may_learn(p, learn[i]) ||
+            p->hub_learned >= HUB_LEARNED_MAX) {
+            rejected++;
+            continue;
+        }
+        if (lpm_add(hub.lpm, learn[i], 32, p->hub_nh))
+            continue;
+        p->hub_learned++;
+        hub.stats.learned++;
+        PEER_LOG(p, "Learned route to %s/32",
+                 hub_prefix_str(learn[i], buf));
+    }
+unlock:
+    pthread_rwlock_unlock(&hub.lock);
+out:
+    if (rejected)
+        __atomic_fetch_add(&hub.stats.learn_rejected, rejected,
+                           __ATOMIC_RELAXED);
+}
+
+/* Takes a next hop, and the static routes naming the peer's address */
+int hub_peer_add(struct peer *p)
+{
+    char buf[INET_ADDRSTRLEN];
+    struct hub_route *r;
+    struct peer **peers;
+    uint32_t nh, size;
+    int i;
+
+    pthread_rwlock_wrlock(&hub.lock);
+    for (nh = 1; nh < hub.npeers && hub.peers[nh]; nh++)
+        ;
+    if (nh >= hub.npeers) {
+        size = hub.npeers ? hub.npeers * 2 : 64;
+        if (size - 1 > LPM_NH_MAX)
+            goto full;
+        peers = realloc(hub.peers, size * sizeof (*peers));
+        if (!peers)
+            goto full;
+        memset(peers + hub.npeers, 0,
+               (size - hub.npeers) * sizeof (*peers));
+        hub.peers = peers;
+        hub.npeers = size;
+    }
+    hub.peers[nh] = p;
+    p->hub_nh = nh;
+    p->hub_learned = 0;
+
+    for (i = 0; i < hub_opts.nroutes; i++) {
+        r = &hub_opts.routes[i];
+        if (r->peer.s_addr != p->addr.sin_addr.s_addr)
+            continue;
+        if (lpm_add(hub.lpm, r->prefix, r->depth, nh))
+            PEER_LOG(p, "Routing table full, dropped route to %s/%d",
+                     hub_prefix_str(r->prefix, buf), r->depth);
+        else
+            PEER_LOG(p, "Route to %s/%d",
+                     hub_prefix_str(r->prefix, buf), r->depth);
+    }
+    pthread_rwlock_unlock(&hub.lock);
+
+    return 0;
+
+full:
+    pthread_rwlock_unlock(&hub.lock);
+    return -1;
+}
+
+void hub_peer_remove(struct peer *p)
+{
+    int n;
+
+    pthread_rwlock_wrlock(&hub.lock);
+    n = lpm_del_nh(hub.lpm, p->hub_nh);
+    hub.peers[p->hub_nh] = NULL;
+    pthread_rwlock_unlock(&hub.lock);
+
+    if (n)
+        PEER_LOG(p, "Removed %d routes", n);
+}
+
+struct iface *hub_iface(void)
+{
+    return hub.iface;
+}
+
+static void hub_metrics_collect(struct metrics_buf *b, void *priv)
+{
+    unsigned long routes, groups, learned;
+
+    (void)priv;
+
+    pthread_rwlock_rdlock(&hub.lock);
+    routes = hub.lpm->nrules;
+    groups = hub.lpm->used_groups - hub.lpm->nfree;
+    learned = hub.stats.learned;
+    pthread_rwlock_unlock(&hub.lock);
+
+    metrics_family(b, "tun_hub_routes", "gauge", "Routes in the table.");
+    metrics_printf(b, "tun_hub_routes %lu\n", routes);
+    metrics_family(b, "tun_hub_route_groups", "gauge",
+                   "/24s of the table holding longer prefixes.");
+    metrics_printf(b, "tun_hub_route_groups %lu\n", groups);
+    metrics_family(b, "tun_hub_learned_routes_total", "counter",
+                   "Routes added for the sources of received packets.");
+    metrics_printf(b, "tun_hub_learned_routes_total %lu\n", learned);
+    metrics_family(b, "tun_hub_rejected_learns_total", "counter",
+                   "Sources of received packets outside the sender's routes, "
+                   "or routed to another peer.");
+    metrics_printf(b, "tun_hub_rejected_learns_total %lu\n",
+                   __atomic_load_n(&hub.stats.learn_rejected,
+                                   __ATOMIC_RELAXED));
+    metrics_family(b, "tun_hub_routed_packets_total", "counter",
+                   "Packets read and handed over to a peer.");
+    metrics_printf(b, "tun_hub_routed_packets_total %lu\n",
+                   __atomic_load_n(&hub.stats.routed, __ATOMIC_RELAXED));
+    metrics_family(b, "tun_hub_no_route_packets_total", "counter",
+                   "Packets read with no route to their destination.");
+    metrics_printf(b, "tun_hub_no_route_packets_total %lu\n",
+                   __atomic_load_n(&hub.stats.no_route, __ATOMIC_RELAXED));
+}
+
+/*
+ * The interface is sized as peer_iface_init() would for a peer over a link
+ * of that MTU, so that whatever the peer, sealing fits in place.
+ */
+int hub_start(struct dispatch *d, int link_mtu)
+{
+    size_t tailroom = crypto_opts.enabled ? CRYPTO_OVERHEAD : 0;
+    int mtu = link_mtu - 28 - sizeof (struct tun_pi) - tailroom;
+
+    hub.lpm = lpm_create(HUB_GROUPS);
+    if (!hub.lpm) {
+        fprintf(stderr, "hub: can't allocate the routing table.\n");
+        return -1;
+    }
+
+    hub.iface = iface_create(HUB_POOL_SZ, mtu, 0, tailroom);
+    if (!hub.iface) {
+        fprintf(stderr, "hub: can't create interface.\n");
+        lpm_destroy(hub.lpm);
+        return -1;
+    }
+    iface_set_tx(hub.iface, hub_tx, NULL);
+    iface_event_start(hub.iface, d);
+
+    if (metrics_register(hub_metrics_collect, NULL))
+        fprintf(stderr, "metrics: too many collectors.\n");
+
+    return 0;
+}
+
+/* Once every peer is gone */
+void hub_stop(void)
+{
+    if (!hub.iface)
+        return;
+
+    metrics_unregister(hub_metrics_collect, NULL);
+    hub_stats_print(stdout);
+
+    iface_event_stop(hub.iface);
+    iface_destroy(hub.iface);
+    lpm_destroy(hub.lpm);
+    free(hub.peers);
+    hub.iface = NULL;
+    hub.peers = NULL;
+    hub.npeers = 0;
+}
+
+void hub_stats_print(FILE *f)
+{
+    fprintf(f, "hub: %lu packets routed, %lu without a route, "
+               "%zu routes, %lu learned, %lu refused\n",
+            hub.stats.routed, hub.stats.no_route, hub.lpm->nrules,
+            hub.stats.learned, hub.stats.learn_rejected);
+}
@@ -0,0 +1,94 @@
+/*
+ *  Copyright (c) 2011, Julian Pidancet <julian.pidancet@gmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *  3. Neither the name of Julian Pidancet nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#ifndef HUB_H_
+#define HUB_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "events.h"
+#include "iface.h"
+
+#define HUB_ROUTES_MAX 64
+#define HUB_LEARNED_MAX 256
+
+/*
+ * Hub mode, for listeners: every peer shares one tunnel interface, and
+ * packets read from it go to the peer the routing table gives for their
+ * destination. Peers own the static routes naming their transport address,
+ * which are also the sources they may send from. /32 routes to those
+ * sources are learned, up to HUB_LEARNED_MAX per peer, as when several
+ * peers connect from the same address.
+ */
+struct hub_route
+{
+    uint32_t prefix;            /* Host order */
+    int depth;
+    struct in_addr peer;        /* Transport address of the next hop */
+};
+
+struct hub_opts
+{
+    int enabled;
+    int nroutes;
+    struct hub_route routes[HUB_ROUTES_MAX];
+};
+
+struct hub_stats
+{
+    unsigned long routed;       /* Packets read and handed over to a peer */
+    unsigned long no_route;     /* Packets read with nowhere to go */
+    unsigned long learned;      /* Routes added for packets' sources */
+    unsigned long learn_rejected;   /* Sources not the peer's to claim */
+};
+
+struct peer;
+
+extern struct hub_opts hub_opts;
+
+static inline int hub_enabled(void)
+{
+    return hub_opts.enabled;
+}
+
+int hub_parse_route(const char *s);
+int hub_start(struct dispatch *d, int link_mtu);
+void hub_stop(void);
+struct iface *hub_iface(void);
+int hub_peer_add(struct peer *p);
+void hub_peer_remove(struct peer *p);
+void hub_learn(struct peer *p, struct pkt **pkts, int n);
+void hub_stats_print(FILE *f);
+
+#endif /* HUB_H_ */
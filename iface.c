@@ -41,91 +41,862 @@
 #include <sys/socket.h>
 #include <linux/if.h>
 #include <linux/if_tun.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/io_uring.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <arpa/inet.h>
 
 #include "events.h"
 #include "pktqueue.h"
+#include "pktring.h"
+#include "offload.h"
 
 #include "iface.h"
+#include "workers.h"
+#include "hub.h"
+#include "aqm.h"
+
+struct iface_opts iface_opts = {
+    .backend = &iface_tun_backend,
+    .budget = IFACE_BUDGET_DEFAULT,
+    .queues = 1,
+};
+
+/*
+ * On io_uring, packets are written with requests submitted along with the
+ * dispatch's next wait, one per packet, or per super-packet in offload
+ * mode, and completed along with the request.
+ */
+#define IFACE_URING_WRITES 64
+
+struct iface_write
+{
+    struct uring_req req;
+    struct iface_queue *q;
+    struct virtio_net_hdr vh;
+    struct iovec iov[OFFLOAD_MAX_SEGS + 2];
+    int iovcnt;
+    size_t len;
+    struct pkt *pkts[OFFLOAD_MAX_SEGS];
+    int count;
+    struct iface_write *next;   /* Free */
+};
 
 static void tx_complete(struct pkt *p, void *priv)
 {
-    struct iface *iface = priv;
+    struct iface_queue *q = priv;
+
+    pkt_reset(p);
+    pktring_enqueue(q->tx_pool, p);
+    /* Stopped queues get packets back from the transport, but never read */
+    if (q->d && pktring_count(q->tx_pool) >= q->pool_low)
+        event_control(q->d, q->ev, EVCTL_READ_RESTART);
+}
+
+/*
+ * Pick the queue a packet is written to. Packets of the same inner flow
+ * always go through the same queue so they reach the kernel in order.
+ */
+static struct iface_queue *iface_select_queue(struct iface *iface,
+                                              struct pkt *p)
+{
+    struct iphdr *ip = (void *)(p->buff + sizeof (struct tun_pi));
+    uint32_t hash;
+
+    if (iface->nqueues == 1)
+        return &iface->queues[0];
+
+    if (p->pkt_size < sizeof (struct tun_pi) + sizeof (*ip))
+        return &iface->queues[0];
+
+    hash = ip->saddr ^ ip->daddr ^ ip->protocol;
+    if ((ip->protocol == IPPROTO_TCP || ip->protocol == IPPROTO_UDP) &&
+        !(ip->frag_off & htons(IP_MF | IP_OFFMASK)) &&
+        p->pkt_size >= sizeof (struct tun_pi) + ip->ihl * 4 + 4) {
+        uint32_t ports;
 
-    p->pkt_size = 0;
-    pktqueue_enqueue(&iface->tx_pool, p);
-    event_control(iface->d, iface->ev, EVCTL_READ_RESTART);
+        memcpy(&ports, (char *)ip + ip->ihl * 4, sizeof (ports));
+        hash ^= ports;
+    }
+    hash *= 0x9e3779b1;
+
+    return &iface->queues[(hash >> 16) % iface->nqueues];
 }
 
 int iface_rx_schedule(struct iface *iface, struct pkt *p)
 {
+    struct iface_queue *q = iface_select_queue(iface, p);
     int rc;
 
-    pktqueue_enqueue(&iface->rx_queue, p);
-    rc = event_control(iface->d, iface->ev, EVCTL_WRITE_RESTART);
+    if (aqm_opts.mode == AQM_FQ_CODEL)
+        p->hash = aqm_flow_hash(p);
+    aqm_stamp(p);
+    if (pktring_enqueue(q->rx_queue, p)) {
+        __atomic_fetch_add(&q->stats.ring_drops, 1, __ATOMIC_RELAXED);
+        pkt_complete(p);
+        return -1;
+    }
+    rc = event_control(q->d, q->ev, EVCTL_WRITE_RESTART);
 
     return rc;
 }
 
-static int iface_event_handler(int fd, unsigned short flags, void *priv)
+/* Hand the packets read so far over to the transport */
+static void iface_tx_flush(struct iface *iface, struct pkt **batch, int *n)
 {
-    struct iface *iface = priv;
+    if (!*n)
+        return;
+    if (iface->credit)
+        __atomic_sub_fetch(&iface->tx_credit, *n, __ATOMIC_RELAXED);
+    iface->tx_handler(batch, *n, iface->tx_priv);
+    *n = 0;
+}
+
+/*
+ * Whether reading has to stop for want of credit, nbatch packets being read
+ * already. The queue is flagged before looking at the credit once more, so
+ * that either this sees credit given meanwhile, or iface_add_credit sees
+ * the flag and restarts reading.
+ */
+static int iface_tx_blocked(struct iface_queue *q, int nbatch)
+{
+    struct iface *iface = q->iface;
+    /* A read may bring as many packets as are kept pooled for it */
+    long need = nbatch + q->pool_low;
+
+    if (!iface->credit ||
+        __atomic_load_n(&iface->tx_credit, __ATOMIC_RELAXED) >= need)
+        return 0;
+
+    __atomic_store_n(&q->credit_stalled, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&iface->tx_credit, __ATOMIC_SEQ_CST) >= need) {
+        __atomic_store_n(&q->credit_stalled, 0, __ATOMIC_RELAXED);
+        return 0;
+    }
+    q->stats.credit_stalls++;
+
+    return 1;
+}
+
+/* Fair queueing on the way out needs the inner flow before it is sealed */
+static inline void iface_tx_add(struct iface *iface, struct pkt **batch,
+                                int *n, struct pkt *p)
+{
+    if (aqm_opts.mode == AQM_FQ_CODEL)
+        p->hash = aqm_flow_hash(p);
+    batch[(*n)++] = p;
+    if (*n == IFACE_TX_BATCH)
+        iface_tx_flush(iface, batch, n);
+}
+
+/*
+ * Read up to the budget from the device. Returns the number of packets read,
+ * or -1 if the event could not be stalled.
+ */
+static int iface_read(struct iface_queue *q, int fd, int *more)
+{
+    struct iface *iface = q->iface;
+    struct pkt *batch[IFACE_TX_BATCH];
     struct pkt *p;
+    int nbatch = 0;
+    int n;
     int rc;
 
-    if (flags & EVENT_READ) {
-        p = pktqueue_dequeue(&iface->tx_pool);
-        if (p) {
-            rc = read(fd, p->buff, p->buff_size);
-            if (rc <= 0)
+    for (n = 0; n < iface_opts.budget; n++) {
+        p = NULL;
+        if (!iface_tx_blocked(q, nbatch))
+            p = pktring_dequeue(q->tx_pool);
+        if (!p) {
+            if (event_control(q->d, q->ev, EVCTL_READ_STALL))
+                n = -1;
+            goto out;
+        }
+
+        rc = read(fd, p->buff, pkt_room(p));
+        if (rc <= 0) {
+            if (rc == 0 || errno != EAGAIN) {
                 fprintf(stderr, "%s: read error.\n", iface->name);
-            p->pkt_size = rc;
-            pkt_set_compl(p, tx_complete, iface);
-            iface->tx_handler(p, iface->tx_priv);
+                q->stats.errors++;
+            } else {
+                event_drained(q->d, q->ev, EVENT_READ);
+            }
+            pktring_putback(q->tx_pool, p);
+            goto out;
+        }
+        pkt_put(p, rc);
+        q->stats.tx_bytes += rc;
+        pkt_set_compl(p, tx_complete, q);
+        iface_tx_add(iface, batch, &nbatch, p);
+    }
+
+    *more = 1;
+out:
+    iface_tx_flush(iface, batch, &nbatch);
+    return n;
+}
+
+/*
+ * Write up to the budget to the device. Returns the number of packets
+ * written, or -1 if the event could not be stalled.
+ */
+static int iface_write(struct iface_queue *q, int fd, int *more)
+{
+    uint64_t now = aqm_now();
+    struct pkt *p;
+    int n;
+    int rc;
+
+    for (n = 0; n < iface_opts.budget; n++) {
+        p = aqm_dequeue(&q->aqm, q->rx_queue, now);
+        if (!p) {
+            if (event_control(q->d, q->ev, EVCTL_WRITE_STALL))
+                return -1;
+            return n;
+        }
+
+        rc = write(fd, p->buff, p->pkt_size);
+        if (rc < 0 && errno == EAGAIN) {
+            pktring_putback(q->rx_queue, p);
+            event_drained(q->d, q->ev, EVENT_WRITE);
+            return n;
+        }
+        if (rc - p->pkt_size) {
+            fprintf(stderr, "%s: write error.\n", q->iface->name);
+            q->stats.errors++;
         } else {
-            rc = event_control(iface->d, iface->ev, EVCTL_READ_STALL);
-            if (rc)
-                return DISPATCH_ABORT;
+            q->stats.rx_bytes += rc;
         }
+
+        pkt_complete(p);
     }
 
-    if (flags & EVENT_WRITE) {
-        p = pktqueue_dequeue(&iface->rx_queue);
-        if (p) {
-            rc = write(fd, p->buff, p->pkt_size);
-            if (rc - p->pkt_size)
-                fprintf(stderr, "%s: write error.\n", iface->name);
+    *more = 1;
+    return n;
+}
+
+/*
+ * Offload mode read. The tun_pi lands in the packet, the virtio_net_hdr on
+ * the side, and whatever does not fit the packet in the queue's scratch
+ * buffer, which only happens with super-packets. Those are then cut into
+ * packets from the pool, so reading waits until the pool holds enough of
+ * them for a whole super-packet.
+ */
+static int iface_read_vnet(struct iface_queue *q, int fd, int *more)
+{
+    struct iface *iface = q->iface;
+    struct pkt *batch[IFACE_TX_BATCH];
+    struct virtio_net_hdr vh;
+    struct tun_pi pi;
+    struct iovec iov[4];
+    struct pkt *p;
+    size_t room, len;
+    char *ip;
+    int nsegs;
+    int nbatch = 0;
+    int n, k;
+    int rc;
+
+    for (n = 0; n < iface_opts.budget; n += k) {
+        p = NULL;
+        if (pktring_count(q->tx_pool) >= q->pool_low &&
+            !iface_tx_blocked(q, nbatch))
+            p = pktring_dequeue(q->tx_pool);
+        if (!p) {
+            if (event_control(q->d, q->ev, EVCTL_READ_STALL))
+                n = -1;
+            goto out;
+        }
+
+        room = pkt_room(p) - sizeof (pi);
+        iov[0].iov_base = p->buff;
+        iov[0].iov_len = sizeof (pi);
+        iov[1].iov_base = &vh;
+        iov[1].iov_len = sizeof (vh);
+        iov[2].iov_base = p->buff + sizeof (pi);
+        iov[2].iov_len = room;
+        iov[3].iov_base = q->gso_buff + room;
+        iov[3].iov_len = q->gso_buff_size - room;
+
+        rc = readv(fd, iov, 4);
+        if (rc < (int)(sizeof (pi) + sizeof (vh))) {
+            if (rc >= 0 || errno != EAGAIN) {
+                fprintf(stderr, "%s: read error.\n", iface->name);
+                q->stats.errors++;
+            } else {
+                event_drained(q->d, q->ev, EVENT_READ);
+            }
+            pktring_putback(q->tx_pool, p);
+            goto out;
+        }
+        len = rc - sizeof (pi) - sizeof (vh);
+
+        if (vh.gso_type == VIRTIO_NET_HDR_GSO_NONE && len <= room) {
+            offload_csum(&vh, p->buff + sizeof (pi), len);
+            pkt_put(p, sizeof (pi) + len);
+            q->stats.tx_bytes += p->pkt_size;
+            pkt_set_compl(p, tx_complete, q);
+            iface_tx_add(iface, batch, &nbatch, p);
+            k = 1;
+            continue;
+        }
+
+        ip = q->gso_buff;
+        memcpy(ip, p->buff + sizeof (pi), room);
+        memcpy(&pi, p->buff, sizeof (pi));
+
+        nsegs = offload_tso_count(&vh, ip, len, room);
+        if (nsegs < 0) {
+            q->stats.drops++;
+            pktring_putback(q->tx_pool, p);
+            k = 0;
+            continue;
+        }
+        q->stats.tso_pkts++;
+
+        for (k = 0; k < nsegs; k++) {
+            if (k && !(p = pktring_dequeue(q->tx_pool))) {
+                q->stats.drops += nsegs - k;
+                break;
+            }
+            memcpy(pkt_put(p, sizeof (pi)), &pi, sizeof (pi));
+            pkt_put(p, offload_tso_segment(&vh, ip, len, k,
+                                           p->buff + sizeof (pi)));
+            q->stats.tx_bytes += p->pkt_size;
+            pkt_set_compl(p, tx_complete, q);
+            iface_tx_add(iface, batch, &nbatch, p);
+        }
+        q->stats.tso_segs += k;
+    }
+
+    *more = 1;
+out:
+    iface_tx_flush(iface, batch, &nbatch);
+    return n;
+}
+
+/*
+ * Offload mode write. Runs of segments of the same TCP stream are merged
+ * into super-packets, gathered straight from the packet buffers.
+ */
+static int iface_write_vnet(struct iface_queue *q, int fd, int *more)
+{
+    struct pkt *pkts[OFFLOAD_MAX_SEGS];
+    struct iovec iov[OFFLOAD_MAX_SEGS + 2];
+    struct offload_gro g;
+    uint64_t now = aqm_now();
+    size_t off;
+    int count, max;
+    int n, i, j;
+    int rc;
 
-            pkt_complete(p);
+    for (n = 0; n < iface_opts.budget; ) {
+        max = iface_opts.budget - n;
+        if (max > OFFLOAD_MAX_SEGS)
+            max = OFFLOAD_MAX_SEGS;
+        if (q->aqm.nflows) {
+            for (count = 0; count < max; count++) {
+                pkts[count] = aqm_dequeue(&q->aqm, q->rx_queue, now);
+                if (!pkts[count])
+                    break;
+            }
         } else {
-            rc = event_control(iface->d, iface->ev, EVCTL_WRITE_STALL);
-            if (rc)
-                return DISPATCH_ABORT;
+            count = pktring_dequeue_bulk(q->rx_queue, pkts, max);
+        }
+        if (!count) {
+            if (event_control(q->d, q->ev, EVCTL_WRITE_STALL))
+                return -1;
+            return n;
+        }
+
+        for (i = 0; i < count; i += g.count) {
+            offload_gro(pkts + i, count - i, &g);
+
+            iov[0].iov_base = pkts[i]->buff;
+            iov[0].iov_len = sizeof (struct tun_pi);
+            iov[1].iov_base = &g.vh;
+            iov[1].iov_len = sizeof (g.vh);
+            iov[2].iov_base = pkts[i]->buff + sizeof (struct tun_pi);
+            iov[2].iov_len = pkts[i]->pkt_size - sizeof (struct tun_pi);
+            off = sizeof (struct tun_pi) + g.vh.hdr_len;
+            for (j = 1; j < g.count; j++) {
+                iov[j + 2].iov_base = pkts[i + j]->buff + off;
+                iov[j + 2].iov_len = pkts[i + j]->pkt_size - off;
+            }
+
+            rc = writev(fd, iov, g.count + 2);
+            if (rc < 0 && errno == EAGAIN) {
+                offload_gro_undo(pkts[i], &g);
+                for (j = count; j-- > i; )
+                    pktring_putback(q->rx_queue, pkts[j]);
+                event_drained(q->d, q->ev, EVENT_WRITE);
+                return n;
+            }
+            if (rc < 0) {
+                fprintf(stderr, "%s: write error.\n", q->iface->name);
+                q->stats.errors++;
+            } else {
+                q->stats.rx_bytes += rc - sizeof (g.vh);
+            }
+
+            if (g.count > 1) {
+                q->stats.gro_pkts++;
+                q->stats.gro_segs += g.count;
+            }
+            for (j = 0; j < g.count; j++)
+                pkt_complete(pkts[i + j]);
+            n += g.count;
         }
     }
 
+    *more = 1;
+    return n;
+}
+
+static int iface_write_done(struct uring_req *req, int res,
+                            unsigned int flags)
+{
+    struct iface_write *w = (struct iface_write *)req;
+    struct iface_queue *q = w->q;
+    int i;
+
+    (void)flags;
+
+    if (res < 0 || (size_t)res != w->len) {
+        fprintf(stderr, "%s: write error.\n", q->iface->name);
+        q->stats.errors++;
+    } else {
+        q->stats.rx_bytes += res - (q->iface->vnet ? sizeof (w->vh) : 0);
+    }
+
+    for (i = 0; i < w->count; i++)
+        pkt_complete(w->pkts[i]);
+
+    w->next = q->free_writes;
+    q->free_writes = w;
+    q->nfree_writes++;
+    event_uring_ready(q->d, q->ev, EVENT_WRITE);
+
     return DISPATCH_CONTINUE;
 }
 
-int iface_event_start(struct iface *iface, struct dispatch *d)
+/*
+ * The packets a write takes, from the first of n: one, or in offload mode
+ * a run of segments merged as by iface_write_vnet().
+ */
+static void iface_write_prep(struct iface_queue *q, struct iface_write *w,
+                             struct pkt **pkts, int n)
+{
+    struct offload_gro g;
+    size_t off;
+    int j;
+
+    if (!q->iface->vnet) {
+        w->pkts[0] = pkts[0];
+        w->count = 1;
+        w->iov[0].iov_base = pkts[0]->buff;
+        w->iov[0].iov_len = pkts[0]->pkt_size;
+        w->iovcnt = 1;
+        w->len = pkts[0]->pkt_size;
+        return;
+    }
+
+    offload_gro(pkts, n, &g);
+    w->vh = g.vh;
+    w->iov[0].iov_base = pkts[0]->buff;
+    w->iov[0].iov_len = sizeof (struct tun_pi);
+    w->iov[1].iov_base = &w->vh;
+    w->iov[1].iov_len = sizeof (w->vh);
+    w->iov[2].iov_base = pkts[0]->buff + sizeof (struct tun_pi);
+    w->iov[2].iov_len = pkts[0]->pkt_size - sizeof (struct tun_pi);
+    w->len = sizeof (w->vh) + pkts[0]->pkt_size;
+    off = sizeof (struct tun_pi) + g.vh.hdr_len;
+    for (j = 1; j < g.count; j++) {
+        w->iov[j + 2].iov_base = pkts[j]->buff + off;
+        w->iov[j + 2].iov_len = pkts[j]->pkt_size - off;
+        w->len += w->iov[j + 2].iov_len;
+    }
+    w->iovcnt = g.count + 2;
+    memcpy(w->pkts, pkts, g.count * sizeof (w->pkts[0]));
+    w->count = g.count;
+
+    if (g.count > 1) {
+        q->stats.gro_pkts++;
+        q->stats.gro_segs += g.count;
+    }
+}
+
+/*
+ * Write up to the budget, and as many packets as there are requests to
+ * spare, with requests on the dispatch's io_uring. Returns the number of
+ * packets submitted, or -1 if the event could not be stalled.
+ */
+static int iface_write_uring(struct iface_queue *q, int fd, int *more)
+{
+    struct pkt *pkts[OFFLOAD_MAX_SEGS];
+    struct io_uring_sqe *sqe;
+    struct iface_write *w;
+    uint64_t now = aqm_now();
+    int count, max;
+    int n, i, j;
+
+    for (n = 0; n < iface_opts.budget; n += count) {
+        max = iface_opts.budget - n;
+        if (max > OFFLOAD_MAX_SEGS)
+            max = OFFLOAD_MAX_SEGS;
+        if (max > q->nfree_writes)
+            max = q->nfree_writes;
+        if (!max) {
+            event_drained(q->d, q->ev, EVENT_WRITE);
+            return n;
+        }
+
+        for (count = 0; count < max; count++) {
+            pkts[count] = aqm_dequeue(&q->aqm, q->rx_queue, now);
+            if (!pkts[count])
+                break;
+        }
+        if (!count) {
+            if (event_control(q->d, q->ev, EVCTL_WRITE_STALL))
+                return -1;
+            return n;
+        }
+
+        for (i = 0; i < count; i += w->count) {
+            w = q->free_writes;
+            sqe = event_uring_sqe(q->d, q->ev, &w->req);
+            if (!sqe) {
+                for (j = count; j-- > i; )
+                    pktring_putback(q->rx_queue, pkts[j]);
+                return -1;
+            }
+            q->free_writes = w->next;
+            q->nfree_writes--;
+
+            iface_write_prep(q, w, pkts + i, count - i);
+            sqe->opcode = IORING_OP_WRITEV;
+            sqe->fd = fd;
+            sqe->addr = (uintptr_t)w->iov;
+            sqe->len = w->iovcnt;
+        }
+    }
+
+    *more = 1;
+    return n;
+}
+
+static int iface_event_handler(int fd, unsigned short flags, void *priv)
+{
+    struct iface_queue *q = priv;
+    int more = 0;
+    int total = 0;
+    int bucket;
+    int rc;
+
+    if (flags & EVENT_READ) {
+        if (q->iface->vnet)
+            rc = iface_read_vnet(q, fd, &more);
+        else
+            rc = iface_read(q, fd, &more);
+        if (rc < 0)
+            return DISPATCH_ABORT;
+        q->stats.tx_pkts += rc;
+        total += rc;
+    }
+
+    if (flags & EVENT_WRITE) {
+        if (q->writes)
+            rc = iface_write_uring(q, fd, &more);
+        else if (q->iface->vnet)
+            rc = iface_write_vnet(q, fd, &more);
+        else
+            rc = iface_write(q, fd, &more);
+        if (rc < 0)
+            return DISPATCH_ABORT;
+        q->stats.rx_pkts += rc;
+        total += rc;
+    }
+
+    q->stats.wakeups++;
+    for (bucket = 0; total && bucket < IFACE_BURST_BUCKETS - 1; bucket++)
+        total >>= 1;
+    q->stats.burst[bucket]++;
+
+    /*
+     * Out of budget with the device possibly still ready: give the other
+     * handlers a turn. The event fires again, level-triggered, or stays on
+     * the ready list, edge-triggered.
+     */
+    if (more)
+        q->stats.budget_hits++;
+
+    return DISPATCH_CONTINUE;
+}
+
+static void iface_stats_add(struct iface_stats *st, struct iface_stats *q)
+{
+    int i;
+
+    st->wakeups += q->wakeups;
+    st->tx_pkts += q->tx_pkts;
+    st->rx_pkts += q->rx_pkts;
+    st->tx_bytes += q->tx_bytes;
+    st->rx_bytes += q->rx_bytes;
+    st->errors += q->errors;
+    st->budget_hits += q->budget_hits;
+    st->tso_pkts += q->tso_pkts;
+    st->tso_segs += q->tso_segs;
+    st->gro_pkts += q->gro_pkts;
+    st->gro_segs += q->gro_segs;
+    st->drops += q->drops;
+    st->ring_drops += q->ring_drops;
+    if (q->rx_hiwat > st->rx_hiwat)
+        st->rx_hiwat = q->rx_hiwat;
+    st->aqm_drops += q->aqm_drops;
+    st->ecn_marks += q->ecn_marks;
+    st->credit_stalls += q->credit_stalls;
+    if (q->sojourn_ns > st->sojourn_ns)
+        st->sojourn_ns = q->sojourn_ns;
+    for (i = 0; i < IFACE_BURST_BUCKETS; i++)
+        st->burst[i] += q->burst[i];
+}
+
+static void iface_stats_fprint(const char *name, struct iface_stats *st,
+                               FILE *f)
+{
+    int i;
+
+    fprintf(f, "%s: %lu wakeups, %lu packets read, %lu written, "
+               "%lu out of budget\n",
+            name, st->wakeups, st->tx_pkts, st->rx_pkts, st->budget_hits);
+    fprintf(f, "%s: %lu bytes read, %lu written, %lu errors\n",
+            name, st->tx_bytes, st->rx_bytes, st->errors);
+    fprintf(f, "%s: at most %lu packets waiting to be written, "
+               "%lu dropped on a full queue\n",
+            name, st->rx_hiwat, st->ring_drops);
+    if (aqm_opts.mode)
+        fprintf(f, "%s: %lu packets to write dropped and %lu marked by "
+                   "queue management\n",
+                name, st->aqm_drops, st->ecn_marks);
+    if (st->credit_stalls)
+        fprintf(f, "%s: reading stopped %lu times for want of credit\n",
+                name, st->credit_stalls);
+    if (st->tso_pkts || st->gro_pkts || st->drops)
+        fprintf(f, "%s: %lu super-packets read (%lu segments), "
+                   "%lu written (%lu segments), %lu dropped\n",
+                name, st->tso_pkts, st->tso_segs, st->gro_pkts, st->gro_segs,
+                st->drops);
+    fprintf(f, "%s: packets per wakeup:", name);
+    for (i = 0; i < IFACE_BURST_BUCKETS; i++) {
+        if (!i)
+            fprintf(f, " 0:%lu", st->burst[i]);
+        else
+            fprintf(f, " %d+:%lu", 1 << (i - 1), st->burst[i]);
+    }
+    fprintf(f, "\n");
+}
+
+/*
+ * Counters are plain stores by the thread running the queue, so from any
+ * other thread they are a snapshot that may be a little behind.
+ */
+void iface_queue_stats_get(struct iface_queue *q, struct iface_stats *st)
+{
+    *st = q->stats;
+    st->ring_drops = __atomic_load_n(&q->stats.ring_drops, __ATOMIC_RELAXED);
+    st->rx_hiwat = __atomic_load_n(&q->rx_queue->hiwat, __ATOMIC_RELAXED);
+    st->aqm_drops = q->aqm.stats.drops;
+    st->ecn_marks = q->aqm.stats.marks;
+    st->sojourn_ns = q->aqm.stats.sojourn_ns;
+}
+
+void iface_stats_get(struct iface *iface, struct iface_stats *st)
+{
+    struct iface_stats qst;
+    int i;
+
+    memset(st, 0, sizeof (*st));
+    for (i = 0; i < iface->nqueues; i++) {
+        iface_queue_stats_get(&iface->queues[i], &qst);
+        iface_stats_add(st, &qst);
+    }
+}
+
+/* Packets read from the device so far, cheap enough to poll from timers */
+unsigned long iface_tx_pkts(struct iface *iface)
+{
+    unsigned long n = 0;
+    int i;
+
+    for (i = 0; i < iface->nqueues; i++)
+        n += __atomic_load_n(&iface->queues[i].stats.tx_pkts,
+                             __ATOMIC_RELAXED);
+
+    return n;
+}
+
+/* Packets waiting to be written, same */
+unsigned long iface_rx_queued(struct iface *iface)
+{
+    struct iface_queue *q;
+    unsigned long n = 0;
+    int i;
+
+    for (i = 0; i < iface->nqueues; i++) {
+        q = &iface->queues[i];
+        n += aqm_count(&q->aqm, q->rx_queue);
+    }
+
+    return n;
+}
+
+/* Limit reads to what the transport may take, before the events start */
+void iface_set_credit(struct iface *iface, long credit)
+{
+    iface->credit = 1;
+    iface->tx_credit = credit;
+}
+
+void iface_add_credit(struct iface *iface, long credit)
+{
+    struct iface_queue *q;
+    int i;
+
+    if (__atomic_add_fetch(&iface->tx_credit, credit, __ATOMIC_SEQ_CST) <= 0)
+        return;
+
+    for (i = 0; i < iface->nqueues; i++) {
+        q = &iface->queues[i];
+        if (__atomic_exchange_n(&q->credit_stalled, 0, __ATOMIC_SEQ_CST) &&
+            q->d)
+            event_control(q->d, q->ev, EVCTL_READ_RESTART);
+    }
+}
+
+void iface_stats_print(struct iface *iface, FILE *f)
 {
-    iface->ev = event_create(d, iface->fd, EVENT_READ, iface_event_handler,
-                             iface);
-    if (!iface->ev)
+    struct iface_stats st, qst;
+    char name[IFNAMSIZ + 16];
+    int i;
+
+    iface_stats_get(iface, &st);
+    iface_stats_fprint(iface->name, &st, f);
+
+    if (iface->nqueues == 1)
+        return;
+
+    for (i = 0; i < iface->nqueues; i++) {
+        snprintf(name, sizeof (name), "%s/q%d", iface->name, i);
+        iface_queue_stats_get(&iface->queues[i], &qst);
+        iface_stats_fprint(name, &qst, f);
+    }
+}
+
+static void iface_queue_writes_free(struct iface_queue *q)
+{
+    free(q->writes);
+    q->writes = NULL;
+    q->free_writes = NULL;
+    q->nfree_writes = 0;
+}
+
+/* Reads are still polled for, on io_uring too */
+static int iface_queue_start(struct iface_queue *q, struct dispatch *d)
+{
+    unsigned short flags = EVENT_READ;
+    int i;
+
+    if (dispatch_opts.edge_triggered)
+        flags |= EVENT_EDGE_TRIGGERED;
+
+    if (d->ring) {
+        q->writes = calloc(IFACE_URING_WRITES, sizeof (*q->writes));
+        if (!q->writes)
+            return -1;
+        for (i = 0; i < IFACE_URING_WRITES; i++) {
+            q->writes[i].req.handler = iface_write_done;
+            q->writes[i].q = q;
+            q->writes[i].next = q->free_writes;
+            q->free_writes = &q->writes[i];
+        }
+        q->nfree_writes = IFACE_URING_WRITES;
+        flags |= EVENT_URING_WRITE;
+    }
+
+    q->ev = event_create(d, q->fd, flags, iface_event_handler, q);
+    if (!q->ev) {
+        iface_queue_writes_free(q);
         return -1;
+    }
 
-    iface->d = d;
+    q->d = d;
 
     return 0;
 }
 
+/* Deleting the event, or cleaning up the dispatch, completes the writes */
+static void iface_queue_stop(struct iface *iface, struct iface_queue *q)
+{
+    if (iface->threaded) {
+        dispatch_stop(q->d);
+        pthread_join(q->thread, NULL);
+        dispatch_cleanup(q->d);
+    } else {
+        event_delete(q->d, q->ev);
+    }
+    iface_queue_writes_free(q);
+    q->d = NULL;
+}
+
+/*
+ * A single queue is served from the caller's dispatch. With multiple queues,
+ * every queue gets a dispatch and a thread of its own.
+ */
+int iface_event_start(struct iface *iface, struct dispatch *d)
+{
+    struct iface_queue *q;
+    int i;
+
+    if (iface->nqueues == 1)
+        return iface_queue_start(&iface->queues[0], d);
+
+    iface->threaded = 1;
+    for (i = 0; i < iface->nqueues; i++) {
+        q = &iface->queues[i];
+
+        if (dispatch_init(&q->own_d))
+            goto error;
+        if (iface_queue_start(q, &q->own_d)) {
+            dispatch_cleanup(&q->own_d);
+            goto error;
+        }
+        if (dispatch_spawn(&q->own_d, &q->thread)) {
+            dispatch_cleanup(&q->own_d);
+            iface_queue_writes_free(q);
+            q->d = NULL;
+            goto error;
+        }
+    }
+
+    return 0;
+
+error:
+    while (i--)
+        iface_queue_stop(iface, &iface->queues[i]);
+    iface->threaded = 0;
+    return -1;
+}
+
 void iface_event_stop(struct iface *iface)
 {
-    event_delete(iface->d, iface->ev);
-    iface->d = NULL;
+    int i;
+
+    for (i = 0; i < iface->nqueues; i++)
+        iface_queue_stop(iface, &iface->queues[i]);
+    iface->threaded = 0;
 }
 
 static int setnonblock(int fd)
@@ -136,8 +907,9 @@ static int setnonblock(int fd)
     return fcntl(fd, F_SETFL, fl | O_NONBLOCK);
 }
 
-static void set_mtu(struct ifreq *ifr, int mtu)
+static void tun_set_mtu(struct iface *iface, int mtu)
 {
+    struct ifreq ifr;
     int sock;
     int rc;
 
@@ -147,81 +919,278 @@ static void set_mtu(struct ifreq *ifr, int mtu)
         return;
     }
 
-    ifr->ifr_flags = 0;
-    ifr->ifr_mtu = mtu;
-    rc = ioctl(sock, SIOCSIFMTU, ifr);
+    memset(&ifr, 0, sizeof (ifr));
+    strncpy(ifr.ifr_name, iface->name, IFNAMSIZ);
+    ifr.ifr_mtu = mtu;
+    rc = ioctl(sock, SIOCSIFMTU, &ifr);
     if (rc) {
-        fprintf(stderr, "Failed to set MTU on %s: %s\n", ifr->ifr_name,
+        fprintf(stderr, "Failed to set MTU on %s: %s\n", ifr.ifr_name,
                 strerror(errno));
     }
 
     close(sock);
 }
 
-struct iface *iface_create(int pool_sz, size_t mtu)
+/*
+ * Keep the kernel from building super-packets of more segments than a read
+ * makes room for. Kernels that do not let it be set still have those
+ * dropped on reading.
+ */
+static void tun_set_gso_max_segs(struct iface *iface, uint32_t segs)
 {
-    struct iface *iface;
+    struct {
+        struct nlmsghdr nh;
+        struct ifinfomsg ifi;
+        struct rtattr rta;
+        uint32_t segs;
+    } req;
+    struct {
+        struct nlmsghdr nh;
+        struct nlmsgerr err;
+    } ack;
     struct ifreq ifr;
+    int sock;
     int rc;
-    int i;
 
-    iface = calloc(1, sizeof (*iface));
-    if (!iface)
-        return NULL;
+    sock = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+    if (sock < 0) {
+        fprintf(stderr, "socket(): %s\n", strerror(errno));
+        return;
+    }
+
+    memset(&ifr, 0, sizeof (ifr));
+    strncpy(ifr.ifr_name, iface->name, IFNAMSIZ);
+    rc = ioctl(sock, SIOCGIFINDEX, &ifr);
+    if (rc)
+        goto out;
+
+    memset(&req, 0, sizeof (req));
+    req.nh.nlmsg_len = sizeof (req);
+    req.nh.nlmsg_type = RTM_NEWLINK;
+    req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    req.ifi.ifi_family = AF_UNSPEC;
+    req.ifi.ifi_index = ifr.ifr_ifindex;
+    req.rta.rta_type = IFLA_GSO_MAX_SEGS;
+    req.rta.rta_len = RTA_LENGTH(sizeof (req.segs));
+    req.segs = segs;
 
-    iface->fd = open("/dev/net/tun", O_RDWR);
-    if (iface->fd < 0) {
+    rc = -1;
+    if (send(sock, &req, sizeof (req), 0) != sizeof (req) ||
+        recv(sock, &ack, sizeof (ack), 0) < (ssize_t)sizeof (ack))
+        goto out;
+    rc = 0;
+    if (ack.nh.nlmsg_type == NLMSG_ERROR && ack.err.error) {
+        errno = -ack.err.error;
+        rc = -1;
+    }
+
+out:
+    if (rc)
+        fprintf(stderr, "%s: failed to limit super-packets to %u segments: "
+                "%s\n", iface->name, segs, strerror(errno));
+    close(sock);
+}
+
+static int tun_open(struct iface *iface, int multi)
+{
+    struct ifreq ifr;
+    int fd;
+    int rc;
+
+    fd = open("/dev/net/tun", O_RDWR);
+    if (fd < 0) {
         fprintf(stderr, "Failed to open /dev/net/tun: %s\n", strerror(errno));
-        free(iface);
-        return NULL;
+        return -1;
     }
-    setnonblock(iface->fd);
+    setnonblock(fd);
 
     memset(&ifr, 0, sizeof (ifr));
     ifr.ifr_flags = IFF_TUN;
-    strncpy(ifr.ifr_name, "tun%d", IFNAMSIZ);
+    if (multi)
+        ifr.ifr_flags |= IFF_MULTI_QUEUE;
+    if (iface_opts.offload)
+        ifr.ifr_flags |= IFF_VNET_HDR;
+    if (iface->name[0])
+        strncpy(ifr.ifr_name, iface->name, IFNAMSIZ);
+    else
+        strncpy(ifr.ifr_name, "tun%d", IFNAMSIZ);
 
-    rc = ioctl(iface->fd, TUNSETIFF, &ifr);
+    rc = ioctl(fd, TUNSETIFF, &ifr);
     if (rc) {
         fprintf(stderr, "Failed to create tunnel interface: %s\n",
                 strerror(errno));
-        close(iface->fd);
-        free(iface);
-        return NULL;
+        close(fd);
+        return -1;
     }
 
     strcpy(iface->name, ifr.ifr_name);
 
-    set_mtu(&ifr, mtu);
+    /*
+     * Without the offloads the kernel keeps segmenting and checksumming
+     * itself, the virtio_net_hdr is then merely empty.
+     */
+    if (iface_opts.offload) {
+        iface->vnet = 1;
+        rc = ioctl(fd, TUNSETOFFLOAD,
+                   TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO_ECN);
+        if (rc)
+            fprintf(stderr, "%s: failed to enable offloads: %s\n",
+                    iface->name, strerror(errno));
+        else
+            tun_set_gso_max_segs(iface, OFFLOAD_MAX_SEGS);
+    }
+
+    return fd;
+}
+
+const struct iface_backend iface_tun_backend = {
+    .name = "tun",
+    .open = tun_open,
+    .set_mtu = tun_set_mtu,
+};
+
+static void iface_queue_free(struct iface_queue *q)
+{
+    struct pkt *p;
+
+    if (q->tx_pool) {
+        while ((p = pktring_dequeue(q->tx_pool))) {
+            pkt_free(p);
+        }
+        pktring_destroy(q->tx_pool);
+    }
+    if (q->rx_queue) {
+        while ((p = pktring_dequeue(q->rx_queue))) {
+            pkt_free(p);
+        }
+        pktring_destroy(q->rx_queue);
+    }
+    while ((p = aqm_drain(&q->aqm))) {
+        pkt_free(p);
+    }
+    aqm_cleanup(&q->aqm);
 
-    pktqueue_init(&iface->rx_queue);
-    pktqueue_init(&iface->tx_pool);
-    for (i = 0; i < pool_sz; i++) {
-        struct pkt *p = pkt_alloc(mtu + sizeof (struct tun_pi));
+    free(q->gso_buff);
+    close(q->fd);
+}
+
+/*
+ * A queue running on the caller's dispatch only ever exchanges packets with
+ * that thread. Queues with threads of their own get MPMC rings, since the
+ * transport threads feed them and complete their packets concurrently, and
+ * so do all queues when the worker pool does the same, or when the hub
+ * shares the interface between peers of every transport shard.
+ */
+static int iface_queue_init(struct iface *iface, struct iface_queue *q,
+                            int pool_sz, size_t mtu, size_t headroom,
+                            size_t tailroom)
+{
+    int mode = iface->nqueues > 1 || workers_enabled() || hub_enabled() ?
+               PKTRING_MPMC : PKTRING_SPSC;
+    int j;
+
+    q->iface = iface;
+    q->fd = iface_opts.backend->open(iface, iface->nqueues > 1);
+    if (q->fd < 0)
+        return -1;
+
+    q->tx_pool = pktring_create(pool_sz, mode);
+    q->rx_queue = pktring_create(IFACE_RING_SZ, mode);
+    if (!q->tx_pool || !q->rx_queue)
+        goto error;
+    if (aqm_init(&q->aqm, IFACE_AQM_FLOWS, IFACE_RING_SZ, aqm_opts.ecn))
+        goto error;
+
+    q->pool_low = 1;
+    if (iface->vnet) {
+        q->gso_buff_size = mtu + IP_MAXPACKET;
+        q->gso_buff = malloc(q->gso_buff_size);
+        if (!q->gso_buff)
+            goto error;
+        q->pool_low = pool_sz < OFFLOAD_MAX_SEGS ? pool_sz : OFFLOAD_MAX_SEGS;
+    }
+
+    for (j = 0; j < pool_sz; j++) {
+        struct pkt *p = pkt_alloc_room(mtu + sizeof (struct tun_pi),
+                                       headroom, tailroom);
 
         if (!p)
             break;
-        pktqueue_enqueue(&iface->tx_pool, p);
+        pktring_enqueue(q->tx_pool, p);
     }
 
-    fprintf(stdout, "%s created.\n", iface->name);
+    return 0;
+
+error:
+    iface_queue_free(q);
+    return -1;
+}
+
+/*
+ * Takes effect on the device straight away. Pool packets are not resized:
+ * the interface must have been created with the largest MTU ever set.
+ */
+void iface_set_mtu(struct iface *iface, int mtu)
+{
+    iface_opts.backend->set_mtu(iface, mtu);
+    iface->mtu = mtu;
+}
+
+/*
+ * Pool packets are sized for the MTU, and reserve headroom and tailroom
+ * bytes, which reads leave free for whatever the transport prepends and
+ * appends.
+ */
+struct iface *iface_create(int pool_sz, size_t mtu, size_t headroom,
+                           size_t tailroom)
+{
+    struct iface *iface;
+    int nqueues = iface_opts.queues;
+    int i;
+
+#ifndef USE_LOCKS
+    if (nqueues > 1) {
+        fprintf(stderr, "Multiple queues need a build with USE_LOCKS.\n");
+        nqueues = 1;
+    }
+#endif
+
+    iface = calloc(1, sizeof (*iface) + nqueues * sizeof (iface->queues[0]));
+    if (!iface)
+        return NULL;
+    iface->nqueues = nqueues;
+
+    for (i = 0; i < nqueues; i++) {
+        if (iface_queue_init(iface, &iface->queues[i], pool_sz, mtu,
+                             headroom, tailroom))
+            goto error;
+    }
+
+    iface_set_mtu(iface, mtu);
+
+    if (nqueues > 1)
+        fprintf(stdout, "%s created with %d queues.\n", iface->name, nqueues);
+    else
+        fprintf(stdout, "%s created.\n", iface->name);
 
     return iface;
+
+error:
+    while (i--)
+        iface_queue_free(&iface->queues[i]);
+    free(iface);
+    return NULL;
 }
 
 void iface_destroy(struct iface *iface)
 {
-    struct pkt *p;
+    int i;
 
     fprintf(stdout, "destroy %s\n", iface->name);
+    iface_stats_print(iface, stdout);
 
-    while ((p = pktqueue_dequeue(&iface->tx_pool))) {
-        pkt_free(p);
-    }
-    while ((p = pktqueue_dequeue(&iface->rx_queue))) {
-        pkt_free(p);
-    }
+    for (i = 0; i < iface->nqueues; i++)
+        iface_queue_free(&iface->queues[i]);
 
-    close(iface->fd);
     free(iface);
 }
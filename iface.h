@@ -33,38 +33,147 @@
 #ifndef IFACE_H_
 #define IFACE_H_
 
+#include <stdio.h>
 #include <netinet/in.h>
 #include <sys/queue.h>
 #include <linux/if.h>
+#include <pthread.h>
 
 #include "events.h"
 #include "pktqueue.h"
+#include "pktring.h"
+#include "aqm.h"
 
 typedef void (*tx_handler_t)(struct pkt *, void *);
+typedef void (*iface_tx_handler_t)(struct pkt **, int, void *);
 
-struct iface
+#define IFACE_BUDGET_DEFAULT 32
+#define IFACE_TX_BATCH 32    /* Most packets handed over per tx_handler call */
+#define IFACE_BURST_BUCKETS 10
+#define IFACE_MAX_QUEUES 16
+#define IFACE_RING_SZ 1024   /* Packets waiting to be written, per queue */
+#define IFACE_AQM_FLOWS 1024 /* Sub-queues of each, with fair queueing */
+
+struct iface;
+struct iface_write;
+
+/*
+ * What the tunnel device is. Each queue is a non-blocking descriptor moving
+ * one packet, tun_pi first, per read and write; the virtio_net_hdr follows
+ * the tun_pi if the backend set iface->vnet when opening it.
+ */
+struct iface_backend
 {
-    char name[IFNAMSIZ];
+    const char *name;
+    int (*open)(struct iface *iface, int multi);   /* Names iface if unset */
+    void (*set_mtu)(struct iface *iface, int mtu);
+};
+
+extern const struct iface_backend iface_tun_backend;
+
+struct iface_opts
+{
+    const struct iface_backend *backend;
+    int budget;         /* Packets moved per direction per wakeup */
+    int queues;         /* IFF_MULTI_QUEUE queues, one thread each if > 1 */
+    int offload;        /* IFF_VNET_HDR with checksum and TSO offloads */
+};
+
+struct iface_stats
+{
+    unsigned long wakeups;
+    unsigned long tx_pkts;      /* Read from the device */
+    unsigned long rx_pkts;      /* Written to the device */
+    unsigned long tx_bytes;     /* Same, tun_pi included */
+    unsigned long rx_bytes;
+    unsigned long errors;       /* Failed reads and writes */
+    unsigned long budget_hits;  /* Wakeups that left work behind */
+
+    /* Offload mode only */
+    unsigned long tso_pkts;     /* Super-packets read */
+    unsigned long tso_segs;     /* Segments they were cut into */
+    unsigned long gro_pkts;     /* Super-packets written */
+    unsigned long gro_segs;     /* Packets merged into them */
+    unsigned long drops;        /* Segments lost for want of a buffer */
+
+    unsigned long ring_drops;   /* Packets to write that found no room */
+    unsigned long rx_hiwat;     /* Most packets ever waiting to be written */
+    unsigned long aqm_drops;    /* Packets to write queue management dropped */
+    unsigned long ecn_marks;    /* Those it marked Congestion Experienced */
+    unsigned long sojourn_ns;   /* Wait of the last packet written */
+    unsigned long credit_stalls;    /* Reads stopped for want of credit */
+
+    /* burst[i]: wakeups that moved [2^(i-1), 2^i) packets, burst[0]: none */
+    unsigned long burst[IFACE_BURST_BUCKETS];
+};
+
+extern struct iface_opts iface_opts;
+
+struct iface_queue
+{
+    struct iface *iface;
     int fd;
 
-    struct pktqueue tx_pool;
-    struct pktqueue rx_queue;
+    struct pktring *tx_pool;
+    struct pktring *rx_queue;
+    struct aqm aqm;             /* Decides what of rx_queue gets written */
 
-    tx_handler_t tx_handler;
-    void *tx_priv;
+    /* Reading stalls below this many pooled packets, or credit for them */
+    size_t pool_low;
+    int credit_stalled;         /* Or for want of credit, until given some */
+
+    /* Offload mode: tail of the super-packets that do not fit a packet */
+    char *gso_buff;
+    size_t gso_buff_size;
 
     struct event *ev;
     struct dispatch *d;
+
+    /* Writes done on the dispatch's io_uring, if it runs on one */
+    struct iface_write *writes;
+    struct iface_write *free_writes;
+    int nfree_writes;
+
+    /* Only used when the queue runs its own dispatch thread */
+    struct dispatch own_d;
+    pthread_t thread;
+
+    struct iface_stats stats;
+};
+
+struct iface
+{
+    char name[IFNAMSIZ];
+
+    iface_tx_handler_t tx_handler;
+    void *tx_priv;
+
+    int vnet;           /* Every read and write carries a virtio_net_hdr */
+    int mtu;            /* Current, pool packets may be sized for more */
+    int credit;         /* Reads are limited by tx_credit */
+    long tx_credit;     /* Packets the transport may still take */
+    int nqueues;
+    int threaded;
+    struct iface_queue queues[];
 };
 
 int iface_rx_schedule(struct iface *iface, struct pkt *p);
-struct iface *iface_create(int pool_sz, size_t mtu);
+struct iface *iface_create(int pool_sz, size_t mtu, size_t headroom,
+                           size_t tailroom);
 void iface_destroy(struct iface *iface);
+void iface_set_mtu(struct iface *iface, int mtu);
 int iface_event_start(struct iface *iface, struct dispatch *d);
 void iface_event_stop(struct iface *iface);
+void iface_queue_stats_get(struct iface_queue *q, struct iface_stats *st);
+void iface_stats_get(struct iface *iface, struct iface_stats *st);
+unsigned long iface_tx_pkts(struct iface *iface);
+unsigned long iface_rx_queued(struct iface *iface);
+void iface_set_credit(struct iface *iface, long credit);
+void iface_add_credit(struct iface *iface, long credit);
+void iface_stats_print(struct iface *iface, FILE *f);
 
 static inline void iface_set_tx(struct iface *iface,
-                                tx_handler_t tx_handler,
+                                iface_tx_handler_t tx_handler,
                                 void *priv)
 {
     iface->tx_handler = tx_handler;
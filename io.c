@@ -30,156 +30,1884 @@
  *  SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <errno.h>
 #include <string.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/udp.h>
+#include <linux/if_ether.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
 
 #include "pktqueue.h"
+#include "pktring.h"
+#include "pktslab.h"
 #include "events.h"
+#include "uring.h"
+#include "iface.h"
 #include "peer.h"
+#include "hub.h"
+#include "aqm.h"
+#include "metrics.h"
+#include "io.h"
 
-static int listen_mode;
-static struct pktqueue rx_pool;
-static struct pktqueue tx_queue;
-static struct dispatch evt_dispatch;
-static struct event *socket_event;
+#ifndef IP_MTU
+# define IP_MTU 14
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+# define SO_PREFER_BUSY_POLL 69
+#endif
+
+struct io_opts io_opts = {
+    .backend = &io_udp_backend,
+    .batch = IO_BATCH_DEFAULT,
+    .shards = 1,
+    .weight = 1,
+};
+
+struct io_flow;
+struct io_ring;
+
+/*
+ * One shard per transport socket. Every shard owns its socket, packet pools,
+ * dispatch and peers, and is only ever touched by the thread running it, but
+ * for the list of flows with packets to send, which any thread may add to.
+ */
+struct io_shard
+{
+    struct io *io;
+    int fd;
+    struct pktring *rx_pool;
+    lock_t flows_lock;
+    TAILQ_HEAD(, io_flow) flows;
+    struct io_flow *cur;            /* Being served, off the list */
+    SIMPLEQ_HEAD(, pkt) unsent;     /* Scheduled, not taken by the kernel */
+    struct dispatch d;
+    struct event *ev;
+    struct peer_table peers;
+    struct io_stats stats;
+    pthread_t thread;
+
+    /* UDP offloads the kernel accepted for this socket */
+    int gso;
+    int gro;
+    char *gro_buff;
+
+    /* Receiving stalls below this many pooled packets */
+    size_t pool_low;
+
+    /* Socket I/O done on the dispatch's io_uring, if it runs on one */
+    struct io_ring *ring;
+};
+
+/* One tunnel endpoint: a client with its server, or a listener */
+struct io
+{
+    int listen_mode;
+    struct io_shard *shards;
+    int nshards;
+};
 
 #define PKT_POOL_SZ 1024
 #define PKT_BUFF_SZ 1600
 
+/* Largest datagram a receive buffer holds whole, IP and UDP headers aside */
+#define IO_MTU_MAX (PKT_BUFF_SZ + 20 + 8)
+
+/* Packets waiting to be sent, per peer */
+#define IO_FLOW_RING_SZ 512
+
+/* Bytes a flow of weight 1 may send per round, enough for any packet */
+#define IO_FLOW_QUANTUM PKT_BUFF_SZ
+#define IO_FLOW_AQM_FLOWS 64    /* Sub-queues of each, with fair queueing */
+
+/* GRO messages received per call, each into a buffer of its own */
+#define IO_GRO_BATCH 8
+#define IO_GRO_BUFF_SZ 65536
+
+/* Largest UDP payload of a GSO message over IPv4 */
+#define IO_GSO_MAX_BYTES (65535 - 20 - 8)
+
+/*
+ * On io_uring, datagrams come in through a single multishot recvmsg, each
+ * into a pool packet the kernel picks from the shard's buffer ring, and go
+ * out as sendmsg requests, one per message, all submitted with the
+ * dispatch's next wait. What recvmsg reports and the sender's name land in
+ * the packet's headroom, in front of the data.
+ */
+#define IO_RING_TX_MSGS 128
+#define IO_RING_RX_HDR \
+    (sizeof (struct io_uring_recvmsg_out) + sizeof (struct sockaddr_in))
+
+struct io_ring_msg
+{
+    struct uring_req req;
+    struct io_shard *s;
+    struct msghdr msg;
+    struct sockaddr_in dst;
+    struct iovec iov[IO_GSO_MAX_SEGS];
+    char ctrl[CMSG_SPACE(sizeof (uint16_t))];
+    struct pkt *pkts[IO_GSO_MAX_SEGS];
+    int count;
+    size_t bytes;
+    struct io_ring_msg *next;       /* Free */
+};
+
+struct io_ring
+{
+    struct uring_req rx_req;
+    struct io_shard *s;
+    struct msghdr rx_msg;
+    int rx_armed;
+
+    /* Pool packets the kernel holds, by buffer id, and the ids left */
+    struct uring_bufs bufs;
+    struct pkt *bufs_pkts[PKT_POOL_SZ];
+    unsigned short free_bids[PKT_POOL_SZ];
+    int nfree_bids;
+
+    /* Received, not handed over to their peers yet */
+    struct pkt *rx_pkts[IO_BATCH_MAX];
+    struct sockaddr_in rx_srcs[IO_BATCH_MAX];
+    int nrx;
+
+    struct io_ring_msg *tx_free;
+    int tx_nfree;
+    struct io_ring_msg tx_msgs[IO_RING_TX_MSGS];
+};
+
 static void rx_complete(struct pkt *p, void *priv)
 {
-    (void)priv;
+    struct io_shard *s = priv;
+
+    pkt_reset(p);
+    pktring_enqueue(s->rx_pool, p);
+    if (pktring_count(s->rx_pool) >= s->pool_low)
+        event_control(&s->d, s->ev, EVCTL_READ_RESTART);
+}
+
+/*
+ * Every peer queues the packets it sends on a flow of its own, and the
+ * shard's socket serves them deficit round robin (Shreedhar & Varghese):
+ * flows with packets waiting take turns, each turn crediting the flow with
+ * its quantum of bytes and sending packets for as long as the credit lasts.
+ * What a flow does not use carries over to its next turn, unless it runs
+ * out of packets. A peer filling the link thus only ever delays the others
+ * by one turn of its own, and bandwidth is shared in proportion to weights
+ * whatever the packet sizes.
+ *
+ * A flow is on the shard's list, or being served, for as long as active is
+ * set; whoever sets it puts the flow on the list, so that picking the next
+ * one is always a matter of taking the head.
+ *
+ * Queue management, if any, sits between a flow's ring and the scheduler:
+ * the packets it lets through are what the flow has to send.
+ */
+struct io_flow
+{
+    struct io_shard *shard;
+    struct peer *peer;
+    struct pktring *queue;
+    struct aqm aqm;
+    TAILQ_ENTRY(io_flow) link;
+    int active;
+    int quantum;
+    long deficit;
+    unsigned long drops;
+};
 
-    p->pkt_size = 0;
-    pktqueue_enqueue(&rx_pool, p);
-    event_control(&evt_dispatch, socket_event, EVCTL_READ_RESTART);
+/* <weight>[@<address>] */
+int io_parse_weight(const char *s)
+{
+    char addr[INET_ADDRSTRLEN];
+    struct io_weight *w;
+    int weight;
+    char c;
+    int rc;
+
+    rc = sscanf(s, "%d@%15[0-9.]%c", &weight, addr, &c);
+    if ((rc != 1 && rc != 2) || weight < 1 || weight > IO_WEIGHT_MAX)
+        return -1;
+    if (rc == 1) {
+        io_opts.weight = weight;
+        return 0;
+    }
+
+    if (io_opts.nweights == IO_WEIGHTS_MAX)
+        return -1;
+    w = &io_opts.weights[io_opts.nweights];
+    if (!inet_aton(addr, &w->addr))
+        return -1;
+    w->weight = weight;
+    io_opts.nweights++;
+
+    return 0;
+}
+
+static int io_flow_weight(struct sockaddr_in *addr)
+{
+    int i;
+
+    for (i = 0; i < io_opts.nweights; i++) {
+        if (io_opts.weights[i].addr.s_addr == addr->sin_addr.s_addr)
+            return io_opts.weights[i].weight;
+    }
+
+    return io_opts.weight;
+}
+
+static struct io_flow *io_flow_create(struct io_shard *s,
+                                      struct sockaddr_in *addr)
+{
+    struct io_flow *f;
+
+    f = calloc(1, sizeof (*f));
+    if (!f)
+        return NULL;
+
+    /* Filled by the same threads as give packets back to the pool */
+    f->queue = pktring_create(IO_FLOW_RING_SZ, s->rx_pool->mode);
+    if (!f->queue) {
+        free(f);
+        return NULL;
+    }
+    /* Sealed already, there is nothing to mark */
+    if (aqm_init(&f->aqm, IO_FLOW_AQM_FLOWS, IO_FLOW_RING_SZ, 0)) {
+        pktring_destroy(f->queue);
+        free(f);
+        return NULL;
+    }
+    f->shard = s;
+    f->quantum = io_flow_weight(addr) * IO_FLOW_QUANTUM;
+
+    return f;
+}
+
+static void io_flow_append(struct io_shard *s, struct io_flow *f)
+{
+    lock(&s->flows_lock);
+    TAILQ_INSERT_TAIL(&s->flows, f, link);
+    unlock(&s->flows_lock);
 }
 
 static void socket_tx_schedule(struct pkt *p, void *priv)
 {
-    struct sockaddr_in *dest = priv;
+    struct io_flow *f = priv;
+    struct io_shard *s = f->shard;
 
-    pkt_set_dest(p, dest);
-    pktqueue_enqueue(&tx_queue, p);
-    event_control(&evt_dispatch, socket_event, EVCTL_WRITE_RESTART);
+    aqm_stamp(p);
+    if (pktring_enqueue(f->queue, p)) {
+        __atomic_fetch_add(&f->drops, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&s->stats.tx_drops, 1, __ATOMIC_RELAXED);
+        pkt_complete(p);
+        return;
+    }
+    if (!__atomic_exchange_n(&f->active, 1, __ATOMIC_SEQ_CST))
+        io_flow_append(s, f);
+    event_control(&s->d, s->ev, EVCTL_WRITE_RESTART);
 }
 
-static void rx_handler(struct pkt *p, struct sockaddr_in *src)
+/*
+ * Shard only, once the peer is gone: nobody queues on the flow anymore, but
+ * it may still be listed and have packets on their way to the socket.
+ */
+static void io_flow_release(void *priv)
+{
+    struct io_flow *f = priv;
+    struct io_shard *s = f->shard;
+    SIMPLEQ_HEAD(, pkt) keep = SIMPLEQ_HEAD_INITIALIZER(keep);
+    struct pkt *p;
+
+    /* Sends in flight on io_uring may hold some of them */
+    if (s->ring)
+        event_uring_flush(&s->d, s->ev);
+
+    if (s->cur == f) {
+        s->cur = NULL;
+    } else if (f->active) {
+        lock(&s->flows_lock);
+        TAILQ_REMOVE(&s->flows, f, link);
+        unlock(&s->flows_lock);
+    }
+
+    /* Keep the unsent packets of other flows, in order */
+    while ((p = SIMPLEQ_FIRST(&s->unsent))) {
+        SIMPLEQ_REMOVE_HEAD(&s->unsent, link);
+        if (pkt_get_dest(p) == &f->peer->addr)
+            pkt_complete(p);
+        else
+            SIMPLEQ_INSERT_TAIL(&keep, p, link);
+    }
+    while ((p = SIMPLEQ_FIRST(&keep))) {
+        SIMPLEQ_REMOVE_HEAD(&keep, link);
+        SIMPLEQ_INSERT_TAIL(&s->unsent, p, link);
+    }
+
+    while ((p = pktring_dequeue(f->queue)))
+        pkt_complete(p);
+    while ((p = aqm_drain(&f->aqm)))
+        pkt_complete(p);
+    aqm_cleanup(&f->aqm);
+    if (f->queue->hiwat > s->stats.tx_hiwat)
+        __atomic_store_n(&s->stats.tx_hiwat, f->queue->hiwat,
+                         __ATOMIC_RELAXED);
+    pktring_destroy(f->queue);
+    free(f);
+}
+
+static int io_link_mtu(struct sockaddr_in *addr)
+{
+    int mtu = io_opts.backend->mtu(addr);
+
+    return mtu < IO_MTU_MAX ? mtu : IO_MTU_MAX;
+}
+
+static struct peer *io_peer_create(struct io_shard *s,
+                                   struct sockaddr_in *addr)
+{
+    struct io_flow *f;
+    struct peer *p;
+
+    f = io_flow_create(s, addr);
+    if (!f)
+        return NULL;
+
+    p = peer_create(&s->peers, &s->d, addr, io_link_mtu(addr),
+                    socket_tx_schedule, io_flow_release, f);
+    if (!p) {
+        aqm_cleanup(&f->aqm);
+        pktring_destroy(f->queue);
+        free(f);
+        return NULL;
+    }
+    f->peer = p;
+
+    return p;
+}
+
+static struct peer *rx_peer(struct io_shard *s, struct sockaddr_in *src)
 {
     struct peer *peer;
 
-    peer = peer_lookup(src);
+    peer = peer_lookup(&s->peers, src);
 
-    if (!peer && listen_mode) {
-        peer = peer_create(&evt_dispatch, src, socket_tx_schedule);
-        peer_listen(peer);
+    if (!peer && s->io->listen_mode) {
+        peer = io_peer_create(s, src);
+        if (peer)
+            peer_listen(peer);
     }
 
-    peer_receive(peer, p);
+    return peer;
 }
 
-static int socket_event_handler(int fd, unsigned short flags, void *priv)
+static inline int same_addr(struct sockaddr_in *a, struct sockaddr_in *b)
 {
-    (void)priv;
+    return a->sin_addr.s_addr == b->sin_addr.s_addr &&
+           a->sin_port == b->sin_port;
+}
+
+/* Hand packets that all came from src over to their peer */
+static void rx_handler(struct io_shard *s, struct sockaddr_in *src,
+                       struct pkt **pkts, int n)
+{
+    struct peer *peer;
+    int i;
+
+    peer = rx_peer(s, src);
+    if (!peer) {
+        for (i = 0; i < n; i++)
+            pkt_complete(pkts[i]);
+        return;
+    }
+
+    peer_receive(peer, pkts, n);
+}
+
+static int socket_rx(struct io_shard *s)
+{
+    struct mmsghdr msgs[IO_BATCH_MAX];
+    struct iovec iovs[IO_BATCH_MAX];
+    struct sockaddr_in srcs[IO_BATCH_MAX];
+    struct pkt *pkts[IO_BATCH_MAX];
+    int n, i, j, rc;
+
+    n = pktring_dequeue_bulk(s->rx_pool, pkts, io_opts.batch);
+    for (i = 0; i < n; i++) {
+        iovs[i].iov_base = pkts[i]->buff;
+        iovs[i].iov_len = pkt_room(pkts[i]);
+        memset(&msgs[i], 0, sizeof (msgs[i]));
+        msgs[i].msg_hdr.msg_name = &srcs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof (srcs[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    if (!n)
+        return event_control(&s->d, s->ev, EVCTL_READ_STALL);
+
+    rc = io_opts.backend->recv(s->fd, msgs, n);
+    if (rc < 0) {
+        if (errno == EAGAIN)
+            event_drained(&s->d, s->ev, EVENT_READ);
+        else if (errno != EINTR)
+            fprintf(stderr, "socket: recv error: %s\n", strerror(errno));
+        rc = 0;
+    } else {
+        s->stats.rx_batches++;
+        s->stats.rx_pkts += rc;
+        if (rc == n)
+            s->stats.rx_full++;
+        else    /* Short of the batch, the socket was seen empty */
+            event_drained(&s->d, s->ev, EVENT_READ);
+    }
+
+    for (i = 0; i < rc; i++) {
+        pkt_put(pkts[i], msgs[i].msg_len);
+        pkt_set_compl(pkts[i], rx_complete, s);
+    }
+
+    /* Runs of packets from the same peer go in one batch */
+    for (i = 0; i < rc; i = j) {
+        for (j = i + 1; j < rc && same_addr(&srcs[j], &srcs[i]); j++)
+            ;
+        rx_handler(s, &srcs[i], pkts + i, j - i);
+    }
+
+    /* Hand back whatever the kernel had nothing for */
+    if (rc < n)
+        pktring_enqueue_bulk(s->rx_pool, pkts + rc, n - rc);
+
+    return 0;
+}
+
+/*
+ * With UDP_GRO, the kernel merges datagrams of the same flow into messages
+ * of up to 64 KB, which are received in the shard's scratch buffers and cut
+ * back into packets. A message can carry up to IO_GSO_MAX_SEGS datagrams,
+ * so receiving waits until the pool could take them all.
+ */
+static int socket_rx_gro(struct io_shard *s)
+{
+    struct mmsghdr msgs[IO_GRO_BATCH];
+    struct iovec iovs[IO_GRO_BATCH];
+    struct sockaddr_in srcs[IO_GRO_BATCH];
+    char ctrl[IO_GRO_BATCH][CMSG_SPACE(sizeof (int))];
+    struct cmsghdr *cmsg;
+    struct pkt *segs[IO_GSO_MAX_SEGS];
     struct pkt *p;
-    int rc;
+    size_t len, seg, off;
+    char *buff;
+    int n, i, k, rc;
 
-    if (flags & EVENT_READ) {
-        p = pktqueue_dequeue(&rx_pool);
-        if (p) {
-            struct sockaddr_in src;
-            socklen_t addrlen = sizeof (src);
-
-            rc = recvfrom(fd, p->buff, p->buff_size, 0,
-                          (struct sockaddr *)&src, &addrlen);
-            if (rc <= 0)
-                fprintf(stderr, "socket: recv error.\n");
-            p->pkt_size = rc;
-            pkt_set_compl(p, rx_complete, NULL);
-            rx_handler(p, &src);
-        } else {
-            rc = event_control(&evt_dispatch, socket_event, EVCTL_READ_STALL);
-            if (rc)
-                return DISPATCH_ABORT;
+    n = pktring_count(s->rx_pool) / IO_GSO_MAX_SEGS;
+    if (n > IO_GRO_BATCH)
+        n = IO_GRO_BATCH;
+    if (n > io_opts.batch)
+        n = io_opts.batch;
+    if (!n)
+        return event_control(&s->d, s->ev, EVCTL_READ_STALL);
+
+    for (i = 0; i < n; i++) {
+        iovs[i].iov_base = s->gro_buff + i * IO_GRO_BUFF_SZ;
+        iovs[i].iov_len = IO_GRO_BUFF_SZ;
+        memset(&msgs[i], 0, sizeof (msgs[i]));
+        msgs[i].msg_hdr.msg_name = &srcs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof (srcs[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = ctrl[i];
+        msgs[i].msg_hdr.msg_controllen = sizeof (ctrl[i]);
+    }
+
+    rc = io_opts.backend->recv(s->fd, msgs, n);
+    if (rc < 0) {
+        if (errno == EAGAIN)
+            event_drained(&s->d, s->ev, EVENT_READ);
+        else if (errno != EINTR)
+            fprintf(stderr, "socket: recv error: %s\n", strerror(errno));
+        return 0;
+    }
+    s->stats.rx_batches++;
+    if (rc == n)
+        s->stats.rx_full++;
+    else
+        event_drained(&s->d, s->ev, EVENT_READ);
+
+    for (i = 0; i < rc; i++) {
+        buff = iovs[i].iov_base;
+        len = msgs[i].msg_len;
+        seg = len;
+        for (cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg;
+             cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                int gso_size;
+
+                memcpy(&gso_size, CMSG_DATA(cmsg), sizeof (gso_size));
+                seg = gso_size;
+            }
+        }
+        if (!seg)
+            continue;
+        if (seg < len) {
+            s->stats.gro_msgs++;
+            s->stats.gro_segs += (len + seg - 1) / seg;
         }
+
+        for (off = 0, k = 0; off < len; off += seg) {
+            if (seg > len - off)
+                seg = len - off;
+
+            p = pktring_dequeue(s->rx_pool);
+            if (!p || seg > pkt_room(p)) {
+                if (p)
+                    pktring_putback(s->rx_pool, p);
+                s->stats.rx_drops++;
+                continue;
+            }
+
+            memcpy(pkt_put(p, seg), buff + off, seg);
+            pkt_set_compl(p, rx_complete, s);
+            s->stats.rx_pkts++;
+            segs[k++] = p;
+            if (k == IO_GSO_MAX_SEGS) {
+                rx_handler(s, &srcs[i], segs, k);
+                k = 0;
+            }
+        }
+        if (k)
+            rx_handler(s, &srcs[i], segs, k);
     }
 
-    if (flags & EVENT_WRITE) {
-        p = pktqueue_dequeue(&tx_queue);
-        if (p) {
-            struct sockaddr_in *dest = pkt_get_dest(p);
+    return 0;
+}
 
-            rc = sendto(fd, p->buff, p->pkt_size, 0,
-                        (struct sockaddr *)dest, sizeof (*dest));
-            if (rc - p->pkt_size)
-                fprintf(stderr, "socket: send error.\n");
+/* Whether p can be appended to message m as one more GSO segment */
+static int gso_fits(struct io_shard *s, struct mmsghdr *m, size_t bytes,
+                    struct pkt **pkts, struct pkt *p)
+{
+    struct sockaddr_in *dst = m->msg_hdr.msg_name;
+    struct sockaddr_in *pdst = pkt_get_dest(p);
+    size_t iovlen = m->msg_hdr.msg_iovlen;
+    size_t seg = pkts[0]->pkt_size;
 
-            pkt_complete(p);
+    if (!s->gso || iovlen >= IO_GSO_MAX_SEGS)
+        return 0;
+    if (dst != pdst && (dst->sin_addr.s_addr != pdst->sin_addr.s_addr ||
+                        dst->sin_port != pdst->sin_port))
+        return 0;
+
+    /* Only the last segment may come short */
+    return pkts[iovlen - 1]->pkt_size == seg && p->pkt_size <= seg &&
+           bytes + p->pkt_size <= IO_GSO_MAX_BYTES;
+}
+
+/*
+ * Next packet the socket should send: one it did not take last time, else
+ * the next the scheduler picks. Sending it is charged to its flow already.
+ */
+static struct pkt *socket_tx_next(struct io_shard *s, uint64_t now)
+{
+    struct io_flow *f;
+    struct pkt *p;
+
+    p = SIMPLEQ_FIRST(&s->unsent);
+    if (p) {
+        SIMPLEQ_REMOVE_HEAD(&s->unsent, link);
+        return p;
+    }
+
+    for (;;) {
+        f = s->cur;
+        if (!f) {
+            lock(&s->flows_lock);
+            f = TAILQ_FIRST(&s->flows);
+            if (f)
+                TAILQ_REMOVE(&s->flows, f, link);
+            unlock(&s->flows_lock);
+            if (!f)
+                return NULL;
+            f->deficit += f->quantum;
+            s->cur = f;
+        }
+
+        p = aqm_dequeue(&f->aqm, f->queue, now);
+        if (!p) {
+            /*
+             * Out of the round, credit and all. A packet queued meanwhile
+             * either finds the flow inactive and lists it again, or is
+             * seen here.
+             */
+            s->cur = NULL;
+            f->deficit = 0;
+            __atomic_store_n(&f->active, 0, __ATOMIC_SEQ_CST);
+            if (aqm_count(&f->aqm, f->queue) &&
+                !__atomic_exchange_n(&f->active, 1, __ATOMIC_SEQ_CST))
+                io_flow_append(s, f);
+            continue;
+        }
+
+        if ((long)p->pkt_size > f->deficit) {
+            /* Its turn is over, the packet waits for the next one */
+            pktring_putback(f->queue, p);
+            s->cur = NULL;
+            io_flow_append(s, f);
+            continue;
+        }
+
+        f->deficit -= p->pkt_size;
+        return p;
+    }
+}
+
+static void socket_tx_putback(struct io_shard *s, struct pkt *p)
+{
+    SIMPLEQ_INSERT_HEAD(&s->unsent, p, link);
+}
+
+/* Give the kernel whatever packets came back to the pool */
+static void socket_ring_refill(struct io_shard *s)
+{
+    struct io_ring *r = s->ring;
+    struct pkt *pkts[IO_BATCH_MAX];
+    unsigned short bid;
+    int added = 0;
+    int n, i;
+
+    do {
+        n = r->nfree_bids < IO_BATCH_MAX ? r->nfree_bids : IO_BATCH_MAX;
+        n = pktring_dequeue_bulk(s->rx_pool, pkts, n);
+        for (i = 0; i < n; i++) {
+            bid = r->free_bids[--r->nfree_bids];
+            r->bufs_pkts[bid] = pkts[i];
+            uring_bufs_add(&r->bufs, pkts[i]->buff - IO_RING_RX_HDR,
+                           IO_RING_RX_HDR + pkt_room(pkts[i]), bid);
+        }
+        added += n;
+    } while (n == IO_BATCH_MAX);
+
+    if (added)
+        uring_bufs_commit(&r->bufs);
+}
+
+/* Runs of packets from the same peer go in one batch */
+static void socket_ring_rx_flush(struct io_shard *s)
+{
+    struct io_ring *r = s->ring;
+    int i, j;
+
+    if (!r->nrx)
+        return;
+
+    s->stats.rx_batches++;
+    for (i = 0; i < r->nrx; i = j) {
+        for (j = i + 1; j < r->nrx && same_addr(&r->rx_srcs[j],
+                                                &r->rx_srcs[i]); j++)
+            ;
+        rx_handler(s, &r->rx_srcs[i], r->rx_pkts + i, j - i);
+    }
+    r->nrx = 0;
+}
+
+/*
+ * Datagrams received are only collected here, and handed over to their
+ * peers by the event handler once the round's completions are all in.
+ */
+static int socket_ring_rx_done(struct uring_req *req, int res,
+                               unsigned int flags)
+{
+    struct io_ring *r = (struct io_ring *)req;
+    struct io_shard *s = r->s;
+    struct io_uring_recvmsg_out *out;
+    unsigned short bid;
+    struct pkt *p;
+
+    if (flags & IORING_CQE_F_BUFFER) {
+        bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        p = r->bufs_pkts[bid];
+        r->bufs_pkts[bid] = NULL;
+        r->free_bids[r->nfree_bids++] = bid;
+
+        out = (void *)(p->buff - IO_RING_RX_HDR);
+        if (res < 0 || (out->flags & MSG_TRUNC)) {
+            s->stats.rx_drops++;
+            pktring_enqueue(s->rx_pool, p);
         } else {
-            rc = event_control(&evt_dispatch, socket_event, EVCTL_WRITE_STALL);
-            if (rc)
-                return DISPATCH_ABORT;
+            memcpy(&r->rx_srcs[r->nrx], out + 1, sizeof (r->rx_srcs[0]));
+            pkt_put(p, out->payloadlen);
+            pkt_set_compl(p, rx_complete, s);
+            s->stats.rx_pkts++;
+            r->rx_pkts[r->nrx++] = p;
+            if (r->nrx == IO_BATCH_MAX) {
+                s->stats.rx_full++;
+                socket_ring_rx_flush(s);
+            }
+        }
+    }
+
+    /* Out of buffers, or cancelled: the handler arms it again */
+    if (res < 0 && res != -ENOBUFS && res != -ECANCELED) {
+        fprintf(stderr, "socket: recv error: %s\n", strerror(-res));
+        /* No multishot receive on this kernel */
+        if (res == -EINVAL)
+            return DISPATCH_ABORT;
+    }
+    if (!(flags & IORING_CQE_F_MORE))
+        r->rx_armed = 0;
+
+    event_uring_ready(&s->d, s->ev, EVENT_READ);
+
+    return DISPATCH_CONTINUE;
+}
+
+/*
+ * Hand over what was received, give the kernel the buffers back and keep a
+ * receive armed, for as long as there are buffers to receive into.
+ */
+static int socket_ring_rx(struct io_shard *s)
+{
+    struct io_ring *r = s->ring;
+    struct io_uring_sqe *sqe;
+
+    socket_ring_rx_flush(s);
+    socket_ring_refill(s);
+
+    if (!r->rx_armed) {
+        if (r->nfree_bids == PKT_POOL_SZ)
+            return event_control(&s->d, s->ev, EVCTL_READ_STALL);
+
+        sqe = event_uring_sqe(&s->d, NULL, &r->rx_req);
+        if (!sqe)
+            return -1;
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->fd = s->fd;
+        sqe->addr = (uintptr_t)&r->rx_msg;
+        sqe->len = 1;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = r->bufs.bgid;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        r->rx_armed = 1;
+    }
+    event_drained(&s->d, s->ev, EVENT_READ);
+
+    return 0;
+}
+
+static int socket_ring_tx_done(struct uring_req *req, int res,
+                               unsigned int flags)
+{
+    struct io_ring_msg *m = (struct io_ring_msg *)req;
+    struct io_shard *s = m->s;
+    struct io_ring *r = s->ring;
+    int i;
+
+    (void)flags;
+
+    if (res == -EIO && s->gso) {
+        /* The route cannot checksum segments, send them one by one */
+        fprintf(stderr, "socket: UDP GSO unusable, disabling it.\n");
+        s->gso = 0;
+        for (i = m->count; i--; )
+            socket_tx_putback(s, m->pkts[i]);
+        event_control(&s->d, s->ev, EVCTL_WRITE_RESTART);
+    } else {
+        if (res < 0)
+            fprintf(stderr, "socket: send error: %s\n", strerror(-res));
+        else if ((size_t)res != m->bytes)
+            fprintf(stderr, "socket: send error.\n");
+
+        if (res >= 0) {
+            s->stats.tx_pkts += m->count;
+            if (m->count > 1) {
+                s->stats.gso_msgs++;
+                s->stats.gso_segs += m->count;
+            }
         }
+        for (i = 0; i < m->count; i++)
+            pkt_complete(m->pkts[i]);
     }
 
+    m->next = r->tx_free;
+    r->tx_free = m;
+    r->tx_nfree++;
+    event_uring_ready(&s->d, s->ev, EVENT_WRITE);
+
     return DISPATCH_CONTINUE;
 }
 
-int io_dispatch(int sockfd, struct sockaddr_in *remote)
+/*
+ * Every message goes out as a sendmsg request of its own, with a copy of
+ * its header, destination and iovecs kept until it completes.
+ */
+static int socket_ring_tx(struct io_shard *s, struct mmsghdr *msgs,
+                          int nmsgs, struct pkt **pkts, int *first,
+                          size_t *bytes)
 {
+    struct io_ring *r = s->ring;
+    struct io_uring_sqe *sqe;
+    struct io_ring_msg *m;
+    struct msghdr *h;
+    int i, j;
+
+    for (i = 0; i < nmsgs; i++) {
+        m = r->tx_free;
+        sqe = event_uring_sqe(&s->d, s->ev, &m->req);
+        if (!sqe) {
+            for (j = first[nmsgs] - 1; j >= first[i]; j--)
+                socket_tx_putback(s, pkts[j]);
+            return -1;
+        }
+        r->tx_free = m->next;
+        r->tx_nfree--;
+
+        h = &msgs[i].msg_hdr;
+        m->count = first[i + 1] - first[i];
+        m->bytes = bytes[i];
+        memcpy(m->pkts, pkts + first[i], m->count * sizeof (m->pkts[0]));
+        memcpy(m->iov, h->msg_iov, m->count * sizeof (m->iov[0]));
+        memcpy(&m->dst, h->msg_name, sizeof (m->dst));
+        m->msg = *h;
+        m->msg.msg_name = &m->dst;
+        m->msg.msg_iov = m->iov;
+        if (h->msg_control) {
+            memcpy(m->ctrl, h->msg_control, h->msg_controllen);
+            m->msg.msg_control = m->ctrl;
+        }
+
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = s->fd;
+        sqe->addr = (uintptr_t)&m->msg;
+        sqe->len = 1;
+    }
+    s->stats.tx_batches++;
+
+    return 0;
+}
+
+static int socket_tx(struct io_shard *s)
+{
+    struct mmsghdr msgs[IO_BATCH_MAX];
+    struct iovec iovs[IO_BATCH_MAX];
+    struct pkt *pkts[IO_BATCH_MAX];
+    char ctrl[IO_BATCH_MAX][CMSG_SPACE(sizeof (uint16_t))];
+    size_t bytes[IO_BATCH_MAX];
+    int first[IO_BATCH_MAX + 1];
+    struct cmsghdr *cmsg;
+    struct mmsghdr *m;
     struct pkt *p;
+    uint64_t now = aqm_now();
+    uint16_t seg;
+    int max = io_opts.batch;
+    int nmsgs = 0;
+    int n, i, j, rc;
+
+    /* On io_uring, messages wait for a request to go out with */
+    if (s->ring && max > s->ring->tx_nfree) {
+        max = s->ring->tx_nfree;
+        if (!max) {
+            event_drained(&s->d, s->ev, EVENT_WRITE);
+            return 0;
+        }
+    }
+
+    /*
+     * Without GSO every packet is a message of its own. With it, a run of
+     * packets to the same destination goes out as one message, the kernel
+     * cutting it back into datagrams at the size of the first packet.
+     */
+    for (n = 0; n < IO_BATCH_MAX; n++) {
+        p = socket_tx_next(s, now);
+        if (!p)
+            break;
+
+        iovs[n].iov_base = p->buff;
+        iovs[n].iov_len = p->pkt_size;
+
+        if (nmsgs && gso_fits(s, &msgs[nmsgs - 1], bytes[nmsgs - 1],
+                              pkts + first[nmsgs - 1], p)) {
+            m = &msgs[nmsgs - 1];
+            if (m->msg_hdr.msg_iovlen++ == 1) {
+                seg = pkts[first[nmsgs - 1]]->pkt_size;
+                m->msg_hdr.msg_control = ctrl[nmsgs - 1];
+                m->msg_hdr.msg_controllen = sizeof (ctrl[nmsgs - 1]);
+                cmsg = CMSG_FIRSTHDR(&m->msg_hdr);
+                cmsg->cmsg_level = SOL_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof (seg));
+                memcpy(CMSG_DATA(cmsg), &seg, sizeof (seg));
+            }
+            bytes[nmsgs - 1] += p->pkt_size;
+            pkts[n] = p;
+            continue;
+        }
+
+        if (nmsgs == max) {
+            socket_tx_putback(s, p);
+            break;
+        }
+
+        m = &msgs[nmsgs];
+        memset(m, 0, sizeof (*m));
+        m->msg_hdr.msg_name = pkt_get_dest(p);
+        m->msg_hdr.msg_namelen = sizeof (struct sockaddr_in);
+        m->msg_hdr.msg_iov = &iovs[n];
+        m->msg_hdr.msg_iovlen = 1;
+        bytes[nmsgs] = p->pkt_size;
+        first[nmsgs++] = n;
+        pkts[n] = p;
+    }
+    first[nmsgs] = n;
+
+    if (!n)
+        return event_control(&s->d, s->ev, EVCTL_WRITE_STALL);
+
+    if (s->ring)
+        return socket_ring_tx(s, msgs, nmsgs, pkts, first, bytes);
+
+    rc = io_opts.backend->send(s->fd, msgs, nmsgs);
+    if (rc < 0) {
+        if (errno == EAGAIN || errno == EINTR) {
+            if (errno == EAGAIN)
+                event_drained(&s->d, s->ev, EVENT_WRITE);
+            rc = 0;
+        } else if (errno == EIO && s->gso) {
+            /* The route cannot checksum segments, send them one by one */
+            fprintf(stderr, "socket: UDP GSO unusable, disabling it.\n");
+            s->gso = 0;
+            rc = 0;
+        } else {
+            /* The first message is the one the kernel choked on, drop it */
+            fprintf(stderr, "socket: send error: %s\n", strerror(errno));
+            for (j = first[0]; j < first[1]; j++) {
+                pkt_complete(pkts[j]);
+                pkts[j] = NULL;
+            }
+            rc = 1;
+        }
+    } else {
+        s->stats.tx_batches++;
+        if (rc < nmsgs)
+            s->stats.tx_partial++;
+    }
+
+    for (i = 0; i < rc; i++) {
+        if (!pkts[first[i]])
+            continue;
+        if (msgs[i].msg_len != bytes[i])
+            fprintf(stderr, "socket: send error.\n");
+
+        s->stats.tx_pkts += first[i + 1] - first[i];
+        if (first[i + 1] - first[i] > 1) {
+            s->stats.gso_msgs++;
+            s->stats.gso_segs += first[i + 1] - first[i];
+        }
+        for (j = first[i]; j < first[i + 1]; j++)
+            pkt_complete(pkts[j]);
+    }
+
+    /* Put the unsent tail back in front of the queue, preserving order */
+    for (j = n - 1; j >= first[rc]; j--)
+        socket_tx_putback(s, pkts[j]);
+
+    return 0;
+}
+
+static int socket_event_handler(int fd, unsigned short flags, void *priv)
+{
+    struct io_shard *s = priv;
     int rc;
+
+    (void)fd;
+
+    if (flags & EVENT_READ) {
+        if (s->ring)
+            rc = socket_ring_rx(s);
+        else
+            rc = s->gro ? socket_rx_gro(s) : socket_rx(s);
+        if (rc)
+            return DISPATCH_ABORT;
+    }
+
+    if ((flags & EVENT_WRITE) && socket_tx(s))
+        return DISPATCH_ABORT;
+
+    return DISPATCH_CONTINUE;
+}
+
+/* Most packets ever queued for a peer of the shard, gone ones included */
+static unsigned long io_shard_tx_hiwat(struct io_shard *s)
+{
+    unsigned long hiwat, h;
+    struct io_flow *f;
+    struct peer *p;
+
+    hiwat = __atomic_load_n(&s->stats.tx_hiwat, __ATOMIC_RELAXED);
+    lock(&s->peers.lock);
+    LIST_FOREACH(p, &s->peers.peers, link) {
+        f = p->tx_priv;
+        h = __atomic_load_n(&f->queue->hiwat, __ATOMIC_RELAXED);
+        if (h > hiwat)
+            hiwat = h;
+    }
+    unlock(&s->peers.lock);
+
+    return hiwat;
+}
+
+void io_stats_get(struct io *io, struct io_stats *st)
+{
+    struct io_shard *shards = io->shards;
+    unsigned long hiwat;
+    int i;
+
+    memset(st, 0, sizeof (*st));
+    for (i = 0; i < io->nshards; i++) {
+        st->rx_batches += shards[i].stats.rx_batches;
+        st->rx_pkts += shards[i].stats.rx_pkts;
+        st->rx_full += shards[i].stats.rx_full;
+        st->tx_batches += shards[i].stats.tx_batches;
+        st->tx_pkts += shards[i].stats.tx_pkts;
+        st->tx_partial += shards[i].stats.tx_partial;
+        st->gro_msgs += shards[i].stats.gro_msgs;
+        st->gro_segs += shards[i].stats.gro_segs;
+        st->gso_msgs += shards[i].stats.gso_msgs;
+        st->gso_segs += shards[i].stats.gso_segs;
+        st->rx_drops += shards[i].stats.rx_drops;
+        st->tx_drops += shards[i].stats.tx_drops;
+        hiwat = io_shard_tx_hiwat(&shards[i]);
+        if (hiwat > st->tx_hiwat)
+            st->tx_hiwat = hiwat;
+    }
+}
+
+void io_stats_print(struct io *io, FILE *f)
+{
+    struct io_stats st;
+
+    io_stats_get(io, &st);
+    fprintf(f, "rx: %lu packets in %lu batches (%lu full), "
+               "tx: %lu packets in %lu batches (%lu partial)\n",
+            st.rx_pkts, st.rx_batches, st.rx_full,
+            st.tx_pkts, st.tx_batches, st.tx_partial);
+    fprintf(f, "tx: at most %lu packets queued for a peer, "
+               "%lu dropped on a full queue\n",
+            st.tx_hiwat, st.tx_drops);
+    if (io_opts.udp_offload)
+        fprintf(f, "gro: %lu datagrams in %lu messages, "
+                   "gso: %lu datagrams in %lu messages, %lu dropped\n",
+                st.gro_segs, st.gro_msgs, st.gso_segs, st.gso_msgs,
+                st.rx_drops);
+}
+
+/*
+ * Metrics. Everything is read from the counters the shard and queue threads
+ * keep anyway; peers are snapshot under their table's lock so that neither
+ * they nor their interfaces go away meanwhile. The text format wants every
+ * family in one piece, so samples are gathered first and printed after.
+ * Each snapshot starts with its labels and holds nothing but unsigned longs
+ * after that, which is what the tables below index into.
+ */
+
+#define IO_METRICS_LABELS_SZ 80
+
+struct io_metric
+{
+    const char *name;
+    const char *type;
+    const char *help;
+    size_t off;
+};
+
+struct io_shard_snap
+{
+    char labels[IO_METRICS_LABELS_SZ];
+    struct io_stats st;
+    unsigned long pool;
+    unsigned long pool_size;
+    unsigned long queued;
+};
+
+struct io_peer_snap
+{
+    char labels[IO_METRICS_LABELS_SZ];
+    struct peer_stats st;
+    struct iface_stats ifst;
+    struct compress_stats zst;
+    unsigned long link_mtu;
+    unsigned long tx_weight;
+    unsigned long tx_queued;
+    unsigned long tx_hiwat;
+    unsigned long tx_drops;
+    unsigned long aqm_drops;
+    unsigned long sojourn_ns;
+    unsigned long tx_credit;
+};
+
+struct io_queue_snap
+{
+    char labels[IO_METRICS_LABELS_SZ];
+    struct iface_stats st;
+    unsigned long pool;
+    unsigned long pool_size;
+    unsigned long queued;
+};
+
+struct io_dispatch_snap
+{
+    char labels[IO_METRICS_LABELS_SZ];
+    struct dispatch_stats st;
+};
+
+struct io_slab_snap
+{
+    char labels[IO_METRICS_LABELS_SZ];
+    struct pktslab_stats st;
+};
+
+#define ARRAY_SIZE(a) (sizeof (a) / sizeof ((a)[0]))
+
+#define COUNTER "counter"
+#define GAUGE "gauge"
+#define SHARD(n, t, f, h) { "tun_transport_" n, t, h, \
+                            offsetof(struct io_shard_snap, f) }
+#define PEER(n, t, f, h) { "tun_peer_" n, t, h, \
+                           offsetof(struct io_peer_snap, f) }
+#define QUEUE(n, t, f, h) { "tun_iface_queue_" n, t, h, \
+                            offsetof(struct io_queue_snap, f) }
+#define DISPATCH(n, t, f, h) { "tun_dispatch_" n, t, h, \
+                               offsetof(struct io_dispatch_snap, f) }
+#define SLAB(n, t, f, h) { "tun_slab_" n, t, h, \
+                           offsetof(struct io_slab_snap, f) }
+
+static const struct io_metric shard_metrics[] = {
+    SHARD("rx_packets_total", COUNTER, st.rx_pkts, "Datagrams received."),
+    SHARD("rx_batches_total", COUNTER, st.rx_batches,
+          "Receive calls that returned data."),
+    SHARD("rx_drops_total", COUNTER, st.rx_drops,
+          "Datagrams lost for want of a buffer."),
+    SHARD("tx_packets_total", COUNTER, st.tx_pkts, "Datagrams sent."),
+    SHARD("tx_batches_total", COUNTER, st.tx_batches,
+          "Send calls that sent data."),
+    SHARD("tx_drops_total", COUNTER, st.tx_drops,
+          "Packets to send that found their peer's queue full."),
+    SHARD("gro_messages_total", COUNTER, st.gro_msgs,
+          "Coalesced messages received."),
+    SHARD("gso_messages_total", COUNTER, st.gso_msgs,
+          "Messages sent with a segment size."),
+    SHARD("rx_pool_packets", GAUGE, pool,
+          "Free packets in the receive pool."),
+    SHARD("rx_pool_size", GAUGE, pool_size, "Capacity of the receive pool."),
+    SHARD("tx_queue_packets", GAUGE, queued, "Packets waiting to be sent."),
+    SHARD("tx_queue_hiwat", GAUGE, st.tx_hiwat,
+          "Most packets ever waiting to be sent to one peer."),
+};
+
+static const struct io_metric peer_metrics[] = {
+    PEER("rx_packets_total", COUNTER, st.rx_pkts,
+         "Packets received from the peer."),
+    PEER("rx_bytes_total", COUNTER, st.rx_bytes,
+         "Bytes received from the peer."),
+    PEER("rx_errors_total", COUNTER, st.rx_errors,
+         "Received packets that were malformed or unexpected."),
+    PEER("rx_rejected_total", COUNTER, st.rx_rejected,
+         "Received packets that were not sealed, replayed, forged or "
+         "garbled."),
+    PEER("tx_control_packets_total", COUNTER, st.tx_ctl,
+         "Control packets sent to the peer."),
+    PEER("link_mtu_bytes", GAUGE, link_mtu,
+         "Largest datagram the path to the peer was found to carry."),
+    PEER("mtu_probes_total", COUNTER, st.tx_probes,
+         "Path MTU probes sent, retries included."),
+    PEER("mtu_probes_lost_total", COUNTER, st.probes_lost,
+         "Path MTU probe sizes that went unacknowledged."),
+    PEER("tx_weight", GAUGE, tx_weight,
+         "Share of the socket the peer gets when it is busy."),
+    PEER("tx_queue_packets", GAUGE, tx_queued,
+         "Packets waiting to be sent to the peer."),
+    PEER("tx_queue_hiwat", GAUGE, tx_hiwat,
+         "Most packets ever waiting to be sent to the peer."),
+    PEER("tx_drops_total", COUNTER, tx_drops,
+         "Packets to the peer that found its queue full."),
+    PEER("aqm_drops_total", COUNTER, aqm_drops,
+         "Packets to the peer dropped by queue management."),
+    PEER("tx_sojourn_nanoseconds", GAUGE, sojourn_ns,
+         "Time the last packet sent to the peer spent queued."),
+    PEER("routed_packets_total", COUNTER, st.tx_routed,
+         "Packets the hub read from its interface for the peer."),
+    PEER("tx_credit_packets", GAUGE, tx_credit,
+         "Packets the peer still lets us send, with flow control."),
+    PEER("credit_stalls_total", COUNTER, ifst.credit_stalls,
+         "Times reading the tunnel device stopped for want of credit."),
+    PEER("credit_drops_total", COUNTER, st.tx_credit_drops,
+         "Packets the hub routed to the peer, but had no credit for."),
+    PEER("too_big_packets_total", COUNTER, st.tx_too_big,
+         "Packets the hub routed to the peer, too large for its path."),
+    PEER("credit_updates_total", COUNTER, st.tx_credits,
+         "Keepalives sent to hand out credit."),
+    PEER("tx_packets_total", COUNTER, ifst.tx_pkts,
+         "Packets read from the tunnel device for the peer."),
+    PEER("tx_bytes_total", COUNTER, ifst.tx_bytes,
+         "Bytes read from the tunnel device for the peer."),
+    PEER("delivered_packets_total", COUNTER, ifst.rx_pkts,
+         "Packets from the peer written to the tunnel device."),
+    PEER("delivered_bytes_total", COUNTER, ifst.rx_bytes,
+         "Bytes from the peer written to the tunnel device."),
+    PEER("queue_drops_total", COUNTER, ifst.ring_drops,
+         "Packets from the peer that found the device queue full."),
+    PEER("segment_drops_total", COUNTER, ifst.drops,
+         "Segments of super-packets lost for want of a buffer."),
+    PEER("device_errors_total", COUNTER, ifst.errors,
+         "Failed reads and writes on the tunnel device."),
+    PEER("compressed_packets_total", COUNTER, zst.tx_pkts,
+         "Packets sent compressed."),
+    PEER("compress_in_bytes_total", COUNTER, zst.tx_bytes_in,
+         "Bytes offered for compression."),
+    PEER("compress_out_bytes_total", COUNTER, zst.tx_bytes_out,
+         "Bytes offered for compression, as sent."),
+    PEER("compress_skipped_packets_total", COUNTER, zst.tx_skipped,
+         "Packets sent as they are, as their flow did not compress lately."),
+    PEER("compress_random_packets_total", COUNTER, zst.tx_random,
+         "Packets sent as they are, as their payload looked random."),
+    PEER("compress_incompressible_packets_total", COUNTER,
+         zst.tx_incompressible, "Packets that did not shrink enough."),
+    PEER("compress_nanoseconds_total", COUNTER, zst.tx_ns,
+         "Time spent compressing."),
+    PEER("decompressed_packets_total", COUNTER, zst.rx_pkts,
+         "Compressed packets received."),
+    PEER("decompress_errors_total", COUNTER, zst.rx_errors,
+         "Compressed packets that were malformed or unexpected."),
+    PEER("decompress_nanoseconds_total", COUNTER, zst.rx_ns,
+         "Time spent decompressing."),
+};
+
+static const struct io_metric queue_metrics[] = {
+    QUEUE("read_packets_total", COUNTER, st.tx_pkts,
+          "Packets read from the device queue."),
+    QUEUE("written_packets_total", COUNTER, st.rx_pkts,
+          "Packets written to the device queue."),
+    QUEUE("wakeups_total", COUNTER, st.wakeups, "Times the queue was ready."),
+    QUEUE("budget_hits_total", COUNTER, st.budget_hits,
+          "Wakeups that left work behind."),
+    QUEUE("pool_packets", GAUGE, pool, "Free packets in the read pool."),
+    QUEUE("pool_size", GAUGE, pool_size, "Capacity of the read pool."),
+    QUEUE("write_queue_packets", GAUGE, queued,
+          "Packets waiting to be written."),
+    QUEUE("write_queue_hiwat", GAUGE, st.rx_hiwat,
+          "Most packets ever waiting to be written."),
+    QUEUE("aqm_drops_total", COUNTER, st.aqm_drops,
+          "Packets to write dropped by queue management."),
+    QUEUE("ecn_marks_total", COUNTER, st.ecn_marks,
+          "Packets to write marked Congestion Experienced."),
+    QUEUE("sojourn_nanoseconds", GAUGE, st.sojourn_ns,
+          "Time the last packet written spent queued."),
+    QUEUE("credit_stalls_total", COUNTER, st.credit_stalls,
+          "Times reading stopped for want of credit."),
+};
+
+static const struct io_metric dispatch_metrics[] = {
+    DISPATCH("loops_total", COUNTER, st.loops, "Waits for events."),
+    DISPATCH("events_total", COUNTER, st.events, "Event handlers run."),
+    DISPATCH("timers_total", COUNTER, st.timers, "Timers expired."),
+    DISPATCH("ctl_calls_total", COUNTER, st.ctls,
+             "epoll_ctl() calls changing the events watched."),
+    DISPATCH("sleeps_total", COUNTER, st.sleeps,
+             "Busy polling: blocking waits, the spin budget spent."),
+    DISPATCH("spins_total", COUNTER, st.spins,
+             "Busy polling: polls finding no events."),
+    DISPATCH("spin_nanoseconds_total", COUNTER, st.spin_ns,
+             "Busy polling: time spent in polls finding no events."),
+    DISPATCH("work_nanoseconds_total", COUNTER, st.work_ns,
+             "Busy polling: time spent handling events polls found."),
+};
+
+static const struct io_metric slab_metrics[] = {
+    SLAB("allocs_total", COUNTER, st.allocs, "Packet buffers allocated."),
+    SLAB("in_use", GAUGE, st.in_use, "Packet buffers in use."),
+    SLAB("slots", GAUGE, st.slots, "Packet buffers carved out so far."),
+    SLAB("regions", GAUGE, st.regions, "Memory regions mapped."),
+};
+
+struct io_snap_array
+{
+    char *snaps;
+    size_t n;
+    size_t size;
+    size_t snap_size;
+};
+
+static void *io_snap_add(struct io_snap_array *a)
+{
+    size_t size;
+    char *snaps;
+
+    if (a->n == a->size) {
+        size = a->size ? a->size * 2 : 16;
+        snaps = realloc(a->snaps, size * a->snap_size);
+        if (!snaps)
+            return NULL;
+        a->snaps = snaps;
+        a->size = size;
+    }
+
+    return memset(a->snaps + a->n++ * a->snap_size, 0, a->snap_size);
+}
+
+static void io_metrics_print(struct metrics_buf *b,
+                             const struct io_metric *m, int nm,
+                             struct io_snap_array *a)
+{
+    const char *snap;
+    size_t i;
+
+    for (; nm--; m++) {
+        metrics_family(b, m->name, m->type, m->help);
+        for (i = 0; i < a->n; i++) {
+            snap = a->snaps + i * a->snap_size;
+            metrics_printf(b, "%s{%s} %lu\n", m->name, snap,
+                           *(const unsigned long *)(snap + m->off));
+        }
+    }
+}
+
+static int io_metrics_iface(struct io_snap_array *queues,
+                            struct io_snap_array *dispatches,
+                            struct iface *iface)
+{
+    struct io_queue_snap *qs;
+    struct io_dispatch_snap *ds;
+    struct iface_queue *q;
+    int i;
+
+    for (i = 0; i < iface->nqueues; i++) {
+        q = &iface->queues[i];
+        qs = io_snap_add(queues);
+        if (!qs)
+            return -1;
+        snprintf(qs->labels, sizeof (qs->labels),
+                 "iface=\"%s\",queue=\"%d\"", iface->name, i);
+        iface_queue_stats_get(q, &qs->st);
+        qs->pool = pktring_count(q->tx_pool);
+        qs->pool_size = q->tx_pool->mask + 1;
+        qs->queued = aqm_count(&q->aqm, q->rx_queue);
+
+        if (!iface->threaded)
+            continue;
+        ds = io_snap_add(dispatches);
+        if (!ds)
+            return -1;
+        snprintf(ds->labels, sizeof (ds->labels), "thread=\"%s/q%d\"",
+                 iface->name, i);
+        ds->st = q->own_d.stats;
+    }
+
+    return 0;
+}
+
+static int io_metrics_peers(struct io_snap_array *peers,
+                            struct io_snap_array *queues,
+                            struct io_snap_array *dispatches,
+                            struct io_shard_snap *ss,
+                            struct io *io, int shard)
+{
+    struct peer_table *t = &io->shards[shard].peers;
+    struct io_peer_snap *ps;
+    struct io_flow *f;
+    char addr[INET_ADDRSTRLEN];
+    struct peer *p;
+    int rc = 0;
+
+    lock(&t->lock);
+    LIST_FOREACH(p, &t->peers, link) {
+        ps = io_snap_add(peers);
+        if (!ps) {
+            rc = -1;
+            break;
+        }
+        inet_ntop(AF_INET, &p->addr.sin_addr, addr, sizeof (addr));
+        snprintf(ps->labels, sizeof (ps->labels),
+                 "peer=\"%s:%d\",shard=\"%d\"", addr,
+                 ntohs(p->addr.sin_port), shard);
+        ps->st = p->stats;
+        ps->st.rx_rejected = __atomic_load_n(&p->stats.rx_rejected,
+                                             __ATOMIC_RELAXED);
+        ps->st.tx_routed = __atomic_load_n(&p->stats.tx_routed,
+                                           __ATOMIC_RELAXED);
+        ps->st.tx_credit_drops = __atomic_load_n(&p->stats.tx_credit_drops,
+                                                 __ATOMIC_RELAXED);
+        ps->st.tx_too_big = __atomic_load_n(&p->stats.tx_too_big,
+                                            __ATOMIC_RELAXED);
+        if (peer_tx_credit(p) > 0)
+            ps->tx_credit = peer_tx_credit(p);
+        ps->link_mtu = p->link_mtu;
+        f = p->tx_priv;
+        ps->tx_weight = f->quantum / IO_FLOW_QUANTUM;
+        ps->tx_queued = aqm_count(&f->aqm, f->queue);
+        ps->tx_hiwat = __atomic_load_n(&f->queue->hiwat, __ATOMIC_RELAXED);
+        ps->tx_drops = __atomic_load_n(&f->drops, __ATOMIC_RELAXED);
+        ps->aqm_drops = f->aqm.stats.drops;
+        ps->sojourn_ns = f->aqm.stats.sojourn_ns;
+        ss->queued += ps->tx_queued;
+        if (ps->tx_hiwat > ss->st.tx_hiwat)
+            ss->st.tx_hiwat = ps->tx_hiwat;
+        if (p->compress)
+            ps->zst = p->compress->stats;
+        if (!p->iface || p->hub_nh)
+            continue;
+        iface_stats_get(p->iface, &ps->ifst);
+        rc = io_metrics_iface(queues, dispatches, p->iface);
+        if (rc)
+            break;
+    }
+    unlock(&t->lock);
+
+    return rc;
+}
+
+static void io_metrics_collect(struct metrics_buf *b, void *priv)
+{
+    struct io_snap_array shard_snaps = {
+        .snap_size = sizeof (struct io_shard_snap) };
+    struct io_snap_array peers = { .snap_size = sizeof (struct io_peer_snap) };
+    struct io_snap_array queues = {
+        .snap_size = sizeof (struct io_queue_snap) };
+    struct io_snap_array dispatches = {
+        .snap_size = sizeof (struct io_dispatch_snap) };
+    struct io_snap_array slabs = { .snap_size = sizeof (struct io_slab_snap) };
+    struct pktslab_stats slab_st[PKTSLAB_NCLASSES];
+    struct io_shard_snap *ss;
+    struct io_dispatch_snap *ds;
+    struct io_slab_snap *sl;
+    struct io *io = priv;
+    struct io_shard *s;
+    int i;
+
+    for (i = 0; i < io->nshards; i++) {
+        s = &io->shards[i];
+        ss = io_snap_add(&shard_snaps);
+        ds = io_snap_add(&dispatches);
+        if (!ss || !ds)
+            goto nomem;
+        snprintf(ss->labels, sizeof (ss->labels), "shard=\"%d\"", i);
+        ss->st = s->stats;
+        ss->st.tx_drops = __atomic_load_n(&s->stats.tx_drops,
+                                          __ATOMIC_RELAXED);
+        ss->st.tx_hiwat = __atomic_load_n(&s->stats.tx_hiwat,
+                                          __ATOMIC_RELAXED);
+        ss->pool = pktring_count(s->rx_pool);
+        ss->pool_size = s->rx_pool->mask + 1;
+
+        snprintf(ds->labels, sizeof (ds->labels), "thread=\"shard%d\"", i);
+        ds->st = s->d.stats;
+
+        if (io_metrics_peers(&peers, &queues, &dispatches, ss, io, i))
+            goto nomem;
+    }
+    if (hub_iface() && io_metrics_iface(&queues, &dispatches, hub_iface()))
+        goto nomem;
+
+    pktslab_stats_get(slab_st);
+    for (i = 0; i < PKTSLAB_NCLASSES; i++) {
+        if (!slab_st[i].regions)
+            continue;
+        sl = io_snap_add(&slabs);
+        if (!sl)
+            goto nomem;
+        snprintf(sl->labels, sizeof (sl->labels), "size=\"%zu\"",
+                 slab_st[i].slot_size);
+        sl->st = slab_st[i];
+    }
+
+    io_metrics_print(b, shard_metrics, ARRAY_SIZE(shard_metrics),
+                     &shard_snaps);
+    io_metrics_print(b, peer_metrics, ARRAY_SIZE(peer_metrics), &peers);
+    io_metrics_print(b, queue_metrics, ARRAY_SIZE(queue_metrics), &queues);
+    io_metrics_print(b, dispatch_metrics, ARRAY_SIZE(dispatch_metrics),
+                     &dispatches);
+    io_metrics_print(b, slab_metrics, ARRAY_SIZE(slab_metrics), &slabs);
+    goto free;
+
+nomem:
+    b->err = 1;
+free:
+    free(shard_snaps.snaps);
+    free(peers.snaps);
+    free(queues.snaps);
+    free(dispatches.snaps);
+    free(slabs.snaps);
+}
+
+/*
+ * Probe the UDP offloads: kernels without them reject the socket options,
+ * in which case the shard quietly sticks to one datagram per message.
+ */
+static void io_shard_offload(struct io_shard *s)
+{
+    int zero = 0;
+    int one = 1;
+
+    if (!io_opts.udp_offload || !io_opts.backend->offload)
+        return;
+
+    if (setsockopt(s->fd, SOL_UDP, UDP_SEGMENT, &zero, sizeof (zero)))
+        fprintf(stderr, "socket: no UDP GSO support: %s\n", strerror(errno));
+    else
+        s->gso = 1;
+
+    /* Receive buffers on io_uring are pool packets, one datagram each */
+    if (s->ring)
+        return;
+
+    if (setsockopt(s->fd, SOL_UDP, UDP_GRO, &one, sizeof (one))) {
+        fprintf(stderr, "socket: no UDP GRO support: %s\n", strerror(errno));
+        return;
+    }
+
+    s->gro_buff = malloc(IO_GRO_BATCH * IO_GRO_BUFF_SZ);
+    if (!s->gro_buff) {
+        setsockopt(s->fd, SOL_UDP, UDP_GRO, &zero, sizeof (zero));
+        return;
+    }
+    s->gro = 1;
+    s->pool_low = IO_GSO_MAX_SEGS;
+}
+
+/*
+ * Let reads of the socket poll the device for datagrams not delivered yet
+ * rather than leave them to the interrupt, and have the kernel hold back
+ * interrupts in favour of such reads while they keep coming.
+ */
+static void io_shard_busy_poll(struct io_shard *s)
+{
+    int usecs = dispatch_opts.busy_poll_us;
+    int one = 1;
+
+    if (!usecs)
+        return;
+
+    if (setsockopt(s->fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof (usecs)))
+        fprintf(stderr, "socket: no busy polling: %s\n", strerror(errno));
+    else if (setsockopt(s->fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one,
+                        sizeof (one)))
+        fprintf(stderr, "socket: no preferred busy polling: %s\n",
+                strerror(errno));
+}
+
+/*
+ * Socket I/O on the dispatch's io_uring, for backends whose sockets it can
+ * use as they are. Kernels without buffer rings have the socket polled.
+ */
+static int io_shard_ring(struct io_shard *s)
+{
+    struct io_ring_msg *m;
+    struct io_ring *r;
+    int i;
+
+    if (!s->d.ring || !io_opts.backend->uring)
+        return 0;
+
+    r = calloc(1, sizeof (*r));
+    if (!r)
+        return -1;
+
+    if (uring_bufs_init(s->d.ring, &r->bufs, PKT_POOL_SZ, 0)) {
+        fprintf(stderr, "io_uring: no buffer rings (%s), polling sockets.\n",
+                strerror(errno));
+        free(r);
+        return 0;
+    }
+
+    r->rx_req.handler = socket_ring_rx_done;
+    r->s = s;
+    r->rx_msg.msg_namelen = sizeof (struct sockaddr_in);
+    for (i = 0; i < PKT_POOL_SZ; i++)
+        r->free_bids[i] = i;
+    r->nfree_bids = PKT_POOL_SZ;
+
+    for (i = 0; i < IO_RING_TX_MSGS; i++) {
+        m = &r->tx_msgs[i];
+        m->req.handler = socket_ring_tx_done;
+        m->s = s;
+        m->next = r->tx_free;
+        r->tx_free = m;
+    }
+    r->tx_nfree = IO_RING_TX_MSGS;
+
+    s->ring = r;
+
+    return 0;
+}
+
+/*
+ * Once the buffer ring is unregistered, and the dispatch has completed the
+ * sends and closed the ring, the packets the kernel held are the shard's.
+ */
+static void io_shard_ring_cleanup(struct io_shard *s)
+{
+    struct io_ring *r = s->ring;
     int i;
-    struct peer *serv = NULL;
 
-    pktqueue_init(&rx_pool);
-    pktqueue_init(&tx_queue);
     for (i = 0; i < PKT_POOL_SZ; i++) {
-        p = pkt_alloc(PKT_BUFF_SZ);
+        if (r->bufs_pkts[i])
+            pkt_free(r->bufs_pkts[i]);
+    }
+    for (i = 0; i < r->nrx; i++)
+        pkt_free(r->rx_pkts[i]);
+    free(r);
+    s->ring = NULL;
+}
+
+/*
+ * With threaded tunnel queues, a worker pool or the hub's interface, shared
+ * by peers of every shard, packets come and go from several threads at
+ * once; otherwise everything happens on the shard's own.
+ */
+static int io_shard_init(struct io *io, struct io_shard *s, int fd)
+{
+    int mode = iface_opts.queues > 1 || workers_enabled() || hub_enabled() ?
+               PKTRING_MPMC : PKTRING_SPSC;
+    unsigned short flags = EVENT_READ;
+    struct pkt *p;
+    int i;
+
+    if (dispatch_opts.edge_triggered)
+        flags |= EVENT_EDGE_TRIGGERED;
+
+    s->io = io;
+    s->fd = fd;
+    s->pool_low = 1;
+    if (peer_table_init(&s->peers))
+        return -1;
+
+    lock_init(&s->flows_lock);
+    TAILQ_INIT(&s->flows);
+    SIMPLEQ_INIT(&s->unsent);
+
+    s->rx_pool = pktring_create(PKT_POOL_SZ, mode);
+    if (!s->rx_pool)
+        goto free_rings;
+
+    if (dispatch_init(&s->d))
+        goto free_rings;
+
+    if (io_shard_ring(s)) {
+        dispatch_cleanup(&s->d);
+        goto free_rings;
+    }
+    if (s->ring)
+        flags |= EVENT_URING_READ | EVENT_URING_WRITE;
+
+    s->ev = event_create(&s->d, fd, flags, socket_event_handler, s);
+    if (!s->ev) {
+        if (s->ring) {
+            uring_bufs_cleanup(s->d.ring, &s->ring->bufs);
+            io_shard_ring_cleanup(s);
+        }
+        dispatch_cleanup(&s->d);
+        goto free_rings;
+    }
+
+    for (i = 0; i < PKT_POOL_SZ; i++) {
+        p = s->ring ? pkt_alloc_room(PKT_BUFF_SZ, IO_RING_RX_HDR, 0) :
+                      pkt_alloc(PKT_BUFF_SZ);
         if (!p)
             break;
-        pktqueue_enqueue(&rx_pool, p);
+        pktring_enqueue(s->rx_pool, p);
     }
 
-    rc = dispatch_init(&evt_dispatch);
-    if (rc)
-        goto error;
+    io_shard_offload(s);
+    io_shard_busy_poll(s);
 
-    socket_event = event_create(&evt_dispatch, sockfd, EVENT_READ,
-                                socket_event_handler, NULL);
-    if (!socket_event)
+    return 0;
+
+free_rings:
+    pktring_destroy(s->rx_pool);
+    peer_table_cleanup(&s->peers);
+    return -1;
+}
+
+static void io_shard_cleanup(struct io_shard *s)
+{
+    struct pkt *p;
+
+    if (s->ring)
+        uring_bufs_cleanup(s->d.ring, &s->ring->bufs);
+    dispatch_cleanup(&s->d);
+    if (s->ring)
+        io_shard_ring_cleanup(s);
+    peer_table_cleanup(&s->peers);
+    while ((p = pktring_dequeue(s->rx_pool))) {
+        pkt_free(p);
+    }
+    pktring_destroy(s->rx_pool);
+    free(s->gro_buff);
+}
+
+struct io *io_create(int *fds, int nfds, struct sockaddr_in *remote)
+{
+    struct io *io;
+    struct peer *serv;
+
+    io = calloc(1, sizeof (*io));
+    if (!io)
+        return NULL;
+
+    io->shards = calloc(nfds, sizeof (*io->shards));
+    if (!io->shards)
         goto cleanup;
 
-    listen_mode = !remote;
+    for (io->nshards = 0; io->nshards < nfds; io->nshards++) {
+        if (io_shard_init(io, &io->shards[io->nshards], fds[io->nshards]))
+            goto cleanup;
+    }
+
+    io->listen_mode = !remote;
+
+    /* Peers may be anywhere: assume Ethernet, probing tells them apart */
+    if (!remote && hub_enabled() && hub_start(&io->shards[0].d, ETH_DATA_LEN))
+        goto cleanup;
 
     if (remote) {
-        serv = peer_create(&evt_dispatch, remote, socket_tx_schedule);
+        serv = io_peer_create(&io->shards[0], remote);
         if (!serv)
             goto cleanup;
         peer_connect(serv);
     }
 
-    rc = event_dispatch(&evt_dispatch);
+    if (metrics_register(io_metrics_collect, io))
+        fprintf(stderr, "metrics: too many collectors.\n");
 
-    if (serv) {
-        peer_destroy(serv);
-    }
+    return io;
 
 cleanup:
-    dispatch_cleanup(&evt_dispatch);
-error:
-    while ((p = pktqueue_dequeue(&rx_pool))) {
-        pkt_free(p);
+    io_destroy(io);
+    return NULL;
+}
+
+/*
+ * Shard 0 runs on the calling thread, every other shard on a thread of its
+ * own. The whole thing stops as soon as shard 0 does.
+ */
+int io_run(struct io *io)
+{
+    struct io_shard *shards = io->shards;
+    int rc = -1;
+    int started;
+    int i;
+
+    for (started = 1; started < io->nshards; started++) {
+        if (dispatch_spawn(&shards[started].d, &shards[started].thread))
+            break;
     }
-    while ((p = pktqueue_dequeue(&tx_queue))) {
-        pkt_free(p);
+
+    if (started == io->nshards)
+        rc = event_dispatch(&shards[0].d);
+
+    for (i = 1; i < started; i++) {
+        dispatch_stop(&shards[i].d);
+        pthread_join(shards[i].thread, NULL);
     }
+
     return rc;
 }
 
+/* Makes io_run() return, from any thread */
+void io_stop(struct io *io)
+{
+    dispatch_stop(&io->shards[0].d);
+}
+
+/*
+ * Peers go first, then the hub: their interfaces hold packets of the shards'
+ * pools.
+ */
+void io_destroy(struct io *io)
+{
+    struct peer *p;
+    int i;
+
+    metrics_unregister(io_metrics_collect, io);
+
+    for (i = 0; i < io->nshards; i++) {
+        while ((p = LIST_FIRST(&io->shards[i].peers.peers)))
+            peer_destroy(p);
+    }
+    hub_stop();
+
+    for (i = 0; i < io->nshards; i++)
+        io_shard_cleanup(&io->shards[i]);
+    free(io->shards);
+    free(io);
+}
+
+int io_dispatch(int *fds, int nfds, struct sockaddr_in *remote)
+{
+    struct io *io;
+    int rc;
+
+    io = io_create(fds, nfds, remote);
+    if (!io)
+        return -1;
+
+    rc = io_run(io);
+
+    io_stats_print(io, stdout);
+    pktslab_stats_print(stdout);
+
+    io_destroy(io);
+
+    return rc;
+}
+
+static int udp_recv(int fd, struct mmsghdr *msgs, unsigned int n)
+{
+    return recvmmsg(fd, msgs, n, MSG_DONTWAIT, NULL);
+}
+
+static int udp_send(int fd, struct mmsghdr *msgs, unsigned int n)
+{
+    return sendmmsg(fd, msgs, n, MSG_DONTWAIT);
+}
+
+static int udp_mtu(struct sockaddr_in *addr)
+{
+    int sock;
+    int mtu = ETH_DATA_LEN;
+    int rc;
+    socklen_t len = sizeof (mtu);
+
+    /* HACK: To discover MTU, Create and connect back a socket to the host */
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0)
+        return mtu;
+    rc = connect(sock, (struct sockaddr *) addr, sizeof (*addr));
+    if (rc) {
+        fprintf(stderr, "%s: connect() failed: %s\n", __func__,
+                strerror(errno));
+        goto close;
+    }
+
+    rc = getsockopt(sock, IPPROTO_IP, IP_MTU, &mtu, &len);
+    if (rc)
+        fprintf(stderr, "Error Getting MTU: %s\n", strerror(errno));
+
+close:
+    close(sock);
+
+    return mtu;
+}
+
+const struct io_backend io_udp_backend = {
+    .name = "udp",
+    .offload = 1,
+    .uring = 1,
+    .recv = udp_recv,
+    .send = udp_send,
+    .mtu = udp_mtu,
+};
@@ -0,0 +1,120 @@
+/*
+ *  Copyright (c) 2011, Julian Pidancet <julian.pidancet@gmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *  3. Neither the name of Julian Pidancet nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#ifndef IO_H_
+#define IO_H_
+
+#include <stdio.h>
+#include <netinet/in.h>
+
+#define IO_BATCH_MAX 256
+#define IO_BATCH_DEFAULT 32
+#define IO_MAX_SHARDS 64
+
+/* Most datagrams sent or received as one UDP GSO/GRO message */
+#define IO_GSO_MAX_SEGS 64
+
+/*
+ * What the transport sockets are. The UDP backend is the real thing, others
+ * stand in for it with whatever datagram sockets they like, as long as
+ * received messages come with the sockaddr_in of the peer that sent them.
+ */
+struct mmsghdr;
+
+struct io_backend
+{
+    const char *name;
+    int offload;        /* Takes UDP GSO/GRO socket options and messages */
+    int uring;          /* Plain sockets io_uring may receive and send on */
+    int (*recv)(int fd, struct mmsghdr *msgs, unsigned int n);
+    int (*send)(int fd, struct mmsghdr *msgs, unsigned int n);
+    int (*mtu)(struct sockaddr_in *addr);   /* Link MTU towards a peer */
+};
+
+extern const struct io_backend io_udp_backend;
+
+#define IO_WEIGHT_MAX 100
+#define IO_WEIGHTS_MAX 64
+
+/* Share of the socket given to the peers connecting from addr */
+struct io_weight
+{
+    struct in_addr addr;
+    int weight;
+};
+
+struct io_opts
+{
+    const struct io_backend *backend;
+    int batch;          /* Messages per recvmmsg()/sendmmsg() call */
+    int shards;         /* SO_REUSEPORT listening sockets, one thread each */
+    int steer;          /* Pin peers to shards with a reuseport BPF program */
+    int udp_offload;    /* UDP_SEGMENT on send and UDP_GRO on receive */
+    int weight;         /* Of peers with none of their own */
+    int nweights;
+    struct io_weight weights[IO_WEIGHTS_MAX];
+};
+
+struct io_stats
+{
+    unsigned long rx_batches;   /* recvmmsg() calls or ring rounds with data */
+    unsigned long rx_pkts;
+    unsigned long rx_full;      /* Batches that came back completely filled */
+    unsigned long tx_batches;   /* sendmmsg() calls or ring rounds sending */
+    unsigned long tx_pkts;
+    unsigned long tx_partial;   /* Batches the kernel only partially took */
+
+    /* UDP offload only, packets above are counted as datagrams */
+    unsigned long gro_msgs;     /* Coalesced messages received */
+    unsigned long gro_segs;     /* Datagrams they were split into */
+    unsigned long gso_msgs;     /* Messages sent with a segment size */
+    unsigned long gso_segs;     /* Datagrams they were cut into */
+    unsigned long rx_drops;     /* Datagrams lost for want of a buffer */
+
+    unsigned long tx_drops;     /* Packets to send that found no room */
+    unsigned long tx_hiwat;     /* Most packets ever queued for one peer */
+};
+
+extern struct io_opts io_opts;
+
+struct io;
+
+int io_parse_weight(const char *s);
+struct io *io_create(int *fds, int nfds, struct sockaddr_in *remote);
+int io_run(struct io *io);
+void io_stop(struct io *io);
+void io_destroy(struct io *io);
+void io_stats_get(struct io *io, struct io_stats *st);
+void io_stats_print(struct io *io, FILE *f);
+int io_dispatch(int *fds, int nfds, struct sockaddr_in *remote);
+
+#endif /* IO_H_ */
@@ -0,0 +1,316 @@
+/*
+ *  Copyright (c) 2011, Julian Pidancet <julian.pidancet@gmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *  3. Neither the name of Julian Pidancet nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lpm.h"
+
+#define LPM_RULES_MIN 64
+
+#define LPM_ENTRY(nh, depth) \
+    (LPM_VALID | (uint32_t)(depth) << LPM_DEPTH_SHIFT | (nh))
+
+static inline uint32_t lpm_mask(int depth)
+{
+    return depth ? ~0u << (32 - depth) : 0;
+}
+
+static inline size_t lpm_rule_hash(struct lpm *l, uint32_t prefix, int depth)
+{
+    uint64_t key = (uint64_t)prefix << 6 | depth;
+
+    return (key * 0x9e3779b97f4a7c15ull) >> 32 & (l->rules_size - 1);
+}
+
+static struct lpm_rule *lpm_rule_find(struct lpm *l, uint32_t prefix,
+                                      int depth)
+{
+    size_t mask = l->rules_size - 1;
+    struct lpm_rule *r;
+    size_t i;
+
+    for (i = lpm_rule_hash(l, prefix, depth);; i = (i + 1) & mask) {
+        r = &l->rules[i];
+        if (!r->used)
+            return NULL;
+        if (r->prefix == prefix && r->depth == depth)
+            return r;
+    }
+}
+
+static struct lpm_rule *lpm_rule_slot(struct lpm *l, uint32_t prefix,
+                                      int depth)
+{
+    size_t mask = l->rules_size - 1;
+    size_t i;
+
+    for (i = lpm_rule_hash(l, prefix, depth); l->rules[i].used;
+         i = (i + 1) & mask)
+        ;
+
+    return &l->rules[i];
+}
+
+static int lpm_rules_grow(struct lpm *l)
+{
+    struct lpm_rule *old = l->rules;
+    size_t size = l->rules_size;
+    size_t i;
+
+    l->rules = calloc(size * 2, sizeof (*l->rules));
+    if (!l->rules) {
+        l->rules = old;
+        return -1;
+    }
+    l->rules_size = size * 2;
+
+    for (i = 0; i < size; i++) {
+        if (old[i].used)
+            *lpm_rule_slot(l, old[i].prefix, old[i].depth) = old[i];
+    }
+    free(old);
+
+    return 0;
+}
+
+/* Backward shift: pull later rules of the run into the hole when allowed */
+static void lpm_rule_del(struct lpm *l, struct lpm_rule *r)
+{
+    size_t mask = l->rules_size - 1;
+    size_t i = r - l->rules;
+    size_t j = i;
+    size_t home;
+
+    for (;;) {
+        j = (j + 1) & mask;
+        if (!l->rules[j].used)
+            break;
+        home = lpm_rule_hash(l, l->rules[j].prefix, l->rules[j].depth);
+        if (j > i ? (home <= i || home > j) : (home <= i && home > j)) {
+            l->rules[i] = l->rules[j];
+            i = j;
+        }
+    }
+    l->rules[i].used = 0;
+    l->nrules--;
+}
+
+/* Entries a rule of that depth may set: empty ones, or set by no longer */
+static inline int lpm_covered(uint32_t e, int depth)
+{
+    return !(e & LPM_VALID) || (int)LPM_DEPTH(e) <= depth;
+}
+
+static void lpm_fill8(uint32_t *group, uint32_t from, uint32_t n, int depth,
+                      uint32_t e)
+{
+    for (; n--; from++) {
+        if (lpm_covered(group[from], depth))
+            group[from] = e;
+    }
+}
+
+static void lpm_fill24(struct lpm *l, uint32_t prefix, int depth, uint32_t e)
+{
+    uint32_t n = 1u << (24 - depth);
+    uint32_t i = prefix >> 8;
+    uint32_t x;
+
+    for (; n--; i++) {
+        x = l->tbl24[i];
+        if (x & LPM_EXT)
+            lpm_fill8(l->tbl8 + (x & LPM_NH_MASK) * LPM_GROUP_SZ, 0,
+                      LPM_GROUP_SZ, depth, e);
+        else if (lpm_covered(x, depth))
+            l->tbl24[i] = e;
+    }
+}
+
+/*
+ * Prefixes longer than /24 go to the group of their /24, created from its
+ * entry if needed, and folded back into it once it holds nothing longer.
+ */
+static int lpm_fill32(struct lpm *l, uint32_t prefix, int depth, uint32_t e)
+{
+    uint32_t i = prefix >> 8;
+    uint32_t x = l->tbl24[i];
+    uint32_t *group;
+    uint32_t g, j;
+
+    if (x & LPM_EXT) {
+        g = x & LPM_NH_MASK;
+    } else {
+        if (l->nfree)
+            g = l->free_groups[--l->nfree];
+        else if (l->used_groups < l->ngroups)
+            g = l->used_groups++;
+        else
+            return -1;
+        group = l->tbl8 + g * LPM_GROUP_SZ;
+        for (j = 0; j < LPM_GROUP_SZ; j++)
+            group[j] = x;
+        l->tbl24[i] = LPM_EXT | g;
+    }
+
+    group = l->tbl8 + g * LPM_GROUP_SZ;
+    lpm_fill8(group, prefix & 0xff, 1u << (32 - depth), depth, e);
+
+    for (j = 1; j < LPM_GROUP_SZ && group[j] == group[0]; j++)
+        ;
+    if (j == LPM_GROUP_SZ && lpm_covered(group[0], 24)) {
+        l->tbl24[i] = group[0];
+        l->free_groups[l->nfree++] = g;
+    }
+
+    return 0;
+}
+
+/* Adds the rule, or changes its next hop */
+int lpm_add(struct lpm *l, uint32_t prefix, int depth, uint32_t nh)
+{
+    struct lpm_rule *r;
+    uint32_t e;
+
+    if (depth < 0 || depth > 32 || nh > LPM_NH_MAX)
+        return -1;
+    prefix &= lpm_mask(depth);
+
+    r = lpm_rule_find(l, prefix, depth);
+    if (!r && (l->nrules + 1) * 2 > l->rules_size && lpm_rules_grow(l))
+        return -1;
+
+    e = LPM_ENTRY(nh, depth);
+    if (depth <= 24)
+        lpm_fill24(l, prefix, depth, e);
+    else if (lpm_fill32(l, prefix, depth, e))
+        return -1;
+
+    if (!r) {
+        r = lpm_rule_slot(l, prefix, depth);
+        r->prefix = prefix;
+        r->depth = depth;
+        r->used = 1;
+        l->nrules++;
+    }
+    r->nh = nh;
+
+    return 0;
+}
+
+int lpm_del(struct lpm *l, uint32_t prefix, int depth)
+{
+    struct lpm_rule *r, *parent = NULL;
+    uint32_t e = 0;
+    int d;
+
+    if (depth < 0 || depth > 32)
+        return -1;
+    prefix &= lpm_mask(depth);
+
+    r = lpm_rule_find(l, prefix, depth);
+    if (!r)
+        return -1;
+    lpm_rule_del(l, r);
+
+    for (d = depth - 1; d >= 0 && !parent; d--)
+        parent = lpm_rule_find(l, prefix & lpm_mask(d), d);
+    if (parent)
+        e = LPM_ENTRY(parent->nh, parent->depth);
+
+    if (depth <= 24)
+        lpm_fill24(l, prefix, depth, e);
+    else
+        lpm_fill32(l, prefix, depth, e);
+
+    return 0;
+}
+
+/*
+ * Deletes every rule going to nh, and returns how many. Rules shifted back
+ * into the slot just emptied are looked at again; those wrapping around from
+ * the start of the table were already, and do not go to nh.
+ */
+int lpm_del_nh(struct lpm *l, uint32_t nh)
+{
+    struct lpm_rule *r;
+    size_t i = 0;
+    int n = 0;
+
+    while (i < l->rules_size) {
+        r = &l->rules[i];
+        if (r->used && r->nh == nh) {
+            lpm_del(l, r->prefix, r->depth);
+            n++;
+            continue;
+        }
+        i++;
+    }
+
+    return n;
+}
+
+/*
+ * The flat table takes 64 MiB of address space and each group 1 KiB, all
+ * zeroed lazily by the kernel: only the parts routes were written to are
+ * ever backed by memory.
+ */
+struct lpm *lpm_create(uint32_t ngroups)
+{
+    struct lpm *l;
+
+    l = calloc(1, sizeof (*l));
+    if (!l)
+        return NULL;
+
+    l->ngroups = ngroups;
+    l->tbl24 = calloc(LPM_TBL24_SZ, sizeof (*l->tbl24));
+    l->tbl8 = calloc((size_t)ngroups * LPM_GROUP_SZ, sizeof (*l->tbl8));
+    l->free_groups = calloc(ngroups, sizeof (*l->free_groups));
+    l->rules_size = LPM_RULES_MIN;
+    l->rules = calloc(l->rules_size, sizeof (*l->rules));
+    if (!l->tbl24 || !l->tbl8 || !l->free_groups || !l->rules) {
+        lpm_destroy(l);
+        return NULL;
+    }
+
+    return l;
+}
+
+void lpm_destroy(struct lpm *l)
+{
+    free(l->tbl24);
+    free(l->tbl8);
+    free(l->free_groups);
+    free(l->rules);
+    free(l);
+}
@@ -0,0 +1,122 @@
+/*
+ *  Copyright (c) 2011, Julian Pidancet <julian.pidancet@gmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *  3. Neither the name of Julian Pidancet nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#ifndef LPM_H_
+#define LPM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * IPv4 longest prefix match, DIR-24-8 style: the top 24 bits of an address
+ * index a flat table whose entries either hold the answer or point to a
+ * group of 256 entries indexed by the last 8 bits, which exists only for
+ * the /24s holding longer prefixes. A lookup is one or two memory accesses,
+ * however many routes there are.
+ *
+ * Entries carry the depth of the prefix which set them, so that shorter
+ * prefixes never overwrite longer ones, and the rules themselves are kept
+ * in a hash table: deleting one refills its entries from the next shorter
+ * rule covering it.
+ *
+ * Next hops are up to 24 bits. Addresses and prefixes are in host order.
+ * Nothing is locked here.
+ */
+
+#define LPM_VALID 0x80000000u
+#define LPM_EXT 0x40000000u     /* Points to a group of 256 entries */
+#define LPM_DEPTH_SHIFT 24
+#define LPM_NH_MASK 0x00ffffffu
+#define LPM_NH_MAX LPM_NH_MASK
+#define LPM_DEPTH(e) (((e) >> LPM_DEPTH_SHIFT) & 0x3f)
+
+#define LPM_TBL24_SZ (1u << 24)
+#define LPM_GROUP_SZ 256
+
+struct lpm_rule
+{
+    uint32_t prefix;
+    uint32_t nh;
+    uint8_t depth;
+    uint8_t used;
+};
+
+struct lpm
+{
+    uint32_t *tbl24;
+    uint32_t *tbl8;
+    uint32_t ngroups;
+    uint32_t used_groups;       /* Handed out at least once */
+    uint32_t *free_groups;
+    uint32_t nfree;
+
+    struct lpm_rule *rules;
+    size_t rules_size;          /* Power of two */
+    size_t nrules;
+};
+
+struct lpm *lpm_create(uint32_t ngroups);
+void lpm_destroy(struct lpm *l);
+int lpm_add(struct lpm *l, uint32_t prefix, int depth, uint32_t nh);
+int lpm_del(struct lpm *l, uint32_t prefix, int depth);
+int lpm_del_nh(struct lpm *l, uint32_t nh);
+
+static inline int lpm_lookup(const struct lpm *l, uint32_t addr, uint32_t *nh)
+{
+    uint32_t e = l->tbl24[addr >> 8];
+
+    if (e & LPM_EXT)
+        e = l->tbl8[(e & LPM_NH_MASK) * LPM_GROUP_SZ + (addr & 0xff)];
+    if (!(e & LPM_VALID))
+        return -1;
+    *nh = e & LPM_NH_MASK;
+
+    return 0;
+}
+
+/* Same, also giving the depth of the prefix matched */
+static inline int lpm_match(const struct lpm *l, uint32_t addr, uint32_t *nh,
+                            int *depth)
+{
+    uint32_t e = l->tbl24[addr >> 8];
+
+    if (e & LPM_EXT)
+        e = l->tbl8[(e & LPM_NH_MASK) * LPM_GROUP_SZ + (addr & 0xff)];
+    if (!(e & LPM_VALID))
+        return -1;
+    *nh = e & LPM_NH_MASK;
+    *depth = LPM_DEPTH(e);
+
+    return 0;
+}
+
+#endif /* LPM_H_ */
@@ -0,0 +1,278 @@
+/*
+ *  Copyright (c) 2011, Julian Pidancet <julian.pidancet@gmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *  3. Neither the name of Julian Pidancet nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <string.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+
+#define METRICS_REQ_TIMEOUT_MS 100
+
+static struct
+{
+    metrics_collect_t collect;
+    void *priv;
+} collectors[METRICS_MAX_COLLECTORS];
+
+/* Held while collecting, so unregistering waits for scrapes in progress */
+static pthread_mutex_t collectors_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int listen_fd = -1;
+static struct sockaddr_un listen_addr;
+static pthread_t thread;
+
+void metrics_printf(struct metrics_buf *b, const char *fmt, ...)
+{
+    va_list ap;
+    size_t size;
+    char *buf;
+    int rc;
+
+    for (;;) {
+        va_start(ap, fmt);
+        rc = vsnprintf(b->buf + b->len, b->size - b->len, fmt, ap);
+        va_end(ap);
+        if (rc < 0) {
+            b->err = 1;
+            return;
+        }
+        if ((size_t)rc < b->size - b->len)
+            break;
+
+        size = b->size ? b->size * 2 : 4096;
+        while (size - b->len <= (size_t)rc)
+            size *= 2;
+        buf = realloc(b->buf, size);
+        if (!buf) {
+            b->err = 1;
+            return;
+        }
+        b->buf = buf;
+        b->size = size;
+    }
+
+    b->len += rc;
+}
+
+void metrics_family(struct metrics_buf *b, const char *name, const char *type,
+                    const char *help)
+{
+    metrics_printf(b, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+int metrics_register(metrics_collect_t collect, void *priv)
+{
+    int i;
+    int rc = -1;
+
+    pthread_mutex_lock(&collectors_lock);
+    for (i = 0; i < METRICS_MAX_COLLECTORS; i++) {
+        if (!collectors[i].collect) {
+            collectors[i].collect = collect;
+            collectors[i].priv = priv;
+            rc = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&collectors_lock);
+
+    return rc;
+}
+
+void metrics_unregister(metrics_collect_t collect, void *priv)
+{
+    int i;
+
+    pthread_mutex_lock(&collectors_lock);
+    for (i = 0; i < METRICS_MAX_COLLECTORS; i++) {
+        if (collectors[i].collect == collect && collectors[i].priv == priv)
+            collectors[i].collect = NULL;
+    }
+    pthread_mutex_unlock(&collectors_lock);
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t rc;
+
+    while (len) {
+        rc = write(fd, buf, len);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += rc;
+        len -= rc;
+    }
+
+    return 0;
+}
+
+/*
+ * Plain clients just connect and read. Give whoever has something to say a
+ * moment to say it, and answer in HTTP if it looks like a request.
+ */
+static int metrics_is_http(int fd)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    char req[512];
+    ssize_t rc;
+
+    if (poll(&pfd, 1, METRICS_REQ_TIMEOUT_MS) <= 0)
+        return 0;
+
+    rc = recv(fd, req, sizeof (req), MSG_DONTWAIT);
+    return rc >= 4 && !memcmp(req, "GET ", 4);
+}
+
+static void metrics_serve(int fd, struct metrics_buf *b)
+{
+    char hdr[128];
+    int http;
+    int i;
+
+    http = metrics_is_http(fd);
+
+    b->len = 0;
+    b->err = 0;
+    pthread_mutex_lock(&collectors_lock);
+    for (i = 0; i < METRICS_MAX_COLLECTORS; i++) {
+        if (collectors[i].collect)
+            collectors[i].collect(b, collectors[i].priv);
+    }
+    pthread_mutex_unlock(&collectors_lock);
+
+    if (b->err) {
+        fprintf(stderr, "metrics: out of memory.\n");
+        return;
+    }
+
+    if (http) {
+        snprintf(hdr, sizeof (hdr),
+                 "HTTP/1.0 200 OK\r\n"
+                 "Content-Type: text/plain; version=0.0.4\r\n"
+                 "Content-Length: %zu\r\n\r\n", b->len);
+        if (write_all(fd, hdr, strlen(hdr)))
+            return;
+    }
+    write_all(fd, b->buf, b->len);
+}
+
+static void *metrics_thread(void *priv)
+{
+    struct metrics_buf b;
+    int fd;
+
+    (void)priv;
+    memset(&b, 0, sizeof (b));
+
+    for (;;) {
+        fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            /* metrics_stop() shut the socket down */
+            break;
+        }
+
+        metrics_serve(fd, &b);
+        close(fd);
+    }
+
+    free(b.buf);
+
+    return NULL;
+}
+
+int metrics_start(const char *path)
+{
+    int rc;
+
+    if (strlen(path) >= sizeof (listen_addr.sun_path)) {
+        fprintf(stderr, "metrics: socket path too long: %s\n", path);
+        return -1;
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        fprintf(stderr, "metrics: socket(): %s\n", strerror(errno));
+        return -1;
+    }
+
+    memset(&listen_addr, 0, sizeof (listen_addr));
+    listen_addr.sun_family = AF_UNIX;
+    strcpy(listen_addr.sun_path, path);
+    unlink(path);
+
+    if (bind(listen_fd, (struct sockaddr *)&listen_addr,
+             sizeof (listen_addr)) ||
+        listen(listen_fd, 8)) {
+        fprintf(stderr, "metrics: failed to listen on %s: %s\n", path,
+                strerror(errno));
+        goto close;
+    }
+
+    rc = pthread_create(&thread, NULL, metrics_thread, NULL);
+    if (rc) {
+        fprintf(stderr, "pthread_create() failed: %s\n", strerror(rc));
+        unlink(path);
+        goto close;
+    }
+
+    return 0;
+
+close:
+    close(listen_fd);
+    listen_fd = -1;
+    return -1;
+}
+
+void metrics_stop(void)
+{
+    if (listen_fd < 0)
+        return;
+
+    shutdown(listen_fd, SHUT_RDWR);
+    pthread_join(thread, NULL);
+    close(listen_fd);
+    listen_fd = -1;
+    unlink(listen_addr.sun_path);
+}
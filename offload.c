@@ -0,0 +1,275 @@
+/*
+ *  Copyright (c) 2011, Julian Pidancet <julian.pidancet@gmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *  3. Neither the name of Julian Pidancet nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <linux/if.h>
+#include <linux/if_tun.h>
+#include <linux/if_ether.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "csum.h"
+#include "pktqueue.h"
+
+#include "offload.h"
+
+#define TCP_FLAG_ECE 0x40
+#define TCP_FLAG_CWR 0x80
+
+/*
+ * Finish the checksum of a packet the kernel handed over with
+ * VIRTIO_NET_HDR_F_NEEDS_CSUM: the field already holds the pseudo-header sum,
+ * what is left is summing everything from csum_start.
+ */
+int offload_csum(const struct virtio_net_hdr *vh, char *ip, size_t len)
+{
+    uint16_t check;
+
+    if (!(vh->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM))
+        return 0;
+    if ((size_t)vh->csum_start + vh->csum_offset + 2 > len)
+        return -1;
+
+    check = csum_fold(csum_partial(ip + vh->csum_start,
+                                   len - vh->csum_start, 0));
+    if (!check)
+        check = 0xffff;
+    memcpy(ip + vh->csum_start + vh->csum_offset, &check, sizeof (check));
+
+    return 0;
+}
+
+/*
+ * Returns the number of segments a TCPv4 super-packet is cut into, or -1 if
+ * it is not one we know how to cut into at most OFFLOAD_MAX_SEGS segments
+ * of at most mtu bytes.
+ */
+int offload_tso_count(const struct virtio_net_hdr *vh, const char *ip,
+                      size_t len, size_t mtu)
+{
+    const struct iphdr *iph = (const void *)ip;
+    const struct tcphdr *th;
+    size_t hlen;
+    size_t mss = vh->gso_size;
+
+    if ((vh->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) != VIRTIO_NET_HDR_GSO_TCPV4)
+        return -1;
+    if (len < sizeof (*iph) || iph->version != 4 || iph->ihl < 5 ||
+        iph->protocol != IPPROTO_TCP)
+        return -1;
+
+    hlen = iph->ihl * 4;
+    if (len < hlen + sizeof (*th))
+        return -1;
+    th = (const void *)(ip + hlen);
+    hlen += th->doff * 4;
+    if (th->doff < 5 || len <= hlen || !mss || hlen + mss > mtu)
+        return -1;
+    if ((len - hlen + mss - 1) / mss > OFFLOAD_MAX_SEGS)
+        return -1;
+
+    return (len - hlen + mss - 1) / mss;
+}
+
+/*
+ * Write segment k of a super-packet, headers included, to out. Returns the
+ * length of the segment.
+ */
+size_t offload_tso_segment(const struct virtio_net_hdr *vh, const char *ip,
+                           size_t len, int k, char *out)
+{
+    const struct iphdr *iph = (const void *)ip;
+    const struct tcphdr *th = (const void *)(ip + iph->ihl * 4);
+    struct iphdr *oiph = (void *)out;
+    struct tcphdr *oth = (void *)(out + iph->ihl * 4);
+    size_t mss = vh->gso_size;
+    size_t hlen = iph->ihl * 4 + th->doff * 4;
+    size_t off = hlen + k * mss;
+    size_t plen = len - off < mss ? len - off : mss;
+    size_t tcplen = th->doff * 4 + plen;
+
+    memcpy(out, ip, hlen);
+    memcpy(out + hlen, ip + off, plen);
+
+    oiph->tot_len = htons(hlen + plen);
+    oiph->id = htons(ntohs(iph->id) + k);
+    oiph->check = 0;
+    oiph->check = csum_fold(csum_partial(oiph, iph->ihl * 4, 0));
+
+    oth->seq = htonl(ntohl(th->seq) + k * mss);
+    if (k)
+        oth->th_flags &= ~TCP_FLAG_CWR;
+    if (off + plen < len)
+        oth->th_flags &= ~(TH_FIN | TH_PUSH);
+    oth->check = 0;
+    oth->check = csum_fold(csum_add(csum_pseudo(iph->saddr, iph->daddr,
+                                                IPPROTO_TCP, tcplen),
+                                    csum_partial(oth, tcplen, 0)));
+
+    return hlen + plen;
+}
+
+/*
+ * Returns the TCP header of a packet that may take part in a merge, NULL
+ * otherwise: plain IPv4 without options or fragments, TCP carrying data with
+ * nothing but ACK and PSH set.
+ */
+static struct tcphdr *gro_tcp(struct pkt *p, size_t *payload)
+{
+    struct tun_pi *pi = (void *)p->buff;
+    struct iphdr *iph = (void *)(p->buff + sizeof (*pi));
+    struct tcphdr *th = (void *)(iph + 1);
+    size_t len = p->pkt_size - sizeof (*pi);
+    size_t hlen;
+
+    if (p->pkt_size < sizeof (*pi) + sizeof (*iph) + sizeof (*th) ||
+        pi->proto != htons(ETH_P_IP))
+        return NULL;
+    if (iph->version != 4 || iph->ihl != 5 || iph->protocol != IPPROTO_TCP ||
+        ntohs(iph->tot_len) != len ||
+        (iph->frag_off & htons(IP_MF | IP_OFFMASK)))
+        return NULL;
+    if ((th->th_flags & ~TH_PUSH) != TH_ACK || th->doff < 5)
+        return NULL;
+
+    hlen = sizeof (*iph) + th->doff * 4;
+    if (len <= hlen)
+        return NULL;
+    *payload = len - hlen;
+
+    return th;
+}
+
+/*
+ * Merge as many of the n packets as possible, starting from the first, into
+ * a single super-packet. Segments must follow each other in sequence and
+ * carry identical headers otherwise; all but the last must be full sized.
+ *
+ * Returns the number of packets merged. When more than one, the first
+ * packet's headers are rewritten to describe the whole and g->vh tells the
+ * kernel how to cut it again. The payload of the following packets starts
+ * g->vh.hdr_len bytes past their tun_pi.
+ */
+int offload_gro(struct pkt **pkts, int n, struct offload_gro *g)
+{
+    struct iphdr *iph, *iph2;
+    struct tcphdr *th, *th2;
+    size_t mss, payload, total;
+    size_t hlen;
+    uint32_t seq;
+    int push = 0;
+    int i;
+
+    memset(&g->vh, 0, sizeof (g->vh));
+    g->count = 1;
+
+    th = gro_tcp(pkts[0], &mss);
+    if (!th || (th->th_flags & TH_PUSH))
+        return 1;
+    iph = (void *)(pkts[0]->buff + sizeof (struct tun_pi));
+    hlen = sizeof (*iph) + th->doff * 4;
+    total = mss;
+    seq = ntohl(th->seq) + mss;
+
+    for (i = 1; i < n && i < OFFLOAD_MAX_SEGS; i++) {
+        th2 = gro_tcp(pkts[i], &payload);
+        if (!th2)
+            break;
+        iph2 = (void *)(pkts[i]->buff + sizeof (struct tun_pi));
+
+        if (iph2->saddr != iph->saddr || iph2->daddr != iph->daddr ||
+            iph2->tos != iph->tos || iph2->ttl != iph->ttl ||
+            iph2->frag_off != iph->frag_off)
+            break;
+        if (th2->source != th->source || th2->dest != th->dest ||
+            th2->ack_seq != th->ack_seq || th2->window != th->window ||
+            th2->doff != th->doff ||
+            memcmp(th2 + 1, th + 1, th->doff * 4 - sizeof (*th)))
+            break;
+        if (ntohl(th2->seq) != seq || payload > mss ||
+            hlen + total + payload > IP_MAXPACKET)
+            break;
+
+        total += payload;
+        seq += payload;
+        push = th2->th_flags & TH_PUSH;
+        if (push || payload < mss) {
+            i++;
+            break;
+        }
+    }
+
+    if (i == 1)
+        return 1;
+
+    g->count = i;
+    g->tot_len = iph->tot_len;
+    g->ip_check = iph->check;
+    g->tcp_check = th->check;
+    g->tcp_flags = th->th_flags;
+
+    if (push)
+        th->th_flags |= TH_PUSH;
+    iph->tot_len = htons(hlen + total);
+    iph->check = 0;
+    iph->check = csum_fold(csum_partial(iph, sizeof (*iph), 0));
+    th->check = ~csum_fold(csum_pseudo(iph->saddr, iph->daddr, IPPROTO_TCP,
+                                       th->doff * 4 + total));
+
+    g->vh.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    g->vh.gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+    g->vh.hdr_len = hlen;
+    g->vh.gso_size = mss;
+    g->vh.csum_start = sizeof (*iph);
+    g->vh.csum_offset = offsetof(struct tcphdr, check);
+
+    return i;
+}
+
+/* Restore the first packet of a merge that could not be written */
+void offload_gro_undo(struct pkt *p, struct offload_gro *g)
+{
+    struct iphdr *iph = (void *)(p->buff + sizeof (struct tun_pi));
+    struct tcphdr *th = (void *)(iph + 1);
+
+    if (g->count == 1)
+        return;
+
+    iph->tot_len = g->tot_len;
+    iph->check = g->ip_check;
+    th->check = g->tcp_check;
+    th->th_flags = g->tcp_flags;
+}
@@ -0,0 +1,70 @@
+/*
+ *  Copyright (c) 2011, Julian Pidancet <julian.pidancet@gmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *  3. Neither the name of Julian Pidancet nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#ifndef OFFLOAD_H_
+#define OFFLOAD_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/virtio_net.h>
+
+#include "pktqueue.h"
+
+/*
+ * Segmentation and coalescing of TCPv4 super-packets exchanged with a tun
+ * device opened with IFF_VNET_HDR.
+ */
+
+/* Most segments a super-packet is cut into or built from */
+#define OFFLOAD_MAX_SEGS 64
+
+struct offload_gro
+{
+    struct virtio_net_hdr vh;
+    int count;
+
+    /* First packet's header fields, as they were before the merge */
+    uint16_t tot_len;
+    uint16_t ip_check;
+    uint16_t tcp_check;
+    uint8_t tcp_flags;
+};
+
+int offload_csum(const struct virtio_net_hdr *vh, char *ip, size_t len);
+int offload_tso_count(const struct virtio_net_hdr *vh, const char *ip,
+                      size_t len, size_t mtu);
+size_t offload_tso_segment(const struct virtio_net_hdr *vh, const char *ip,
+                           size_t len, int k, char *out);
+int offload_gro(struct pkt **pkts, int n, struct offload_gro *g);
+void offload_gro_undo(struct pkt *p, struct offload_gro *g);
+
+#endif /* OFFLOAD_H_ */
@@ -0,0 +1,150 @@
+/*
+ *  Copyright (c) 2011, Julian Pidancet <julian.pidancet@gmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *  3. Neither the name of Julian Pidancet nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "pair.h"
+
+struct pair_opts pair_opts;
+
+static int pair_socketpair(int fds[2])
+{
+    if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0,
+                   fds)) {
+        fprintf(stderr, "socketpair(): %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int pair_open(struct iface *iface, int multi)
+{
+    static int count;
+    int fds[2];
+
+    (void)multi;
+
+    if (iface_opts.offload) {
+        fprintf(stderr, "pair: no offload support.\n");
+        return -1;
+    }
+
+    if (pair_socketpair(fds))
+        return -1;
+
+    if (!iface->name[0])
+        snprintf(iface->name, IFNAMSIZ, "pair%d",
+                 __atomic_fetch_add(&count, 1, __ATOMIC_RELAXED));
+
+    if (pair_opts.attach)
+        pair_opts.attach(iface, fds[1], pair_opts.priv);
+    else
+        close(fds[1]);
+
+    return fds[0];
+}
+
+static void pair_set_mtu(struct iface *iface, int mtu)
+{
+    (void)iface;
+    (void)mtu;
+}
+
+const struct iface_backend iface_pair_backend = {
+    .name = "pair",
+    .open = pair_open,
+    .set_mtu = pair_set_mtu,
+};
+
+int pair_transport(int fds[2])
+{
+    return pair_socketpair(fds);
+}
+
+/* Where each end of the transport sees the other one */
+void pair_addr(struct sockaddr_in *addr)
+{
+    memset(addr, 0, sizeof (*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr->sin_port = htons(1);
+}
+
+/* Messages come from an unbound socket, i.e. nowhere: fill in the far end */
+static int pair_recv(int fd, struct mmsghdr *msgs, unsigned int n)
+{
+    int rc;
+    int i;
+
+    rc = recvmmsg(fd, msgs, n, MSG_DONTWAIT, NULL);
+    for (i = 0; i < rc; i++) {
+        pair_addr(msgs[i].msg_hdr.msg_name);
+        msgs[i].msg_hdr.msg_namelen = sizeof (struct sockaddr_in);
+    }
+
+    return rc;
+}
+
+/* There is only one destination, and no naming it on a connected socket */
+static int pair_send(int fd, struct mmsghdr *msgs, unsigned int n)
+{
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        msgs[i].msg_hdr.msg_name = NULL;
+        msgs[i].msg_hdr.msg_namelen = 0;
+    }
+
+    return sendmmsg(fd, msgs, n, MSG_DONTWAIT);
+}
+
+static int pair_mtu(struct sockaddr_in *addr)
+{
+    (void)addr;
+
+    return PAIR_MTU;
+}
+
+const struct io_backend io_pair_backend = {
+    .name = "pair",
+    .offload = 0,
+    .recv = pair_recv,
+    .send = pair_send,
+    .mtu = pair_mtu,
+};
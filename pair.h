@@ -0,0 +1,65 @@
+/*
+ *  Copyright (c) 2011, Julian Pidancet <julian.pidancet@gmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *  3. Neither the name of Julian Pidancet nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#ifndef PAIR_H_
+#define PAIR_H_
+
+#include <netinet/in.h>
+
+#include "iface.h"
+#include "io.h"
+
+/*
+ * In-memory backends, for running two tunnel endpoints in one process
+ * without privileges or a network. The transport is a socketpair joining a
+ * client and a listener, and interfaces are socketpairs as well, the device
+ * side of which goes to whoever plays the kernel.
+ */
+
+/* Link MTU the pair transport claims, so that tunnels get the usual one */
+#define PAIR_MTU 1500
+
+struct pair_opts
+{
+    /* Gets the device side of every interface queue opened, to close */
+    void (*attach)(struct iface *iface, int fd, void *priv);
+    void *priv;
+};
+
+extern struct pair_opts pair_opts;
+extern const struct iface_backend iface_pair_backend;
+extern const struct io_backend io_pair_backend;
+
+int pair_transport(int fds[2]);
+void pair_addr(struct sockaddr_in *addr);
+
+#endif /* PAIR_H_ */
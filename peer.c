@@ -32,119 +32,882 @@
 
 #include <stdio.h>
 #include <unistd.h>
+#include <errno.h>
 #include <linux/if_tun.h>
 #include <linux/if_ether.h>
 #include <netinet/in.h>
-#include <sys/timerfd.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <sys/random.h>
+#include <time.h>
 
 #include "pktqueue.h"
+#include "csum.h"
 #include "events.h"
 #include "iface.h"
+#include "crypto.h"
+#include "compress.h"
+#include "workers.h"
+#include "hub.h"
 #include "peer.h"
 
-#ifndef IP_MTU
-# define IP_MTU 14
-#endif
-
 #define PEER_RX_TIMEOUT 10
 
-LIST_HEAD(, peer) peer_list = {NULL};
+/* IP and UDP headers, in front of the tun_pi */
+#define PEER_PMTU_OVERHEAD 28
+
+struct peer_opts peer_opts;
+
+static int peer_tunnel_mtu(struct peer *p, int link_mtu)
+{
+    int mtu = link_mtu - PEER_PMTU_OVERHEAD - sizeof (struct tun_pi);
+
+    if (p->crypto)
+        mtu -= CRYPTO_OVERHEAD;
+
+    return mtu;
+}
+
+/* Compress, then seal. Returns the number of packets left to send. */
+static int peer_tx_filter(struct peer *p, struct pkt **pkts, int n)
+{
+    int i, good = n;
+
+    if (p->compress)
+        compress_pack(p->compress, pkts, n);
+
+    if (p->crypto) {
+        good = crypto_seal(p->crypto, pkts, n);
+        for (i = good; i < n; i++)
+            pkt_complete(pkts[i]);
+    }
+
+    return good;
+}
+
+static void peer_tx_process(struct worker_job *job)
+{
+    job->good = peer_tx_filter(job->priv, job->pkts, job->n);
+}
+
+static void peer_tx_deliver(struct worker_job *job)
+{
+    struct peer *p = job->priv;
+    int i;
+
+    for (i = 0; i < job->good; i++)
+        peer_xmit(p, job->pkts[i]);
+}
+
+/*
+ * Count what goes out against the credit. The hub cannot stop reading the
+ * interface it shares for the sake of one peer: what the peer has no
+ * credit for is dropped here, short of the network.
+ */
+static int peer_tx_take(struct peer *p, struct pkt **pkts, int n)
+{
+    long credit;
+    int i;
+
+    if (p->hub_nh) {
+        credit = peer_tx_credit(p);
+        if (credit < n) {
+            if (credit < 0)
+                credit = 0;
+            for (i = credit; i < n; i++)
+                pkt_complete(pkts[i]);
+            __atomic_fetch_add(&p->stats.tx_credit_drops, n - credit,
+                               __ATOMIC_RELAXED);
+            n = credit;
+        }
+    }
+    __atomic_fetch_add(&p->credit.tx_sent, n, __ATOMIC_RELAXED);
+
+    return n;
+}
+
+/*
+ * Turn a packet read from the interface into the ICMP fragmentation needed
+ * (RFC 1191) its sender gets back, in place, as if from its destination.
+ * Returns -1 for packets that may be fragmented, which the hub does not
+ * do, and for ICMP errors, which are never answered.
+ */
+static int peer_icmp_too_big(struct pkt *pkt, int mtu)
+{
+    struct tun_pi *pi = (void *)pkt->buff;
+    struct iphdr *ip = (void *)(pi + 1);
+    struct icmphdr *icmp = (void *)(ip + 1);
+    char quote[60 + 8];
+    uint32_t saddr, daddr;
+    size_t len = pkt->pkt_size - sizeof (*pi);
+    size_t qlen;
+
+    if (len < sizeof (*ip) || ip->version != 4 || ip->ihl < 5 ||
+        len < (size_t)ip->ihl * 4 + 8 || !(ip->frag_off & htons(IP_DF)))
+        return -1;
+    if (ip->protocol == IPPROTO_ICMP &&
+        ((struct icmphdr *)((char *)ip + ip->ihl * 4))->type != ICMP_ECHO)
+        return -1;
+
+    qlen = ip->ihl * 4 + 8;
+    memcpy(quote, ip, qlen);
+    saddr = ip->daddr;
+    daddr = ip->saddr;
+
+    memset(ip, 0, sizeof (*ip));
+    ip->version = 4;
+    ip->ihl = 5;
+    ip->tot_len = htons(sizeof (*ip) + sizeof (*icmp) + qlen);
+    ip->ttl = 64;
+    ip->protocol = IPPROTO_ICMP;
+    ip->saddr = saddr;
+    ip->daddr = daddr;
+    ip->check = csum_fold(csum_partial(ip, sizeof (*ip), 0));
+
+    memset(icmp, 0, sizeof (*icmp));
+    icmp->type = ICMP_DEST_UNREACH;
+    icmp->code = ICMP_FRAG_NEEDED;
+    icmp->un.frag.mtu = htons(mtu);
+    memcpy(icmp + 1, quote, qlen);
+    icmp->checksum = csum_fold(csum_partial(icmp, sizeof (*icmp) + qlen, 0));
+
+    pi->flags = 0;
+    pi->proto = htons(ETH_P_IP);
+    pkt_trim(pkt, sizeof (*pi) + sizeof (*ip) + sizeof (*icmp) + qlen);
+
+    return 0;
+}
+
+/*
+ * The hub's interface takes packets as large as the transport does, which
+ * a peer's path may not carry. Those are sent back to where they came from
+ * as ICMP errors, or dropped. Returns the number of packets left.
+ */
+static int peer_tx_fit(struct peer *p, struct pkt **pkts, int n)
+{
+    int link_mtu = __atomic_load_n(&p->link_mtu, __ATOMIC_RELAXED);
+    size_t mtu = peer_tunnel_mtu(p, link_mtu);
+    int i, good = 0;
+
+    for (i = 0; i < n; i++) {
+        if (pkts[i]->pkt_size - sizeof (struct tun_pi) <= mtu) {
+            pkts[good++] = pkts[i];
+            continue;
+        }
+        __atomic_fetch_add(&p->stats.tx_too_big, 1, __ATOMIC_RELAXED);
+        if (peer_icmp_too_big(pkts[i], mtu))
+            pkt_complete(pkts[i]);
+        else
+            iface_rx_schedule(p->iface, pkts[i]);
+    }
 
-void peer_tx(struct pkt *pkt, void *priv)
+    return good;
+}
+
+/*
+ * Packets read from the interface, in batches. Compression and sealing run
+ * on the thread of the interface queue, which is one of several with
+ * multiple queues, or on the worker pool, which keeps the batches in order.
+ */
+void peer_tx(struct pkt **pkts, int n, void *priv)
 {
     struct peer *p = priv;
-#if 0
-    struct tun_pi *hdr = (void *)pkt->buff;
-    unsigned char *data = (void *)(hdr + 1);
-    int len = pkt->pkt_size - sizeof (*hdr);
+    int i;
+
+    if (p->hub_nh) {
+        n = peer_tx_fit(p, pkts, n);
+        if (!n)
+            return;
+    }
 
-    /* tx filter */
-#endif
+    if (p->credit.on) {
+        n = peer_tx_take(p, pkts, n);
+        if (!n)
+            return;
+    }
+
+    if ((p->crypto || p->compress) && workers_enabled()) {
+        if (worker_submit(&p->tx_serial, pkts, n, peer_tx_process,
+                          peer_tx_deliver, p))
+            for (i = 0; i < n; i++)
+                pkt_complete(pkts[i]);
+        return;
+    }
+
+    n = peer_tx_filter(p, pkts, n);
+    for (i = 0; i < n; i++)
+        peer_xmit(p, pkts[i]);
+}
+
+/*
+ * Open, then decompress. The packets left go first, and so do their nonce
+ * counters in ctrs if sealed, which still have to pass the replay window.
+ * Returns the number left.
+ */
+static int peer_rx_filter(struct peer *p, struct pkt **pkts, int n,
+                          uint64_t *ctrs)
+{
+    struct tun_pi *hdr;
+    struct pkt *pkt;
+    int i, good;
+
+    if (p->crypto) {
+        good = crypto_open(p->crypto, pkts, n, ctrs);
+        return compress_unpack(p->compress, pkts, good, ctrs);
+    }
+
+    /* Sealed traffic we have no key for would come out as garbage */
+    for (i = good = 0; i < n; i++) {
+        pkt = pkts[i];
+        hdr = (struct tun_pi *)pkt->buff;
+        if (hdr->flags & htons(TUN_PI_SEALED))
+            continue;
+        pkts[i] = pkts[good];
+        pkts[good++] = pkt;
+    }
+
+    return compress_unpack(p->compress, pkts, good, NULL);
+}
+
+static void peer_rx_process(struct worker_job *job)
+{
+    job->good = peer_rx_filter(job->priv, job->pkts, job->n, job->meta);
+}
+
+/* The replay window wants the packets in the order they came in */
+static void peer_rx_deliver(struct worker_job *job)
+{
+    struct peer *p = job->priv;
+    int i, good = job->good;
+
+    if (p->crypto) {
+        good = crypto_replay_filter(p->crypto, job->pkts, job->meta, good);
+        peer_credit_data(&p->credit, good);
+    }
+    __atomic_fetch_add(&p->stats.rx_rejected, job->n - good,
+                       __ATOMIC_RELAXED);
+
+    if (p->hub_nh)
+        hub_learn(p, job->pkts, good);
+    for (i = 0; i < good; i++)
+        iface_rx_schedule(p->iface, job->pkts[i]);
+    for (; i < job->n; i++)
+        pkt_complete(job->pkts[i]);
+}
 
-    p->tx_count++;
-    p->tx(pkt, &p->addr);
+void peer_rx(struct peer *p, struct pkt **pkts, int n)
+{
+    uint64_t ctrs[CRYPTO_BATCH_MAX];
+    int i, good;
+
+    if ((p->crypto || p->compress) && workers_enabled()) {
+        if (worker_submit(&p->rx_serial, pkts, n, peer_rx_process,
+                          peer_rx_deliver, p)) {
+            __atomic_fetch_add(&p->stats.rx_rejected, n, __ATOMIC_RELAXED);
+            for (i = 0; i < n; i++)
+                pkt_complete(pkts[i]);
+        }
+        return;
+    }
+
+    good = peer_rx_filter(p, pkts, n, ctrs);
+    if (p->crypto) {
+        good = crypto_replay_filter(p->crypto, pkts, ctrs, good);
+        peer_credit_data(&p->credit, good);
+    }
+    __atomic_fetch_add(&p->stats.rx_rejected, n - good, __ATOMIC_RELAXED);
+
+    if (p->hub_nh)
+        hub_learn(p, pkts, good);
+    for (i = 0; i < good; i++)
+        iface_rx_schedule(p->iface, pkts[i]);
+    for (; i < n; i++)
+        pkt_complete(pkts[i]);
 }
 
-void peer_rx(struct peer *p, struct pkt *pkt)
+/* What the peer may have sent us, all told */
+static uint32_t peer_credit_limit(struct peer *p)
 {
-#if 0
-    struct tun_pi *hdr = (void *)pkt->buff;
-    unsigned char *data = (void *)(hdr + 1);
-    int len = pkt->pkt_size - sizeof (*hdr);
+    struct peer_credit *c = &p->credit;
+    unsigned long queued = p->iface ? iface_rx_queued(p->iface) : 0;
 
-    /* rx filter */
-#endif
+    if (queued > PEER_CREDIT_WINDOW)
+        queued = PEER_CREDIT_WINDOW;
 
-    iface_rx_schedule(p->iface, pkt);
+    return peer_credit_seen(c) + PEER_CREDIT_WINDOW - queued;
 }
 
-static struct pkt *tun_ctl_pkt(__u8 flags)
+static void peer_credit_stamp(struct peer *p, struct tun_ctl *ctl)
+{
+    struct peer_credit *c = &p->credit;
+    uint32_t limit = peer_credit_limit(p);
+
+    if ((int32_t)(limit - c->rx_limit) > 0)
+        c->rx_limit = limit;
+
+    ctl->credit_sent = htonl(__atomic_load_n(&c->tx_sent, __ATOMIC_RELAXED));
+    ctl->credit_limit = htonl(c->rx_limit);
+}
+
+/*
+ * Zero padded up to len bytes after the tun_pi, if that is more. Carries
+ * the credit if we want flow control, in case the peer does too.
+ */
+static struct pkt *tun_ctl_pkt_len(struct peer *p, __u8 flags, size_t len)
 {
     struct pkt *pkt;
     struct tun_pi *hdr;
     struct tun_ctl *ctl;
-    size_t len;
 
-    len = sizeof (struct tun_pi) + sizeof (struct tun_ctl);
+    if (len < sizeof (*ctl))
+        len = sizeof (*ctl);
 
-    pkt = pkt_alloc(len);
+    pkt = pkt_alloc_room(len, sizeof (*hdr), CRYPTO_OVERHEAD);
     if (!pkt)
         return NULL;
-    hdr = (struct tun_pi *)pkt->buff;
-    hdr->flags = 0;
-    hdr->proto = htons(TUN_CTL_PROTO);
-    pkt->pkt_size = len;
 
-    ctl = (void *)(hdr + 1);
+    ctl = (void *)pkt_put(pkt, len);
+    memset(ctl, 0, len);
     ctl->ctl_flags = flags;
+    if (peer_opts.credit)
+        peer_credit_stamp(p, ctl);
+
+    hdr = (void *)pkt_push(pkt, sizeof (*hdr));
+    hdr->flags = 0;
+    hdr->proto = htons(TUN_CTL_PROTO);
 
     return pkt;
 }
 
+static struct pkt *tun_ctl_pkt(struct peer *p, __u8 flags)
+{
+    return tun_ctl_pkt_len(p, flags, 0);
+}
+
+static inline struct tun_ctl *tun_ctl(struct pkt *pkt)
+{
+    return (void *)(pkt->buff + sizeof (struct tun_pi));
+}
+
+/*
+ * Sealed once both sides have the keys: the listener has them before it
+ * sends its ACK, which the client still has to read in the clear.
+ */
+static inline int peer_ctl_sealed(struct peer *p)
+{
+    return p->crypto && p->state != PEER_STATE_LISTENING;
+}
+
+static void peer_ctl_xmit(struct peer *p, struct pkt *pkt)
+{
+    if (peer_ctl_sealed(p) && crypto_seal_ctl(p->crypto, pkt)) {
+        pkt_complete(pkt);
+        return;
+    }
+
+    peer_xmit(p, pkt);
+}
+
+static void peer_send(struct peer *p, struct pkt *pkt)
+{
+    p->stats.tx_ctl++;
+    peer_ctl_xmit(p, pkt);
+}
+
 static void peer_send_keepalive(struct peer *p)
 {
     struct pkt *pkt;
 
-    pkt = tun_ctl_pkt(0);
+    pkt = tun_ctl_pkt(p, 0);
     if (!pkt)
         return;
 
-    p->tx(pkt, &p->addr);
+    peer_ctl_xmit(p, pkt);
 }
 
-struct peer *peer_lookup(struct sockaddr_in *addr)
+static void peer_send_credit(struct peer *p)
 {
-    struct peer *tmp, *p = NULL;
+    struct pkt *pkt;
 
-    LIST_FOREACH(tmp, &peer_list, link) {
-        if (!memcmp(&tmp->addr, addr, sizeof (addr))) {
-            p = tmp;
-            break;
+    pkt = tun_ctl_pkt(p, 0);
+    if (!pkt)
+        return;
+
+    p->stats.tx_credits++;
+    peer_ctl_xmit(p, pkt);
+}
+
+/*
+ * Hand credit out once there is enough of it, in a keepalive. The timer
+ * looks again shortly while the peer is about to run out, as it may be
+ * waiting for credit already.
+ */
+static void peer_credit_check(struct peer *p)
+{
+    struct peer_credit *c = &p->credit;
+
+    if ((int32_t)(peer_credit_limit(p) - c->rx_limit) >= PEER_CREDIT_UPDATE)
+        peer_send_credit(p);
+
+    if ((int32_t)(c->rx_limit - peer_credit_seen(c)) < PEER_CREDIT_UPDATE &&
+        !c->timer.pending)
+        timer_arm(p->dispatch, &c->timer, PEER_CREDIT_MS);
+}
+
+/*
+ * Also runs for as long as we send: the interface threads running out of
+ * credit cannot tell, and the peer may be holding credit back for packets
+ * it does not know were lost. Telling it how many we sent settles that.
+ */
+static int credit_timer_handler(struct timer *t, void *priv)
+{
+    struct peer *p = priv;
+    struct peer_credit *c = &p->credit;
+    uint32_t sent = __atomic_load_n(&c->tx_sent, __ATOMIC_RELAXED);
+    int short_of_credit = peer_tx_credit(p) < PEER_CREDIT_UPDATE;
+
+    if (short_of_credit)
+        peer_send_credit(p);
+    peer_credit_check(p);
+
+    if ((short_of_credit || sent != c->tx_last) && !t->pending)
+        timer_arm(p->dispatch, t, PEER_CREDIT_MS);
+    c->tx_last = sent;
+
+    return DISPATCH_CONTINUE;
+}
+
+/* Any control packet from a peer we agreed on flow control with */
+static void peer_credit_rx(struct peer *p, struct tun_ctl *ctl)
+{
+    struct peer_credit *c = &p->credit;
+    uint32_t sent = ntohl(ctl->credit_sent);
+    uint32_t limit = ntohl(ctl->credit_limit);
+    uint32_t grant = limit - c->tx_limit;
+
+    /* Whatever the peer sent before this and we did not get is lost */
+    peer_credit_sent(c, sent);
+
+    if ((int32_t)grant <= 0)
+        return;
+    __atomic_store_n(&c->tx_limit, limit, __ATOMIC_RELAXED);
+    if (p->iface && !p->hub_nh)
+        iface_add_credit(p->iface, grant);
+    if (!c->timer.pending)
+        timer_arm(p->dispatch, &c->timer, PEER_CREDIT_MS);
+}
+
+/* Assumed to get through when a larger size stops doing so */
+#define PEER_PMTU_BASE 1200
+
+/* Timer runs a probe waits for its acknowledgement, retries included */
+#define PEER_PMTU_TRIES 3
+
+/* Timer runs between probes of the size in use, and searches above it */
+#define PEER_PMTU_CONFIRM 15
+#define PEER_PMTU_RAISE 600
+
+static inline int peer_pmtu_base(struct peer_pmtu *m)
+{
+    return m->max < PEER_PMTU_BASE ? m->max : PEER_PMTU_BASE;
+}
+
+static void peer_pmtu_set(struct peer *p, int mtu)
+{
+    if (mtu == p->link_mtu)
+        return;
+
+    PEER_LOG(p, "Path MTU %d -> %d", p->link_mtu, mtu);
+    __atomic_store_n(&p->link_mtu, mtu, __ATOMIC_RELAXED);
+    if (p->iface && !p->hub_nh)
+        iface_set_mtu(p->iface, peer_tunnel_mtu(p, mtu));
+}
+
+/* What a control packet of the given size carries past its tun_pi */
+static int peer_ctl_len(struct peer *p, int size)
+{
+    int len = size - PEER_PMTU_OVERHEAD - sizeof (struct tun_pi);
+
+    if (p->crypto)
+        len -= CRYPTO_OVERHEAD;
+
+    return len;
+}
+
+static void peer_pmtu_send(struct peer *p)
+{
+    struct peer_pmtu *m = &p->pmtu;
+    struct pkt *pkt;
+
+    pkt = tun_ctl_pkt_len(p, TUN_CTL_PROBE, peer_ctl_len(p, m->probe));
+    if (!pkt)
+        return;
+    tun_ctl(pkt)->probe_seq = htons(m->seq);
+    tun_ctl(pkt)->probe_size = htons(m->probe);
+
+    p->stats.tx_probes++;
+    peer_send(p, pkt);
+}
+
+/*
+ * Probes the link MTU first, which is what most paths carry, then halves
+ * the interval between the sizes acknowledged and lost until they meet.
+ */
+static void peer_pmtu_next(struct peer *p)
+{
+    struct peer_pmtu *m = &p->pmtu;
+
+    m->tries = 0;
+    if (m->hi - m->lo <= 1) {
+        m->probe = 0;
+        m->wait = PEER_PMTU_CONFIRM;
+        return;
+    }
+
+    m->probe = m->hi > m->max ? m->max : m->lo + (m->hi - m->lo) / 2;
+    m->seq++;
+    peer_pmtu_send(p);
+}
+
+/* The interface starts at the link MTU, which the first probe checks */
+static void peer_pmtu_start(struct peer *p)
+{
+    struct peer_pmtu *m = &p->pmtu;
+
+    m->lo = peer_pmtu_base(m);
+    m->hi = m->max + 1;
+    m->raise = PEER_PMTU_RAISE;
+    peer_pmtu_next(p);
+}
+
+static void peer_pmtu_ack(struct peer *p, struct tun_ctl *ctl)
+{
+    struct peer_pmtu *m = &p->pmtu;
+
+    if (!m->probe || ntohs(ctl->probe_seq) != m->seq ||
+        ntohs(ctl->probe_size) != m->probe)
+        return;
+
+    if (m->probe > m->lo)
+        m->lo = m->probe;
+    peer_pmtu_set(p, m->lo);
+    peer_pmtu_next(p);
+}
+
+/*
+ * Losing a size no larger than the one in use means the path shrank under
+ * us: fall back to the base size straight away, then search up from there.
+ */
+static void peer_pmtu_lost(struct peer *p)
+{
+    struct peer_pmtu *m = &p->pmtu;
+
+    p->stats.probes_lost++;
+    if (m->probe <= p->link_mtu) {
+        m->lo = peer_pmtu_base(m);
+        peer_pmtu_set(p, m->lo);
+    }
+    m->hi = m->probe;
+    peer_pmtu_next(p);
+}
+
+static void peer_pmtu_timer(struct peer *p)
+{
+    struct peer_pmtu *m = &p->pmtu;
+
+    if (m->probe) {
+        if (++m->tries < PEER_PMTU_TRIES)
+            peer_pmtu_send(p);
+        else
+            peer_pmtu_lost(p);
+        return;
+    }
+
+    if (--m->raise == 0) {
+        m->raise = PEER_PMTU_RAISE;
+        m->hi = m->max + 1;
+        peer_pmtu_next(p);
+    } else if (--m->wait == 0) {
+        m->probe = m->lo;
+        m->seq++;
+        peer_pmtu_send(p);
+    }
+}
+
+/* Answers probes which arrived whole, at the size they claim */
+static void peer_pmtu_reply(struct peer *p, struct pkt *pkt,
+                            struct tun_ctl *ctl)
+{
+    struct pkt *ack;
+
+    if ((int)(pkt->pkt_size - sizeof (struct tun_pi)) !=
+        peer_ctl_len(p, ntohs(ctl->probe_size)))
+        return;
+
+    ack = tun_ctl_pkt(p, TUN_CTL_PROBE_ACK);
+    if (!ack)
+        return;
+    tun_ctl(ack)->probe_seq = ctl->probe_seq;
+    tun_ctl(ack)->probe_size = ctl->probe_size;
+    peer_send(p, ack);
+}
+
+#define PEER_TABLE_MIN 16
+#define PEER_TABLE_MIGRATE 8
+
+static inline uint64_t peer_key(struct sockaddr_in *addr)
+{
+    return ((uint64_t)addr->sin_addr.s_addr << 16) | addr->sin_port;
+}
+
+static inline uint64_t peer_hash(struct peer_table *t, uint64_t key)
+{
+    uint64_t h = key ^ t->seed;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+static int peer_htab_alloc(struct peer_htab *h, size_t size)
+{
+    h->slots = calloc(size, sizeof (*h->slots));
+    if (!h->slots)
+        return -1;
+    h->mask = size - 1;
+    h->count = 0;
+
+    return 0;
+}
+
+static void peer_htab_free(struct peer_htab *h)
+{
+    free(h->slots);
+    h->slots = NULL;
+    h->mask = 0;
+    h->count = 0;
+}
+
+/*
+ * Where a probe for the given hash starts. In the old table, the migrated
+ * part is a run of free slots ending at the first unmigrated one, so probes
+ * landing there skip to its end.
+ */
+static inline size_t peer_htab_home(struct peer_table *t,
+                                    struct peer_htab *h, uint64_t hash)
+{
+    size_t i = hash & h->mask;
+
+    if (h == &t->old && ((i - t->mig_start) & h->mask) < t->mig_done)
+        i = (t->mig_start + t->mig_done) & h->mask;
+
+    return i;
+}
+
+static struct peer_slot *peer_htab_find(struct peer_table *t,
+                                        struct peer_htab *h, uint64_t key,
+                                        uint64_t hash)
+{
+    size_t i;
+
+    if (!h->slots)
+        return NULL;
+
+    for (i = peer_htab_home(t, h, hash); h->slots[i].peer;
+         i = (i + 1) & h->mask) {
+        if (h->slots[i].key == key)
+            return &h->slots[i];
+    }
+
+    return NULL;
+}
+
+static void peer_htab_put(struct peer_htab *h, uint64_t key, uint64_t hash,
+                          struct peer *p)
+{
+    size_t i;
+
+    for (i = hash & h->mask; h->slots[i].peer; i = (i + 1) & h->mask)
+        ;
+    h->slots[i].key = key;
+    h->slots[i].peer = p;
+    h->count++;
+}
+
+/* Backward shift deletion: pull later members of the cluster into the hole */
+static void peer_htab_del(struct peer_table *t, struct peer_htab *h,
+                          struct peer_slot *slot)
+{
+    size_t i = slot - h->slots;
+    size_t j, k;
+
+    for (j = (i + 1) & h->mask; h->slots[j].peer; j = (j + 1) & h->mask) {
+        k = peer_htab_home(t, h, peer_hash(t, h->slots[j].key));
+
+        /* Leave it alone if its home lies in (i, j] */
+        if (((j - k) & h->mask) < ((j - i) & h->mask))
+            continue;
+
+        h->slots[i] = h->slots[j];
+        i = j;
+    }
+
+    h->slots[i].peer = NULL;
+    h->slots[i].key = 0;
+    h->count--;
+}
+
+static void peer_table_migrate(struct peer_table *t, size_t n)
+{
+    struct peer_htab *old = &t->old;
+    struct peer_slot *slot;
+
+    while (old->slots && n--) {
+        slot = &old->slots[(t->mig_start + t->mig_done) & old->mask];
+        if (slot->peer) {
+            peer_htab_put(&t->cur, slot->key, peer_hash(t, slot->key),
+                          slot->peer);
+            slot->peer = NULL;
+            slot->key = 0;
+            old->count--;
+        }
+
+        if (++t->mig_done > old->mask) {
+            peer_htab_free(old);
+            t->mig_start = t->mig_done = 0;
         }
     }
+}
 
-    return p;
+static int peer_table_grow(struct peer_table *t)
+{
+    struct peer_htab h;
+    size_t i;
+
+    /* Still busy with the previous resize, get it over with */
+    if (t->old.slots)
+        peer_table_migrate(t, t->old.mask + 1);
+
+    if (peer_htab_alloc(&h, (t->cur.mask + 1) * 2))
+        return -1;
+
+    t->old = t->cur;
+    t->cur = h;
+
+    /* Start right after a free slot, i.e. at the beginning of a cluster */
+    for (i = 0; t->old.slots[i].peer; i++)
+        ;
+    t->mig_start = (i + 1) & t->old.mask;
+    t->mig_done = 0;
+
+    return 0;
 }
 
-static int timer_handler(int fd, unsigned short flags, void *priv)
+int peer_table_init(struct peer_table *t)
 {
-    struct peer *p = priv;
-    uint64_t expirations;
-    int rc;
+    memset(t, 0, sizeof (*t));
+    LIST_INIT(&t->peers);
+    lock_init(&t->lock);
+
+    if (getrandom(&t->seed, sizeof (t->seed), 0) != sizeof (t->seed))
+        t->seed = (uintptr_t)t ^ (uint64_t)time(NULL) << 32;
+
+    return peer_htab_alloc(&t->cur, PEER_TABLE_MIN);
+}
+
+void peer_table_cleanup(struct peer_table *t)
+{
+    peer_htab_free(&t->cur);
+    peer_htab_free(&t->old);
+}
+
+int peer_table_insert(struct peer_table *t, struct peer *p)
+{
+    uint64_t key = peer_key(&p->addr);
+
+    peer_table_migrate(t, PEER_TABLE_MIGRATE);
+
+    /* Keep the load factor at or below 1/2 */
+    if ((t->cur.count + t->old.count + 1) * 2 > t->cur.mask + 1 &&
+        peer_table_grow(t))
+        return -1;
+
+    peer_htab_put(&t->cur, key, peer_hash(t, key), p);
+    p->table = t;
+    lock(&t->lock);
+    LIST_INSERT_HEAD(&t->peers, p, link);
+    unlock(&t->lock);
+
+    return 0;
+}
+
+void peer_table_remove(struct peer_table *t, struct peer *p)
+{
+    uint64_t key = peer_key(&p->addr);
+    uint64_t hash = peer_hash(t, key);
+    struct peer_slot *slot;
+
+    slot = peer_htab_find(t, &t->cur, key, hash);
+    if (slot)
+        peer_htab_del(t, &t->cur, slot);
+    else if ((slot = peer_htab_find(t, &t->old, key, hash)))
+        peer_htab_del(t, &t->old, slot);
+
+    peer_table_migrate(t, PEER_TABLE_MIGRATE);
+
+    lock(&t->lock);
+    LIST_REMOVE(p, link);
+    unlock(&t->lock);
+    p->table = NULL;
+}
+
+struct peer *peer_lookup(struct peer_table *t, struct sockaddr_in *addr)
+{
+    uint64_t key = peer_key(addr);
+    uint64_t hash = peer_hash(t, key);
+    struct peer_slot *slot;
+
+    slot = peer_htab_find(t, &t->cur, key, hash);
+    if (!slot)
+        slot = peer_htab_find(t, &t->old, key, hash);
+
+    return slot ? slot->peer : NULL;
+}
 
-    (void)flags;
+#define PEER_TIMER_MS 1000
 
-    rc = read(fd, &expirations, sizeof(expirations));
-    if (rc != sizeof (expirations))
-        PEER_LOG(p, "???");
+/* Data packets sent, which make keepalives unnecessary */
+static unsigned long peer_tx_pkts(struct peer *p)
+{
+    if (p->hub_nh)
+        return __atomic_load_n(&p->stats.tx_routed, __ATOMIC_RELAXED);
+
+    return p->iface ? iface_tx_pkts(p->iface) : 0;
+}
+
+static int timer_handler(struct timer *t, void *priv)
+{
+    struct peer *p = priv;
+    unsigned long tx;
 
     if (p->state == PEER_STATE_CLOSED)
         goto destroy;
 
-    if (!p->tx_count) {
+    if (p->state == PEER_STATE_CONNECTED)
+        peer_pmtu_timer(p);
+
+    tx = p->stats.tx_ctl + p->stats.tx_credits + peer_tx_pkts(p);
+    if (tx == p->last_tx) {
         peer_send_keepalive(p);
+        tx++;
     }
-    if (!p->rx_count) {
+    p->last_tx = tx;
+
+    if (p->stats.rx_pkts == p->last_rx) {
         if (--p->timeout == 0) {
             PEER_LOG(p, "No RX activity recorded for the past %d seconds."
                         " Destroying...",
@@ -161,29 +924,26 @@ destroy:
         p->timeout = PEER_RX_TIMEOUT;
     }
 
-    p->tx_count = p->rx_count = 0;
+    p->last_rx = p->stats.rx_pkts;
+    timer_arm(p->dispatch, t, PEER_TIMER_MS);
 
     return DISPATCH_CONTINUE;
 }
 
 static void peer_arm_timer(struct peer *p, int enable)
 {
-    struct itimerspec its = {{0, 0}, {0, 0}};
-    struct itimerspec old;
-
-    if (enable) {
-        its.it_interval.tv_sec = 1;
-        its.it_value.tv_sec = 1;
-    }
-
-    timerfd_settime(p->timer->fd, 0, &its, &old);
+    if (enable)
+        timer_arm(p->dispatch, &p->timer, PEER_TIMER_MS);
+    else
+        timer_cancel(p->dispatch, &p->timer);
 }
 
-struct peer *peer_create(struct dispatch *d, struct sockaddr_in *addr,
-                         tx_handler_t tx)
+struct peer *peer_create(struct peer_table *t, struct dispatch *d,
+                         struct sockaddr_in *addr, int link_mtu,
+                         tx_handler_t tx, tx_release_t tx_release,
+                         void *tx_priv)
 {
     struct peer *p;
-    int timerfd;
 
     p = calloc(1, sizeof (*p));
     if (!p)
@@ -192,71 +952,89 @@ struct peer *peer_create(struct dispatch *d, struct sockaddr_in *addr,
     p->dispatch = d;
     p->state = PEER_STATE_INVALID;
     p->tx = tx;
+    p->tx_release = tx_release;
+    p->tx_priv = tx_priv;
+    p->link_mtu = link_mtu;
+    p->pmtu.max = link_mtu;
     memcpy(&p->addr, addr, sizeof (*addr));
-    LIST_INSERT_HEAD(&peer_list, p, link);
-    timerfd = timerfd_create(CLOCK_MONOTONIC, 0);
-    if (timerfd == -1) {
-        peer_destroy(p);
-        return NULL;
-    }
-    p->timer = event_create(p->dispatch, timerfd, EVENT_READ,
-                            timer_handler, p);
-    if (!p->timer) {
-        peer_destroy(p);
+    if (peer_table_insert(t, p)) {
+        free(p);
         return NULL;
     }
+    timer_init(&p->timer, timer_handler, p);
+    timer_init(&p->credit.timer, credit_timer_handler, p);
     p->timeout = PEER_RX_TIMEOUT;
+    worker_serial_init(&p->tx_serial);
+    worker_serial_init(&p->rx_serial);
 
     return p;
 }
 
+static void peer_compress_log(struct peer *p)
+{
+    struct compress_stats *st = &p->compress->stats;
+
+    PEER_LOG(p, "Compression: %lu bytes sent as %lu (%.1f%%) in %lu ms, "
+                "%lu packets compressed, %lu left alone, %lu decompressed "
+                "in %lu ms",
+             st->tx_bytes_in, st->tx_bytes_out,
+             st->tx_bytes_in ? 100.0 * st->tx_bytes_out / st->tx_bytes_in : 0,
+             st->tx_ns / 1000000, st->tx_pkts,
+             st->tx_skipped + st->tx_random + st->tx_incompressible,
+             st->rx_pkts, st->rx_ns / 1000000);
+}
+
 void peer_destroy(struct peer *p)
 {
-    if (p->iface) {
+    /* Off the list first, so nobody walking it finds the iface going away */
+    peer_table_remove(p->table, p);
+    if (p->hub_nh) {
+        /* The hub hands no more packets over once it forgot the peer */
+        hub_peer_remove(p);
+        worker_serial_wait(&p->rx_serial);
+        worker_serial_wait(&p->tx_serial);
+    } else if (p->iface) {
+        /* Batches still with the workers deliver into the iface */
+        worker_serial_wait(&p->rx_serial);
         iface_event_stop(p->iface);
-        iface_destroy(p->iface);
+        worker_serial_wait(&p->tx_serial);
     }
-    if (p->timer) {
-        int fd = p->timer->fd;
-        event_delete(p->dispatch, p->timer);
-        close(fd);
+    /*
+     * Nothing is sent anymore. Packets still queued for the transport point
+     * at p->addr, and belong to the iface's pools.
+     */
+    if (p->tx_release)
+        p->tx_release(p->tx_priv);
+    if (p->iface && !p->hub_nh)
+        iface_destroy(p->iface);
+    if (p->crypto)
+        crypto_session_destroy(p->crypto);
+    if (p->compress) {
+        peer_compress_log(p);
+        compress_ctx_destroy(p->compress);
     }
-    LIST_REMOVE(p, link);
+    timer_cancel(p->dispatch, &p->timer);
+    timer_cancel(p->dispatch, &p->credit.timer);
     free(p);
 }
 
-static int mtu_discover(struct sockaddr_in *addr)
-{
-    int sock;
-    int mtu = ETH_DATA_LEN;
-    int rc;
-    socklen_t len = sizeof (mtu);
-
-    /* HACK: To discover MTU, Create and connect back a socket to the host */
-    sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sock < 0)
-        return mtu;
-    rc = connect(sock, (struct sockaddr *) addr, sizeof (*addr));
-    if (rc) {
-        fprintf(stderr, "%s: connect() failed: %s\n", __func__,
-                strerror(errno));
-        goto close;
-    }
-
-    rc = getsockopt(sock, IPPROTO_IP, IP_MTU, &mtu, &len);
-    if (rc)
-        fprintf(stderr, "Error Getting MTU: %s\n", strerror(errno));
-
-close:
-    close(sock);
-
-    return mtu;
-}
-
 static int peer_iface_init(struct peer *p)
 {
+    struct iface *iface;
     int mtu;
 
+    /* The hub's interface is shared, and already running */
+    if (hub_enabled()) {
+        if (hub_peer_add(p)) {
+            fprintf(stderr, "Can't route to peer.\n");
+            return -1;
+        }
+        lock(&p->table->lock);
+        p->iface = hub_iface();
+        unlock(&p->table->lock);
+        return 0;
+    }
+
     /*
      * Transport frame layout:
      *
@@ -269,16 +1047,26 @@ static int peer_iface_init(struct peer *p)
      *
      * Tunnel MTU = Link MTU - (IP header size + UDP header size + Tun PI size)
      *            = Link MTU - 32
+     *
+     * Sealed packets also carry the crypto trailer behind the data, which
+     * is appended in place. The link MTU is that of the transport until
+     * probing finds the path's, and never grows past it.
      */
-    mtu = mtu_discover(&p->addr) - 32;
+    mtu = peer_tunnel_mtu(p, p->pmtu.max);
 
-    p->iface = iface_create(1024, mtu);
-    if (!p->iface) {
+    iface = iface_create(1024, mtu, 0, p->crypto ? CRYPTO_OVERHEAD : 0);
+    if (!iface) {
         fprintf(stderr, "Can't create interface.");
         return -1;
     }
-    iface_event_start(p->iface, p->dispatch);
-    iface_set_tx(p->iface, peer_tx, p);
+    iface_set_tx(iface, peer_tx, p);
+    if (p->credit.on)
+        iface_set_credit(iface, peer_tx_credit(p));
+
+    lock(&p->table->lock);
+    p->iface = iface;
+    unlock(&p->table->lock);
+    iface_event_start(iface, p->dispatch);
 
     return 0;
 }
@@ -291,12 +1079,129 @@ static void peer_set_state(struct peer *p, int state)
     p->state = state;
 }
 
+static int peer_hs_nonce(struct peer *p)
+{
+    if (getrandom(p->hs_nonce, sizeof (p->hs_nonce), 0) !=
+        sizeof (p->hs_nonce)) {
+        PEER_LOG(p, "getrandom(): %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int peer_crypto_start(struct peer *p, int cipher,
+                             const uint8_t *cnonce, const uint8_t *snonce,
+                             int initiator)
+{
+    p->crypto = crypto_session_create(cipher, cnonce, snonce, initiator);
+    if (!p->crypto) {
+        PEER_LOG(p, "Can't create crypto session.");
+        return -1;
+    }
+
+    PEER_LOG(p, "Encrypting with %s (%s)", crypto_cipher_str(cipher),
+             cipher == CRYPTO_AES256_GCM ? "aes-ni" : crypto_simd_str());
+
+    return 0;
+}
+
+/* Listener side: pick a cipher among those offered in the SYN */
+static int peer_crypto_accept(struct peer *p, struct tun_ctl *ctl)
+{
+    int cipher;
+
+    if (!crypto_opts.enabled) {
+        if (ctl->ciphers) {
+            PEER_LOG(p, "Peer wants encryption, but we have no key.");
+            return -1;
+        }
+        return 0;
+    }
+
+    cipher = crypto_choose(ctl->ciphers);
+    if (!cipher) {
+        PEER_LOG(p, "No cipher in common with peer (offered 0x%x).",
+                 ctl->ciphers);
+        return -1;
+    }
+
+    if (peer_hs_nonce(p))
+        return -1;
+
+    return peer_crypto_start(p, cipher, ctl->nonce, p->hs_nonce, 0);
+}
+
+/* Client side: check the listener's pick in the ACK */
+static int peer_crypto_connect(struct peer *p, struct tun_ctl *ctl)
+{
+    if (!crypto_opts.enabled) {
+        if (ctl->ciphers) {
+            PEER_LOG(p, "Peer wants encryption, but we have no key.");
+            return -1;
+        }
+        return 0;
+    }
+
+    if (!(ctl->ciphers & crypto_ciphers()) ||
+        (ctl->ciphers & (ctl->ciphers - 1))) {
+        PEER_LOG(p, "Peer picked no cipher we offered (0x%x).",
+                 ctl->ciphers);
+        return -1;
+    }
+
+    return peer_crypto_start(p, ctl->ciphers, p->hs_nonce, ctl->nonce, 1);
+}
+
+/* Agreed on the same way as compression, starting with the limit given */
+static void peer_credit_start(struct peer *p, struct tun_ctl *ctl)
+{
+    if (!peer_opts.credit || !(ctl->features & TUN_CTL_CREDIT))
+        return;
+
+    p->credit.on = 1;
+    p->credit.tx_limit = ntohl(ctl->credit_limit);
+    PEER_LOG(p, "Flow control with %u packets of credit", p->credit.tx_limit);
+}
+
+/*
+ * Both ways if both sides want it: the listener agrees to the SYN if it
+ * wants it too, and the client takes the ACK's word.
+ */
+static int peer_compress_start(struct peer *p, struct tun_ctl *ctl)
+{
+    if (!compress_opts.enabled || !(ctl->features & TUN_CTL_COMPRESS))
+        return 0;
+
+    p->compress = compress_ctx_create();
+    if (!p->compress) {
+        PEER_LOG(p, "Can't create compression context.");
+        return -1;
+    }
+
+    PEER_LOG(p, "Compressing with lz4");
+
+    return 0;
+}
+
 void peer_connect(struct peer *p)
 {
     struct pkt *pkt;
 
     /* Ship SYN */
-    pkt = tun_ctl_pkt(TUN_CTL_SYN);
+    pkt = tun_ctl_pkt(p, TUN_CTL_SYN);
+    if (crypto_opts.enabled) {
+        if (peer_hs_nonce(p)) {
+            pkt_complete(pkt);
+            return;
+        }
+        tun_ctl(pkt)->ciphers = crypto_ciphers();
+        memcpy(tun_ctl(pkt)->nonce, p->hs_nonce, sizeof (p->hs_nonce));
+    }
+    if (compress_opts.enabled)
+        tun_ctl(pkt)->features |= TUN_CTL_COMPRESS;
+    if (peer_opts.credit)
+        tun_ctl(pkt)->features |= TUN_CTL_CREDIT;
     peer_send(p, pkt);
 
     peer_set_state(p, PEER_STATE_CONNECTING);
@@ -312,8 +1217,16 @@ void peer_ctl_rx(struct peer *p, struct pkt *pkt)
 {
     struct tun_pi *hdr = (struct tun_pi *)pkt->buff;
     struct tun_ctl *ctl = (void *)(hdr + 1);
-    size_t len = pkt->pkt_size - sizeof (*hdr);
+    size_t len;
 
+    /* Be it a reset, a probe or credit, nobody else gets to say */
+    if (peer_ctl_sealed(p) ? crypto_open_ctl(p->crypto, pkt) :
+                             !!(hdr->flags & htons(TUN_PI_SEALED))) {
+        __atomic_fetch_add(&p->stats.rx_rejected, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    len = pkt->pkt_size - sizeof (*hdr);
     if (len < sizeof (*ctl)) {
         PEER_LOG(p, "Control packet too small.");
         return;
@@ -326,8 +1239,22 @@ void peer_ctl_rx(struct peer *p, struct pkt *pkt)
 
     case PEER_STATE_LISTENING:
         if (ctl->ctl_flags & TUN_CTL_SYN) {
-            struct pkt *ack = tun_ctl_pkt(TUN_CTL_ACK);
+            struct pkt *ack;
 
+            if (peer_crypto_accept(p, ctl) || peer_compress_start(p, ctl))
+                goto set_refused;
+            peer_credit_start(p, ctl);
+
+            ack = tun_ctl_pkt(p, TUN_CTL_ACK);
+            if (p->crypto) {
+                tun_ctl(ack)->ciphers = p->crypto->cipher;
+                memcpy(tun_ctl(ack)->nonce, p->hs_nonce,
+                       sizeof (p->hs_nonce));
+            }
+            if (p->compress)
+                tun_ctl(ack)->features |= TUN_CTL_COMPRESS;
+            if (p->credit.on)
+                tun_ctl(ack)->features |= TUN_CTL_CREDIT;
             peer_send(p, ack);
             goto set_connected;
         }
@@ -336,13 +1263,23 @@ void peer_ctl_rx(struct peer *p, struct pkt *pkt)
     case PEER_STATE_CONNECTING:
         if (ctl->ctl_flags & TUN_CTL_RST)
             goto set_closed;
-        if (ctl->ctl_flags & TUN_CTL_ACK)
+        if (ctl->ctl_flags & TUN_CTL_ACK) {
+            if (peer_crypto_connect(p, ctl) || peer_compress_start(p, ctl))
+                goto set_refused;
+            peer_credit_start(p, ctl);
             goto set_connected;
+        }
         break;
 
     case PEER_STATE_CONNECTED:
         if (ctl->ctl_flags & TUN_CTL_RST)
             goto set_closed;
+        if (ctl->ctl_flags & TUN_CTL_PROBE)
+            peer_pmtu_reply(p, pkt, ctl);
+        if (ctl->ctl_flags & TUN_CTL_PROBE_ACK)
+            peer_pmtu_ack(p, ctl);
+        if (p->credit.on)
+            peer_credit_rx(p, ctl);
         break;
 
     default:
@@ -351,41 +1288,80 @@ void peer_ctl_rx(struct peer *p, struct pkt *pkt)
     }
 
     return;
+set_refused:
+    peer_send(p, tun_ctl_pkt(p, TUN_CTL_RST));
 set_closed:
+    /* The timer destroys closed peers on its next run */
+    peer_arm_timer(p, 1);
     peer_set_state(p, PEER_STATE_CLOSED);
     return;
 set_connected:
     peer_arm_timer(p, 1);
     peer_set_state(p, PEER_STATE_CONNECTED);
     peer_iface_init(p);
+    peer_pmtu_start(p);
 }
 
-void peer_receive(struct peer *p, struct pkt *pkt)
+/*
+ * A run of packets received from the peer, in order. Data packets are
+ * handed over to peer_rx in batches.
+ */
+void peer_receive(struct peer *p, struct pkt **pkts, int n)
 {
-    struct tun_pi *hdr = (struct tun_pi *)pkt->buff;
-
-    if (pkt->pkt_size < sizeof (*hdr)) {
-        PEER_LOG(p, "Packet too small.");
-        return;
-    }
+    struct pkt *data[CRYPTO_BATCH_MAX];
+    struct tun_pi *hdr;
+    struct pkt *pkt;
+    int ndata = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        pkt = pkts[i];
+        hdr = (struct tun_pi *)pkt->buff;
+
+        if (pkt->pkt_size < sizeof (*hdr)) {
+            PEER_LOG(p, "Packet too small.");
+            p->stats.rx_errors++;
+            pkt_complete(pkt);
+            continue;
+        }
 
-    switch (ntohs(hdr->proto)) {
-    case ETH_P_IP:
-        if (p->state == PEER_STATE_CONNECTED)
-            peer_rx(p, pkt);
-        else {
+        p->stats.rx_pkts++;
+        p->stats.rx_bytes += pkt->pkt_size;
+        /*
+         * Whatever the peer read from its interface, delivered or not. If
+         * sealed, once it opened: until then, it may come from anyone.
+         */
+        if (hdr->proto != htons(TUN_CTL_PROTO) && !p->crypto)
+            peer_credit_data(&p->credit, 1);
+
+        switch (ntohs(hdr->proto)) {
+        case ETH_P_IP:
+            if (p->state == PEER_STATE_CONNECTED && p->iface) {
+                data[ndata++] = pkt;
+                if (ndata == CRYPTO_BATCH_MAX) {
+                    peer_rx(p, data, ndata);
+                    ndata = 0;
+                }
+                continue;
+            }
             PEER_LOG(p, "Protocol error: Not connected.");
+            p->stats.rx_errors++;
+            break;
+        case TUN_CTL_PROTO:
+            peer_ctl_rx(p, pkt);
+            break;
+        default:
+            PEER_LOG (p, "Unrecognized Protocol ID 0x%04x",
+                      ntohs(hdr->proto));
+            p->stats.rx_errors++;
         }
-        break;
-    case TUN_CTL_PROTO:
-        peer_ctl_rx(p, pkt);
-        break;
-    default:
-        PEER_LOG (p, "Unrecognized Protocol ID 0x%04x", ntohs(hdr->proto));
-    }
 
-    p->rx_count++;
+        /* Anything not handed over to the interface goes back to its pool */
+        pkt_complete(pkt);
+    }
 
-    return;
+    if (ndata)
+        peer_rx(p, data, ndata);
+    if (p->credit.on && p->state == PEER_STATE_CONNECTED)
+        peer_credit_check(p);
 }
-
@@ -36,21 +36,59 @@
 #include <sys/queue.h>
 #include <netinet/in.h>
 #include <sys/types.h>
+#include <stdint.h>
 #include <linux/if_ether.h>
 #include <arpa/inet.h>
 
 #include "iface.h"
+#include "crypto.h"
+#include "compress.h"
+#include "workers.h"
 
 #define TUN_CTL_PROTO 0
 
+/*
+ * SYN offers ciphers and carries the client's nonce, ACK names the one the
+ * listener picked along with its own nonce. Both are zero in plaintext mode.
+ * Features are those wanted by the SYN's sender and agreed to in the ACK.
+ * Once the handshake is over, control packets are sealed just like data
+ * with the session's keys, and those that do not open are dropped.
+ *
+ * A PROBE is padded up to probe_size, the size of the IP datagram carrying
+ * it, and answered with a PROBE_ACK echoing its sequence number and size.
+ *
+ * With credit flow control, every control packet also carries the number
+ * of data packets its sender sent so far, and the number it may have sent
+ * before it has to wait, both counted since the handshake, modulo 2^32.
+ * Keepalives go out as soon as there is credit to hand out.
+ */
 struct tun_ctl
 {
 #define TUN_CTL_SYN 0x01
 #define TUN_CTL_ACK 0x02
 #define TUN_CTL_RST 0x04
+#define TUN_CTL_PROBE 0x08
+#define TUN_CTL_PROBE_ACK 0x10
    __u8 ctl_flags;
+   __u8 ciphers;
+   __u8 nonce[CRYPTO_HS_NONCE_SZ];
+#define TUN_CTL_COMPRESS 0x01
+#define TUN_CTL_CREDIT 0x02
+   __u8 features;
+   __u8 reserved;
+   __be16 probe_seq;
+   __be16 probe_size;
+   __be32 credit_sent;
+   __be32 credit_limit;
 };
 
+struct peer_opts
+{
+    int credit;         /* Flow control, with peers that want it too */
+};
+
+extern struct peer_opts peer_opts;
+
 #define PEER_LOG(_p, fmt, ...) \
     fprintf(stdout, "[%s:%d] "fmt"\n", \
             inet_ntoa((_p)->addr.sin_addr), \
@@ -84,36 +122,201 @@ static inline const char *peer_state_str(enum peer_state state)
     return 0;
 }
 
+struct peer_table;
+
+typedef void (*tx_release_t)(void *);
+
+/*
+ * Monotonic, only written by the thread running the peer's dispatch, but for
+ * rx_rejected, tx_routed, tx_credit_drops and tx_too_big which are added to
+ * atomically.
+ */
+struct peer_stats
+{
+    unsigned long rx_pkts;
+    unsigned long rx_bytes;
+    unsigned long rx_errors;    /* Runts, unknown protocols, not connected */
+    unsigned long rx_rejected;  /* Not sealed, replayed, forged or garbled */
+    unsigned long tx_ctl;       /* Control packets; data is counted by iface */
+    unsigned long tx_probes;    /* Path MTU probes, retries included */
+    unsigned long probes_lost;  /* Sizes given up on after every retry */
+    unsigned long tx_routed;    /* Hub mode: packets routed to the peer */
+    unsigned long tx_credit_drops;  /* Hub mode: routed, but out of credit */
+    unsigned long tx_too_big;   /* Hub mode: routed, larger than the path */
+    unsigned long tx_credits;   /* Keepalives sent to hand out credit */
+};
+
+/*
+ * Packetization layer path MTU discovery (RFC 8899). Every datagram leaves
+ * with DF set; probes padded to a candidate size find the largest one the
+ * path carries, by binary search between a size acknowledged and one lost.
+ * Sizes are those of the IP datagram.
+ */
+struct peer_pmtu
+{
+    int lo;             /* Largest size acknowledged */
+    int hi;             /* Smallest size lost, or max + 1 if none yet */
+    int max;            /* Of the transport, towards the peer */
+    int probe;          /* Size of the probe in flight, 0 if none */
+    uint16_t seq;
+    int tries;          /* Timer runs the probe in flight went unanswered */
+    int wait;           /* Timer runs until the next probe */
+    int raise;          /* Timer runs until searching above hi again */
+};
+
+/*
+ * Credit-based flow control. The receiving end advertises how many data
+ * packets it can take without the peer's packets waiting to be written to
+ * its interface going past the window; the sending end stops reading its
+ * interface once it sent that many, leaving packets in the kernel's queue
+ * instead of having them cross the network to be dropped.
+ *
+ * Counts are in the sender's numbering: packets lost on the way count as
+ * received once a control packet says they were sent. That count is kept
+ * apart from the packets actually received, as control packets can get
+ * ahead of data they count, and the later of the two is what was seen.
+ * Limits only ever grow.
+ */
+#define PEER_CREDIT_WINDOW 512      /* Half a shard's receive pool */
+#define PEER_CREDIT_UPDATE (PEER_CREDIT_WINDOW / 8)
+#define PEER_CREDIT_MS 10
+
+struct peer_credit
+{
+    int on;                     /* Agreed during the handshake */
+
+    /* Receiving: the peer's data packets */
+    uint32_t rx_data;           /* Received, and opened if sealed */
+    uint32_t rx_sent;           /* Sent, as the peer last said */
+    uint32_t rx_limit;          /* Advertised */
+    struct timer timer;         /* Checks for credit to hand out */
+
+    /* Sending, added to and read by the interface threads */
+    uint32_t tx_sent;
+    uint32_t tx_limit;
+    uint32_t tx_last;           /* tx_sent at the last timer run */
+};
+
+/* The peer's data packets received, or lost */
+static inline uint32_t peer_credit_seen(const struct peer_credit *c)
+{
+    uint32_t data = __atomic_load_n(&c->rx_data, __ATOMIC_RELAXED);
+
+    return (int32_t)(c->rx_sent - data) > 0 ? c->rx_sent : data;
+}
+
+static inline void peer_credit_data(struct peer_credit *c, int n)
+{
+    __atomic_fetch_add(&c->rx_data, n, __ATOMIC_RELAXED);
+}
+
+static inline void peer_credit_sent(struct peer_credit *c, uint32_t sent)
+{
+    if ((int32_t)(sent - c->rx_sent) > 0)
+        c->rx_sent = sent;
+}
+
 struct peer
 {
     LIST_ENTRY(peer) link;
+    struct peer_table *table;
 
     int state;
     struct sockaddr_in addr;
-    struct iface *iface;
+    int link_mtu;               /* Largest datagram towards the peer */
+    struct peer_pmtu pmtu;
+    struct iface *iface;        /* The hub's in hub mode */
+    uint32_t hub_nh;            /* Next hop in the hub's routes, 0 if none */
+    unsigned int hub_learned;   /* Routes learned for it, under the hub lock */
     struct dispatch *dispatch;
-    struct event *timer;
-    int tx_count;
-    int rx_count;
+    struct timer timer;
+    struct peer_stats stats;
+    unsigned long last_rx;      /* stats.rx_pkts at the last timer run */
+    unsigned long last_tx;      /* Same for control plus interface packets */
     int timeout;
     int abort_on_destroy;
 
+    /* Set once connected if encrypting, read by the interface threads */
+    struct crypto_session *crypto;
+    uint8_t hs_nonce[CRYPTO_HS_NONCE_SZ];   /* The client's, ours or theirs */
+    struct compress_ctx *compress;      /* Set once connected if agreed */
+    struct peer_credit credit;
+    struct worker_serial tx_serial;     /* Batches with the worker pool */
+    struct worker_serial rx_serial;
+
     tx_handler_t tx;
+    tx_release_t tx_release;    /* Once nothing will be sent anymore */
+    void *tx_priv;
+};
+
+struct peer_slot
+{
+    uint64_t key;
+    struct peer *peer;          /* NULL if the slot is free */
 };
 
-struct peer *peer_lookup(struct sockaddr_in *addr);
-struct peer *peer_create(struct dispatch *d, struct sockaddr_in *addr,
-                         tx_handler_t tx);
+struct peer_htab
+{
+    struct peer_slot *slots;
+    size_t mask;
+    size_t count;
+};
+
+/*
+ * The set of peers driven by one dispatch, hashed on (address, port).
+ *
+ * Open addressing with linear probing; deletion shifts the rest of the
+ * cluster back instead of leaving tombstones. Growing the table allocates
+ * a new one twice as big and moves a few slots of the old one over on
+ * every insertion and removal, so no single operation pays for a full
+ * rehash. Lookups check the new table, then what is left of the old one.
+ */
+struct peer_table
+{
+    struct peer_htab cur;
+    struct peer_htab old;       /* Being migrated into cur if slots != NULL */
+    size_t mig_start;           /* Free slot of old the migration began after */
+    size_t mig_done;            /* Slots of old migrated so far */
+    uint64_t seed;
+
+    /*
+     * Only the dispatch thread inserts, removes and looks up; the lock lets
+     * other threads (metrics) walk the peer list and their interfaces.
+     */
+    lock_t lock;
+    LIST_HEAD(, peer) peers;
+};
+
+int peer_table_init(struct peer_table *t);
+void peer_table_cleanup(struct peer_table *t);
+int peer_table_insert(struct peer_table *t, struct peer *p);
+void peer_table_remove(struct peer_table *t, struct peer *p);
+struct peer *peer_lookup(struct peer_table *t, struct sockaddr_in *addr);
+struct peer *peer_create(struct peer_table *t, struct dispatch *d,
+                         struct sockaddr_in *addr, int link_mtu,
+                         tx_handler_t tx, tx_release_t tx_release,
+                         void *tx_priv);
 void peer_destroy(struct peer *p);
 void peer_connect(struct peer *p);
 void peer_listen(struct peer *p);
 
-void peer_receive(struct peer *p, struct pkt *pkt);
+void peer_receive(struct peer *p, struct pkt **pkts, int n);
+void peer_tx(struct pkt **pkts, int n, void *priv);
 
-static inline void peer_send(struct peer *p, struct pkt *pkt)
+static inline void peer_xmit(struct peer *p, struct pkt *pkt)
 {
-    p->tx_count++;
-    p->tx(pkt, &p->addr);
+    pkt_set_dest(pkt, &p->addr);
+    p->tx(pkt, p->tx_priv);
+}
+
+/* Data packets the peer still lets us send */
+static inline long peer_tx_credit(struct peer *p)
+{
+    if (!p->credit.on)
+        return 0;
+
+    return (int32_t)(__atomic_load_n(&p->credit.tx_limit, __ATOMIC_RELAXED) -
+                     __atomic_load_n(&p->credit.tx_sent, __ATOMIC_RELAXED));
 }
 
 #endif /* PEER_H_ */
@@ -33,37 +33,42 @@
 #ifndef PKTQUEUE_H_
 #define PKTQUEUE_H_
 
+#include <stdint.h>
 #include <sys/queue.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <aio.h>
 
-#ifdef USE_LOCKS
-# include <pthread.h>
-typedef pthread_spinlock_t lock_t;
-# define lock_init(x) pthread_spin_init(x)
-# define lock(x) pthread_spin_lock(x)
-# define unlock(x) pthread_spin_unlock(x)
-#else
-typedef char lock_t[0];
-#define lock_init(x)
-#define lock(x)
-#define unlock(x)
-#endif
+#include "lock.h"
+#include "pktslab.h"
 
 #define PKT_INFO_SZ 40
 
 struct pkt;
 typedef void (*compl_handler_t)(struct pkt *, void *);
 
+/*
+ * Packet buffers are laid out as in the kernel's sk_buff:
+ *
+ *     head           buff               buff + pkt_size     head + buff_size
+ *      |  headroom    |       data       |      tailroom      |
+ *
+ * Headers are pushed in front of the data and pulled off it, trailers put
+ * behind it and trimmed off, all in place. Packets start out empty, with
+ * the headroom and tailroom they were allocated with reserved, and go back
+ * to that with pkt_reset() when they are recycled.
+ */
 struct pkt
 {
     SIMPLEQ_ENTRY(pkt) link;
 
-    size_t buff_size;
-    size_t pkt_size;
+    size_t buff_size;   /* The whole buffer, from head */
+    size_t pkt_size;    /* The data, from buff */
     char *buff;
+    char *head;
+    size_t headroom;    /* Reserved in front of the data, and behind it */
+    size_t tailroom;
 
     struct {
         compl_handler_t handler;
@@ -71,8 +76,17 @@ struct pkt
     } compl;
 
     void *dest;
+
+    uint64_t stamp;     /* Queued to go out at, with queue management */
+    uint32_t hash;      /* Of the inner flow, with fair queueing */
+
+    int slab;
 };
 
+/* Packet buffers start on the first cache line after the metadata */
+#define PKT_HDR_SZ \
+    ((sizeof (struct pkt) + PKTSLAB_LINE - 1) & ~(PKTSLAB_LINE - 1))
+
 struct pktqueue
 {
     SIMPLEQ_HEAD(,pkt) h;
@@ -93,8 +107,7 @@ static inline void pktqueue_init(struct pktqueue *pq)
 
 static inline void pkt_free(struct pkt *p)
 {
-    free(p->buff);
-    free(p);
+    pktslab_free(p, p->slab);
 }
 
 static inline void pkt_complete_default(struct pkt *pkt, void *priv)
@@ -110,22 +123,95 @@ static inline void pkt_set_compl(struct pkt *p, compl_handler_t h,
     p->compl.priv = priv;
 }
 
-static inline struct pkt *pkt_alloc(size_t size)
+/*
+ * Metadata and buffer share one slab slot. Unlike the metadata, the buffer
+ * is not cleared. Room is made for size bytes of data, with headroom bytes
+ * in front of them and tailroom bytes behind them reserved for headers and
+ * trailers.
+ */
+static inline struct pkt *pkt_alloc_room(size_t size, size_t headroom,
+                                         size_t tailroom)
 {
     struct pkt *p;
+    int slab;
 
-    p = calloc(1, sizeof (*p));
+    p = pktslab_alloc(PKT_HDR_SZ + headroom + size + tailroom, &slab);
     if (!p)
         return NULL;
-    p->buff = calloc(1, size);
-    if (!p->buff)
-        return NULL;
-    p->buff_size = size;
+    memset(p, 0, sizeof (*p));
+    p->slab = slab;
+    p->head = (char *)p + PKT_HDR_SZ;
+    p->buff = p->head + headroom;
+    p->buff_size = headroom + size + tailroom;
+    p->headroom = headroom;
+    p->tailroom = tailroom;
     pkt_set_compl(p, pkt_complete_default, NULL);
 
     return p;
 }
 
+static inline struct pkt *pkt_alloc(size_t size)
+{
+    return pkt_alloc_room(size, 0, 0);
+}
+
+/* Back to empty, with the room reserved at allocation */
+static inline void pkt_reset(struct pkt *p)
+{
+    p->buff = p->head + p->headroom;
+    p->pkt_size = 0;
+}
+
+static inline size_t pkt_headroom(const struct pkt *p)
+{
+    return p->buff - p->head;
+}
+
+static inline size_t pkt_tailroom(const struct pkt *p)
+{
+    return p->buff_size - pkt_headroom(p) - p->pkt_size;
+}
+
+/* What the data may grow to at the tail, short of the reserved tailroom */
+static inline size_t pkt_room(const struct pkt *p)
+{
+    size_t room = pkt_tailroom(p);
+
+    return room > p->tailroom ? room - p->tailroom : 0;
+}
+
+/*
+ * Grow or shrink the data at either end, and return where the data, or
+ * what was put, starts. Callers check the room first.
+ */
+static inline char *pkt_push(struct pkt *p, size_t len)
+{
+    p->buff -= len;
+    p->pkt_size += len;
+    return p->buff;
+}
+
+static inline char *pkt_pull(struct pkt *p, size_t len)
+{
+    p->buff += len;
+    p->pkt_size -= len;
+    return p->buff;
+}
+
+static inline char *pkt_put(struct pkt *p, size_t len)
+{
+    char *tail = p->buff + p->pkt_size;
+
+    p->pkt_size += len;
+    return tail;
+}
+
+static inline void pkt_trim(struct pkt *p, size_t len)
+{
+    if (len < p->pkt_size)
+        p->pkt_size = len;
+}
+
 static inline void pkt_complete(struct pkt *p)
 {
     compl_handler_t h = p->compl.handler;
@@ -142,10 +228,25 @@ static inline int pktqueue_enqueue(struct pktqueue *pq, struct pkt *p)
 {
     lock(&pq->l);
     SIMPLEQ_INSERT_TAIL(&pq->h, p, link);
+    ++pq->pkt_count;
+    pq->total_mem += p->buff_size;
+    pq->pkt_mem += p->pkt_size;
     unlock(&pq->l);
+    return 0;
+}
+
+/*
+ * Put a packet back at the head of the queue, e.g. when the device would not
+ * take it yet.
+ */
+static inline int pktqueue_requeue(struct pktqueue *pq, struct pkt *p)
+{
+    lock(&pq->l);
+    SIMPLEQ_INSERT_HEAD(&pq->h, p, link);
     ++pq->pkt_count;
     pq->total_mem += p->buff_size;
     pq->pkt_mem += p->pkt_size;
+    unlock(&pq->l);
     return 0;
 }
 
@@ -0,0 +1,309 @@
+/*
+ *  Copyright (c) 2011, Julian Pidancet <julian.pidancet@gmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *  3. Neither the name of Julian Pidancet nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#ifndef PKTRING_H_
+#define PKTRING_H_
+
+#include <sys/queue.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pktqueue.h"
+#include "pktslab.h"
+
+/*
+ * Bounded lock-free packet rings for handing packets between threads.
+ *
+ * PKTRING_SPSC rings take one producer and one consumer thread and cost a
+ * plain load and store per packet. PKTRING_MPMC rings are Vyukov's bounded
+ * queue: every cell carries a sequence number telling whose turn it is, and
+ * positions are claimed with a compare-and-swap, so any number of threads
+ * may sit on either side.
+ *
+ * Producer and consumer indices live on cache lines of their own. In the
+ * SPSC case each side also keeps a private copy of the other side's index
+ * and only reloads it when the ring looks full or empty.
+ *
+ * Only the consumer may put packets back. Those go to a private list which
+ * dequeues drain first, so that a packet the device would not take yet
+ * keeps its place at the front.
+ */
+
+#define PKTRING_SPSC 0
+#define PKTRING_MPMC 1
+
+struct pktring_cell
+{
+    unsigned long seq;
+    struct pkt *p;
+};
+
+struct pktring
+{
+    /* Consumer side */
+    unsigned long head __attribute__((aligned(PKTSLAB_LINE)));
+    unsigned long tail_cache;
+    SIMPLEQ_HEAD(,pkt) back;
+    unsigned long nback;
+
+    /* Producer side */
+    unsigned long tail __attribute__((aligned(PKTSLAB_LINE)));
+    unsigned long head_cache;
+    unsigned long hiwat;        /* Most packets ever queued at once */
+
+    /* Read-only */
+    int mode __attribute__((aligned(PKTSLAB_LINE)));
+    unsigned long size;
+    unsigned long mask;
+    struct pktring_cell cells[];
+};
+
+static inline struct pktring *pktring_create(unsigned long size, int mode)
+{
+    struct pktring *r;
+    size_t sz;
+    unsigned long i;
+
+    size = size < 2 ? 2 : size;
+    while (size & (size - 1))
+        size += size & -size;
+
+    sz = sizeof (*r) + size * sizeof (r->cells[0]);
+    sz = (sz + PKTSLAB_LINE - 1) & ~(size_t)(PKTSLAB_LINE - 1);
+    r = aligned_alloc(PKTSLAB_LINE, sz);
+    if (!r)
+        return NULL;
+
+    memset(r, 0, sz);
+    SIMPLEQ_INIT(&r->back);
+    r->mode = mode;
+    r->size = size;
+    r->mask = size - 1;
+    for (i = 0; i < size; i++)
+        r->cells[i].seq = i;
+
+    return r;
+}
+
+static inline void pktring_destroy(struct pktring *r)
+{
+    free(r);
+}
+
+/*
+ * Number of packets queued. Exact from the consumer, a snapshot that may
+ * already be stale from anywhere else.
+ */
+static inline unsigned long pktring_count(struct pktring *r)
+{
+    unsigned long head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    unsigned long tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+
+    return (tail - head) + __atomic_load_n(&r->nback, __ATOMIC_RELAXED);
+}
+
+static inline void pktring_hiwat(struct pktring *r, unsigned long tail)
+{
+    long count = tail - __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    unsigned long hiwat = __atomic_load_n(&r->hiwat, __ATOMIC_RELAXED);
+
+    /* Consumers may already be past tail on a busy MPMC ring */
+    while (count > (long)hiwat &&
+           !__atomic_compare_exchange_n(&r->hiwat, &hiwat, count, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static inline int pktring_enqueue_mpmc(struct pktring *r, struct pkt *p)
+{
+    struct pktring_cell *c;
+    unsigned long pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    long dif;
+
+    for (;;) {
+        c = &r->cells[pos & r->mask];
+        dif = (long)(__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - pos);
+        if (!dif) {
+            if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        } else if (dif < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    c->p = p;
+    __atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+    pktring_hiwat(r, pos + 1);
+
+    return 0;
+}
+
+static inline struct pkt *pktring_dequeue_mpmc(struct pktring *r)
+{
+    struct pktring_cell *c;
+    struct pkt *p;
+    unsigned long pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    long dif;
+
+    for (;;) {
+        c = &r->cells[pos & r->mask];
+        dif = (long)(__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+        if (!dif) {
+            if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        } else if (dif < 0) {
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    p = c->p;
+    __atomic_store_n(&c->seq, pos + r->size, __ATOMIC_RELEASE);
+
+    return p;
+}
+
+/*
+ * Enqueue up to n packets, in order. Returns how many went in, fewer than
+ * n only if the ring filled up.
+ */
+static inline unsigned int pktring_enqueue_bulk(struct pktring *r,
+                                                struct pkt **pkts,
+                                                unsigned int n)
+{
+    unsigned long tail = r->tail;
+    unsigned long room;
+    unsigned int i;
+
+    if (r->mode == PKTRING_MPMC) {
+        for (i = 0; i < n; i++) {
+            if (pktring_enqueue_mpmc(r, pkts[i]))
+                break;
+        }
+        return i;
+    }
+
+    room = r->size - (tail - r->head_cache);
+    if (room < n) {
+        r->head_cache = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        room = r->size - (tail - r->head_cache);
+        if (n > room)
+            n = room;
+    }
+
+    for (i = 0; i < n; i++)
+        r->cells[(tail + i) & r->mask].p = pkts[i];
+    __atomic_store_n(&r->tail, tail + n, __ATOMIC_RELEASE);
+
+    if (tail + n - r->head_cache > r->hiwat)
+        pktring_hiwat(r, tail + n);
+
+    return n;
+}
+
+/* Returns -1 if the ring is full, in which case p stays with the caller */
+static inline int pktring_enqueue(struct pktring *r, struct pkt *p)
+{
+    if (r->mode == PKTRING_MPMC)
+        return pktring_enqueue_mpmc(r, p);
+
+    return pktring_enqueue_bulk(r, &p, 1) ? 0 : -1;
+}
+
+/* Dequeue up to n packets, in order. Returns how many came out. */
+static inline unsigned int pktring_dequeue_bulk(struct pktring *r,
+                                                struct pkt **pkts,
+                                                unsigned int n)
+{
+    unsigned long head;
+    unsigned long avail;
+    unsigned int i = 0;
+
+    while (i < n && (pkts[i] = SIMPLEQ_FIRST(&r->back))) {
+        SIMPLEQ_REMOVE_HEAD(&r->back, link);
+        __atomic_store_n(&r->nback, r->nback - 1, __ATOMIC_RELAXED);
+        i++;
+    }
+
+    if (r->mode == PKTRING_MPMC) {
+        for (; i < n; i++) {
+            pkts[i] = pktring_dequeue_mpmc(r);
+            if (!pkts[i])
+                break;
+        }
+        return i;
+    }
+
+    head = r->head;
+    avail = r->tail_cache - head;
+    if (avail < n - i) {
+        r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        avail = r->tail_cache - head;
+    }
+    if (avail > n - i)
+        avail = n - i;
+
+    for (; avail; avail--, head++)
+        pkts[i++] = r->cells[head & r->mask].p;
+    __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+
+    return i;
+}
+
+static inline struct pkt *pktring_dequeue(struct pktring *r)
+{
+    struct pkt *p;
+
+    if (!pktring_dequeue_bulk(r, &p, 1))
+        return NULL;
+
+    return p;
+}
+
+/*
+ * Consumer only: give back a dequeued packet, dequeued again before
+ * anything else. Putting several back in reverse order preserves theirs.
+ */
+static inline void pktring_putback(struct pktring *r, struct pkt *p)
+{
+    SIMPLEQ_INSERT_HEAD(&r->back, p, link);
+    __atomic_store_n(&r->nback, r->nback + 1, __ATOMIC_RELAXED);
+}
+
+#endif /* PKTRING_H_ */
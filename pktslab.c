@@ -0,0 +1,205 @@
+/*
+ *  Copyright (c) 2011, Julian Pidancet <julian.pidancet@gmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *  3. Neither the name of Julian Pidancet nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "lock.h"
+#include "pktslab.h"
+
+/*
+ * Packet slab allocator.
+ *
+ * Slots are carved out of PKTSLAB_REGION_SZ regions, one region per size
+ * class at a time, and recycled through per-class free lists. Regions are
+ * never given back, so once the working set has been reached, allocating
+ * and freeing a slot is a couple of pointer moves. Slot sizes are multiples
+ * of a cache line and regions are page aligned, so every slot starts on a
+ * cache line of its own.
+ *
+ * Requests bigger than the largest class fall back to the C library.
+ */
+
+struct pktslab_free
+{
+    struct pktslab_free *next;
+};
+
+struct pktslab_class
+{
+    lock_t l;
+    struct pktslab_free *free;
+    char *cur;                  /* Uncarved part of the current region */
+    char *end;
+    struct pktslab_stats stats;
+} __attribute__((aligned(PKTSLAB_LINE)));
+
+static const size_t class_size[PKTSLAB_NCLASSES] = {
+    256, 1024, 1728, 4096, 16384, 69632
+};
+
+static struct pktslab_class classes[PKTSLAB_NCLASSES];
+
+struct pktslab_opts pktslab_opts;
+
+static void __attribute__((constructor)) pktslab_init(void)
+{
+    int i;
+
+    for (i = 0; i < PKTSLAB_NCLASSES; i++) {
+        lock_init(&classes[i].l);
+        classes[i].stats.slot_size = class_size[i];
+    }
+}
+
+static void *region_map(void)
+{
+    void *r = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if (pktslab_opts.hugepages)
+        r = mmap(NULL, PKTSLAB_REGION_SZ, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (r == MAP_FAILED) {
+        r = mmap(NULL, PKTSLAB_REGION_SZ, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (r == MAP_FAILED) {
+            fprintf(stderr, "pktslab: mmap() failed: %s\n", strerror(errno));
+            return NULL;
+        }
+#ifdef MADV_HUGEPAGE
+        if (pktslab_opts.hugepages)
+            madvise(r, PKTSLAB_REGION_SZ, MADV_HUGEPAGE);
+#endif
+    }
+
+    return r;
+}
+
+void *pktslab_alloc(size_t size, int *cls)
+{
+    struct pktslab_class *c;
+    void *slot;
+    int i;
+
+    for (i = 0; i < PKTSLAB_NCLASSES; i++) {
+        if (size <= class_size[i])
+            break;
+    }
+
+    if (i == PKTSLAB_NCLASSES) {
+        *cls = -1;
+        return aligned_alloc(PKTSLAB_LINE,
+                             (size + PKTSLAB_LINE - 1) & ~(PKTSLAB_LINE - 1));
+    }
+
+    c = &classes[i];
+    *cls = i;
+
+    lock(&c->l);
+    if (c->free) {
+        slot = c->free;
+        c->free = c->free->next;
+    } else {
+        if (c->cur + class_size[i] > c->end) {
+            char *r = region_map();
+
+            if (!r) {
+                unlock(&c->l);
+                return NULL;
+            }
+            c->cur = r;
+            c->end = r + PKTSLAB_REGION_SZ;
+            c->stats.regions++;
+        }
+        slot = c->cur;
+        c->cur += class_size[i];
+        c->stats.slots++;
+    }
+    c->stats.allocs++;
+    c->stats.in_use++;
+    unlock(&c->l);
+
+    return slot;
+}
+
+void pktslab_free(void *slot, int cls)
+{
+    struct pktslab_class *c;
+    struct pktslab_free *f = slot;
+
+    if (cls < 0) {
+        free(slot);
+        return;
+    }
+
+    c = &classes[cls];
+
+    lock(&c->l);
+    f->next = c->free;
+    c->free = f;
+    c->stats.frees++;
+    c->stats.in_use--;
+    unlock(&c->l);
+}
+
+void pktslab_stats_get(struct pktslab_stats st[PKTSLAB_NCLASSES])
+{
+    int i;
+
+    for (i = 0; i < PKTSLAB_NCLASSES; i++) {
+        lock(&classes[i].l);
+        st[i] = classes[i].stats;
+        unlock(&classes[i].l);
+    }
+}
+
+void pktslab_stats_print(FILE *f)
+{
+    struct pktslab_stats st[PKTSLAB_NCLASSES];
+    int i;
+
+    pktslab_stats_get(st);
+    for (i = 0; i < PKTSLAB_NCLASSES; i++) {
+        if (!st[i].regions)
+            continue;
+        fprintf(f, "slab %zu: %lu allocs, %lu frees, %lu in use, "
+                   "%lu slots in %lu regions\n",
+                st[i].slot_size, st[i].allocs, st[i].frees, st[i].in_use,
+                st[i].slots, st[i].regions);
+    }
+}
@@ -0,0 +1,65 @@
+/*
+ *  Copyright (c) 2011, Julian Pidancet <julian.pidancet@gmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *  3. Neither the name of Julian Pidancet nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#ifndef PKTSLAB_H_
+#define PKTSLAB_H_
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define PKTSLAB_LINE 64
+#define PKTSLAB_REGION_SZ (2UL << 20)
+#define PKTSLAB_NCLASSES 6
+
+struct pktslab_opts
+{
+    int hugepages;      /* Try MAP_HUGETLB for new regions */
+};
+
+struct pktslab_stats
+{
+    size_t slot_size;
+    unsigned long allocs;
+    unsigned long frees;
+    unsigned long in_use;
+    unsigned long slots;    /* Carved out of regions so far */
+    unsigned long regions;  /* Regions mapped, i.e. actual allocations */
+};
+
+extern struct pktslab_opts pktslab_opts;
+
+void *pktslab_alloc(size_t size, int *cls);
+void pktslab_free(void *slot, int cls);
+void pktslab_stats_get(struct pktslab_stats st[PKTSLAB_NCLASSES]);
+void pktslab_stats_print(FILE *f);
+
+#endif /* PKTSLAB_H_ */
@@ -0,0 +1,131 @@
+/*
+ *  Copyright (c) 2011, Julian Pidancet <julian.pidancet@gmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *  3. Neither the name of Julian Pidancet nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "peer.h"
+
+/*
+ * Receive side credit accounting: what was seen of the peer's data must
+ * not depend on whether its control packets arrive before or after the
+ * data they count.
+ */
+
+static int failed;
+
+#define CHECK(c, want, what) do {                                       \
+    uint32_t got = peer_credit_seen(c);                                 \
+    if (got != (uint32_t)(want)) {                                      \
+        fprintf(stderr, "%s: seen %u, want %u\n", what, got,            \
+                (uint32_t)(want));                                      \
+        failed = 1;                                                     \
+    }                                                                   \
+} while (0)
+
+static void data(struct peer_credit *c, unsigned int n)
+{
+    while (n--)
+        peer_credit_data(c, 1);
+}
+
+static void test_in_order(uint32_t base)
+{
+    struct peer_credit c;
+
+    memset(&c, 0, sizeof (c));
+    c.rx_data = c.rx_sent = base;
+
+    data(&c, 100);
+    peer_credit_sent(&c, base + 100);
+    CHECK(&c, base + 100, "in order");
+}
+
+/* The report overtakes the data it counts */
+static void test_reordered(uint32_t base)
+{
+    struct peer_credit c;
+
+    memset(&c, 0, sizeof (c));
+    c.rx_data = c.rx_sent = base;
+
+    peer_credit_sent(&c, base + 100);
+    CHECK(&c, base + 100, "report first");
+    data(&c, 100);
+    CHECK(&c, base + 100, "data after report");
+
+    /* Half way: a report of 150 between the next 100 */
+    data(&c, 50);
+    peer_credit_sent(&c, base + 200);
+    data(&c, 50);
+    CHECK(&c, base + 200, "report in between");
+
+    /* An older report arriving late changes nothing */
+    peer_credit_sent(&c, base + 150);
+    CHECK(&c, base + 200, "stale report");
+}
+
+/* Data the report counts never arrives */
+static void test_lost(uint32_t base)
+{
+    struct peer_credit c;
+
+    memset(&c, 0, sizeof (c));
+    c.rx_data = c.rx_sent = base;
+
+    data(&c, 60);
+    peer_credit_sent(&c, base + 100);
+    CHECK(&c, base + 100, "lost");
+
+    /* Arrivals are not told from late ones until the next report */
+    data(&c, 10);
+    CHECK(&c, base + 100, "after loss");
+    peer_credit_sent(&c, base + 110);
+    CHECK(&c, base + 110, "after loss reported");
+}
+
+int main(void)
+{
+    static const uint32_t bases[] = { 0, 12345, UINT32_MAX - 120 };
+    size_t i;
+
+    for (i = 0; i < sizeof (bases) / sizeof (bases[0]); i++) {
+        test_in_order(bases[i]);
+        test_reordered(bases[i]);
+        test_lost(bases[i]);
+    }
+
+    printf("credit_test: %s\n", failed ? "FAIL" : "ok");
+    return failed;
+}
@@ -0,0 +1,298 @@
+/*
+ *  Copyright (c) 2011, Julian Pidancet <julian.pidancet@gmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *  3. Neither the name of Julian Pidancet nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "crypto.h"
+
+/*
+ * Known answers for the AEAD kernels, at every SIMD level the CPU has:
+ * the ChaCha20-Poly1305 vectors of RFC 8439 and the AES-256 vectors of the
+ * GCM specification, then longer messages that go through the wide code
+ * paths, checked against tags from OpenSSL. Every message must also fail
+ * to open once its tag, ciphertext or associated data are tampered with.
+ */
+
+struct aead_vector
+{
+    const char *name;
+    int cipher;
+    const char *key;
+    const char *nonce;
+    const char *aad;
+    const char *pt;
+    const char *ct;
+    const char *tag;
+};
+
+static const struct aead_vector vectors[] = {
+    {
+        "RFC 8439 2.8.2", CRYPTO_CHACHA20_POLY1305,
+        "808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f",
+        "070000004041424344454647",
+        "50515253c0c1c2c3c4c5c6c7",
+        "4c616469657320616e642047656e746c656d656e206f662074686520636c6173"
+        "73206f66202739393a204966204920636f756c64206f6666657220796f75206f"
+        "6e6c79206f6e652074697020666f7220746865206675747572652c2073756e73"
+        "637265656e20776f756c642062652069742e",
+        "d31a8d34648e60db7b86afbc53ef7ec2a4aded51296e08fea9e2b5a736ee62d6"
+        "3dbea45e8ca9671282fafb69da92728b1a71de0a9e060b2905d6a5b67ecd3b36"
+        "92ddbd7f2d778b8c9803aee328091b58fab324e4fad675945585808b4831d7bc"
+        "3ff4def08e4b7a9de576d26586cec64b6116",
+        "1ae10b594f09e26a7e902ecbd0600691"
+    },
+    {
+        "RFC 8439 A.5", CRYPTO_CHACHA20_POLY1305,
+        "1c9240a5eb55d38af333888604f6b5f0473917c1402b80099dca5cbc207075c0",
+        "000000000102030405060708",
+        "f33388860000000000004e91",
+        "496e7465726e65742d4472616674732061726520647261667420646f63756d65"
+        "6e74732076616c696420666f722061206d6178696d756d206f6620736978206d"
+        "6f6e74687320616e64206d617920626520757064617465642c207265706c6163"
+        "65642c206f72206f62736f6c65746564206279206f7468657220646f63756d65"
+        "6e747320617420616e792074696d652e20497420697320696e617070726f7072"
+        "6961746520746f2075736520496e7465726e65742d4472616674732061732072"
+        "65666572656e6365206d6174657269616c206f7220746f206369746520746865"
+        "6d206f74686572207468616e206173202fe2809c776f726b20696e2070726f67"
+        "726573732e2fe2809d",
+        "64a0861575861af460f062c79be643bd5e805cfd345cf389f108670ac76c8cb2"
+        "4c6cfc18755d43eea09ee94e382d26b0bdb7b73c321b0100d4f03b7f355894cf"
+        "332f830e710b97ce98c8a84abd0b948114ad176e008d33bd60f982b1ff37c855"
+        "9797a06ef4f0ef61c186324e2b3506383606907b6a7c02b0f9f6157b53c867e4"
+        "b9166c767b804d46a59b5216cde7a4e99040c5a40433225ee282a1b0a06c523e"
+        "af4534d7f83fa1155b0047718cbc546a0d072b04b3564eea1b422273f548271a"
+        "0bb2316053fa76991955ebd63159434ecebb4e466dae5a1073a6727627097a10"
+        "49e617d91d361094fa68f0ff77987130305beaba2eda04df997b714d6c6f2c29"
+        "a6ad5cb4022b02709b",
+        "eead9d67890cbb22392336fea1851f38"
+    },
+    {
+        "GCM test case 13", CRYPTO_AES256_GCM,
+        "0000000000000000000000000000000000000000000000000000000000000000",
+        "000000000000000000000000",
+        "",
+        "",
+        "",
+        "530f8afbc74536b9a963b4f1c4cb738b"
+    },
+    {
+        "GCM test case 14", CRYPTO_AES256_GCM,
+        "0000000000000000000000000000000000000000000000000000000000000000",
+        "000000000000000000000000",
+        "",
+        "00000000000000000000000000000000",
+        "cea7403d4d606b6e074ec5d3baf39d18",
+        "d0d1c8a799996bf0265b98b5d48ab919"
+    },
+    {
+        "GCM test case 15", CRYPTO_AES256_GCM,
+        "feffe9928665731c6d6a8f9467308308feffe9928665731c6d6a8f9467308308",
+        "cafebabefacedbaddecaf888",
+        "",
+        "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+        "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b391aafd255",
+        "522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd2555d1aa"
+        "8cb08e48590dbb3da7b08b1056828838c5f61e6393ba7a0abcc9f662898015ad",
+        "b094dac5d93471bdec1a502270e3cc6c"
+    },
+    {
+        "GCM test case 16", CRYPTO_AES256_GCM,
+        "feffe9928665731c6d6a8f9467308308feffe9928665731c6d6a8f9467308308",
+        "cafebabefacedbaddecaf888",
+        "feedfacedeadbeeffeedfacedeadbeefabaddad2",
+        "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+        "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39",
+        "522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd2555d1aa"
+        "8cb08e48590dbb3da7b08b1056828838c5f61e6393ba7a0abcc9f662",
+        "76fc6ece0f4e1768cddf8853bb2d551b"
+    },
+};
+
+/*
+ * Longer messages: key 00..1f, nonce 00000000 00..07, associated data
+ * 01..08 and len bytes of i * 7 + 3. The tag covers the ciphertext.
+ */
+struct aead_long_vector
+{
+    int cipher;
+    size_t len;
+    const char *tag;
+};
+
+static const struct aead_long_vector long_vectors[] = {
+    { CRYPTO_CHACHA20_POLY1305, 1500, "dcab79e8bc3e4cf80f5ffb120574df19" },
+    { CRYPTO_CHACHA20_POLY1305, 4099, "6ad77348bc91a2795a6c5ec918af55f9" },
+    { CRYPTO_AES256_GCM, 1500, "d7343ac9d7bc735615d429ab62285a85" },
+    { CRYPTO_AES256_GCM, 4099, "a74918552c4bc68ceb5e262287b9720a" },
+};
+
+#define MSG_MAX (4096 + 64)
+
+static int failed;
+
+static size_t unhex(uint8_t *out, const char *hex)
+{
+    size_t n;
+
+    for (n = 0; hex[2 * n]; n++)
+        sscanf(hex + 2 * n, "%2hhx", &out[n]);
+
+    return n;
+}
+
+static void fail(const char *name, const char *level, const char *what)
+{
+    fprintf(stderr, "%s (%s): %s\n", name, level, what);
+    failed = 1;
+}
+
+/* Seal, compare, open, then make sure tampering with anything is caught */
+static void check(const char *name, int cipher, const uint8_t *key,
+                  const uint8_t *nonce, const uint8_t *aad, size_t aad_len,
+                  const uint8_t *pt, size_t len, const uint8_t *ct,
+                  const uint8_t *want_tag)
+{
+    const char *level = cipher == CRYPTO_AES256_GCM ? "aes-ni" :
+                        crypto_simd_str();
+    struct crypto_aead a;
+    uint8_t buf[MSG_MAX];
+    uint8_t bad_aad[64];
+    uint8_t tag[CRYPTO_TAG_SZ];
+
+    crypto_aead_init(&a, cipher, key);
+
+    memcpy(buf, pt, len);
+    crypto_aead_seal(&a, nonce, aad, aad_len, buf, len, tag);
+    if (ct && memcmp(buf, ct, len))
+        fail(name, level, "wrong ciphertext");
+    if (memcmp(tag, want_tag, sizeof (tag)))
+        fail(name, level, "wrong tag");
+
+    if (crypto_aead_open(&a, nonce, aad, aad_len, buf, len, tag))
+        fail(name, level, "refused to open");
+    else if (memcmp(buf, pt, len))
+        fail(name, level, "wrong plaintext");
+
+    crypto_aead_seal(&a, nonce, aad, aad_len, buf, len, tag);
+    tag[CRYPTO_TAG_SZ - 1] ^= 0x01;
+    if (!crypto_aead_open(&a, nonce, aad, aad_len, buf, len, tag))
+        fail(name, level, "opened with a tampered tag");
+    tag[CRYPTO_TAG_SZ - 1] ^= 0x01;
+
+    if (len) {
+        buf[len / 2] ^= 0x80;
+        if (!crypto_aead_open(&a, nonce, aad, aad_len, buf, len, tag))
+            fail(name, level, "opened tampered ciphertext");
+        buf[len / 2] ^= 0x80;
+    }
+
+    if (aad_len) {
+        memcpy(bad_aad, aad, aad_len);
+        bad_aad[0] ^= 0x01;
+        if (!crypto_aead_open(&a, nonce, bad_aad, aad_len, buf, len, tag))
+            fail(name, level, "opened with tampered associated data");
+    }
+}
+
+static void check_vectors(int cipher)
+{
+    static uint8_t key[CRYPTO_KEY_SZ], nonce[12], aad[64];
+    static uint8_t pt[MSG_MAX], ct[MSG_MAX], tag[CRYPTO_TAG_SZ];
+    size_t aad_len, len;
+    size_t i;
+
+    for (i = 0; i < sizeof (vectors) / sizeof (vectors[0]); i++) {
+        const struct aead_vector *v = &vectors[i];
+
+        if (v->cipher != cipher)
+            continue;
+        unhex(key, v->key);
+        unhex(nonce, v->nonce);
+        aad_len = unhex(aad, v->aad);
+        len = unhex(pt, v->pt);
+        unhex(ct, v->ct);
+        unhex(tag, v->tag);
+        check(v->name, cipher, key, nonce, aad, aad_len, pt, len, ct, tag);
+    }
+
+    for (i = 0; i < sizeof (key); i++)
+        key[i] = i;
+    memset(nonce, 0, sizeof (nonce));
+    for (i = 0; i < 8; i++) {
+        nonce[4 + i] = i;
+        aad[i] = i + 1;
+    }
+    for (i = 0; i < sizeof (pt); i++)
+        pt[i] = i * 7 + 3;
+
+    for (i = 0; i < sizeof (long_vectors) / sizeof (long_vectors[0]); i++) {
+        const struct aead_long_vector *v = &long_vectors[i];
+        char name[32];
+
+        if (v->cipher != cipher)
+            continue;
+        snprintf(name, sizeof (name), "%s, %zu bytes",
+                 crypto_cipher_str(cipher), v->len);
+        unhex(tag, v->tag);
+        check(name, cipher, key, nonce, aad, 8, pt, v->len, NULL, tag);
+    }
+}
+
+int main(void)
+{
+    static const enum crypto_simd levels[] = {
+        CRYPTO_SIMD_NONE, CRYPTO_SIMD_AVX2, CRYPTO_SIMD_AVX512,
+    };
+    size_t i;
+
+    if (crypto_init())
+        return 1;
+
+    for (i = 0; i < sizeof (levels) / sizeof (levels[0]); i++) {
+        if (crypto_simd_set(levels[i]) != (int)levels[i])
+            continue;
+        check_vectors(CRYPTO_CHACHA20_POLY1305);
+        printf("crypto_test: chacha20-poly1305 (%s) checked\n",
+               crypto_simd_str());
+    }
+
+    if (crypto_aesni()) {
+        check_vectors(CRYPTO_AES256_GCM);
+        printf("crypto_test: aes-256-gcm checked\n");
+    }
+
+    printf("crypto_test: %s\n", failed ? "FAIL" : "ok");
+    return failed;
+}
@@ -45,6 +45,18 @@
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <arpa/inet.h>
+#include <linux/filter.h>
+
+#include "iface.h"
+#include "io.h"
+#include "pktslab.h"
+#include "metrics.h"
+#include "crypto.h"
+#include "compress.h"
+#include "workers.h"
+#include "hub.h"
+#include "peer.h"
+#include "aqm.h"
 
 static void usage(char *progname)
 {
@@ -52,23 +64,84 @@ static void usage(char *progname)
     fprintf(stderr, "    %s [OPTION] hostname port\n", progname);
     fprintf(stderr, "    %s -l [OPTION] port\n", progname);
     fprintf(stderr, "Options:\n");
-#if 0 /* FIXME */
-    fprintf(stderr, "    -k <filename>          Path to the file containing the private RSA key to use\n"
-                    "                           for securing communication with peer. If none is given,\n"
-                    "                           communication will be sent in plain text.\n");
-    fprintf(stderr, "    -a <digest list>       Comma separated list of SHA-1 public key digests that %s\n"
-                    "                           will automatically accept when establishing a secure\n"
-                    "                           channel with the remote host. If the remote host's public\n"
-                    "                           key digest is not listed, the user will be prompted to\n"
-                    "                           accept the remote host RSA key on the standard output.\n",
+    fprintf(stderr, "    -b <count>             Number of datagrams moved per socket system call\n"
+                    "                           (1-%d, default: %d).\n",
+                    IO_BATCH_MAX, IO_BATCH_DEFAULT);
+    fprintf(stderr, "    -B <count>             Maximum number of packets read from and written to\n"
+                    "                           the tunnel interface per wakeup (default: %d).\n",
+                    IFACE_BUDGET_DEFAULT);
+    fprintf(stderr, "    -e                     Use edge-triggered notifications for the tunnel\n"
+                    "                           interface and the sockets, keeping track of which are\n"
+                    "                           ready rather than telling the kernel what to watch\n"
+                    "                           every time a queue empties or a pool runs dry.\n");
+    fprintf(stderr, "    -Q <count>             Number of tunnel interface queues, each served by a\n"
+                    "                           thread of its own (1-%d, default: 1).\n",
+                    IFACE_MAX_QUEUES);
+    fprintf(stderr, "    -O                     Let the tunnel interface hand over and take TCP\n"
+                    "                           super-packets, segmented and merged by %s.\n",
                     progname);
-#endif
+    fprintf(stderr, "    -s <count>             In listen mode, number of SO_REUSEPORT sockets bound\n"
+                    "                           to the port, each served by a thread of its own\n"
+                    "                           (1-%d, default: 1).\n",
+                    IO_MAX_SHARDS);
+    fprintf(stderr, "    -S                     Steer peers to sockets with a BPF program hashing\n"
+                    "                           their address rather than the kernel's hash.\n");
+    fprintf(stderr, "    -w <weight[@addr]>     Share of the socket given to busy peers, relative to each\n"
+                    "                           other, or to peers connecting from the given address\n"
+                    "                           (1-%d, default: 1, up to %d addresses).\n",
+                    IO_WEIGHT_MAX, IO_WEIGHTS_MAX);
+    fprintf(stderr, "    -A <codel|fq_codel>    Drop packets from the head of queues that stay above %lums\n"
+                    "                           of wait for %lums, fair queueing flows to the interface\n"
+                    "                           and to each peer with fq_codel (default: none).\n",
+                    AQM_TARGET_NS / 1000000, AQM_INTERVAL_NS / 1000000);
+    fprintf(stderr, "    -E                     With queue management, mark ECN-capable packets written\n"
+                    "                           to the tunnel interface rather than drop them.\n");
+    fprintf(stderr, "    -U                     Send and receive runs of datagrams as single messages\n"
+                    "                           with UDP GSO and GRO, when the kernel supports them.\n");
+    fprintf(stderr, "    -u                     Run the data path on io_uring rather than epoll, falling\n"
+                    "                           back to epoll if the kernel does not allow it. The UDP\n"
+                    "                           socket receives into a ring of packet buffers and sends\n"
+                    "                           with queued requests, as tun writes are; tun reads are\n"
+                    "                           still polled for. Turns off UDP GRO.\n");
+    fprintf(stderr, "    -P <usecs>             Keep polling for events, and the sockets for datagrams,\n"
+                    "                           until none came for the given time before sleeping\n"
+                    "                           (1-%d). Spins a CPU per thread while busy.\n",
+                    DISPATCH_BUSY_POLL_MAX_US);
+    fprintf(stderr, "    -H                     Back packet buffers with huge pages.\n");
+    fprintf(stderr, "    -M <path>              Serve metrics in the Prometheus text format on a Unix\n"
+                    "                           domain socket at the given path.\n");
+    fprintf(stderr, "    -k <filename>          Path to the file holding the pre-shared key, as 64 hex\n"
+                    "                           digits, securing communication with peers. If none is\n"
+                    "                           given, communication will be sent in plain text.\n");
+    fprintf(stderr, "    -c <cipher list>       Comma separated list of ciphers to offer or accept among\n"
+                    "                           chacha20-poly1305 and aes-256-gcm (default: both; AES-GCM\n"
+                    "                           only where AES-NI is available).\n");
+    fprintf(stderr, "    -z                     Compress packets to and from peers that ask for it too,\n"
+                    "                           leaving alone those that do not shrink. Packet sizes\n"
+                    "                           then tell something about what encrypted packets hold.\n");
+    fprintf(stderr, "    -W <count>             Number of worker threads sealing and opening packets\n"
+                    "                           in batches, in order per peer (0-%d, default: 0, on\n"
+                    "                           the threads moving the packets).\n",
+                    WORKERS_MAX);
+    fprintf(stderr, "    -C                     Flow control with peers that ask for it too: each side\n"
+                    "                           hands out credit for what it can queue to its tunnel\n"
+                    "                           interface, and stops reading its own when out of it.\n");
+    fprintf(stderr, "    -G                     In listen mode, share one tunnel interface between every\n"
+                    "                           peer, routing packets read from it by destination.\n"
+                    "                           Sources of the packets peers send, within their own\n"
+                    "                           routes, are routed back to them, up to %d each.\n",
+                    HUB_LEARNED_MAX);
+    fprintf(stderr, "    -r <prefix/len@addr>   In hub mode, route the prefix to the peer connecting from\n"
+                    "                           the given address (up to %d times).\n",
+                    HUB_ROUTES_MAX);
 }
 
-static int sock_alloc(int listen, struct sockaddr_in *addr)
+static int sock_alloc(int listen, struct sockaddr_in *addr, int reuseport)
 {
     int fd;
     int rc;
+    int one = 1;
+    int pmtudisc = IP_PMTUDISC_PROBE;
 
     fd = socket(AF_INET, SOCK_DGRAM, 0);
     addr->sin_family = AF_INET;
@@ -78,17 +151,39 @@ static int sock_alloc(int listen, struct sockaddr_in *addr)
         return fd;
     }
 
+    if (reuseport) {
+        rc = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof (one));
+        if (rc) {
+            fprintf(stderr, "Failed to set SO_REUSEPORT: %s\n",
+                    strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+
+    /* Never fragment, probing finds the largest size the path carries */
+    rc = setsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &pmtudisc,
+                    sizeof (pmtudisc));
+    if (rc) {
+        fprintf(stderr, "Failed to set IP_MTU_DISCOVER: %s\n",
+                strerror(errno));
+        close(fd);
+        return -1;
+    }
+
     if (listen) {
         addr->sin_addr.s_addr = INADDR_ANY;
         rc = bind(fd, (struct sockaddr *) addr, sizeof (*addr));
         if (rc) {
             fprintf(stderr, "Failed to bind: %s\n", strerror(errno));
+            close(fd);
             return -1;
         }
     } else {
         rc = connect(fd, (struct sockaddr *) addr, sizeof (*addr));
         if (rc) {
             fprintf(stderr, "Failed to connect: %s\n", strerror(errno));
+            close(fd);
             return -1;
         }
     }
@@ -96,9 +191,48 @@ static int sock_alloc(int listen, struct sockaddr_in *addr)
     return fd;
 }
 
+/*
+ * Select the socket of a reuseport group from a hash of the source address
+ * and port, so that a given peer always ends up on the same shard no matter
+ * how the kernel would hash it. Sockets are indexed in bind order.
+ */
+static int sock_steer(int fd, int nsocks)
+{
+    struct sock_filter code[] = {
+        /* X = IP header length */
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, SKF_NET_OFF),
+        /* X = UDP source port */
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, SKF_NET_OFF),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        /* A = IP source address ^ X */
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12),
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+        /* return hash(A) % nsocks */
+        BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 0x9e3779b1),
+        BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, nsocks),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+    struct sock_fprog prog = {
+        .len = sizeof (code) / sizeof (code[0]),
+        .filter = code,
+    };
+    int rc;
+
+    rc = setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+                    sizeof (prog));
+    if (rc)
+        fprintf(stderr, "Failed to attach steering program: %s\n",
+                strerror(errno));
+
+    return rc;
+}
+
 /*
  * My little poney ugly function.
  */
+static const char *metrics_path;
+
 static int parse_opts(int argc, char **argv, struct sockaddr_in *addr, int *listen)
 {
     int i;
@@ -113,21 +247,111 @@ static int parse_opts(int argc, char **argv, struct sockaddr_in *addr, int *list
 
         if (!strcmp(argv[i], "-l")) {
             *listen = 1;
-#if 0 /* FIXME */
+        } else if (!strcmp(argv[i], "-b")) {
+            if (++i == argc ||
+                1 != sscanf(argv[i], "%d", &io_opts.batch) ||
+                io_opts.batch < 1 || io_opts.batch > IO_BATCH_MAX) {
+                fprintf(stderr, "Bad batch size: %s\n",
+                        i < argc ? argv[i] : "");
+                goto printusage;
+            }
+        } else if (!strcmp(argv[i], "-B")) {
+            if (++i == argc ||
+                1 != sscanf(argv[i], "%d", &iface_opts.budget) ||
+                iface_opts.budget < 1) {
+                fprintf(stderr, "Bad interface budget: %s\n",
+                        i < argc ? argv[i] : "");
+                goto printusage;
+            }
+        } else if (!strcmp(argv[i], "-e")) {
+            dispatch_opts.edge_triggered = 1;
+        } else if (!strcmp(argv[i], "-Q")) {
+            if (++i == argc ||
+                1 != sscanf(argv[i], "%d", &iface_opts.queues) ||
+                iface_opts.queues < 1 ||
+                iface_opts.queues > IFACE_MAX_QUEUES) {
+                fprintf(stderr, "Bad queue count: %s\n",
+                        i < argc ? argv[i] : "");
+                goto printusage;
+            }
+        } else if (!strcmp(argv[i], "-O")) {
+            iface_opts.offload = 1;
+        } else if (!strcmp(argv[i], "-s")) {
+            if (++i == argc ||
+                1 != sscanf(argv[i], "%d", &io_opts.shards) ||
+                io_opts.shards < 1 || io_opts.shards > IO_MAX_SHARDS) {
+                fprintf(stderr, "Bad socket count: %s\n",
+                        i < argc ? argv[i] : "");
+                goto printusage;
+            }
+        } else if (!strcmp(argv[i], "-S")) {
+            io_opts.steer = 1;
+        } else if (!strcmp(argv[i], "-w")) {
+            if (++i == argc || io_parse_weight(argv[i])) {
+                fprintf(stderr, "Bad weight: %s\n", i < argc ? argv[i] : "");
+                goto printusage;
+            }
+        } else if (!strcmp(argv[i], "-A")) {
+            if (++i == argc || aqm_parse(argv[i])) {
+                fprintf(stderr, "Bad queue management: %s\n",
+                        i < argc ? argv[i] : "");
+                goto printusage;
+            }
+        } else if (!strcmp(argv[i], "-E")) {
+            aqm_opts.ecn = 1;
+        } else if (!strcmp(argv[i], "-U")) {
+            io_opts.udp_offload = 1;
+        } else if (!strcmp(argv[i], "-u")) {
+            dispatch_opts.backend = DISPATCH_URING;
+        } else if (!strcmp(argv[i], "-P")) {
+            if (++i == argc ||
+                1 != sscanf(argv[i], "%u", &dispatch_opts.busy_poll_us) ||
+                dispatch_opts.busy_poll_us < 1 ||
+                dispatch_opts.busy_poll_us > DISPATCH_BUSY_POLL_MAX_US) {
+                fprintf(stderr, "Bad busy polling time: %s\n",
+                        i < argc ? argv[i] : "");
+                goto printusage;
+            }
+        } else if (!strcmp(argv[i], "-H")) {
+            pktslab_opts.hugepages = 1;
+        } else if (!strcmp(argv[i], "-M")) {
+            if (++i == argc) {
+                fprintf(stderr, "Missing metrics socket path\n");
+                goto printusage;
+            }
+            metrics_path = argv[i];
         } else if (!strcmp(argv[i], "-k")) {
-            i++;
-            if (crypto_load_key(argv[i])) {
-                fprintf(stderr, "Failed to load key file %s: %s\n", argv[i],
-                        strerror(errno));
+            if (++i == argc || crypto_load_key(argv[i])) {
+                fprintf(stderr, "Failed to load key file %s\n",
+                        i < argc ? argv[i] : "");
+                goto printusage;
+            }
+        } else if (!strcmp(argv[i], "-c")) {
+            if (++i == argc ||
+                (crypto_opts.ciphers = crypto_parse_ciphers(argv[i])) <= 0) {
+                fprintf(stderr, "Bad cipher list: %s\n",
+                        i < argc ? argv[i] : "");
+                goto printusage;
+            }
+        } else if (!strcmp(argv[i], "-z")) {
+            compress_opts.enabled = 1;
+        } else if (!strcmp(argv[i], "-W")) {
+            if (++i == argc ||
+                1 != sscanf(argv[i], "%d", &worker_opts.count) ||
+                worker_opts.count < 0 || worker_opts.count > WORKERS_MAX) {
+                fprintf(stderr, "Bad worker count: %s\n",
+                        i < argc ? argv[i] : "");
                 goto printusage;
             }
-        } else if (!strcmp(argv[i], "-a")) {
-            i++;
-            if (crypto_accept_list(argv[i])) {
-                fprintf(stderr, "Syntax error in accept list: %s\n", argv[i]);
+        } else if (!strcmp(argv[i], "-C")) {
+            peer_opts.credit = 1;
+        } else if (!strcmp(argv[i], "-G")) {
+            hub_opts.enabled = 1;
+        } else if (!strcmp(argv[i], "-r")) {
+            if (++i == argc || hub_parse_route(argv[i])) {
+                fprintf(stderr, "Bad route: %s\n", i < argc ? argv[i] : "");
                 goto printusage;
             }
-#endif
         } else {
             if (argv[i][0] == '-') {
                 fprintf(stderr, "Unrecognized option: %s\n", argv[i]);
@@ -169,6 +393,16 @@ static int parse_opts(int argc, char **argv, struct sockaddr_in *addr, int *list
         goto printusage;
     }
 
+    if ((hub_opts.enabled || hub_opts.nroutes) && !*listen) {
+        fprintf(stderr, "Hub mode is for listeners\n");
+        goto printusage;
+    }
+
+    if (hub_opts.nroutes && !hub_opts.enabled) {
+        fprintf(stderr, "Routes need hub mode\n");
+        goto printusage;
+    }
+
     if (!*listen && (addr->sin_addr.s_addr == 0)) {
         fprintf(stderr, "No remote IP address provided\n");
         goto printusage;
@@ -180,14 +414,14 @@ printusage:
     return -1;
 }
 
-int io_dispatch(int sockfd, struct sockaddr_in *remote);
-
 int main(int argc, char **argv)
 {
-    int sockfd;
+    int sockfds[IO_MAX_SHARDS];
+    int nsocks;
     int listen = 0;
     struct sockaddr_in addr;
     int rc = 0;
+    int i;
 
     memset(&addr, 0, sizeof (addr));
     rc = parse_opts(argc, argv, &addr, &listen);
@@ -195,14 +429,41 @@ int main(int argc, char **argv)
         return rc;
     }
 
-    sockfd = sock_alloc(listen, &addr);
-    if (sockfd < 0)
+    if (crypto_init())
         return -1;
 
-    rc = io_dispatch(sockfd, listen ? NULL : &addr);
+    nsocks = listen ? io_opts.shards : 1;
+    for (i = 0; i < nsocks; i++) {
+        sockfds[i] = sock_alloc(listen, &addr, nsocks > 1);
+        if (sockfds[i] < 0) {
+            rc = -1;
+            goto close;
+        }
+    }
 
-    close(sockfd);
+    if (nsocks > 1 && io_opts.steer)
+        sock_steer(sockfds[0], nsocks);
 
-    return 0;
+    if (metrics_path && metrics_start(metrics_path)) {
+        rc = -1;
+        goto close;
+    }
+
+    if (workers_start()) {
+        rc = -1;
+        goto metrics;
+    }
+
+    rc = io_dispatch(sockfds, nsocks, listen ? NULL : &addr);
+
+    workers_stop();
+metrics:
+    metrics_stop();
+
+close:
+    while (i--)
+        close(sockfds[i]);
+
+    return rc;
 }
 
@@ -0,0 +1,259 @@
+/*
+ *  Copyright (c) 2011, Julian Pidancet <julian.pidancet@gmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *  3. Neither the name of Julian Pidancet nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned wait_nr,
+                              unsigned flags, void *arg, size_t argsz)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, wait_nr, flags, arg,
+                   argsz);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+                                 unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Timed waits go through IORING_ENTER_EXT_ARG, kernels without it are turned
+ * down so that the caller falls back to something else.
+ */
+int uring_init(struct uring *r, unsigned entries)
+{
+    struct io_uring_params p;
+    void *sq, *cq;
+
+    memset(r, 0, sizeof (*r));
+    memset(&p, 0, sizeof (p));
+    p.flags = IORING_SETUP_COOP_TASKRUN;
+
+    r->fd = sys_io_uring_setup(entries, &p);
+    if (r->fd < 0 && errno == EINVAL) {
+        p.flags = 0;
+        r->fd = sys_io_uring_setup(entries, &p);
+    }
+    if (r->fd < 0)
+        return -1;
+
+    if (!(p.features & IORING_FEAT_EXT_ARG)) {
+        close(r->fd);
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    r->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+    r->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_sz > r->sq_ring_sz)
+            r->sq_ring_sz = r->cq_ring_sz;
+        r->cq_ring_sz = 0;
+    }
+
+    sq = mmap(NULL, r->sq_ring_sz, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+        goto close;
+    r->sq_ring = sq;
+
+    if (r->cq_ring_sz) {
+        cq = mmap(NULL, r->cq_ring_sz, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED)
+            goto unmap_sq;
+        r->cq_ring = cq;
+    } else {
+        cq = sq;
+    }
+
+    r->sqes_sz = p.sq_entries * sizeof (struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        goto unmap_cq;
+
+    r->sq_head = (unsigned *)((char *)sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)((char *)sq + p.sq_off.tail);
+    r->sq_array = (unsigned *)((char *)sq + p.sq_off.array);
+    r->sq_mask = *(unsigned *)((char *)sq + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+
+    r->cq_head = (unsigned *)((char *)cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)((char *)cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)((char *)cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)cq + p.cq_off.cqes);
+
+    return 0;
+
+unmap_cq:
+    if (r->cq_ring)
+        munmap(r->cq_ring, r->cq_ring_sz);
+unmap_sq:
+    munmap(r->sq_ring, r->sq_ring_sz);
+close:
+    close(r->fd);
+    return -1;
+}
+
+void uring_cleanup(struct uring *r)
+{
+    munmap(r->sqes, r->sqes_sz);
+    if (r->cq_ring)
+        munmap(r->cq_ring, r->cq_ring_sz);
+    munmap(r->sq_ring, r->sq_ring_sz);
+    close(r->fd);
+}
+
+/*
+ * Returns a cleared SQE, queued for the next uring_enter(). When the ring is
+ * full, whatever is pending gets submitted first.
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *r)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail = *r->sq_tail;
+
+    if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) ==
+        r->sq_entries) {
+        if (uring_enter(r, 0, -1) < 0)
+            return NULL;
+        if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) ==
+            r->sq_entries)
+            return NULL;
+    }
+
+    sqe = &r->sqes[tail & r->sq_mask];
+    memset(sqe, 0, sizeof (*sqe));
+    r->sq_array[tail & r->sq_mask] = tail & r->sq_mask;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->to_submit++;
+
+    return sqe;
+}
+
+/*
+ * Submit the pending SQEs and wait for wait_nr completions, for at most
+ * timeout_ms unless negative. A timeout is not an error, and with nothing to
+ * submit or wait for, there is no system call at all.
+ */
+int uring_enter(struct uring *r, unsigned wait_nr, int timeout_ms)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags = 0;
+    int rc;
+
+    if (!wait_nr && !r->to_submit)
+        return 0;
+
+    if (wait_nr) {
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        memset(&arg, 0, sizeof (arg));
+        if (timeout_ms >= 0) {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+            arg.ts = (unsigned long)&ts;
+        }
+    }
+
+    rc = sys_io_uring_enter(r->fd, r->to_submit, wait_nr, flags,
+                            wait_nr ? &arg : NULL, wait_nr ? sizeof (arg) : 0);
+    if (rc < 0) {
+        if (errno == ETIME)
+            return 0;
+        return -1;
+    }
+    r->to_submit -= rc;
+
+    return 0;
+}
+
+/*
+ * The ring lives in memory of its own, page aligned as the kernel wants it.
+ * entries must be a power of two.
+ */
+int uring_bufs_init(struct uring *r, struct uring_bufs *b, unsigned entries,
+                    unsigned short bgid)
+{
+    struct io_uring_buf_reg reg;
+    void *br;
+
+    memset(b, 0, sizeof (*b));
+    b->size = entries * sizeof (struct io_uring_buf);
+    br = mmap(NULL, b->size, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (br == MAP_FAILED)
+        return -1;
+
+    memset(&reg, 0, sizeof (reg));
+    reg.ring_addr = (unsigned long)br;
+    reg.ring_entries = entries;
+    reg.bgid = bgid;
+    if (sys_io_uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+        munmap(br, b->size);
+        return -1;
+    }
+
+    b->br = br;
+    b->mask = entries - 1;
+    b->bgid = bgid;
+
+    return 0;
+}
+
+/*
+ * Once unregistered, the kernel picks no more buffers from the ring, and
+ * those it holds are the caller's again.
+ */
+void uring_bufs_cleanup(struct uring *r, struct uring_bufs *b)
+{
+    struct io_uring_buf_reg reg;
+
+    memset(&reg, 0, sizeof (reg));
+    reg.bgid = b->bgid;
+    sys_io_uring_register(r->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    munmap(b->br, b->size);
+}
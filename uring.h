@@ -0,0 +1,124 @@
+/*
+ *  Copyright (c) 2011, Julian Pidancet <julian.pidancet@gmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *  3. Neither the name of Julian Pidancet nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#ifndef URING_H_
+#define URING_H_
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/*
+ * Bare io_uring, set up with the raw system calls: the submission and
+ * completion rings shared with the kernel, and where we stand in them.
+ * A ring is only ever used by the thread running its dispatch.
+ */
+struct uring
+{
+    int fd;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* SQEs handed out but not submitted yet */
+    unsigned to_submit;
+
+    void *sq_ring;
+    size_t sq_ring_sz;
+    void *cq_ring;
+    size_t cq_ring_sz;
+    size_t sqes_sz;
+};
+
+/*
+ * Ring of buffers registered as group bgid, which the kernel picks from for
+ * requests submitted with IOSQE_BUFFER_SELECT. Buffers are added by the
+ * thread running the ring, and come back as the completions that filled
+ * them, tagged with the buffer id they were added with.
+ */
+struct uring_bufs
+{
+    struct io_uring_buf_ring *br;
+    size_t size;
+    unsigned mask;
+    unsigned short tail;        /* Added, not published yet from here */
+    unsigned short bgid;
+};
+
+int uring_init(struct uring *r, unsigned entries);
+void uring_cleanup(struct uring *r);
+struct io_uring_sqe *uring_get_sqe(struct uring *r);
+int uring_enter(struct uring *r, unsigned wait_nr, int timeout_ms);
+int uring_bufs_init(struct uring *r, struct uring_bufs *b, unsigned entries,
+                    unsigned short bgid);
+void uring_bufs_cleanup(struct uring *r, struct uring_bufs *b);
+
+static inline void uring_bufs_add(struct uring_bufs *b, void *addr,
+                                  unsigned len, unsigned short bid)
+{
+    struct io_uring_buf *buf = &b->br->bufs[b->tail++ & b->mask];
+
+    buf->addr = (unsigned long)addr;
+    buf->len = len;
+    buf->bid = bid;
+}
+
+/* Hand the buffers added so far over to the kernel */
+static inline void uring_bufs_commit(struct uring_bufs *b)
+{
+    __atomic_store_n(&b->br->tail, b->tail, __ATOMIC_RELEASE);
+}
+
+static inline struct io_uring_cqe *uring_peek_cqe(struct uring *r)
+{
+    unsigned head = *r->cq_head;
+
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    return &r->cqes[head & r->cq_mask];
+}
+
+static inline void uring_cqe_seen(struct uring *r)
+{
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* URING_H_ */
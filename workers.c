@@ -0,0 +1,333 @@
+/*
+ *  Copyright (c) 2011, Julian Pidancet <julian.pidancet@gmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *  3. Neither the name of Julian Pidancet nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "pktqueue.h"
+#include "events.h"
+#include "metrics.h"
+#include "workers.h"
+
+struct worker_opts worker_opts;
+
+struct worker
+{
+    pthread_t thread;
+    struct worker_stats stats;  /* Only written by the worker */
+};
+
+/*
+ * One queue feeds every worker. Jobs are batches of packets, so taking the
+ * lock once per job is cheap next to what the job costs.
+ */
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    SIMPLEQ_HEAD(, worker_job) queue;
+    SIMPLEQ_HEAD(, worker_job) free;
+    unsigned long queued;
+    unsigned long hiwat;        /* Most jobs ever waiting */
+    int idle;                   /* Workers waiting on cond */
+    int stop;
+    int nworkers;
+    struct worker workers[WORKERS_MAX];
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .queue = SIMPLEQ_HEAD_INITIALIZER(pool.queue),
+    .free = SIMPLEQ_HEAD_INITIALIZER(pool.free),
+};
+
+int workers_enabled(void)
+{
+    return worker_opts.count > 0;
+}
+
+void worker_serial_init(struct worker_serial *s)
+{
+    pthread_mutex_init(&s->lock, NULL);
+    SIMPLEQ_INIT(&s->jobs);
+    s->inflight = 0;
+}
+
+/* Until everything submitted to the serial queue has been delivered */
+void worker_serial_wait(struct worker_serial *s)
+{
+    while (__atomic_load_n(&s->inflight, __ATOMIC_ACQUIRE))
+        sched_yield();
+}
+
+static struct worker_job *worker_job_alloc(void)
+{
+    struct worker_job *job;
+
+    pthread_mutex_lock(&pool.lock);
+    job = SIMPLEQ_FIRST(&pool.free);
+    if (job)
+        SIMPLEQ_REMOVE_HEAD(&pool.free, link);
+    pthread_mutex_unlock(&pool.lock);
+
+    return job ? job : malloc(sizeof (*job));
+}
+
+/*
+ * Hand a batch of packets over to the pool. Returns -1 if no job could be
+ * allocated, in which case the packets are still the caller's.
+ */
+int worker_submit(struct worker_serial *s, struct pkt **pkts, int n,
+                  worker_fn_t process, worker_fn_t deliver, void *priv)
+{
+    struct worker_job *job;
+
+    job = worker_job_alloc();
+    if (!job)
+        return -1;
+
+    job->serial = s;
+    job->process = process;
+    job->deliver = deliver;
+    job->priv = priv;
+    job->done = 0;
+    job->n = n;
+    job->good = n;
+    memcpy(job->pkts, pkts, n * sizeof (*pkts));
+
+    __atomic_fetch_add(&s->inflight, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&s->lock);
+    SIMPLEQ_INSERT_TAIL(&s->jobs, job, serial_link);
+    pthread_mutex_unlock(&s->lock);
+
+    pthread_mutex_lock(&pool.lock);
+    SIMPLEQ_INSERT_TAIL(&pool.queue, job, link);
+    if (++pool.queued > pool.hiwat)
+        pool.hiwat = pool.queued;
+    if (pool.idle)
+        pthread_cond_signal(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+
+    return 0;
+}
+
+/*
+ * Deliver every completed job at the head of the serial queue. Whoever
+ * completes a job tries, so the one completing the head of the queue
+ * delivers it along with whatever finished behind it in the meantime.
+ */
+static void worker_serial_drain(struct worker_serial *s)
+{
+    SIMPLEQ_HEAD(, worker_job) done = SIMPLEQ_HEAD_INITIALIZER(done);
+    struct worker_job *job;
+    int n = 0;
+
+    pthread_mutex_lock(&s->lock);
+    while ((job = SIMPLEQ_FIRST(&s->jobs)) &&
+           __atomic_load_n(&job->done, __ATOMIC_ACQUIRE)) {
+        SIMPLEQ_REMOVE_HEAD(&s->jobs, serial_link);
+        job->deliver(job);
+        SIMPLEQ_INSERT_TAIL(&done, job, link);
+        n++;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    if (!n)
+        return;
+
+    pthread_mutex_lock(&pool.lock);
+    while ((job = SIMPLEQ_FIRST(&done))) {
+        SIMPLEQ_REMOVE_HEAD(&done, link);
+        SIMPLEQ_INSERT_HEAD(&pool.free, job, link);
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+static void *worker_thread(void *priv)
+{
+    struct worker *w = priv;
+    struct worker_job *job;
+    struct worker_serial *s;
+
+    /* Dispatches touched from here are always someone else's */
+    dispatch_foreign_thread();
+
+    for (;;) {
+        pthread_mutex_lock(&pool.lock);
+        while (SIMPLEQ_EMPTY(&pool.queue) && !pool.stop) {
+            w->stats.waits++;
+            pool.idle++;
+            pthread_cond_wait(&pool.cond, &pool.lock);
+            pool.idle--;
+        }
+        job = SIMPLEQ_FIRST(&pool.queue);
+        if (!job) {
+            pthread_mutex_unlock(&pool.lock);
+            break;
+        }
+        SIMPLEQ_REMOVE_HEAD(&pool.queue, link);
+        pool.queued--;
+        pthread_mutex_unlock(&pool.lock);
+
+        /* The job may be delivered and reused as soon as done is set */
+        s = job->serial;
+        w->stats.jobs++;
+        w->stats.pkts += job->n;
+        job->process(job);
+        __atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+
+        worker_serial_drain(s);
+
+        /*
+         * Only now, as whoever drains last delivers our job: once inflight
+         * drops the owner may free s.
+         */
+        __atomic_fetch_sub(&s->inflight, 1, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+static void workers_metrics_collect(struct metrics_buf *b, void *priv)
+{
+    struct worker_stats st[WORKERS_MAX];
+    unsigned long hiwat;
+    int i, n;
+
+    (void)priv;
+
+    pthread_mutex_lock(&pool.lock);
+    n = pool.nworkers;
+    hiwat = pool.hiwat;
+    pthread_mutex_unlock(&pool.lock);
+    for (i = 0; i < n; i++)
+        st[i] = pool.workers[i].stats;
+
+    metrics_family(b, "tun_worker_jobs_total", "counter",
+                   "Batches of packets processed by the worker.");
+    for (i = 0; i < n; i++)
+        metrics_printf(b, "tun_worker_jobs_total{worker=\"%d\"} %lu\n",
+                       i, st[i].jobs);
+    metrics_family(b, "tun_worker_packets_total", "counter",
+                   "Packets processed by the worker.");
+    for (i = 0; i < n; i++)
+        metrics_printf(b, "tun_worker_packets_total{worker=\"%d\"} %lu\n",
+                       i, st[i].pkts);
+    metrics_family(b, "tun_worker_waits_total", "counter",
+                   "Times the worker found nothing to do and slept.");
+    for (i = 0; i < n; i++)
+        metrics_printf(b, "tun_worker_waits_total{worker=\"%d\"} %lu\n",
+                       i, st[i].waits);
+    metrics_family(b, "tun_worker_queue_hiwat", "gauge",
+                   "Most jobs ever waiting for a worker.");
+    metrics_printf(b, "tun_worker_queue_hiwat %lu\n", hiwat);
+}
+
+int workers_start(void)
+{
+    int i;
+
+    if (!workers_enabled())
+        return 0;
+
+#ifndef USE_LOCKS
+    fprintf(stderr, "Workers need a build with USE_LOCKS.\n");
+    worker_opts.count = 0;
+    return 0;
+#endif
+
+    pool.stop = 0;
+    for (i = 0; i < worker_opts.count; i++) {
+        if (pthread_create(&pool.workers[i].thread, NULL, worker_thread,
+                           &pool.workers[i])) {
+            fprintf(stderr, "pthread_create() failed.\n");
+            break;
+        }
+        pthread_mutex_lock(&pool.lock);
+        pool.nworkers++;
+        pthread_mutex_unlock(&pool.lock);
+    }
+
+    if (i < worker_opts.count) {
+        workers_stop();
+        return -1;
+    }
+
+    if (metrics_register(workers_metrics_collect, NULL))
+        fprintf(stderr, "metrics: too many collectors.\n");
+
+    return 0;
+}
+
+/* Workers finish whatever is queued before they exit */
+void workers_stop(void)
+{
+    struct worker_job *job;
+    int i;
+
+    if (!pool.nworkers)
+        return;
+
+    metrics_unregister(workers_metrics_collect, NULL);
+
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = 1;
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (i = 0; i < pool.nworkers; i++)
+        pthread_join(pool.workers[i].thread, NULL);
+
+    workers_stats_print(stdout);
+
+    pthread_mutex_lock(&pool.lock);
+    pool.nworkers = 0;
+    while ((job = SIMPLEQ_FIRST(&pool.free))) {
+        SIMPLEQ_REMOVE_HEAD(&pool.free, link);
+        free(job);
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void workers_stats_print(FILE *f)
+{
+    int i;
+
+    for (i = 0; i < pool.nworkers; i++)
+        fprintf(f, "worker %d: %lu jobs, %lu packets, %lu waits\n", i,
+                pool.workers[i].stats.jobs, pool.workers[i].stats.pkts,
+                pool.workers[i].stats.waits);
+    if (pool.nworkers)
+        fprintf(f, "workers: at most %lu jobs waiting\n", pool.hiwat);
+}
@@ -0,0 +1,106 @@
+/*
+ *  Copyright (c) 2011, Julian Pidancet <julian.pidancet@gmail.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *  3. Neither the name of Julian Pidancet nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#ifndef WORKERS_H_
+#define WORKERS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/queue.h>
+#include <pthread.h>
+
+#include "pktqueue.h"
+
+#define WORKERS_MAX 64
+#define WORKER_BATCH_MAX 64
+
+/*
+ * A pool of threads doing the per-packet work (sealing, opening) on batches
+ * of packets, so that a single busy tunnel spreads over every core.
+ *
+ * Jobs are processed in any order, by any worker, concurrently. Each job
+ * also belongs to a serial queue, one per peer and direction, and is only
+ * delivered once every job submitted to that queue before it has been:
+ * delivery runs in submission order and one job at a time, on whichever
+ * worker completed the job at the head of the queue.
+ */
+struct worker_opts
+{
+    int count;          /* Threads; none processes packets inline */
+};
+
+struct worker_stats
+{
+    unsigned long jobs;
+    unsigned long pkts;
+    unsigned long waits;        /* Times the worker went to sleep */
+};
+
+struct worker_job;
+typedef void (*worker_fn_t)(struct worker_job *);
+
+struct worker_serial
+{
+    pthread_mutex_t lock;
+    SIMPLEQ_HEAD(, worker_job) jobs;
+    unsigned long inflight;     /* Submitted, not yet delivered and done with */
+};
+
+struct worker_job
+{
+    SIMPLEQ_ENTRY(worker_job) link;     /* In the pool's queue or free list */
+    SIMPLEQ_ENTRY(worker_job) serial_link;
+    struct worker_serial *serial;
+    worker_fn_t process;        /* Concurrently with other jobs */
+    worker_fn_t deliver;        /* In order, under the serial queue lock */
+    void *priv;
+    int done;
+
+    int n;                      /* Packets */
+    int good;                   /* Those process left for deliver */
+    struct pkt *pkts[WORKER_BATCH_MAX];
+    uint64_t meta[WORKER_BATCH_MAX];    /* Scratch for process and deliver */
+};
+
+extern struct worker_opts worker_opts;
+
+int workers_start(void);
+void workers_stop(void);
+int workers_enabled(void);
+void workers_stats_print(FILE *f);
+
+void worker_serial_init(struct worker_serial *s);
+void worker_serial_wait(struct worker_serial *s);
+int worker_submit(struct worker_serial *s, struct pkt **pkts, int n,
+                  worker_fn_t process, worker_fn_t deliver, void *priv);
+
+#endif /* WORKERS_H_ */